@@ -76,6 +76,8 @@ struct mapcache_alias_entry {
   char *configfile;
   mapcache_cfg *cfg;
   mapcache_connection_pool *cp;
+  mapcache_worker_pool *wp;
+  mapcache_http_engine *he;
 };
 
 struct mapcache_server_cfg {
@@ -177,6 +179,26 @@ mapcache_context *mapcache_context_request_clone(mapcache_context *ctx)
   return nctx;
 }
 
+/*
+ * server contexts are cloned for jobs that outlive the request that queued them,
+ * possibly from several threads at once: don't allocate anything from the parent
+ */
+mapcache_context *mapcache_context_server_clone(mapcache_context *ctx)
+{
+  apr_pool_t *pool;
+  mapcache_context_apache_server *newctx;
+  mapcache_context *nctx;
+  if(apr_pool_create(&pool,NULL) != APR_SUCCESS) {
+    return NULL;
+  }
+  newctx = (mapcache_context_apache_server*)apr_pcalloc(pool, sizeof(mapcache_context_apache_server));
+  nctx = (mapcache_context*)newctx;
+  mapcache_context_copy(ctx,nctx);
+  nctx->pool = pool;
+  newctx->server = ((mapcache_context_apache_server*)ctx)->server;
+  return nctx;
+}
+
 mapcache_context_apache_request* create_apache_request_context(request_rec *r)
 {
   mapcache_context_apache_request *rctx = apr_pcalloc(r->pool, sizeof(mapcache_context_apache_request));
@@ -197,6 +219,7 @@ static mapcache_context_apache_server* create_apache_server_context(server_rec *
   ctx->pool = pool;
   ctx->config = NULL;
   ctx->log = apache_context_server_log;
+  ctx->clone = mapcache_context_server_clone;
   actx->server = s;
   return actx;
 }
@@ -274,15 +297,7 @@ static int write_http_response(mapcache_context_apache_request *ctx, mapcache_ht
   int rc;
   char *timestr;
 
-  if(response->mtime) {
-    ap_update_mtime(r, response->mtime);
-    if((rc = ap_meets_conditions(r)) != OK) {
-      return rc;
-    }
-    timestr = apr_palloc(r->pool, APR_RFC822_DATE_LEN);
-    apr_rfc822_date(timestr, response->mtime);
-    apr_table_setn(r->headers_out, "Last-Modified", timestr);
-  }
+  /* set the headers first so that ap_meets_conditions() can see our ETag */
   if(response->headers && !apr_is_empty_table(response->headers)) {
     const apr_array_header_t *elts = apr_table_elts(response->headers);
     int i;
@@ -295,8 +310,28 @@ static int write_http_response(mapcache_context_apache_request *ctx, mapcache_ht
       }
     }
   }
+  if(response->mtime) {
+    ap_update_mtime(r, response->mtime);
+    if((rc = ap_meets_conditions(r)) != OK) {
+      return rc;
+    }
+    timestr = apr_palloc(r->pool, APR_RFC822_DATE_LEN);
+    apr_rfc822_date(timestr, response->mtime);
+    apr_table_setn(r->headers_out, "Last-Modified", timestr);
+  }
   if(response->data && response->data->size) {
     ap_set_content_length(r,response->data->size);
+    if(response->data->file) {
+      /* let the core output filter sendfile() the data straight from the cache file */
+      apr_bucket_brigade *bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+      apr_brigade_insert_file(bb, response->data->file, response->data->file_offset, response->data->size, r->pool);
+      APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(r->connection->bucket_alloc));
+      r->status = response->code;
+      if(ap_pass_brigade(r->output_filters, bb) != APR_SUCCESS) {
+        return AP_FILTER_ERROR;
+      }
+      return OK;
+    }
     ap_rwrite((void*)response->data->buf, response->data->size, r);
   }
 
@@ -317,6 +352,23 @@ static void mod_mapcache_child_init(apr_pool_t *pool, server_rec *s)
       if(rv!=APR_SUCCESS) {
         ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, "failed to create mapcache connection pool");
       }
+      if(alias_entry->cfg->threaded_fetching || alias_entry->cfg->background_refresh || alias_entry->cfg->write_behind) {
+        rv = mapcache_worker_pool_create(&(alias_entry->wp),alias_entry->cfg->fetching_threads,
+                                         (mapcache_context*)create_apache_server_context(s,pool),pool);
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "creating a child process mapcache worker pool of %d threads on server %s for alias %s", alias_entry->cfg->fetching_threads, s->server_hostname, alias_entry->endpoint);
+        if(rv!=APR_SUCCESS) {
+          ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, "failed to create mapcache worker pool");
+          alias_entry->wp = NULL;
+        }
+      }
+      if(alias_entry->cfg->http_engine) {
+        rv = mapcache_http_engine_create(&(alias_entry->he),pool);
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "creating a child process mapcache http engine on server %s for alias %s", s->server_hostname, alias_entry->endpoint);
+        if(rv!=APR_SUCCESS) {
+          ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "failed to create mapcache http engine, http requests will be run synchronously");
+          alias_entry->he = NULL;
+        }
+      }
     }
     for(i=0;i<cfg->quickaliases->nelts;i++) {
       mapcache_alias_entry *alias_entry = APR_ARRAY_IDX(cfg->quickaliases,i,mapcache_alias_entry*);
@@ -325,6 +377,23 @@ static void mod_mapcache_child_init(apr_pool_t *pool, server_rec *s)
       if(rv!=APR_SUCCESS) {
         ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, "failed to create mapcache connection pool");
       }
+      if(alias_entry->cfg->threaded_fetching || alias_entry->cfg->background_refresh || alias_entry->cfg->write_behind) {
+        rv = mapcache_worker_pool_create(&(alias_entry->wp),alias_entry->cfg->fetching_threads,
+                                         (mapcache_context*)create_apache_server_context(s,pool),pool);
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "creating a child process mapcache worker pool of %d threads on server %s for alias %s", alias_entry->cfg->fetching_threads, s->server_hostname, alias_entry->endpoint);
+        if(rv!=APR_SUCCESS) {
+          ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, "failed to create mapcache worker pool");
+          alias_entry->wp = NULL;
+        }
+      }
+      if(alias_entry->cfg->http_engine) {
+        rv = mapcache_http_engine_create(&(alias_entry->he),pool);
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "creating a child process mapcache http engine on server %s for alias %s", s->server_hostname, alias_entry->endpoint);
+        if(rv!=APR_SUCCESS) {
+          ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "failed to create mapcache http engine, http requests will be run synchronously");
+          alias_entry->he = NULL;
+        }
+      }
     }
   }
 }
@@ -338,7 +407,10 @@ static int mapcache_handler(request_rec *r, mapcache_alias_entry *alias_entry) {
 
   ctx->config = alias_entry->cfg;
   ctx->connection_pool = alias_entry->cp;
+  ctx->worker_pool = alias_entry->wp;
+  ctx->http_engine = alias_entry->he;
   ctx->supports_redirects = 1;
+  ctx->supports_sendfile = 1;
   ctx->headers_in = r->headers_in;
 
   params = mapcache_http_parse_param_string(ctx, r->args);
@@ -3,6 +3,7 @@
 import commands
 import os
 import re
+import sys
 
 def do_ab_call(url,nthreads,reqs):
     cmd="ab -k -c %d -n %d '%s'" % (nthreads,reqs,url)
@@ -20,20 +21,32 @@ def do_ab_call(url,nthreads,reqs):
     return summary
 
 base="http://localhost:8081"
-params="LAYERS=test,test3&FORMAT=image%2Fpng&SERVICE=WMS&VERSION=1.1.1&REQUEST=GetMap&STYLES=&EXCEPTIONS=application%2Fvnd.ogc.se_inimage&SRS=EPSG%3A4326&BBOX=-2.8125,47.8125,0,50.625&WIDTH=256&HEIGHT=256"
 urls={}
 nreqs=400
 
-title="tile merging"
+scenario = len(sys.argv) > 1 and sys.argv[1] or "merge"
+if scenario == "merge":
+    params="LAYERS=test,test3&FORMAT=image%2Fpng&SERVICE=WMS&VERSION=1.1.1&REQUEST=GetMap&STYLES=&EXCEPTIONS=application%2Fvnd.ogc.se_inimage&SRS=EPSG%3A4326&BBOX=-2.8125,47.8125,0,50.625&WIDTH=256&HEIGHT=256"
+    title="tile merging"
+    urls['tilecache']="%s/%s?%s" % (base,'tilecache',params)
+    urls['mapcache best compression']="%s/%s?%s" % (base,'mapcache-best',params)
+    urls['mapcache default compression']="%s/%s?%s" % (base,'mapcache-default',params)
+    urls['mapcache fast compression']="%s/%s?%s" % (base,'mapcache-fast',params)
+    urls['mapcache png quantization']="%s/%s?%s" % (base,'mapcache-pngq',params)
+    #urls['mapproxy']="http://localhost:8080/service?%s" % (params)
+elif scenario == "mbtiles":
+    # GetTile hits on a seeded MBTiles file, served by two tilesets sharing it:
+    # "mbtiles" through a cache with the default settings, and "mbtiles-mmap"
+    # through a second cache on the same file with <read_mmap_size> set
+    title="mbtiles hits"
+    tile="default/GoogleMapsCompatible/5/16/10.png"
+    urls['mbtiles default']="%s/mapcache/wmts/1.0.0/%s/%s" % (base,'mbtiles',tile)
+    urls['mbtiles read_mmap_size']="%s/mapcache/wmts/1.0.0/%s/%s" % (base,'mbtiles-mmap',tile)
+else:
+    print "usage: %s [merge|mbtiles]" % (sys.argv[0])
+    sys.exit(1)
 filebase=title
 
-urls['tilecache']="%s/%s?%s" % (base,'tilecache',params)
-urls['mapcache best compression']="%s/%s?%s" % (base,'mapcache-best',params)
-urls['mapcache default compression']="%s/%s?%s" % (base,'mapcache-default',params)
-urls['mapcache fast compression']="%s/%s?%s" % (base,'mapcache-fast',params)
-urls['mapcache png quantization']="%s/%s?%s" % (base,'mapcache-pngq',params)
-#urls['mapproxy']="http://localhost:8080/service?%s" % (params)
-
 plotfile = open("%s.plot"%(filebase),"w")
 datafile = open("%s.dat"%(filebase),"w")
 
@@ -47,12 +47,15 @@ static char *err404 = "Not Found";
 static char *err500 = "Internal Server Error";
 static char *err501 = "Not Implemented";
 static char *err502 = "Bad Gateway";
+static char *err304 = "Not Modified";
 static char *errother = "No Description";
 apr_pool_t *global_pool = NULL,*config_pool, *tmp_config_pool;
 
 static char* err_msg(int code)
 {
   switch(code) {
+    case 304:
+      return err304;
     case 400:
       return err400;
     case 404:
@@ -82,6 +85,20 @@ static mapcache_context* fcgi_context_clone(mapcache_context *ctx)
   return nctx;
 }
 
+/* used for jobs that outlive the request, and that may run concurrently with it */
+static mapcache_context* fcgi_context_detached_clone(mapcache_context *ctx)
+{
+  apr_pool_t *pool;
+  mapcache_context *nctx;
+  if(apr_pool_create(&pool,NULL) != APR_SUCCESS) {
+    return NULL;
+  }
+  nctx = (mapcache_context*)apr_pcalloc(pool, sizeof(mapcache_context_fcgi));
+  mapcache_context_copy(ctx,nctx);
+  nctx->pool = pool;
+  return nctx;
+}
+
 static void fcgi_context_log(mapcache_context *c, mapcache_log_level level, char *message, ...)
 {
   va_list args;
@@ -127,7 +144,8 @@ static void fcgi_write_response(mapcache_context_fcgi *ctx, mapcache_http_respon
   }
   if(response->mtime) {
     char *datestr;
-    char *if_modified_since = getenv("HTTP_IF_MODIFIED_SINCE");
+    /* If-Modified-Since is to be ignored when If-None-Match is present, the core has checked the latter */
+    char *if_modified_since = getenv("HTTP_IF_NONE_MATCH")?NULL:getenv("HTTP_IF_MODIFIED_SINCE");
 
     datestr = apr_palloc(ctx->ctx.pool, APR_RFC822_DATE_LEN);
     apr_rfc822_date(datestr, response->mtime);
@@ -141,8 +159,10 @@ static void fcgi_write_response(mapcache_context_fcgi *ctx, mapcache_http_respon
       mtime =  apr_time_sec(response->mtime);
       ims_time = apr_date_parse_http(if_modified_since);
       ims = apr_time_sec(ims_time);
-      if(ims >= mtime) {
-        printf("Status: 304 Not Modified\r\n");
+      if(response->code == 304 || ims >= mtime) {
+        if(response->code != 304) {
+          printf("Status: 304 Not Modified\r\n");
+        }
 	/*
 	 * "The 304 response MUST NOT contain a message-body"
 	 * https://tools.ietf.org/html/rfc2616#section-10.3.5
@@ -152,6 +172,10 @@ static void fcgi_write_response(mapcache_context_fcgi *ctx, mapcache_http_respon
       }
     }
   }
+  if(response->code == 304) {
+    printf("\r\n");
+    return;
+  }
   if(response->data) {
     printf("Content-Length: %ld\r\n\r\n", response->data->size);
     fwrite((char*)response->data->buf, response->data->size,1,stdout);
@@ -211,6 +235,24 @@ static void load_config(mapcache_context *ctx, char *filename)
   }
   config_pool = tmp_config_pool;
   mapcache_connection_pool_create(&ctx->connection_pool, config_pool);
+  ctx->worker_pool = NULL;
+  if(cfg->threaded_fetching || cfg->background_refresh || cfg->write_behind) {
+    mapcache_context *wctx = (mapcache_context*)apr_pcalloc(config_pool, sizeof(mapcache_context_fcgi));
+    mapcache_context_copy(ctx,wctx);
+    wctx->pool = config_pool;
+    wctx->clone = fcgi_context_detached_clone;
+    if(mapcache_worker_pool_create(&ctx->worker_pool, cfg->fetching_threads, wctx, config_pool) != APR_SUCCESS) {
+      ctx->log(ctx,MAPCACHE_WARN,"failed to create worker pool, falling back to a thread per metatile");
+      ctx->worker_pool = NULL;
+    }
+  }
+  ctx->http_engine = NULL;
+  if(cfg->http_engine) {
+    if(mapcache_http_engine_create(&ctx->http_engine, config_pool) != APR_SUCCESS) {
+      ctx->log(ctx,MAPCACHE_WARN,"failed to create http engine, http requests will be run synchronously");
+      ctx->http_engine = NULL;
+    }
+  }
 
   return;
 
@@ -288,6 +330,13 @@ int main(int argc, const char **argv)
     apr_pool_create(&(ctx->pool),config_pool);
     request = NULL;
     pathInfo = getenv("PATH_INFO");
+    ctx->headers_in = apr_table_make(ctx->pool, 2);
+    if(getenv("HTTP_IF_NONE_MATCH")) {
+      apr_table_set(ctx->headers_in, "If-None-Match", getenv("HTTP_IF_NONE_MATCH"));
+    }
+    if(getenv("HTTP_IF_MODIFIED_SINCE")) {
+      apr_table_set(ctx->headers_in, "If-Modified-Since", getenv("HTTP_IF_MODIFIED_SINCE"));
+    }
 
 
     params = mapcache_http_parse_param_string(ctx, getenv("QUERY_STRING"));
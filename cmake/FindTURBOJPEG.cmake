@@ -0,0 +1,21 @@
+
+FIND_PACKAGE(PkgConfig)
+PKG_CHECK_MODULES(PC_TURBOJPEG libturbojpeg)
+
+FIND_PATH(TURBOJPEG_INCLUDE_DIR
+    NAMES turbojpeg.h
+    HINTS ${PC_TURBOJPEG_INCLUDEDIR}
+          ${PC_TURBOJPEG_INCLUDE_DIRS}
+)
+
+FIND_LIBRARY(TURBOJPEG_LIBRARY
+    NAMES turbojpeg
+    HINTS ${PC_TURBOJPEG_LIBDIR}
+          ${PC_TURBOJPEG_LIBRARY_DIRS}
+)
+
+set(TURBOJPEG_INCLUDE_DIRS ${TURBOJPEG_INCLUDE_DIR})
+set(TURBOJPEG_LIBRARIES ${TURBOJPEG_LIBRARY})
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(TURBOJPEG DEFAULT_MSG TURBOJPEG_LIBRARY TURBOJPEG_INCLUDE_DIR)
+mark_as_advanced(TURBOJPEG_LIBRARY TURBOJPEG_INCLUDE_DIR)
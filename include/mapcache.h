@@ -39,6 +39,7 @@
 #include <apr_tables.h>
 #include <apr_hash.h>
 #include <apr_reslist.h>
+#include <apr_file_io.h>
 
 #include "util.h"
 #include "ezxml.h"
@@ -77,7 +78,9 @@ typedef struct mapcache_image_format mapcache_image_format;
 typedef struct mapcache_image_format_mixed mapcache_image_format_mixed;
 typedef struct mapcache_image_format_png mapcache_image_format_png;
 typedef struct mapcache_image_format_png_q mapcache_image_format_png_q;
+typedef struct mapcache_palette mapcache_palette;
 typedef struct mapcache_image_format_jpeg mapcache_image_format_jpeg;
+typedef struct mapcache_image_format_webp mapcache_image_format_webp;
 typedef struct mapcache_image_format_raw mapcache_image_format_raw;
 typedef struct mapcache_cfg mapcache_cfg;
 typedef struct mapcache_tileset mapcache_tileset;
@@ -111,7 +114,16 @@ typedef struct mapcache_requested_dimension mapcache_requested_dimension;
 typedef struct mapcache_extent mapcache_extent;
 typedef struct mapcache_extent_i mapcache_extent_i;
 typedef struct mapcache_connection_pool mapcache_connection_pool;
+typedef struct mapcache_worker_pool mapcache_worker_pool;
+typedef struct mapcache_http_engine mapcache_http_engine;
+typedef struct mapcache_http_transfer mapcache_http_transfer;
+typedef struct mapcache_worker_batch mapcache_worker_batch;
 typedef struct mapcache_locker mapcache_locker;
+typedef struct mapcache_inflight mapcache_inflight;
+typedef struct mapcache_inflight_table mapcache_inflight_table;
+typedef struct mapcache_image_cache mapcache_image_cache;
+typedef struct mapcache_write_behind mapcache_write_behind;
+typedef struct mapcache_write_behind_hold mapcache_write_behind_hold;
 typedef struct mapcache_source_rule mapcache_source_rule;
 
 
@@ -209,6 +221,8 @@ struct mapcache_context {
   mapcache_context* (*clone)(mapcache_context *ctx);
   apr_pool_t *pool;
   mapcache_connection_pool *connection_pool;
+  mapcache_worker_pool *worker_pool;
+  mapcache_http_engine *http_engine;
   char *_contenttype;
   char *_errmsg;
   int _errcode;
@@ -216,7 +230,9 @@ struct mapcache_context {
   mapcache_service *service;
   apr_table_t *exceptions;
   int supports_redirects;
+  int supports_sendfile; /**< the front-end sends mapcache_buffer::file instead of the buffer contents */
   apr_table_t *headers_in;
+  mapcache_write_behind_hold *write_behind_hold; /**< the metatile lock held by the tiles queued from this context */
 };
 
 MS_DLL_EXPORT void mapcache_context_init(mapcache_context *ctx);
@@ -237,6 +253,13 @@ struct mapcache_buffer {
   size_t size; /**< number of bytes actually used in the buffer */
   size_t avail; /**< number of bytes allocated */
   apr_pool_t* pool; /**< apache pool to allocate from */
+  /**
+   * if not NULL, an open file whose contents at file_offset are the same as
+   * the size bytes of buf, that the front-ends can send without copying buf.
+   * reset once the buffer is modified.
+   */
+  apr_file_t *file;
+  apr_off_t file_offset;
 };
 
 /* in buffer.c */
@@ -310,6 +333,8 @@ struct mapcache_http {
   size_t post_len;
   int connection_timeout;
   int timeout;
+  int max_idle_connections; /**< connections kept open to the server between requests, 0 to disable reuse */
+  int idle_timeout; /**< seconds after which an idle connection is not reused anymore */
   /* TODO: authentication */
 };
 
@@ -342,6 +367,8 @@ struct mapcache_cache {
   unsigned int retry_count;
   double retry_delay;
 
+  /* queue of tiles waiting to be written by a background thread. NULL if writes are synchronous */
+  mapcache_write_behind *write_behind;
 
   /**
    * get tile content from cache
@@ -352,6 +379,13 @@ struct mapcache_cache {
    */
   int (*_tile_get)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
 
+  /**
+   * optional: get the content of several tiles in as few round trips as possible
+   * \param rets receives, for each tile, the value _tile_get() would have returned
+   * \memberof mapcache_cache
+   */
+  void (*_tile_multi_get)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile **tiles, int ntiles, int *rets);
+
   /**
    * delete tile from cache
    *
@@ -361,6 +395,13 @@ struct mapcache_cache {
 
   int (*_tile_exists)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
 
+  /**
+   * optional: set the tile's mtime and encoded_size without loading its data
+   * \returns MAPCACHE_SUCCESS if the tile exists, MAPCACHE_CACHE_MISS if it does not
+   * \memberof mapcache_cache
+   */
+  int (*_tile_stat)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
+
   /**
    * set tile content to cache
    * \memberof mapcache_cache
@@ -373,10 +414,28 @@ struct mapcache_cache {
 };
 
 MS_DLL_EXPORT int mapcache_cache_tile_get(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile);
+/**
+ * \brief get several tiles from a cache, falling back to successive tile_get calls if
+ * the cache has no native multi-get support
+ * \param rets receives the MAPCACHE_SUCCESS / MAPCACHE_CACHE_MISS / MAPCACHE_FAILURE status of each tile
+ */
+void mapcache_cache_tile_multi_get(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile **tiles, int ntiles, int *rets);
 void mapcache_cache_tile_delete(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile);
+/**
+ * \brief delete the tile from the cache itself, leaving its write-behind queue untouched
+ */
+void mapcache_cache_tile_delete_direct(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile);
 MS_DLL_EXPORT int mapcache_cache_tile_exists(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile);
+/**
+ * \returns MAPCACHE_FAILURE if the cache cannot stat tiles
+ */
+int mapcache_cache_tile_stat(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile);
 MS_DLL_EXPORT void mapcache_cache_tile_set(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile);
 void mapcache_cache_tile_multi_set(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tiles, int ntiles);
+/**
+ * \brief write the tiles to the cache itself, bypassing its write-behind queue
+ */
+void mapcache_cache_tile_multi_set_direct(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tiles, int ntiles);
 
 
 
@@ -670,7 +729,7 @@ MS_DLL_EXPORT int mapcache_config_services_enabled(mapcache_context *ctx, mapcac
 /** @{ */
 
 typedef enum {
-  GC_UNKNOWN, GC_PNG, GC_JPEG, GC_RAW
+  GC_UNKNOWN, GC_PNG, GC_JPEG, GC_RAW, GC_WEBP
 } mapcache_image_format_type;
 
 typedef enum {
@@ -694,7 +753,7 @@ struct mapcache_image {
   size_t stride; /**< stride of an image row */
   mapcache_image_blank_type is_blank;
   mapcache_image_alpha_type has_alpha;
-
+  mapcache_palette *palette; /**< palette to quantize the image with, if computed beforehand, e.g. for a whole metatile */
 };
 
 /** \def GET_IMG_PIXEL
@@ -755,12 +814,108 @@ int mapcache_image_has_alpha(mapcache_image *img, unsigned int cutoff);
 
 void mapcache_image_fill(mapcache_context *ctx, mapcache_image *image, const unsigned char *fill_color);
 
+/**
+ * \brief the pixel kernels the image functions are built on, vectorized for the
+ * instructions supported by the running cpu
+ */
+typedef struct {
+  const char *name;
+  /** composite n premultiplied src pixels OVER dst */
+  void (*over)(unsigned char *dst, const unsigned char *src, int n);
+  /** \returns MAPCACHE_TRUE if one of the n pixels has an alpha below cutoff */
+  int (*alpha_below)(const unsigned char *px, int n, unsigned char cutoff);
+  /** \returns MAPCACHE_TRUE if all of the n pixels are equal to value */
+  int (*uniform)(const unsigned char *px, int n, unsigned int value);
+  /**
+   * interpolate n pixels between rows r0 and r1. x0 and x1 are the byte offsets of the
+   * left and right source pixels in the rows, fx and fy the weights of the right
+   * pixel and of r1, in 1/256ths
+   */
+  void (*bilinear)(unsigned char *dst, const unsigned char *r0, const unsigned char *r1,
+                   const int *x0, const int *x1, const unsigned short *fx, unsigned int fy, int n);
+} mapcache_image_kernels;
+
+const mapcache_image_kernels* mapcache_image_kernels_get(void);
+/** \brief the portable kernels the vectorized ones are checked and measured against */
+const mapcache_image_kernels* mapcache_image_kernels_scalar(void);
+
+/**
+ * \brief compute a palette of at most ncolors colors to quantize the image with
+ * \returns the palette, allocated from the context pool
+ */
+mapcache_palette* mapcache_palette_create(mapcache_context *ctx, mapcache_image *image, int ncolors);
+
+/**
+ * \brief map each pixel of the image to the index of its closest palette entry
+ * \param pixels receives the image->w * image->h indexes
+ */
+void mapcache_palette_classify(mapcache_context *ctx, const mapcache_palette *palette, mapcache_image *image,
+                               unsigned char *pixels);
+
+/**
+ * \brief get the entries of a palette, as premultiplied pixels of 4 bytes
+ * \returns the number of entries
+ */
+int mapcache_palette_colors(const mapcache_palette *palette, const unsigned char **colors);
+
 /** @} */
 
 
 /** \defgroup http HTTP Request handling*/
 /** @{ */
 void mapcache_http_do_request(mapcache_context *ctx, mapcache_http *req, mapcache_buffer *data, apr_table_t *headers, long *http_code);
+/**
+ * \brief start the request of a mapcache_http, which is run concurrently with the other
+ * requests of the process if there is an http engine
+ *
+ * the arguments are the same as for mapcache_http_do_request(), data and headers being
+ * filled in by mapcache_http_await()
+ */
+mapcache_http_transfer* mapcache_http_submit(mapcache_context *ctx, mapcache_http *req, mapcache_buffer *data, apr_table_t *headers, long *http_code);
+/**
+ * \brief wait for the completion of a request started with mapcache_http_submit()
+ */
+void mapcache_http_await(mapcache_context *ctx, mapcache_http_transfer *transfer);
+
+/**
+ * \brief create the process wide engine that drives the http transfers of all threads on
+ * a single curl multi handle, so that they share connections and HTTP/2 streams
+ * \returns APR_ENOTIMPL if not supported by this build (no threads, or libcurl older than 7.68)
+ */
+MS_DLL_EXPORT apr_status_t mapcache_http_engine_create(mapcache_http_engine **engine, apr_pool_t *server_pool);
+/**
+ * \brief prepare a transfer on a curl easy handle whose url and request options are set
+ *
+ * the response body and headers are collected by the transfer (the handle's write and
+ * header functions are overridden) and handed over to data and headers (both optional)
+ * by mapcache_http_transfer_await(). A transfer that has been submitted must be awaited
+ * before the handle is reused or freed.
+ */
+mapcache_http_transfer* mapcache_http_transfer_create(mapcache_context *ctx, void *curl, mapcache_buffer *data, apr_table_t *headers);
+/**
+ * \brief start the transfer on ctx->http_engine. Without an engine, the transfer is
+ * run when awaited
+ */
+void mapcache_http_transfer_submit(mapcache_context *ctx, mapcache_http_transfer *transfer);
+/**
+ * \brief run the given transfers concurrently, even without an http engine. Their outcome
+ * is then available through mapcache_http_transfer_await()
+ */
+void mapcache_http_transfer_await_all(mapcache_context *ctx, mapcache_http_transfer **transfers, int ntransfers);
+/**
+ * \brief wait for a transfer to complete
+ * \returns the CURLcode of the transfer
+ */
+int mapcache_http_transfer_await(mapcache_context *ctx, mapcache_http_transfer *transfer);
+/**
+ * \brief create a curl share handle for the DNS cache, TLS sessions and connections,
+ * usable from several threads, that lives as long as the given pool
+ */
+apr_status_t mapcache_http_share_create(void **share, apr_pool_t *pool);
+/**
+ * \brief have a curl easy handle use a share created by mapcache_http_share_create()
+ */
+void mapcache_http_share_attach(void *share, void *curl);
 char* mapcache_http_build_url(mapcache_context *ctx, char *base, apr_table_t *params);
 MS_DLL_EXPORT apr_table_t *mapcache_http_parse_param_string(mapcache_context *ctx, char *args);
 /** @} */
@@ -795,6 +950,17 @@ struct mapcache_locker{
   mapcache_lock_result (*aquire_lock)(mapcache_context *ctx, mapcache_locker *self, char *resource, void **lock);
   mapcache_lock_result (*ping_lock)(mapcache_context *ctx, mapcache_locker *self, void *lock);
   void (*release_lock)(mapcache_context *ctx, mapcache_locker *self, void *lock);
+  /**
+   * optional: block until the lock is released or the deadline is reached, returning
+   * the state of the lock. lockers not implementing this are polled every retry_interval
+   * with ping_lock()
+   */
+  mapcache_lock_result (*wait_lock)(mapcache_context *ctx, mapcache_locker *self, void *lock, apr_time_t deadline);
+  /**
+   * optional: copy the lock to the given pool, so that it can be released with another
+   * context once the request that acquired it is gone
+   */
+  void* (*copy_lock)(mapcache_context *ctx, mapcache_locker *self, void *lock, apr_pool_t *pool);
 
   void (*parse_xml)(mapcache_context *ctx, mapcache_locker *self, ezxml_t node);
   mapcache_lock_mode type;
@@ -868,8 +1034,27 @@ struct mapcache_cfg {
 
   mapcache_locker *locker;
 
+  /* metatiles currently being rendered by threads of this process */
+  mapcache_inflight_table *inflight;
+
+  /* recently decoded tiles, reused when assembling getmap responses. NULL if disabled */
+  mapcache_image_cache *image_cache;
+
   int threaded_fetching;
 
+  /* number of threads in the per-process pool used for threaded fetching */
+  int fetching_threads;
+
+  /* number of tilesets refreshing their stale tiles in the background, which
+   * also requires the per-process worker pool */
+  int background_refresh;
+
+  /* number of caches with a write-behind queue, flushed by the per-process worker pool */
+  int write_behind;
+
+  /* run the http requests of all the threads of a process on a shared curl multi handle */
+  int http_engine;
+
   /* for fastcgi only */
   int autoreload; /* should the modification time of the config file be recorded
                        and the file be reparsed if it is modified. */
@@ -950,6 +1135,17 @@ mapcache_source* mapcache_source_ogc_api_tiles_create(mapcache_context *ctx);
  */
 mapcache_cache* mapcache_cache_disk_create(mapcache_context *ctx);
 
+/**
+ * \brief rewrite a bundle file of a disk cache with the bundle layout, dropping the
+ * records left behind by overwritten and deleted tiles
+ *
+ * processes that have the bundle open keep using the replaced file, so this must not
+ * be run on a cache that is being served or seeded
+ * \param size_before, size_after if not NULL, set to the size of the bundle before
+ * and after compaction
+ */
+int mapcache_cache_disk_bundle_compact(mapcache_context *ctx, const char *path, apr_off_t *size_before, apr_off_t *size_after);
+
 /**
  * \memberof mapcache_cache_rest
  */
@@ -967,6 +1163,15 @@ mapcache_cache* mapcache_cache_composite_create(mapcache_context *ctx);
 mapcache_cache* mapcache_cache_fallback_create(mapcache_context *ctx);
 mapcache_cache* mapcache_cache_multitier_create(mapcache_context *ctx);
 
+/**
+ * \memberof mapcache_cache_shm_lru
+ */
+mapcache_cache* mapcache_cache_shm_lru_create(mapcache_context *ctx);
+/**
+ * \brief get the hit, miss and eviction counters of a shm_lru cache, shared by all processes
+ */
+MS_DLL_EXPORT void mapcache_cache_shm_lru_get_stats(mapcache_cache *cache, apr_uint32_t *hits, apr_uint32_t *misses, apr_uint32_t *evictions);
+
 
 /** \defgroup tileset Tilesets*/
 /** @{ */
@@ -991,8 +1196,14 @@ struct mapcache_tile {
   mapcache_buffer *encoded_data;
   char *redirect;
   int allow_redirect;
+  /**
+   * the tile is sent as is to a front-end supporting sendfile, so the cache may
+   * leave the file it was read from open in encoded_data->file
+   */
+  int allow_file;
   mapcache_image *raw_image;
   apr_time_t mtime; /**< last modification time */
+  apr_size_t encoded_size; /**< size of the encoded tile as reported by mapcache_cache::tile_stat(), 0 if unknown */
   int expires; /**< time in seconds after which the tile should be rechecked for validity */
 
   apr_array_header_t *dimensions;
@@ -1126,6 +1337,12 @@ struct mapcache_tileset {
    */
   int auto_expire;
 
+  /**
+   * when an #auto_expire tile is stale, return it as is and have it re-rendered
+   * in the background instead of making the client wait for the source
+   */
+  int stale_while_revalidate;
+
   int read_only;
   int subdimension_read_only;
 
@@ -1134,6 +1351,13 @@ struct mapcache_tileset {
    */
   mapcache_cache *_cache;
 
+  /**
+   * the cache in which tiles re-encoded to a format other than #format are kept, so that
+   * requests for another format don't need to decode and re-encode the tile each time.
+   * NULL if variants aren't cached
+   */
+  mapcache_cache *transcode_cache;
+
   /**
    * the source from which tiles should be requested
    */
@@ -1225,8 +1449,30 @@ void mapcache_tileset_get_level(mapcache_context *ctx, mapcache_tileset *tileset
 
 mapcache_grid_link* mapcache_grid_get_closest_wms_level(mapcache_context *ctx, mapcache_grid_link *grid, double resolution, int *level);
 MS_DLL_EXPORT void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile);
+/**
+ * \brief set the mtime, encoded_size and expires of a cached and up to date tile, without loading its data
+ * \returns MAPCACHE_SUCCESS if the tile could be checked and will be returned as is by mapcache_tileset_tile_get()
+ */
+int mapcache_tileset_tile_stat(mapcache_context *ctx, mapcache_tile *tile);
+/**
+ * \brief look several tiles up in their tileset caches with batched cache requests
+ *
+ * done[i] is set for the tiles that are completely handled, i.e. that were found and
+ * are not stale, or that were not found in a read-only tileset. The other tiles must
+ * still go through mapcache_tileset_tile_get()
+ */
+void mapcache_tileset_tile_multi_get_cached(mapcache_context *ctx, mapcache_tile **tiles, int ntiles, int *done);
 MS_DLL_EXPORT void mapcache_tileset_tile_set_get_with_subdimensions(mapcache_context *ctx, mapcache_tile *tile);
 
+/**
+ * \brief return a tile's data encoded in the given format, through the tileset's transcode cache
+ *
+ * the tile must have been fetched with mapcache_tileset_tile_get(). The re-encoded variant is
+ * stored in the mapcache_tileset::transcode_cache the first time it is requested, and is
+ * re-encoded when the original tile is more recent than it
+ */
+mapcache_buffer* mapcache_tileset_tile_transcode(mapcache_context *ctx, mapcache_tile *tile, mapcache_image_format *format);
+
 /**
  * \brief delete tile from cache
  * @param whole_metatile delete all the other tiles from the metatile to
@@ -1277,6 +1523,81 @@ void mapcache_tileset_add_watermark(mapcache_context *ctx, mapcache_tileset *til
 
 MS_DLL_EXPORT int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, mapcache_locker *locker, char *resource, void **lock);
 MS_DLL_EXPORT void mapcache_unlock_resource(mapcache_context *ctx, mapcache_locker *locker, void *lock);
+/**
+ * \brief copy a lock to a pool outliving the request that acquired it
+ * \returns NULL if the locker does not support it
+ */
+void* mapcache_lock_copy(mapcache_context *ctx, mapcache_locker *locker, void *lock, apr_pool_t *pool);
+
+mapcache_inflight_table* mapcache_inflight_table_create(apr_pool_t *pool);
+/**
+ * \brief join the in-process render of the given resource, creating it if needed
+ * \param leader set to MAPCACHE_TRUE if the caller is responsible for the rendering
+ */
+mapcache_inflight* mapcache_inflight_join(mapcache_context *ctx, mapcache_inflight_table *table, const char *key, int *leader);
+/**
+ * \brief called by the leader once done, shares the encoded tiles of mt (if not NULL) with the waiters
+ */
+void mapcache_inflight_land(mapcache_context *ctx, mapcache_inflight_table *table, mapcache_inflight *flight, mapcache_metatile *mt);
+/**
+ * \brief wait for the leader to finish, and fill the tile if it was shared
+ * \returns MAPCACHE_SUCCESS if the tile was filled, MAPCACHE_CACHE_MISS if it should be read from the cache
+ */
+int mapcache_inflight_wait(mapcache_context *ctx, mapcache_inflight_table *table, mapcache_inflight *flight, mapcache_tile *tile);
+void mapcache_inflight_leave(mapcache_context *ctx, mapcache_inflight_table *table, mapcache_inflight *flight);
+
+/**
+ * \brief create a per-process cache of decoded images, holding up to max_size bytes of pixel data
+ */
+mapcache_image_cache* mapcache_image_cache_create(apr_pool_t *pool, apr_size_t max_size);
+/**
+ * \brief copy the image cached for key into the allocated dst image, if it was decoded from data
+ * modified at mtime
+ * \returns MAPCACHE_SUCCESS or MAPCACHE_CACHE_MISS
+ */
+int mapcache_image_cache_get(mapcache_image_cache *cache, const char *key, apr_time_t mtime, mapcache_image *dst);
+/**
+ * \brief store a copy of src under key, evicting the least recently used images if needed
+ */
+void mapcache_image_cache_set(mapcache_image_cache *cache, const char *key, apr_time_t mtime, mapcache_image *src);
+
+/**
+ * \brief create the per-process write-behind queue of a cache
+ * \param flush_interval the time a tile may wait in the queue before it is written
+ * \param batch_size the number of queued tiles that triggers a write without waiting
+ * \param max_size the number of bytes of encoded tile data the queue may hold
+ */
+mapcache_write_behind* mapcache_write_behind_create(apr_pool_t *pool, mapcache_cache *cache,
+    apr_interval_time_t flush_interval, int batch_size, apr_size_t max_size);
+/**
+ * \brief queue the tiles, to be written by a worker pool thread
+ * \returns MAPCACHE_SUCCESS if the tiles were queued, MAPCACHE_FAILURE if the caller
+ * must write them itself (no worker pool, or the queue is full)
+ */
+int mapcache_write_behind_push(mapcache_context *ctx, mapcache_write_behind *wb, mapcache_tile *tiles, int ntiles);
+/**
+ * \brief look a tile up in the queue, copying its data and mtime if with_data is set
+ * \returns MAPCACHE_SUCCESS or MAPCACHE_CACHE_MISS
+ */
+int mapcache_write_behind_get(mapcache_context *ctx, mapcache_write_behind *wb, mapcache_tile *tile, int with_data);
+/**
+ * \brief drop a queued tile, so that it does not reappear after the cache has deleted it
+ */
+void mapcache_write_behind_delete(mapcache_context *ctx, mapcache_write_behind *wb, mapcache_tile *tile);
+/**
+ * \brief start collecting the tiles queued from this context, so that the lock of the
+ * metatile they belong to can be handed over to them
+ * \returns NULL if no cache of the configuration has a write-behind queue
+ */
+mapcache_write_behind_hold* mapcache_write_behind_hold_create(mapcache_context *ctx);
+/**
+ * \brief have the lock released once the tiles queued since the hold was created have
+ * been written, instead of now
+ * \returns MAPCACHE_SUCCESS if the lock was handed over, MAPCACHE_FAILURE if the caller
+ * must release it itself (nothing left in the queues, or the locker can't copy its locks)
+ */
+int mapcache_write_behind_hold_lock(mapcache_context *ctx, mapcache_write_behind_hold *hold,
+    mapcache_locker *locker, void *lock);
 
 MS_DLL_EXPORT mapcache_metatile* mapcache_tileset_metatile_get(mapcache_context *ctx, mapcache_tile *tile);
 MS_DLL_EXPORT void mapcache_tileset_render_metatile(mapcache_context *ctx, mapcache_metatile *mt);
@@ -1382,6 +1703,86 @@ char* mapcache_util_get_tile_key(mapcache_context *ctx, mapcache_tile *tile, cha
                                  char* sanitized_chars, char *sanitize_to);
 void mapcache_make_parent_dirs(mapcache_context *ctx, char *filename);
 
+/**
+ * variables that can be referenced from a tile key template
+ */
+typedef enum {
+  MAPCACHE_KEY_LITERAL, /**< text copied as is */
+  MAPCACHE_KEY_TILESET, /**< {tileset} */
+  MAPCACHE_KEY_GRID, /**< {grid} */
+  MAPCACHE_KEY_EXT, /**< {ext}, the extension of the tileset's format */
+  MAPCACHE_KEY_X, /**< {x}, rounded down to a multiple of mapcache_key_template::count_x */
+  MAPCACHE_KEY_INV_X, /**< {inv_x}, counted from the right of the level */
+  MAPCACHE_KEY_Y, /**< {y}, rounded down to a multiple of mapcache_key_template::count_y */
+  MAPCACHE_KEY_INV_Y, /**< {inv_y}, counted from the top of the level */
+  MAPCACHE_KEY_Z, /**< {z} */
+  MAPCACHE_KEY_INV_Z, /**< {inv_z} */
+  MAPCACHE_KEY_DIV_X, /**< {div_x}, x divided by mapcache_key_template::count_x */
+  MAPCACHE_KEY_INV_DIV_X, /**< {inv_div_x} */
+  MAPCACHE_KEY_DIV_Y, /**< {div_y}, y divided by mapcache_key_template::count_y */
+  MAPCACHE_KEY_INV_DIV_Y, /**< {inv_div_y} */
+  MAPCACHE_KEY_DIM, /**< {dim}, all the dimension values */
+  MAPCACHE_KEY_DIM_NAMED /**< {dim:name}, the value of a single dimension */
+} mapcache_key_token_type;
+
+#define MAPCACHE_KEY_TOKEN(type) (1u<<(type))
+
+/**
+ * the variables substituted in disk and rest cache templates
+ */
+#define MAPCACHE_KEY_TILE_TOKENS (MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_TILESET) | MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_GRID) | \
+    MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_EXT) | MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_X) | MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_INV_X) | \
+    MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_Y) | MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_INV_Y) | MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_Z) | \
+    MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_INV_Z) | MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_DIM) | MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_DIM_NAMED))
+
+typedef struct {
+  mapcache_key_token_type type;
+  const char *text; /**< source text of the token, output as is for literals and for unknown dimensions */
+  int len;
+  const char *name; /**< dimension name for MAPCACHE_KEY_DIM_NAMED */
+  const char *fmt; /**< printf format for numeric tokens, "%d" by default */
+} mapcache_key_token;
+
+/**
+ * \brief a tile key template, parsed once at configuration time
+ *
+ * rendering a key is then a single pass over the tokens, instead of a search and
+ * replace over the whole string for each possible variable
+ */
+typedef struct {
+  mapcache_key_token *tokens;
+  int ntokens;
+  int count_x, count_y; /**< size of the blocks of tiles the x and y variables refer to, 1 by default */
+  const char *sanitized_chars; /**< characters replaced in dimension values, NULL to keep them as is */
+  char sanitize_to;
+  int dim_names; /**< {dim} expands to "#name#value" for each dimension instead of "#value" */
+} mapcache_key_template;
+
+/**
+ * \brief parse a tile key template
+ * \param tokens the variables to substitute, as a mask of MAPCACHE_KEY_TOKEN() values.
+ *        other variables are left as is in the rendered keys
+ */
+mapcache_key_template* mapcache_key_template_compile(apr_pool_t *pool, const char *template, unsigned int tokens);
+
+/**
+ * \brief set the printf format used to render the numeric variables of the given type
+ */
+void mapcache_key_template_set_format(mapcache_key_template *tmpl, mapcache_key_token_type type, const char *fmt);
+
+/**
+ * \brief render the key of a tile into the given buffer
+ * \returns the length of the key, which has been truncated if it is not less than size,
+ *          or -1 on error
+ */
+int mapcache_key_template_render(mapcache_context *ctx, mapcache_key_template *tmpl, mapcache_tile *tile,
+                                 char *buf, int size);
+
+/**
+ * \brief return the key of a tile, allocated from the context pool
+ */
+char* mapcache_key_template_get(mapcache_context *ctx, mapcache_key_template *tmpl, mapcache_tile *tile);
+
 /**\defgroup imageio Image IO */
 /** @{ */
 
@@ -1395,6 +1796,14 @@ typedef enum {
   MAPCACHE_COMPRESSION_DEFAULT /**< default compression*/
 } mapcache_compression_type;
 
+/**
+ * library used to encode png images
+ */
+typedef enum {
+  MAPCACHE_PNG_ENCODER_LIBPNG, /**< libpng and zlib */
+  MAPCACHE_PNG_ENCODER_LIBDEFLATE /**< our own png writer, with libdeflate */
+} mapcache_png_encoder;
+
 /**
  * photometric interpretation for jpeg bands
  */
@@ -1416,6 +1825,7 @@ typedef enum {
  * \brief an image format
  * \sa mapcache_image_format_jpeg
  * \sa mapcache_image_format_png
+ * \sa mapcache_image_format_webp
  */
 struct mapcache_image_format {
   char *name; /**< the key by which this format will be referenced */
@@ -1444,6 +1854,8 @@ struct mapcache_image_format {
 struct mapcache_image_format_png {
   mapcache_image_format format;
   mapcache_compression_type compression_level; /**< PNG compression level to apply */
+  mapcache_png_encoder encoder;
+  void *encoder_state; /**< per-thread compressors and scratch buffers of the libdeflate encoder */
 };
 
 struct mapcache_image_format_mixed {
@@ -1472,6 +1884,7 @@ int mapcache_imageio_is_raw_tileset(mapcache_tileset *tileset);
 struct mapcache_image_format_png_q {
   mapcache_image_format_png format;
   int ncolors; /**< number of colors used in quantization, 2-256 */
+  int shared_palette; /**< quantize metatiles as a whole and encode all their tiles with the same palette */
 };
 
 /**
@@ -1512,6 +1925,20 @@ mapcache_image_format* mapcache_imageio_create_png_format(apr_pool_t *pool, char
  */
 mapcache_image_format* mapcache_imageio_create_png_q_format(apr_pool_t *pool, char *name, mapcache_compression_type compression, int ncolors);
 
+/**
+ * \brief compute the palette that should be used for all the tiles split out of the given
+ * metatile image, for quantized png formats configured with a shared palette
+ * \returns the palette, or NULL if the format does not use shared palettes
+ */
+mapcache_palette* mapcache_imageio_png_q_shared_palette(mapcache_context *ctx, mapcache_image_format *format,
+    mapcache_image *metatile);
+
+/**
+ * \brief select the encoder of a png or quantized png format
+ * \memberof mapcache_image_format_png
+ */
+void mapcache_imageio_png_set_encoder(mapcache_context *ctx, mapcache_image_format *format, mapcache_png_encoder encoder);
+
 /** @} */
 
 /**\defgroup imageio_jpg JPEG Image IO
@@ -1527,6 +1954,7 @@ struct mapcache_image_format_jpeg {
   int quality; /**< JPEG quality, 1-100 */
   mapcache_photometric photometric;
   mapcache_optimization optimize;
+  void *compressors; /**< libjpeg compressors reused by each thread */
 };
 
 mapcache_image_format* mapcache_imageio_create_jpeg_format(apr_pool_t *pool, char *name, int quality,
@@ -1542,9 +1970,39 @@ mapcache_image* _mapcache_imageio_jpeg_decode(mapcache_context *ctx, mapcache_bu
 /**
  * @param r
  * @param buffer
+ * @param scale_denom reduce the image by this factor (1, 2, 4 or 8) in the DCT domain
  * @return
  */
 void _mapcache_imageio_jpeg_decode_to_image(mapcache_context *ctx, mapcache_buffer *buffer,
+    mapcache_image *image, int scale_denom);
+
+/** @} */
+
+/**\defgroup imageio_webp WebP Image IO
+ * \ingroup imageio */
+/** @{ */
+
+/**\class mapcache_image_format_webp
+ * \brief WebP image format
+ * \extends mapcache_image_format
+ */
+struct mapcache_image_format_webp {
+  mapcache_image_format format;
+  int quality; /**< lossy quality or lossless compression effort, 0-100 */
+  int lossless;
+  int method; /**< encoder speed/size tradeoff, 0 (fastest) to 6 (smallest) */
+};
+
+/**
+ * \brief create a format capable of creating lossy or lossless webp, with alpha
+ * \memberof mapcache_image_format_webp
+ */
+mapcache_image_format* mapcache_imageio_create_webp_format(apr_pool_t *pool, char *name, int quality,
+    int lossless, int method);
+
+mapcache_image* _mapcache_imageio_webp_decode(mapcache_context *ctx, mapcache_buffer *buffer);
+
+void _mapcache_imageio_webp_decode_to_image(mapcache_context *ctx, mapcache_buffer *buffer,
     mapcache_image *image);
 
 /** @} */
@@ -1570,6 +2028,13 @@ mapcache_image* mapcache_imageio_decode(mapcache_context *ctx, mapcache_buffer *
  */
 void mapcache_imageio_decode_to_image(mapcache_context *ctx, mapcache_buffer *buffer, mapcache_image *image);
 
+/**
+ * decodes given jpeg buffer to an allocated image of 1/scale_denom of its size, scale_denom
+ * being 1, 2, 4 or 8. This is much cheaper than decoding at full size and downsampling
+ */
+void mapcache_imageio_decode_to_image_scaled(mapcache_context *ctx, mapcache_buffer *buffer, mapcache_image *image,
+    int scale_denom);
+
 
 /** @} */
 
@@ -1665,6 +2130,52 @@ mapcache_pooled_connection* mapcache_connection_pool_get_connection(mapcache_con
         void *params);
 void mapcache_connection_pool_invalidate_connection(mapcache_context *ctx, mapcache_pooled_connection *connection);
 void mapcache_connection_pool_release_connection(mapcache_context *ctx, mapcache_pooled_connection *connection);
+/**
+ * \brief the curl share handle (DNS cache and TLS sessions) of the connection pool
+ */
+void* mapcache_connection_pool_get_http_share(mapcache_connection_pool *cp);
+
+typedef void (*mapcache_worker_func)(void *data);
+typedef void (*mapcache_worker_detached_func)(mapcache_context *ctx, void *data);
+
+/**
+ * \brief create a pool of nthreads worker threads living as long as server_pool
+ * \param ctx a process level context, or NULL if detached jobs are not supported. Its
+ * clone() function must be callable from any thread and return a context allocated
+ * from a new root pool, as the job will destroy that pool once done.
+ */
+MS_DLL_EXPORT apr_status_t mapcache_worker_pool_create(mapcache_worker_pool **wp, int nthreads, mapcache_context *ctx, apr_pool_t *server_pool);
+/**
+ * \brief create a completion latch for a set of jobs pushed to the pool
+ * \param pool the (request) pool the batch and its jobs are allocated from
+ */
+mapcache_worker_batch* mapcache_worker_batch_create(mapcache_worker_pool *wp, apr_pool_t *pool);
+apr_status_t mapcache_worker_pool_push(mapcache_worker_batch *batch, mapcache_worker_func func, void *data);
+/**
+ * \brief wait until all the jobs of the batch have completed
+ *
+ * jobs of the batch that have not been picked up by a worker yet are run by
+ * the calling thread.
+ */
+void mapcache_worker_batch_wait(mapcache_worker_batch *batch);
+/**
+ * \brief create a context for a job that outlives the current request
+ * \returns NULL if ctx has no worker pool supporting detached jobs
+ */
+mapcache_context* mapcache_worker_pool_detached_context(mapcache_context *ctx);
+/**
+ * \brief queue a job that will not be waited upon
+ *
+ * the job runs with the given detached context, whose pool (from which data should be
+ * allocated) is destroyed once the job has run. On failure the caller still owns the context.
+ * \param cancel if not NULL, called instead of func when the pool shuts down before the job
+ * could run, so that the job can release whatever it holds on to
+ */
+apr_status_t mapcache_worker_pool_push_detached(mapcache_context *dctx, mapcache_worker_detached_func func,
+    mapcache_worker_detached_func cancel, void *data);
+int mapcache_worker_pool_queue_depth(mapcache_worker_pool *wp);
+int mapcache_worker_pool_busy_count(mapcache_worker_pool *wp);
+int mapcache_worker_pool_thread_count(mapcache_worker_pool *wp);
 
 #endif /* MAPCACHE_H_ */
 /* vim: ts=2 sts=2 et sw=2
@@ -70,6 +70,8 @@ mapcache_buffer *mapcache_buffer_create(size_t initialStorage, apr_pool_t* pool)
 int mapcache_buffer_append(mapcache_buffer *buffer, size_t len, void *data)
 {
   size_t total = buffer->size + len;
+  /* the data no longer matches the file's */
+  buffer->file = NULL;
   if(total > buffer->avail)
     _mapcache_buffer_realloc(buffer,total);
 
@@ -28,11 +28,17 @@
 #include "mapcache.h"
 #include <apr_time.h>
 
+static void _mapcache_cache_tile_multi_get(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile **tiles, int ntiles, int *rets);
+static void _mapcache_cache_tile_set(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile);
+
 int mapcache_cache_tile_get(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile) {
   int i,rv;
 #ifdef DEBUG
   ctx->log(ctx,MAPCACHE_DEBUG,"calling tile_get on cache (%s): (tileset=%s, grid=%s, z=%d, x=%d, y=%d",cache->name,tile->tileset->name,tile->grid_link->grid->name,tile->z,tile->x, tile->y);
 #endif
+  if(cache->write_behind && mapcache_write_behind_get(ctx,cache->write_behind,tile,1) == MAPCACHE_SUCCESS) {
+    return MAPCACHE_SUCCESS;
+  }
   for(i=0;i<=cache->retry_count;i++) {
     if(i) {
       ctx->log(ctx,MAPCACHE_INFO,"cache (%s) get retry %d of %d. previous try returned error: %s",cache->name,i,cache->retry_count,ctx->get_error_message(ctx));
@@ -52,13 +58,80 @@ int mapcache_cache_tile_get(mapcache_context *ctx, mapcache_cache *cache, mapcac
   return rv;
 }
 
-void mapcache_cache_tile_delete(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile) {
+void mapcache_cache_tile_multi_get(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile **tiles, int ntiles, int *rets) {
+  int i;
+#ifdef DEBUG
+  ctx->log(ctx,MAPCACHE_DEBUG,"calling tile_multi_get on cache (%s): (tileset=%s, grid=%s, %d tiles, first tile: z=%d, x=%d, y=%d",cache->name,tiles[0]->tileset->name,tiles[0]->grid_link->grid->name,
+      ntiles,tiles[0]->z,tiles[0]->x, tiles[0]->y);
+#endif
+  if(cache->write_behind) {
+    /* only ask the cache for the tiles that are not waiting in the queue */
+    mapcache_tile **pending = apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+    int *pending_idx = apr_palloc(ctx->pool, ntiles*sizeof(int));
+    int *pending_rets;
+    int n = 0;
+    for(i=0;i<ntiles;i++) {
+      if(mapcache_write_behind_get(ctx,cache->write_behind,tiles[i],1) == MAPCACHE_SUCCESS) {
+        rets[i] = MAPCACHE_SUCCESS;
+      } else {
+        pending_idx[n] = i;
+        pending[n++] = tiles[i];
+      }
+    }
+    if(n) {
+      pending_rets = apr_palloc(ctx->pool, n*sizeof(int));
+      _mapcache_cache_tile_multi_get(ctx,cache,pending,n,pending_rets);
+      for(i=0;i<n;i++) {
+        rets[pending_idx[i]] = pending_rets[i];
+      }
+    }
+    return;
+  }
+  _mapcache_cache_tile_multi_get(ctx,cache,tiles,ntiles,rets);
+}
+
+static void _mapcache_cache_tile_multi_get(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile **tiles, int ntiles, int *rets) {
   int i;
+  if(cache->_tile_multi_get) {
+    for(i=0;i<=cache->retry_count;i++) {
+      if(i) {
+        ctx->log(ctx,MAPCACHE_INFO,"cache (%s) multi-get retry %d of %d. previous try returned error: %s",cache->name,i,cache->retry_count,ctx->get_error_message(ctx));
+        ctx->clear_errors(ctx);
+        if(cache->retry_delay > 0) {
+          double wait = cache->retry_delay;
+          int j = 0;
+          for(j=1;j<i;j++) /* sleep twice as long as before previous retry */
+            wait *= 2;
+          apr_sleep((int)(wait*1000000));  /* apr_sleep expects microseconds */
+        }
+      }
+      cache->_tile_multi_get(ctx,cache,tiles,ntiles,rets);
+      if(!GC_HAS_ERROR(ctx))
+        break;
+    }
+  } else {
+    for( i=0;i<ntiles;i++ ) {
+      rets[i] = mapcache_cache_tile_get(ctx, cache, tiles[i]);
+      if(GC_HAS_ERROR(ctx))
+        return;
+    }
+  }
+}
+
+void mapcache_cache_tile_delete(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile) {
 #ifdef DEBUG
   ctx->log(ctx,MAPCACHE_DEBUG,"calling tile_delete on cache (%s): (tileset=%s, grid=%s, z=%d, x=%d, y=%d",cache->name,tile->tileset->name,tile->grid_link->grid->name,tile->z,tile->x, tile->y);
 #endif
   if(tile->tileset->read_only)
     return;
+  if(cache->write_behind) {
+    mapcache_write_behind_delete(ctx,cache->write_behind,tile);
+  }
+  mapcache_cache_tile_delete_direct(ctx,cache,tile);
+}
+
+void mapcache_cache_tile_delete_direct(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile) {
+  int i;
   for(i=0;i<=cache->retry_count;i++) {
     if(i) {
       ctx->log(ctx,MAPCACHE_INFO,"cache (%s) delete retry %d of %d. previous try returned error: %s",cache->name,i,cache->retry_count,ctx->get_error_message(ctx));
@@ -82,6 +155,9 @@ int mapcache_cache_tile_exists(mapcache_context *ctx, mapcache_cache *cache, map
 #ifdef DEBUG
   ctx->log(ctx,MAPCACHE_DEBUG,"calling tile_exists on cache (%s): (tileset=%s, grid=%s, z=%d, x=%d, y=%d",cache->name,tile->tileset->name,tile->grid_link->grid->name,tile->z,tile->x, tile->y);
 #endif
+  if(cache->write_behind && mapcache_write_behind_get(ctx,cache->write_behind,tile,0) == MAPCACHE_SUCCESS) {
+    return MAPCACHE_TRUE;
+  }
   for(i=0;i<=cache->retry_count;i++) {
     if(i) {
       ctx->log(ctx,MAPCACHE_INFO,"cache (%s) exists retry %d of %d. previous try returned error: %s",cache->name,i,cache->retry_count,ctx->get_error_message(ctx));
@@ -101,13 +177,49 @@ int mapcache_cache_tile_exists(mapcache_context *ctx, mapcache_cache *cache, map
   return rv;
 }
 
+int mapcache_cache_tile_stat(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile) {
+  int i,rv;
+  if(!cache->_tile_stat) {
+    return MAPCACHE_FAILURE;
+  }
+#ifdef DEBUG
+  ctx->log(ctx,MAPCACHE_DEBUG,"calling tile_stat on cache (%s): (tileset=%s, grid=%s, z=%d, x=%d, y=%d",cache->name,tile->tileset->name,tile->grid_link->grid->name,tile->z,tile->x, tile->y);
+#endif
+  if(cache->write_behind && mapcache_write_behind_get(ctx,cache->write_behind,tile,0) == MAPCACHE_SUCCESS) {
+    return MAPCACHE_SUCCESS;
+  }
+  for(i=0;i<=cache->retry_count;i++) {
+    if(i) {
+      ctx->log(ctx,MAPCACHE_INFO,"cache (%s) stat retry %d of %d. previous try returned error: %s",cache->name,i,cache->retry_count,ctx->get_error_message(ctx));
+      ctx->clear_errors(ctx);
+      if(cache->retry_delay > 0) {
+        double wait = cache->retry_delay;
+        int j = 0;
+        for(j=1;j<i;j++) /* sleep twice as long as before previous retry */
+          wait *= 2;
+        apr_sleep((int)(wait*1000000));  /* apr_sleep expects microseconds */
+      }
+    }
+    rv = cache->_tile_stat(ctx,cache,tile);
+    if(!GC_HAS_ERROR(ctx))
+      break;
+  }
+  return rv;
+}
+
 void mapcache_cache_tile_set(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile) {
-  int i;
 #ifdef DEBUG
   ctx->log(ctx,MAPCACHE_DEBUG,"calling tile_set on cache (%s): (tileset=%s, grid=%s, z=%d, x=%d, y=%d",cache->name,tile->tileset->name,tile->grid_link->grid->name,tile->z,tile->x, tile->y);
 #endif
   if(tile->tileset->read_only)
     return;
+  if(cache->write_behind && (mapcache_write_behind_push(ctx,cache->write_behind,tile,1) == MAPCACHE_SUCCESS || GC_HAS_ERROR(ctx)))
+    return;
+  _mapcache_cache_tile_set(ctx,cache,tile);
+}
+
+static void _mapcache_cache_tile_set(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile) {
+  int i;
   for(i=0;i<=cache->retry_count;i++) {
     if(i) {
       ctx->log(ctx,MAPCACHE_INFO,"cache (%s) set retry %d of %d. previous try returned error: %s",cache->name,i,cache->retry_count,ctx->get_error_message(ctx));
@@ -127,13 +239,19 @@ void mapcache_cache_tile_set(mapcache_context *ctx, mapcache_cache *cache, mapca
 }
 
 void mapcache_cache_tile_multi_set(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tiles, int ntiles) {
-  int i;
 #ifdef DEBUG
   ctx->log(ctx,MAPCACHE_DEBUG,"calling tile_multi_set on cache (%s): (tileset=%s, grid=%s, first tile: z=%d, x=%d, y=%d",cache->name,tiles[0].tileset->name,tiles[0].grid_link->grid->name,
       tiles[0].z,tiles[0].x, tiles[0].y);
 #endif
   if((&tiles[0])->tileset->read_only)
     return;
+  if(cache->write_behind && (mapcache_write_behind_push(ctx,cache->write_behind,tiles,ntiles) == MAPCACHE_SUCCESS || GC_HAS_ERROR(ctx)))
+    return;
+  mapcache_cache_tile_multi_set_direct(ctx,cache,tiles,ntiles);
+}
+
+void mapcache_cache_tile_multi_set_direct(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tiles, int ntiles) {
+  int i;
   if(cache->_tile_multi_set) {
     for(i=0;i<=cache->retry_count;i++) {
       if(i) {
@@ -153,7 +271,7 @@ void mapcache_cache_tile_multi_set(mapcache_context *ctx, mapcache_cache *cache,
     }
   } else {
     for( i=0;i<ntiles;i++ ) {
-      mapcache_cache_tile_set(ctx, cache, tiles+i);
+      _mapcache_cache_tile_set(ctx, cache, tiles+i);
     }
   }
 }
@@ -39,6 +39,16 @@
 #include <unistd.h>
 #endif
 
+#ifdef HAVE_PREAD
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+#endif
+
 /**\class mapcache_cache_disk
  * \brief a mapcache_cache on a filesytem
  * \implements mapcache_cache
@@ -48,10 +58,18 @@ struct mapcache_cache_disk {
   mapcache_cache cache;
   char *base_directory;
   char *filename_template;
+  mapcache_key_template *compiled_template;
   int symlink_blank;
   int detect_blank;
   int creation_retry;
 
+  /**
+   * for the bundle layout, number of tiles along each side of the square blocks of
+   * tiles stored in a single file
+   */
+  int bundle_size;
+  void *bundles; /**< bundle files opened by this process */
+
   /**
    * Set filename for a given tile
    * \memberof mapcache_cache_disk
@@ -258,65 +276,8 @@ static void _mapcache_cache_disk_tilecache_tile_key(mapcache_context *ctx, mapca
 
 static void _mapcache_cache_disk_template_tile_key(mapcache_context *ctx, mapcache_cache_disk *cache, mapcache_tile *tile, char **path)
 {
-
-  *path = cache->filename_template;
-  *path = mapcache_util_str_replace(ctx->pool,*path, "{tileset}", tile->tileset->name);
-  *path = mapcache_util_str_replace(ctx->pool,*path, "{grid}", tile->grid_link->grid->name);
-  *path = mapcache_util_str_replace(ctx->pool,*path, "{ext}",
-                                    tile->tileset->format?tile->tileset->format->extension:"png");
-
-  if(strstr(*path,"{x}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{x}",
-                                      apr_psprintf(ctx->pool,"%d",tile->x));
-  else
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_x}",
-                                      apr_psprintf(ctx->pool,"%d",
-                                          tile->grid_link->grid->levels[tile->z]->maxx - tile->x - 1));
-  if(strstr(*path,"{y}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{y}",
-                                      apr_psprintf(ctx->pool,"%d",tile->y));
-  else
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_y}",
-                                      apr_psprintf(ctx->pool,"%d",
-                                          tile->grid_link->grid->levels[tile->z]->maxy - tile->y - 1));
-  if(strstr(*path,"{z}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{z}",
-                                      apr_psprintf(ctx->pool,"%d",tile->z));
-  else
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_z}",
-                                      apr_psprintf(ctx->pool,"%d",
-                                          tile->grid_link->grid->nlevels - tile->z - 1));
-  if(tile->dimensions && strstr(*path,"{dim")) {
-    char *dimstring="";
-    int i = tile->dimensions->nelts;
-    while(i--) {
-      mapcache_requested_dimension *entry = APR_ARRAY_IDX(tile->dimensions,i, mapcache_requested_dimension*);
-      char *dimval;
-      char *single_dim;
-      char *iter;
-      if(!entry->cached_value) {
-        ctx->set_error(ctx,500,"BUG: dimension (%s) not set",entry->dimension->name);
-        return;
-      }
-      dimval = apr_pstrdup(ctx->pool,entry->cached_value);
-      iter = dimval;
-      while(*iter) {
-        /* replace dangerous characters by '#' */
-        if(*iter == '.' || *iter == '/') {
-          *iter = '#';
-        }
-        iter++;
-      }
-      dimstring = apr_pstrcat(ctx->pool,dimstring,"#",entry->dimension->name,"#",dimval,NULL);
-      single_dim = apr_pstrcat(ctx->pool,"{dim:",entry->dimension->name,"}",NULL);
-      if(strstr(*path,single_dim)) {
-        *path = mapcache_util_str_replace(ctx->pool,*path, single_dim, dimval);
-      }
-    }
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{dim}", dimstring);
-  }
-
-  if(!*path) {
+  *path = mapcache_key_template_get(ctx, cache->compiled_template, tile);
+  if(!*path && !GC_HAS_ERROR(ctx)) {
     ctx->set_error(ctx,500, "failed to allocate tile key");
   }
 }
@@ -375,6 +336,24 @@ static int _mapcache_cache_disk_has_tile(mapcache_context *ctx, mapcache_cache *
   }
 }
 
+static int _mapcache_cache_disk_stat(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  char *filename;
+  apr_finfo_t finfo;
+  mapcache_cache_disk *cache = (mapcache_cache_disk*)pcache;
+  cache->tile_key(ctx, cache, tile, &filename);
+  if(GC_HAS_ERROR(ctx)) {
+    return MAPCACHE_FAILURE;
+  }
+  /* same checks and mtime as _mapcache_cache_disk_get, which stats the (possibly symlinked) file it opened */
+  if(apr_stat(&finfo,filename,APR_FINFO_SIZE|APR_FINFO_MTIME,ctx->pool) != APR_SUCCESS || !finfo.size) {
+    return MAPCACHE_CACHE_MISS;
+  }
+  tile->mtime = finfo.mtime;
+  tile->encoded_size = finfo.size;
+  return MAPCACHE_SUCCESS;
+}
+
 static void _mapcache_cache_disk_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   apr_status_t ret;
@@ -415,7 +394,7 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_cache *pcach
   ctx->log(ctx,MAPCACHE_DEBUG,"checking for tile %s",filename);
   if((rv=apr_file_open(&f, filename,
 #ifndef NOMMAP
-                       APR_FOPEN_READ, APR_UREAD | APR_GREAD,
+                       APR_FOPEN_READ|APR_FOPEN_SENDFILE_ENABLED, APR_UREAD | APR_GREAD,
 #else
                        APR_FOPEN_READ|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,APR_OS_DEFAULT,
 #endif
@@ -448,6 +427,18 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_cache *pcach
     }
     tile->encoded_data->buf = tilemmap->mm;
     tile->encoded_data->size = tile->encoded_data->avail = finfo.size;
+    if(tile->allow_file) {
+      /*
+       * keep the file open so the front-end can sendfile() it. The mapping itself
+       * is then never paged in
+       */
+      tile->encoded_data->file = f;
+      tile->encoded_data->file_offset = 0;
+    } else {
+      /* the mapping stays valid once the file is closed */
+      apr_file_close(f);
+    }
+    return MAPCACHE_SUCCESS;
 #else
     tile->encoded_data = mapcache_buffer_create(size,ctx->pool);
     //manually add the data to our buffer
@@ -671,6 +662,634 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_cache *pcac
 
 }
 
+#ifdef HAVE_PREAD
+
+/*
+ * bundle layout: the tiles of each bundle_size x bundle_size block of a level are
+ * packed in a single file, laid out as
+ *
+ *   [header][index][tile record][tile record]...
+ *
+ * the index holds one fixed size entry per tile of the block, giving the offset and
+ * size of its latest record. Records are only ever appended, and the index entry is
+ * updated once its record has been written, so a reader never sees a partially
+ * written tile. Overwritten and deleted tiles leave dead records behind, that can
+ * only be reclaimed by rewriting the bundle offline with mapcache_cache_disk_bundle_compact().
+ * Integers are stored in the byte order of the host.
+ */
+
+#define MAPCACHE_BUNDLE_MAGIC "MCBUNDL1"
+#define MAPCACHE_BUNDLE_MAX_OPEN 256
+
+typedef struct {
+  char magic[8];
+  apr_uint32_t bundle_size;
+  apr_uint32_t reserved;
+} _bundle_header;
+
+typedef struct {
+  apr_uint64_t offset; /* offset of the tile record, 0 if the tile isn't stored */
+  apr_uint32_t size; /* size of the tile data */
+  apr_uint32_t mtime; /* in seconds since the epoch */
+} _bundle_entry;
+
+/* precedes the data of each tile, used to detect index entries read while being updated */
+typedef struct {
+  apr_uint32_t size;
+  apr_uint32_t slot;
+} _bundle_record;
+
+typedef struct {
+  char *path;
+  int fd;
+  int writable;
+  void *index; /* the header and index, mapped read-only */
+  size_t index_size;
+  int refcount; /* number of requests currently using the bundle */
+} _bundle_file;
+
+typedef struct {
+#if APR_HAS_THREADS
+  apr_thread_mutex_t *mutex; /* protects the table of open bundles */
+  apr_thread_mutex_t *write_mutex; /* fcntl locks do not exclude the threads of a same process */
+#endif
+  apr_pool_t *pool;
+  apr_hash_t *files;
+  int count;
+} _bundle_table;
+
+static void _bundle_file_close(_bundle_file *b)
+{
+  munmap(b->index, b->index_size);
+  close(b->fd);
+  free(b->path);
+  free(b);
+}
+
+static apr_status_t _bundle_table_cleanup(void *data)
+{
+  _bundle_table *t = (_bundle_table*)data;
+  apr_hash_index_t *hi;
+  for(hi = apr_hash_first(NULL, t->files); hi; hi = apr_hash_next(hi)) {
+    void *b;
+    apr_hash_this(hi, NULL, NULL, &b);
+    _bundle_file_close((_bundle_file*)b);
+  }
+  return APR_SUCCESS;
+}
+
+static _bundle_table* _bundle_table_create(mapcache_context *ctx)
+{
+  _bundle_table *t = apr_pcalloc(ctx->pool, sizeof(_bundle_table));
+  /* the hash gets its own pool as it is only ever accessed with the mutex held */
+  apr_pool_create(&t->pool, ctx->pool);
+#if APR_HAS_THREADS
+  if(apr_thread_mutex_create(&t->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS ||
+      apr_thread_mutex_create(&t->write_mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to create bundle table mutex");
+    return NULL;
+  }
+#endif
+  t->files = apr_hash_make(t->pool);
+  apr_pool_cleanup_register(ctx->pool, t, _bundle_table_cleanup, apr_pool_cleanup_null);
+  return t;
+}
+
+static void _bundle_table_lock(_bundle_table *t)
+{
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(t->mutex);
+#endif
+}
+
+static void _bundle_table_unlock(_bundle_table *t)
+{
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(t->mutex);
+#endif
+}
+
+/* closes the bundles no request is using. must be called with the mutex held */
+static void _bundle_table_evict(_bundle_table *t)
+{
+  apr_hash_index_t *hi;
+  for(hi = apr_hash_first(NULL, t->files); hi; hi = apr_hash_next(hi)) {
+    void *val;
+    _bundle_file *b;
+    apr_hash_this(hi, NULL, NULL, &val);
+    b = (_bundle_file*)val;
+    if(!b->refcount) {
+      apr_hash_set(t->files, b->path, APR_HASH_KEY_STRING, NULL);
+      _bundle_file_close(b);
+      t->count--;
+    }
+  }
+}
+
+static int _bundle_flock(int fd, short type)
+{
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  while(fcntl(fd, F_SETLKW, &fl) != 0) {
+    if(errno != EINTR) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void _bundle_tile_key(mapcache_context *ctx, mapcache_cache_disk *cache, mapcache_tile *tile, char **path, int *slot)
+{
+  char *base;
+  int n = cache->bundle_size;
+  _mapcache_cache_disk_base_tile_key(ctx, cache, tile, &base);
+  if(GC_HAS_ERROR(ctx)) {
+    return;
+  }
+  *path = apr_psprintf(ctx->pool, "%s/%02d/R%04xC%04x.bundle", base, tile->z, tile->y / n, tile->x / n);
+  *slot = (tile->y % n) * n + (tile->x % n);
+}
+
+/*
+ * checks the header of a newly opened bundle, or writes it if the bundle has just been
+ * created. returns MAPCACHE_CACHE_MISS for an empty bundle that could not be initialized
+ */
+static int _bundle_init(mapcache_context *ctx, mapcache_cache_disk *cache, const char *path, int fd, int writable, size_t index_size)
+{
+  struct stat st;
+  _bundle_header header;
+  int ret = MAPCACHE_SUCCESS;
+  /* lock the file so we never read a header another process is writing */
+  if(_bundle_flock(fd, writable?F_WRLCK:F_RDLCK) != 0) {
+    ctx->set_error(ctx, 500, "failed to lock bundle %s: %s", path, strerror(errno));
+    return MAPCACHE_FAILURE;
+  }
+  if(fstat(fd, &st) != 0) {
+    ctx->set_error(ctx, 500, "failed to stat bundle %s: %s", path, strerror(errno));
+    ret = MAPCACHE_FAILURE;
+  } else if(st.st_size == 0) {
+    if(writable) {
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, MAPCACHE_BUNDLE_MAGIC, 8);
+      header.bundle_size = cache->bundle_size;
+      if(ftruncate(fd, index_size) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        ctx->set_error(ctx, 500, "failed to initialize bundle %s: %s", path, strerror(errno));
+        ret = MAPCACHE_FAILURE;
+      }
+    } else {
+      ret = MAPCACHE_CACHE_MISS;
+    }
+  } else if(st.st_size < (off_t)index_size || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(header.magic, MAPCACHE_BUNDLE_MAGIC, 8)) {
+    ctx->set_error(ctx, 500, "%s is not a valid bundle file", path);
+    ret = MAPCACHE_FAILURE;
+  } else if((int)header.bundle_size != cache->bundle_size) {
+    ctx->set_error(ctx, 500, "bundle %s holds blocks of %d tiles, but cache %s has a bundle_size of %d",
+                   path, (int)header.bundle_size, cache->cache.name, cache->bundle_size);
+    ret = MAPCACHE_FAILURE;
+  }
+  _bundle_flock(fd, F_UNLCK);
+  return ret;
+}
+
+/*
+ * returns the bundle stored at path, opening it if it isn't already open in this
+ * process. if create is set the bundle is created if needed, otherwise NULL is
+ * returned without setting an error when the bundle does not exist.
+ * the returned bundle must be given back with _bundle_release()
+ */
+static _bundle_file* _bundle_acquire(mapcache_context *ctx, mapcache_cache_disk *cache, const char *path, int create)
+{
+  _bundle_table *t = (_bundle_table*)cache->bundles;
+  size_t index_size = sizeof(_bundle_header) + (size_t)cache->bundle_size * cache->bundle_size * sizeof(_bundle_entry);
+  _bundle_file *b;
+  void *index;
+  int fd, writable = 1, rv;
+
+  /*
+   * bundles are opened with the table locked so that each one is only opened once per
+   * process: closing a second descriptor would release the fcntl locks held on the first
+   */
+  _bundle_table_lock(t);
+  b = apr_hash_get(t->files, path, APR_HASH_KEY_STRING);
+  if(b) {
+    b->refcount++;
+    _bundle_table_unlock(t);
+    return b;
+  }
+
+  fd = open(path, O_RDWR);
+  if(fd < 0 && errno == EACCES) {
+    writable = 0;
+    fd = open(path, O_RDONLY);
+  }
+  if(fd < 0 && errno == ENOENT && create) {
+    mapcache_make_parent_dirs(ctx, apr_pstrdup(ctx->pool, path));
+    if(GC_HAS_ERROR(ctx)) {
+      _bundle_table_unlock(t);
+      return NULL;
+    }
+    fd = open(path, O_RDWR|O_CREAT, 0666);
+  }
+  if(fd < 0) {
+    if(errno != ENOENT) {
+      ctx->set_error(ctx, 500, "failed to open bundle %s: %s", path, strerror(errno));
+    }
+    _bundle_table_unlock(t);
+    return NULL;
+  }
+
+  rv = _bundle_init(ctx, cache, path, fd, writable, index_size);
+  if(rv != MAPCACHE_SUCCESS) {
+    close(fd);
+    _bundle_table_unlock(t);
+    return NULL;
+  }
+  index = mmap(NULL, index_size, PROT_READ, MAP_SHARED, fd, 0);
+  if(index == MAP_FAILED) {
+    ctx->set_error(ctx, 500, "failed to map index of bundle %s: %s", path, strerror(errno));
+    close(fd);
+    _bundle_table_unlock(t);
+    return NULL;
+  }
+
+  b = calloc(1, sizeof(_bundle_file));
+  if(b) b->path = strdup(path);
+  if(!b || !b->path) {
+    ctx->set_error(ctx, 500, "failed to allocate bundle %s", path);
+    free(b);
+    munmap(index, index_size);
+    close(fd);
+    _bundle_table_unlock(t);
+    return NULL;
+  }
+  b->fd = fd;
+  b->writable = writable;
+  b->index = index;
+  b->index_size = index_size;
+  b->refcount = 1;
+  if(t->count >= MAPCACHE_BUNDLE_MAX_OPEN) {
+    _bundle_table_evict(t);
+  }
+  apr_hash_set(t->files, b->path, APR_HASH_KEY_STRING, b);
+  t->count++;
+  _bundle_table_unlock(t);
+  return b;
+}
+
+static void _bundle_release(mapcache_cache_disk *cache, _bundle_file *b)
+{
+  _bundle_table *t = (_bundle_table*)cache->bundles;
+  _bundle_table_lock(t);
+  b->refcount--;
+  _bundle_table_unlock(t);
+}
+
+static void _bundle_entry_read(_bundle_file *b, int slot, _bundle_entry *e)
+{
+  memcpy(e, (char*)b->index + sizeof(_bundle_header) + slot * sizeof(_bundle_entry), sizeof(_bundle_entry));
+}
+
+/*
+ * appends a record for the given slot and points its index entry to it. a NULL data
+ * clears the index entry instead
+ */
+static void _bundle_write(mapcache_context *ctx, mapcache_cache_disk *cache, _bundle_file *b, int slot, mapcache_buffer *data)
+{
+#if APR_HAS_THREADS
+  _bundle_table *t = (_bundle_table*)cache->bundles;
+#endif
+  _bundle_entry e;
+  _bundle_record rec;
+  struct stat st;
+  off_t end;
+
+  if(!b->writable) {
+    ctx->set_error(ctx, 500, "bundle %s is read-only", b->path);
+    return;
+  }
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(t->write_mutex);
+#endif
+  if(_bundle_flock(b->fd, F_WRLCK) != 0) {
+    ctx->set_error(ctx, 500, "failed to lock bundle %s: %s", b->path, strerror(errno));
+    goto unlock_mutex;
+  }
+  memset(&e, 0, sizeof(e));
+  if(data) {
+    if(fstat(b->fd, &st) != 0) {
+      ctx->set_error(ctx, 500, "failed to stat bundle %s: %s", b->path, strerror(errno));
+      goto unlock_file;
+    }
+    end = st.st_size;
+    rec.size = data->size;
+    rec.slot = slot;
+    if(pwrite(b->fd, &rec, sizeof(rec), end) != sizeof(rec) ||
+        pwrite(b->fd, data->buf, data->size, end + sizeof(rec)) != (ssize_t)data->size) {
+      ctx->set_error(ctx, 500, "failed to write tile to bundle %s: %s", b->path, strerror(errno));
+      if(ftruncate(b->fd, end) != 0) {
+        ctx->log(ctx, MAPCACHE_WARN, "failed to truncate bundle %s after failed write", b->path);
+      }
+      goto unlock_file;
+    }
+    e.offset = end;
+    e.size = data->size;
+    e.mtime = apr_time_sec(apr_time_now());
+  }
+  if(pwrite(b->fd, &e, sizeof(e), sizeof(_bundle_header) + slot * sizeof(_bundle_entry)) != sizeof(e)) {
+    ctx->set_error(ctx, 500, "failed to update index of bundle %s: %s", b->path, strerror(errno));
+  }
+unlock_file:
+  _bundle_flock(b->fd, F_UNLCK);
+unlock_mutex:
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(t->write_mutex);
+#endif
+  return;
+}
+
+/*
+ * looks up the index entry of a tile. returns NULL if the bundle doesn't exist, or
+ * the acquired bundle with e filled in (possibly with a zero offset) otherwise
+ */
+static _bundle_file* _bundle_lookup(mapcache_context *ctx, mapcache_cache_disk *cache, mapcache_tile *tile,
+                                    char **path, int *slot, _bundle_entry *e)
+{
+  _bundle_file *b;
+  _bundle_tile_key(ctx, cache, tile, path, slot);
+  if(GC_HAS_ERROR(ctx)) {
+    return NULL;
+  }
+  b = _bundle_acquire(ctx, cache, *path, 0);
+  if(b) {
+    _bundle_entry_read(b, *slot, e);
+  }
+  return b;
+}
+
+static int _mapcache_cache_disk_bundle_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_disk *cache = (mapcache_cache_disk*)pcache;
+  _bundle_file *b;
+  _bundle_entry e;
+  char *path;
+  int slot;
+  b = _bundle_lookup(ctx, cache, tile, &path, &slot, &e);
+  if(!b) {
+    return MAPCACHE_FALSE;
+  }
+  _bundle_release(cache, b);
+  return e.offset ? MAPCACHE_TRUE : MAPCACHE_FALSE;
+}
+
+static int _mapcache_cache_disk_bundle_stat(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_disk *cache = (mapcache_cache_disk*)pcache;
+  _bundle_file *b;
+  _bundle_entry e;
+  char *path;
+  int slot;
+  b = _bundle_lookup(ctx, cache, tile, &path, &slot, &e);
+  if(!b) {
+    return GC_HAS_ERROR(ctx) ? MAPCACHE_FAILURE : MAPCACHE_CACHE_MISS;
+  }
+  _bundle_release(cache, b);
+  if(!e.offset || !e.size) {
+    return MAPCACHE_CACHE_MISS;
+  }
+  tile->mtime = apr_time_from_sec(e.mtime);
+  tile->encoded_size = e.size;
+  return MAPCACHE_SUCCESS;
+}
+
+static void _mapcache_cache_disk_bundle_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_disk *cache = (mapcache_cache_disk*)pcache;
+  _bundle_file *b;
+  _bundle_entry e;
+  char *path;
+  int slot;
+  b = _bundle_lookup(ctx, cache, tile, &path, &slot, &e);
+  if(!b) {
+    return;
+  }
+  if(e.offset) {
+    _bundle_write(ctx, cache, b, slot, NULL);
+  }
+  _bundle_release(cache, b);
+}
+
+/**
+ * \brief get a tile from its bundle
+ *
+ * reads the tile record with a single pread on the bundle's descriptor, which stays open
+ * across requests
+ * \private \memberof mapcache_cache_disk
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_disk_bundle_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_disk *cache = (mapcache_cache_disk*)pcache;
+  _bundle_file *b;
+  _bundle_entry e;
+  _bundle_record *rec;
+  unsigned char *data;
+  char *path;
+  int slot, attempt;
+  ssize_t bytes;
+
+  b = _bundle_lookup(ctx, cache, tile, &path, &slot, &e);
+  if(!b) {
+    return GC_HAS_ERROR(ctx) ? MAPCACHE_FAILURE : MAPCACHE_CACHE_MISS;
+  }
+  /* the entry may be replaced between reading it and reading the record, in which case read it again */
+  for(attempt = 0; attempt < 2; attempt++) {
+    if(!e.offset || !e.size) {
+      _bundle_release(cache, b);
+      return MAPCACHE_CACHE_MISS;
+    }
+    data = apr_palloc(ctx->pool, sizeof(_bundle_record) + e.size);
+    bytes = pread(b->fd, data, sizeof(_bundle_record) + e.size, (off_t)e.offset);
+    rec = (_bundle_record*)data;
+    if(bytes == (ssize_t)(sizeof(_bundle_record) + e.size) && rec->size == e.size && rec->slot == (apr_uint32_t)slot) {
+      _bundle_release(cache, b);
+      tile->encoded_data = mapcache_buffer_create(0, ctx->pool);
+      tile->encoded_data->buf = data + sizeof(_bundle_record);
+      tile->encoded_data->size = e.size;
+      tile->encoded_data->avail = e.size;
+      tile->mtime = apr_time_from_sec(e.mtime);
+      return MAPCACHE_SUCCESS;
+    }
+    _bundle_entry_read(b, slot, &e);
+  }
+  _bundle_release(cache, b);
+  ctx->log(ctx, MAPCACHE_WARN, "inconsistent record for tile %d in bundle %s", slot, path);
+  return MAPCACHE_CACHE_MISS;
+}
+
+/**
+ * \brief append a tile to its bundle
+ * \private \memberof mapcache_cache_disk
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_disk_bundle_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_disk *cache = (mapcache_cache_disk*)pcache;
+  _bundle_file *b;
+  char *path;
+  int slot;
+
+  _bundle_tile_key(ctx, cache, tile, &path, &slot);
+  GC_CHECK_ERROR(ctx);
+  if(cache->detect_blank) {
+    if(!tile->raw_image) {
+      tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
+      GC_CHECK_ERROR(ctx);
+    }
+    if(mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE && tile->raw_image->data[3] == 0) {
+      /* fully transparent tile, don't store it */
+      tile->nodata = 1;
+      return;
+    }
+  }
+
+  if(!tile->encoded_data) {
+    tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+    GC_CHECK_ERROR(ctx);
+  }
+  if(tile->encoded_data->size == 0) {
+    ctx->set_error(ctx, 500, "attempting to write 0 length tile to %s", path);
+    return;
+  }
+
+  b = _bundle_acquire(ctx, cache, path, 1);
+  if(!b) {
+    if(!GC_HAS_ERROR(ctx)) {
+      ctx->set_error(ctx, 500, "failed to create bundle %s", path);
+    }
+    return;
+  }
+  _bundle_write(ctx, cache, b, slot, tile->encoded_data);
+  _bundle_release(cache, b);
+}
+
+/*
+ * rewrites a bundle with only the records its index points to, dropping those left
+ * behind by overwritten and deleted tiles. the bundle is locked for writing while its
+ * records are copied, but a process that already has it open keeps using the replaced
+ * file: this must only be run on caches that are not being served or seeded
+ */
+int mapcache_cache_disk_bundle_compact(mapcache_context *ctx, const char *path, apr_off_t *size_before, apr_off_t *size_after)
+{
+  char *tmppath = apr_pstrcat(ctx->pool, path, ".compact", NULL);
+  struct stat st;
+  _bundle_header header;
+  _bundle_entry *index = NULL;
+  char *buf = NULL;
+  size_t bufsize = 0, count = 0, index_size = 0, i;
+  off_t end = 0;
+  int fd, out = -1, ret = MAPCACHE_FAILURE;
+
+  fd = open(path, O_RDWR);
+  if(fd < 0) {
+    ctx->set_error(ctx, 500, "failed to open bundle %s: %s", path, strerror(errno));
+    return MAPCACHE_FAILURE;
+  }
+  if(_bundle_flock(fd, F_WRLCK) != 0) {
+    ctx->set_error(ctx, 500, "failed to lock bundle %s: %s", path, strerror(errno));
+    close(fd);
+    return MAPCACHE_FAILURE;
+  }
+  if(fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+     memcmp(header.magic, MAPCACHE_BUNDLE_MAGIC, 8) || header.bundle_size == 0) {
+    ctx->set_error(ctx, 500, "%s is not a valid bundle file", path);
+    goto cleanup;
+  }
+  count = (size_t)header.bundle_size * header.bundle_size;
+  index_size = sizeof(header) + count * sizeof(_bundle_entry);
+  index = apr_palloc(ctx->pool, count * sizeof(_bundle_entry));
+  if(st.st_size < (off_t)index_size ||
+     pread(fd, index, count * sizeof(_bundle_entry), sizeof(header)) != (ssize_t)(count * sizeof(_bundle_entry))) {
+    ctx->set_error(ctx, 500, "%s is not a valid bundle file", path);
+    goto cleanup;
+  }
+
+  out = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+  if(out < 0) {
+    ctx->set_error(ctx, 500, "failed to create %s: %s", tmppath, strerror(errno));
+    goto cleanup;
+  }
+  end = index_size;
+  for(i = 0; i < count; i++) {
+    _bundle_entry *entry = &index[i];
+    _bundle_record record;
+    size_t size;
+    if(!entry->offset) {
+      continue;
+    }
+    size = sizeof(record) + entry->size;
+    if(size > bufsize) {
+      bufsize = size * 2;
+      buf = apr_palloc(ctx->pool, bufsize);
+    }
+    if(entry->offset + size > (apr_uint64_t)st.st_size ||
+       pread(fd, buf, size, (off_t)entry->offset) != (ssize_t)size) {
+      ctx->set_error(ctx, 500, "failed to read tile %d of bundle %s", (int)i, path);
+      goto cleanup;
+    }
+    memcpy(&record, buf, sizeof(record));
+    if(record.size != entry->size || record.slot != i) {
+      ctx->set_error(ctx, 500, "bundle %s is corrupted: tile %d points to the record of another tile", path, (int)i);
+      goto cleanup;
+    }
+    if(pwrite(out, buf, size, end) != (ssize_t)size) {
+      ctx->set_error(ctx, 500, "failed to write %s: %s", tmppath, strerror(errno));
+      goto cleanup;
+    }
+    entry->offset = end;
+    end += size;
+  }
+  if(pwrite(out, &header, sizeof(header), 0) != sizeof(header) ||
+     pwrite(out, index, count * sizeof(_bundle_entry), sizeof(header)) != (ssize_t)(count * sizeof(_bundle_entry)) ||
+     fsync(out) != 0) {
+    ctx->set_error(ctx, 500, "failed to write %s: %s", tmppath, strerror(errno));
+    goto cleanup;
+  }
+  close(out);
+  out = -1;
+  if(rename(tmppath, path) != 0) {
+    ctx->set_error(ctx, 500, "failed to replace bundle %s: %s", path, strerror(errno));
+    goto cleanup;
+  }
+  if(size_before) *size_before = st.st_size;
+  if(size_after) *size_after = end;
+  ret = MAPCACHE_SUCCESS;
+
+cleanup:
+  if(out >= 0) {
+    close(out);
+  }
+  if(ret != MAPCACHE_SUCCESS) {
+    unlink(tmppath);
+  }
+  _bundle_flock(fd, F_UNLCK);
+  close(fd);
+  return ret;
+}
+
+#else
+
+int mapcache_cache_disk_bundle_compact(mapcache_context *ctx, const char *path, apr_off_t *size_before, apr_off_t *size_after)
+{
+  ctx->set_error(ctx, 500, "bundle layout is not supported on this platform");
+  return MAPCACHE_FAILURE;
+}
+
+
+#endif /* HAVE_PREAD */
+
 /**
  * \private \memberof mapcache_cache_disk
  */
@@ -680,6 +1299,9 @@ static void _mapcache_cache_disk_configuration_parse_xml(mapcache_context *ctx,
   mapcache_cache_disk *dcache = (mapcache_cache_disk*)cache;
   char *layout = NULL;
   int template_layout = MAPCACHE_FALSE;
+#ifdef HAVE_PREAD
+  int bundle_layout = MAPCACHE_FALSE;
+#endif
 
   layout = (char*)ezxml_attr(node,"layout");
   if (!layout || !strlen(layout) || !strcmp(layout,"tilecache")) {
@@ -688,6 +1310,13 @@ static void _mapcache_cache_disk_configuration_parse_xml(mapcache_context *ctx,
     dcache->tile_key = _mapcache_cache_disk_arcgis_tile_key;
   } else if(!strcmp(layout,"worldwind")) {
     dcache->tile_key = _mapcache_cache_disk_worldwind_tile_key;
+  } else if(!strcmp(layout,"bundle")) {
+#ifdef HAVE_PREAD
+    bundle_layout = MAPCACHE_TRUE;
+#else
+    ctx->set_error(ctx, 400, "cache \"%s\": bundle layout is not supported on this platform", cache->name);
+    return;
+#endif
   } else if (!strcmp(layout,"template")) {
     dcache->tile_key = _mapcache_cache_disk_template_tile_key;
     template_layout = MAPCACHE_TRUE;
@@ -724,6 +1353,31 @@ static void _mapcache_cache_disk_configuration_parse_xml(mapcache_context *ctx,
     dcache->detect_blank=1;
   }
 
+#ifdef HAVE_PREAD
+  if(bundle_layout) {
+    if(dcache->symlink_blank) {
+      ctx->set_error(ctx, 400, "cache \"%s\": symlink_blank cannot be used with the bundle layout", cache->name);
+      return;
+    }
+    if ((cur_node = ezxml_child(node,"bundle_size")) != NULL) {
+      char *endptr;
+      dcache->bundle_size = (int)strtol(cur_node->txt,&endptr,10);
+      if(*endptr != 0 || dcache->bundle_size <= 0 || dcache->bundle_size > 1024) {
+        ctx->set_error(ctx, 400, "cache \"%s\": failed to parse bundle_size \"%s\" (expecting a positive integer not above 1024)",
+                       cache->name, cur_node->txt);
+        return;
+      }
+    }
+    dcache->bundles = _bundle_table_create(ctx);
+    GC_CHECK_ERROR(ctx);
+    cache->_tile_get = _mapcache_cache_disk_bundle_get;
+    cache->_tile_set = _mapcache_cache_disk_bundle_set;
+    cache->_tile_exists = _mapcache_cache_disk_bundle_has_tile;
+    cache->_tile_stat = _mapcache_cache_disk_bundle_stat;
+    cache->_tile_delete = _mapcache_cache_disk_bundle_delete;
+  }
+#endif
+
 }
 
 /**
@@ -739,6 +1393,13 @@ static void _mapcache_cache_disk_configuration_post_config(mapcache_context *ctx
     ctx->set_error(ctx, 400, "disk cache %s has no base directory or template",dcache->cache.name);
     return;
   }
+  if(dcache->filename_template) {
+    dcache->compiled_template = mapcache_key_template_compile(ctx->pool, dcache->filename_template, MAPCACHE_KEY_TILE_TOKENS);
+    /* dangerous characters in dimension values are replaced by '#' */
+    dcache->compiled_template->sanitized_chars = "./";
+    dcache->compiled_template->sanitize_to = '#';
+    dcache->compiled_template->dim_names = 1;
+  }
 }
 
 /**
@@ -754,11 +1415,13 @@ mapcache_cache* mapcache_cache_disk_create(mapcache_context *ctx)
   cache->symlink_blank = 0;
   cache->detect_blank = 0;
   cache->creation_retry = 0;
+  cache->bundle_size = 128;
   cache->cache.metadata = apr_table_make(ctx->pool,3);
   cache->cache.type = MAPCACHE_CACHE_DISK;
   cache->cache._tile_delete = _mapcache_cache_disk_delete;
   cache->cache._tile_get = _mapcache_cache_disk_get;
   cache->cache._tile_exists = _mapcache_cache_disk_has_tile;
+  cache->cache._tile_stat = _mapcache_cache_disk_stat;
   cache->cache._tile_set = _mapcache_cache_disk_set;
   cache->cache.configuration_post_config = _mapcache_cache_disk_configuration_post_config;
   cache->cache.configuration_parse_xml = _mapcache_cache_disk_configuration_parse_xml;
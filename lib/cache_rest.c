@@ -73,6 +73,7 @@ struct mapcache_rest_operation {
   apr_table_t *headers;
   mapcache_rest_method method;
   char *tile_url;
+  mapcache_key_template *tile_url_template;
   char *header_file;
   void (*add_headers)(mapcache_context *ctx, mapcache_cache_rest *pcache, mapcache_tile *tile, char *url, apr_table_t *headers);
 };
@@ -81,6 +82,7 @@ typedef struct mapcache_rest_configuration mapcache_rest_configuration;
 struct mapcache_rest_configuration {
   apr_table_t *common_headers;
   char *tile_url;
+  mapcache_key_template *tile_url_template;
   char *header_file;
   mapcache_rest_operation has_tile;
   mapcache_rest_operation get_tile;
@@ -160,7 +162,11 @@ static mapcache_pooled_connection* _rest_get_connection(mapcache_context *ctx, m
           mapcache_rest_connection_destructor, &params);
   if(!GC_HAS_ERROR(ctx) && pc && pc->connection) {
     CURL *curl_handle = (CURL*)pc->connection;
+    void *share = mapcache_connection_pool_get_http_share(ctx->connection_pool);
     curl_easy_reset(curl_handle);
+    if(share) {
+      mapcache_http_share_attach(share, curl_handle);
+    }
     curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT, cache->connection_timeout);
     curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, cache->timeout);
   }
@@ -331,31 +337,26 @@ static int _delete_request(mapcache_context *ctx, CURL *curl, char *url, apr_tab
   return (int)http_code;
 }
 
-static mapcache_buffer* _get_request(mapcache_context *ctx, CURL *curl, char *url, apr_table_t *headers) {
-
-  CURLcode res;
-  mapcache_buffer *data = NULL;
-  long http_code;
-
+/*
+ * set up the handle for a GET, the response body is collected by the
+ * mapcache_http_transfer the handle is then run with
+ */
+static void _get_request_setup(mapcache_context *ctx, CURL *curl, char *url, apr_table_t *headers) {
   _set_headers(ctx, curl, headers);
 
   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
 
-  data = mapcache_buffer_create(4000, ctx->pool);
-
-  /* send all data to this function  */
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, buffer_write_callback);
-
-  /* we pass our mapcache_buffer struct to the callback function */
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)data);
-
   /* specify target URL, and note that this URL should include a file
    *        name, not only a directory */
   curl_easy_setopt(curl, CURLOPT_URL, url);
+}
 
-  /* Now run off and do what you've been told! */
-  res = curl_easy_perform(curl);
-  /* Check for errors */
+/*
+ * interpret the outcome of a GET set up with _get_request_setup()
+ * \returns the tile data, or NULL if the tile does not exist or on error
+ */
+static mapcache_buffer* _get_request_result(mapcache_context *ctx, CURL *curl, CURLcode res, mapcache_buffer *data) {
+  long http_code;
   if(res != CURLE_OK) {
     ctx->set_error(ctx, 500, "curl_easy_perform() failed in rest get: %s",curl_easy_strerror(res));
     data = NULL;
@@ -387,6 +388,19 @@ static mapcache_buffer* _get_request(mapcache_context *ctx, CURL *curl, char *ur
   return data;
 }
 
+static mapcache_buffer* _get_request(mapcache_context *ctx, CURL *curl, char *url, apr_table_t *headers) {
+  CURLcode res;
+  mapcache_http_transfer *t;
+  mapcache_buffer *data = mapcache_buffer_create(4000, ctx->pool);
+  _get_request_setup(ctx, curl, url, headers);
+  t = mapcache_http_transfer_create(ctx, curl, data, NULL);
+
+  /* Now run off and do what you've been told! */
+  mapcache_http_transfer_submit(ctx, t);
+  res = mapcache_http_transfer_await(ctx, t);
+  return _get_request_result(ctx, curl, res, data);
+}
+
 /**
  * @brief _mapcache_cache_rest_add_headers_from_file populate header table from entries found in file
  * @param ctx
@@ -518,57 +532,17 @@ static void _mapcache_cache_rest_tile_url(mapcache_context *ctx, mapcache_tile *
 {
   char *slashptr,*path;
   int cnt=0;
-  if(operation && operation->tile_url) {
-    *url = apr_pstrdup(ctx->pool, operation->tile_url);
-  } else {
-    *url = apr_pstrdup(ctx->pool, config->tile_url);
+  mapcache_key_template *tmpl = config->tile_url_template;
+  if(operation && operation->tile_url_template) {
+    tmpl = operation->tile_url_template;
   }
-
-  *url = mapcache_util_str_replace(ctx->pool, *url, "{tileset}", tile->tileset->name);
-  *url = mapcache_util_str_replace(ctx->pool, *url, "{grid}", tile->grid_link->grid->name);
-  *url = mapcache_util_str_replace(ctx->pool, *url, "{ext}",
-      tile->tileset->format?tile->tileset->format->extension:"png");
-  if(strstr(*url,"{x}"))
-    *url = mapcache_util_str_replace(ctx->pool,*url, "{x}",
-        apr_psprintf(ctx->pool,"%d",tile->x));
-  else
-    *url = mapcache_util_str_replace(ctx->pool,*url, "{inv_x}",
-        apr_psprintf(ctx->pool,"%d",
-          tile->grid_link->grid->levels[tile->z]->maxx - tile->x - 1));
-  if(strstr(*url,"{y}"))
-    *url = mapcache_util_str_replace(ctx->pool,*url, "{y}",
-        apr_psprintf(ctx->pool,"%d",tile->y));
-  else
-    *url = mapcache_util_str_replace(ctx->pool,*url, "{inv_y}",
-        apr_psprintf(ctx->pool,"%d",
-          tile->grid_link->grid->levels[tile->z]->maxy - tile->y - 1));
-  if(strstr(*url,"{z}"))
-    *url = mapcache_util_str_replace(ctx->pool,*url, "{z}",
-        apr_psprintf(ctx->pool,"%d",tile->z));
-  else
-    *url = mapcache_util_str_replace(ctx->pool,*url, "{inv_z}",
-        apr_psprintf(ctx->pool,"%d",
-          tile->grid_link->grid->nlevels - tile->z - 1));
-  if(tile->dimensions) {
-    int i;
-    if(strstr(*url,"{dim")) {
-      char *dimstring="";
-      i = tile->dimensions->nelts;
-      while(i--) {
-        char *single_dim;
-        mapcache_requested_dimension *entry = APR_ARRAY_IDX(tile->dimensions,i,mapcache_requested_dimension*);
-        if(!entry->cached_value) {
-          ctx->set_error(ctx,500,"BUG: dimension (%s) not defined",entry->dimension->name);
-          return;
-        }
-        dimstring = apr_pstrcat(ctx->pool,dimstring,"#",entry->dimension->name,"#",entry->cached_value,NULL);
-        single_dim = apr_pstrcat(ctx->pool,"{dim:",entry->dimension->name,"}",NULL);
-        if(strstr(*url,single_dim)) {
-          *url = mapcache_util_str_replace(ctx->pool,*url, single_dim, entry->cached_value);
-        }
-      }
-      *url = mapcache_util_str_replace(ctx->pool,*url, "{dim}", dimstring);
-    }
+  if(!tmpl) {
+    ctx->set_error(ctx,500,"rest cache used by tileset %s has no <url> for this operation",tile->tileset->name);
+    return;
+  }
+  *url = mapcache_key_template_get(ctx, tmpl, tile);
+  if(GC_HAS_ERROR(ctx)) {
+    return;
   }
   /* url-encode everything after the host name */
 
@@ -1092,6 +1066,33 @@ static void _mapcache_cache_rest_delete(mapcache_context *ctx, mapcache_cache *p
 }
 
 
+/*
+ * compute the url and headers of the GET request of a tile
+ * \returns MAPCACHE_FALSE if no request should be made, either on error or because
+ * the client is redirected to the tile
+ */
+static int _mapcache_cache_rest_get_prepare(mapcache_context *ctx, mapcache_cache_rest *rcache, mapcache_tile *tile,
+    char **url, apr_table_t **headers)
+{
+  _mapcache_cache_rest_tile_url(ctx, tile, &rcache->rest, &rcache->rest.get_tile, url);
+  if(tile->allow_redirect && rcache->use_redirects) {
+    tile->redirect = *url;
+    return MAPCACHE_FALSE;
+  }
+  *headers = _mapcache_cache_rest_headers(ctx, tile, &rcache->rest, &rcache->rest.get_tile);
+
+  if(GC_HAS_ERROR(ctx))
+    return MAPCACHE_FALSE;
+
+  if(rcache->rest.add_headers) {
+    rcache->rest.add_headers(ctx,rcache,tile,*url,*headers);
+  }
+  if(rcache->rest.get_tile.add_headers) {
+    rcache->rest.get_tile.add_headers(ctx,rcache,tile,*url,*headers);
+  }
+  return MAPCACHE_TRUE;
+}
+
 /**
  * \brief get file content of given tile
  *
@@ -1106,23 +1107,10 @@ static int _mapcache_cache_rest_get(mapcache_context *ctx, mapcache_cache *pcach
   apr_table_t *headers;
   mapcache_pooled_connection *pc;
   CURL *curl;
-  _mapcache_cache_rest_tile_url(ctx, tile, &rcache->rest, &rcache->rest.get_tile, &url);
-  if(tile->allow_redirect && rcache->use_redirects) {
-    tile->redirect = url;
-    return MAPCACHE_SUCCESS;
+  if(!_mapcache_cache_rest_get_prepare(ctx, rcache, tile, &url, &headers)) {
+    return GC_HAS_ERROR(ctx)?MAPCACHE_FAILURE:MAPCACHE_SUCCESS;
   }
-  headers = _mapcache_cache_rest_headers(ctx, tile, &rcache->rest, &rcache->rest.get_tile);
 
-  if(GC_HAS_ERROR(ctx))
-    return MAPCACHE_FAILURE;
-
-  if(rcache->rest.add_headers) {
-    rcache->rest.add_headers(ctx,rcache,tile,url,headers);
-  }
-  if(rcache->rest.get_tile.add_headers) {
-    rcache->rest.get_tile.add_headers(ctx,rcache,tile,url,headers);
-  }
-  
   pc = _rest_get_connection(ctx, rcache, tile);
   if(GC_HAS_ERROR(ctx))
     return MAPCACHE_FAILURE;
@@ -1143,6 +1131,83 @@ static int _mapcache_cache_rest_get(mapcache_context *ctx, mapcache_cache *pcach
   return MAPCACHE_SUCCESS;
 }
 
+typedef struct {
+  mapcache_context *ctx;
+  mapcache_pooled_connection *pc;
+} _rest_pending_connection;
+
+/* a request was left unfinished, the state of its handle is unknown */
+static apr_status_t _rest_pending_connection_cleanup(void *data)
+{
+  _rest_pending_connection *pending = (_rest_pending_connection*)data;
+  mapcache_connection_pool_invalidate_connection(pending->ctx, pending->pc);
+  return APR_SUCCESS;
+}
+
+/**
+ * \brief get the content of several tiles with concurrent requests
+ *
+ * the requests are handed to the process wide http engine if there is one, or
+ * are driven by a curl multi handle from the calling thread otherwise, instead
+ * of needing a thread per tile
+ * \private \memberof mapcache_cache_rest
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_rest_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  mapcache_cache_rest *rcache = (mapcache_cache_rest*)pcache;
+  _rest_pending_connection **pendings = apr_pcalloc(ctx->pool, ntiles*sizeof(_rest_pending_connection*));
+  mapcache_buffer **datas = apr_pcalloc(ctx->pool, ntiles*sizeof(mapcache_buffer*));
+  mapcache_http_transfer **transfers = apr_pcalloc(ctx->pool, ntiles*sizeof(mapcache_http_transfer*));
+  int *indexes = apr_pcalloc(ctx->pool, ntiles*sizeof(int));
+  int i, n = 0;
+
+  for(i=0; i<ntiles; i++) {
+    char *url;
+    apr_table_t *headers;
+    mapcache_pooled_connection *pc;
+    mapcache_tile *tile = tiles[i];
+    rets[i] = MAPCACHE_CACHE_MISS;
+    if(!_mapcache_cache_rest_get_prepare(ctx, rcache, tile, &url, &headers)) {
+      if(GC_HAS_ERROR(ctx))
+        return;
+      rets[i] = MAPCACHE_SUCCESS; /* redirected */
+      continue;
+    }
+    pc = _rest_get_connection(ctx, rcache, tile);
+    if(GC_HAS_ERROR(ctx))
+      return;
+    /*
+     * registered before the transfer's own cleanup, so that on error the handle is
+     * only given back once the engine is done with it
+     */
+    pendings[n] = apr_palloc(ctx->pool, sizeof(_rest_pending_connection));
+    pendings[n]->ctx = ctx;
+    pendings[n]->pc = pc;
+    apr_pool_cleanup_register(ctx->pool, pendings[n], _rest_pending_connection_cleanup, apr_pool_cleanup_null);
+    _get_request_setup(ctx, pc->connection, url, headers);
+    datas[n] = mapcache_buffer_create(4000, ctx->pool);
+    transfers[n] = mapcache_http_transfer_create(ctx, pc->connection, datas[n], NULL);
+    mapcache_http_transfer_submit(ctx, transfers[n]);
+    indexes[n++] = i;
+  }
+
+  mapcache_http_transfer_await_all(ctx, transfers, n);
+
+  for(i=0; i<n; i++) {
+    mapcache_tile *tile = tiles[indexes[i]];
+    CURLcode res = mapcache_http_transfer_await(ctx, transfers[i]);
+    tile->encoded_data = _get_request_result(ctx, pendings[i]->pc->connection, res, datas[i]);
+    if(GC_HAS_ERROR(ctx))
+      return;
+    apr_pool_cleanup_kill(ctx->pool, pendings[i], _rest_pending_connection_cleanup);
+    mapcache_connection_pool_release_connection(ctx, pendings[i]->pc);
+    if(tile->encoded_data) {
+      rets[indexes[i]] = MAPCACHE_SUCCESS;
+    }
+  }
+}
+
 static void _mapcache_cache_rest_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile) {
   mapcache_cache_rest *rcache = (mapcache_cache_rest*)pcache;
   char *url;
@@ -1186,6 +1251,8 @@ static void _mapcache_cache_rest_set(mapcache_context *ctx, mapcache_cache *pcac
       apr_table_set(headers, "Content-Type", "image/jpeg");
     } else if (imgfmt == GC_PNG) {
       apr_table_set(headers, "Content-Type", "image/png");
+    } else if (imgfmt == GC_WEBP) {
+      apr_table_set(headers, "Content-Type", "image/webp");
     }
   }
 
@@ -1389,6 +1456,19 @@ static void _mapcache_cache_azure_configuration_parse_xml(mapcache_context *ctx,
   }
 }
 
+static mapcache_key_template* _mapcache_cache_rest_compile_url(mapcache_context *ctx, char *url)
+{
+  mapcache_key_template *tmpl;
+  if(!url) {
+    return NULL;
+  }
+  tmpl = mapcache_key_template_compile(ctx->pool, url, MAPCACHE_KEY_TILE_TOKENS);
+  /* dimension values are inserted as is, and url-encoded with the rest of the path.
+   * {dim} keeps expanding to "#name#value" for each dimension */
+  tmpl->dim_names = 1;
+  return tmpl;
+}
+
 /**
  * \private \memberof mapcache_cache_rest
  */
@@ -1412,6 +1492,13 @@ static void _mapcache_cache_rest_configuration_post_config(mapcache_context *ctx
       return;
     }
   }
+
+  dcache->rest.tile_url_template = _mapcache_cache_rest_compile_url(ctx, dcache->rest.tile_url);
+  dcache->rest.has_tile.tile_url_template = _mapcache_cache_rest_compile_url(ctx, dcache->rest.has_tile.tile_url);
+  dcache->rest.get_tile.tile_url_template = _mapcache_cache_rest_compile_url(ctx, dcache->rest.get_tile.tile_url);
+  dcache->rest.set_tile.tile_url_template = _mapcache_cache_rest_compile_url(ctx, dcache->rest.set_tile.tile_url);
+  dcache->rest.multi_set_tile.tile_url_template = _mapcache_cache_rest_compile_url(ctx, dcache->rest.multi_set_tile.tile_url);
+  dcache->rest.delete_tile.tile_url_template = _mapcache_cache_rest_compile_url(ctx, dcache->rest.delete_tile.tile_url);
 }
 
 void mapcache_cache_rest_init(mapcache_context *ctx, mapcache_cache_rest *cache) {
@@ -1425,6 +1512,7 @@ void mapcache_cache_rest_init(mapcache_context *ctx, mapcache_cache_rest *cache)
   cache->cache.type = MAPCACHE_CACHE_REST;
   cache->cache._tile_delete = _mapcache_cache_rest_delete;
   cache->cache._tile_get = _mapcache_cache_rest_get;
+  cache->cache._tile_multi_get = _mapcache_cache_rest_multi_get;
   cache->cache._tile_exists = _mapcache_cache_rest_has_tile;
   cache->cache._tile_set = _mapcache_cache_rest_set;
   cache->cache.configuration_post_config = _mapcache_cache_rest_configuration_post_config;
@@ -314,6 +314,8 @@ static void _mapcache_cache_riak_set(mapcache_context *ctx, mapcache_cache *pcac
         content_type = "image/png";
       else if(t == GC_JPEG)
         content_type = "image/jpeg";
+      else if(t == GC_WEBP)
+        content_type = "image/webp";
     }
 
     pc = _riak_get_connection(ctx, cache, tile);
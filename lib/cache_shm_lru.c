@@ -0,0 +1,796 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching: shared memory hot tile cache backend.
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <apr_shm.h>
+#include <apr_atomic.h>
+#include <string.h>
+
+#if APR_HAS_SHARED_MEMORY && defined(HAVE_PTHREAD_MUTEX_ROBUST)
+#include <pthread.h>
+#include <errno.h>
+
+#define SHM_LRU_MAGIC 0x4d43534c
+
+/*
+ * layout of the shared memory segment:
+ *
+ * [header][stripe 0][stripe 1]...[stripe n-1]
+ *
+ * each stripe is an independent cache protected by its own robust process-shared
+ * mutex, and is made of:
+ *
+ * [stripe header][buckets][entries][chunk chain][chunk data]
+ *
+ * the key and the encoded data of a tile are stored back to back in a chain
+ * of fixed size chunks. Only offsets and indexes are stored in the segment,
+ * as it may be mapped at different addresses in different processes.
+ */
+
+typedef struct {
+  apr_uint32_t hash;
+  apr_uint32_t key_len;
+  apr_uint32_t data_len;
+  apr_int32_t first_chunk; /* -1 if the entry is unused */
+  apr_int32_t next; /* next entry in the hash bucket, or in the free list */
+  apr_uint32_t referenced; /* CLOCK reference bit */
+  apr_time_t mtime;
+} _shm_lru_entry;
+
+typedef struct {
+  pthread_mutex_t lock;
+  apr_int32_t free_entry;
+  apr_int32_t free_chunk;
+  apr_uint32_t nfree_chunks;
+  apr_uint32_t hand;
+} _shm_lru_stripe;
+
+typedef struct {
+  volatile apr_uint32_t magic;
+  apr_uint32_t nstripes;
+  apr_uint32_t nbuckets;
+  apr_uint32_t nentries;
+  apr_uint32_t nchunks;
+  apr_uint32_t chunk_size;
+  apr_size_t stripe_size;
+  apr_size_t buckets_offset;
+  apr_size_t entries_offset;
+  apr_size_t chain_offset;
+  apr_size_t chunks_offset;
+  /* updated with atomics, outside of the stripe locks */
+  volatile apr_uint32_t hits;
+  volatile apr_uint32_t misses;
+  volatile apr_uint32_t evictions;
+} _shm_lru_header;
+
+/* process local pointers into a stripe */
+typedef struct {
+  _shm_lru_header *header;
+  _shm_lru_stripe *stripe;
+  apr_int32_t *buckets;
+  _shm_lru_entry *entries;
+  apr_int32_t *chain;
+  unsigned char *chunks;
+} _shm_lru_view;
+
+typedef struct {
+  apr_int32_t chunk;
+  apr_uint32_t pos;
+} _shm_lru_cursor;
+
+typedef struct mapcache_cache_shm_lru mapcache_cache_shm_lru;
+
+struct mapcache_cache_shm_lru {
+  mapcache_cache cache;
+  mapcache_cache *child;
+  apr_size_t size;
+  int nstripes;
+  int chunk_size;
+  char *shm_file;
+  apr_shm_t *shm;
+  _shm_lru_header *header;
+};
+
+static apr_uint32_t _shm_lru_hash(const char *key, apr_size_t len)
+{
+  /* FNV-1a */
+  apr_uint32_t h = 2166136261u;
+  while(len--) {
+    h ^= (unsigned char)*key++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static void _shm_lru_view_get(_shm_lru_header *header, apr_uint32_t hash, _shm_lru_view *v)
+{
+  unsigned char *base = (unsigned char*)header + APR_ALIGN_DEFAULT(sizeof(_shm_lru_header));
+  base += (hash % header->nstripes) * header->stripe_size;
+  v->header = header;
+  v->stripe = (_shm_lru_stripe*)base;
+  v->buckets = (apr_int32_t*)(base + header->buckets_offset);
+  v->entries = (_shm_lru_entry*)(base + header->entries_offset);
+  v->chain = (apr_int32_t*)(base + header->chain_offset);
+  v->chunks = base + header->chunks_offset;
+}
+
+/* empties a stripe. must be called with the stripe locked, or before it is shared */
+static void _shm_lru_stripe_clear(_shm_lru_view *v)
+{
+  _shm_lru_header *header = v->header;
+  apr_uint32_t i;
+  v->stripe->hand = 0;
+  v->stripe->free_entry = header->nentries ? 0 : -1;
+  v->stripe->free_chunk = header->nchunks ? 0 : -1;
+  v->stripe->nfree_chunks = header->nchunks;
+  for(i=0; i<header->nbuckets; i++) {
+    v->buckets[i] = -1;
+  }
+  for(i=0; i<header->nentries; i++) {
+    v->entries[i].first_chunk = -1;
+    v->entries[i].next = (i+1 < header->nentries) ? (apr_int32_t)(i+1) : -1;
+  }
+  for(i=0; i<header->nchunks; i++) {
+    v->chain[i] = (i+1 < header->nchunks) ? (apr_int32_t)(i+1) : -1;
+  }
+}
+
+/*
+ * a process that dies while holding a stripe leaves its mutex to the next locker
+ * with EOWNERDEAD. As the stripe may have been left half updated, it is emptied
+ * before being marked consistent again.
+ * \returns MAPCACHE_FAILURE if the stripe could not be locked
+ */
+static int _shm_lru_lock(_shm_lru_view *v)
+{
+  int rv = pthread_mutex_lock(&v->stripe->lock);
+  if(rv == EOWNERDEAD) {
+    _shm_lru_stripe_clear(v);
+    rv = pthread_mutex_consistent(&v->stripe->lock);
+    if(rv) {
+      pthread_mutex_unlock(&v->stripe->lock);
+    }
+  }
+  return rv ? MAPCACHE_FAILURE : MAPCACHE_SUCCESS;
+}
+
+static void _shm_lru_unlock(_shm_lru_view *v)
+{
+  pthread_mutex_unlock(&v->stripe->lock);
+}
+
+static void _shm_lru_copy_in(_shm_lru_view *v, _shm_lru_cursor *c, const unsigned char *src, apr_size_t len)
+{
+  apr_uint32_t chunk_size = v->header->chunk_size;
+  while(len) {
+    apr_size_t n = chunk_size - c->pos;
+    if(n > len) n = len;
+    memcpy(v->chunks + (apr_size_t)c->chunk * chunk_size + c->pos, src, n);
+    src += n;
+    len -= n;
+    c->pos += n;
+    if(c->pos == chunk_size) {
+      c->chunk = v->chain[c->chunk];
+      c->pos = 0;
+    }
+  }
+}
+
+static void _shm_lru_copy_out(_shm_lru_view *v, _shm_lru_cursor *c, unsigned char *dst, apr_size_t len)
+{
+  apr_uint32_t chunk_size = v->header->chunk_size;
+  while(len) {
+    apr_size_t n = chunk_size - c->pos;
+    if(n > len) n = len;
+    memcpy(dst, v->chunks + (apr_size_t)c->chunk * chunk_size + c->pos, n);
+    dst += n;
+    len -= n;
+    c->pos += n;
+    if(c->pos == chunk_size) {
+      c->chunk = v->chain[c->chunk];
+      c->pos = 0;
+    }
+  }
+}
+
+static int _shm_lru_key_equals(_shm_lru_view *v, _shm_lru_entry *e, const char *key, apr_size_t len)
+{
+  apr_uint32_t chunk_size = v->header->chunk_size;
+  _shm_lru_cursor c;
+  if(e->key_len != len) return MAPCACHE_FALSE;
+  c.chunk = e->first_chunk;
+  c.pos = 0;
+  while(len) {
+    apr_size_t n = chunk_size;
+    if(n > len) n = len;
+    if(memcmp(v->chunks + (apr_size_t)c.chunk * chunk_size, key, n)) return MAPCACHE_FALSE;
+    key += n;
+    len -= n;
+    c.chunk = v->chain[c.chunk];
+  }
+  return MAPCACHE_TRUE;
+}
+
+/* returns the index of the entry for key, or -1. must be called with the stripe locked */
+static apr_int32_t _shm_lru_find(_shm_lru_view *v, apr_uint32_t hash, const char *key, apr_size_t len)
+{
+  apr_int32_t idx = v->buckets[(hash / v->header->nstripes) % v->header->nbuckets];
+  while(idx != -1) {
+    _shm_lru_entry *e = &v->entries[idx];
+    if(e->hash == hash && _shm_lru_key_equals(v, e, key, len)) {
+      return idx;
+    }
+    idx = e->next;
+  }
+  return -1;
+}
+
+/* unlinks an entry from its bucket and releases its chunks. must be called with the stripe locked */
+static void _shm_lru_remove(_shm_lru_view *v, apr_int32_t idx)
+{
+  _shm_lru_entry *e = &v->entries[idx];
+  apr_int32_t *prev = &v->buckets[(e->hash / v->header->nstripes) % v->header->nbuckets];
+  apr_int32_t chunk = e->first_chunk;
+  while(*prev != idx) {
+    prev = &v->entries[*prev].next;
+  }
+  *prev = e->next;
+  while(chunk != -1) {
+    apr_int32_t next = v->chain[chunk];
+    v->chain[chunk] = v->stripe->free_chunk;
+    v->stripe->free_chunk = chunk;
+    v->stripe->nfree_chunks++;
+    chunk = next;
+  }
+  e->first_chunk = -1;
+  e->next = v->stripe->free_entry;
+  v->stripe->free_entry = idx;
+}
+
+/* CLOCK eviction of a single entry. must be called with the stripe locked */
+static int _shm_lru_evict(_shm_lru_view *v)
+{
+  apr_uint32_t n = v->header->nentries * 2;
+  while(n--) {
+    apr_uint32_t idx = v->stripe->hand;
+    _shm_lru_entry *e = &v->entries[idx];
+    v->stripe->hand = (idx + 1) % v->header->nentries;
+    if(e->first_chunk == -1) continue;
+    if(e->referenced) {
+      e->referenced = 0;
+      continue;
+    }
+    _shm_lru_remove(v, idx);
+    apr_atomic_inc32(&v->header->evictions);
+    return MAPCACHE_TRUE;
+  }
+  return MAPCACHE_FALSE;
+}
+
+static void _shm_lru_store(mapcache_cache_shm_lru *cache, const char *key, mapcache_buffer *data, apr_time_t mtime)
+{
+  _shm_lru_view v;
+  _shm_lru_cursor c;
+  apr_size_t key_len = strlen(key);
+  apr_uint32_t hash = _shm_lru_hash(key, key_len);
+  apr_uint32_t nchunks;
+  apr_int32_t idx, prev_chunk = -1;
+  _shm_lru_entry *e;
+  apr_uint32_t i;
+
+  _shm_lru_view_get(cache->header, hash, &v);
+  nchunks = (key_len + data->size + v.header->chunk_size - 1) / v.header->chunk_size;
+  if(nchunks > v.header->nchunks / 4) {
+    /* don't let a single tile flush a large part of the stripe */
+    return;
+  }
+
+  if(_shm_lru_lock(&v) != MAPCACHE_SUCCESS) {
+    return;
+  }
+  idx = _shm_lru_find(&v, hash, key, key_len);
+  if(idx != -1) {
+    _shm_lru_remove(&v, idx);
+  }
+  while(v.stripe->nfree_chunks < nchunks || v.stripe->free_entry == -1) {
+    if(!_shm_lru_evict(&v)) {
+      _shm_lru_unlock(&v);
+      return;
+    }
+  }
+
+  idx = v.stripe->free_entry;
+  e = &v.entries[idx];
+  v.stripe->free_entry = e->next;
+  for(i=0; i<nchunks; i++) {
+    apr_int32_t chunk = v.stripe->free_chunk;
+    v.stripe->free_chunk = v.chain[chunk];
+    v.stripe->nfree_chunks--;
+    v.chain[chunk] = -1;
+    if(prev_chunk == -1) {
+      e->first_chunk = chunk;
+    } else {
+      v.chain[prev_chunk] = chunk;
+    }
+    prev_chunk = chunk;
+  }
+  e->hash = hash;
+  e->key_len = key_len;
+  e->data_len = data->size;
+  e->mtime = mtime;
+  e->referenced = 0;
+  c.chunk = e->first_chunk;
+  c.pos = 0;
+  _shm_lru_copy_in(&v, &c, (unsigned char*)key, key_len);
+  _shm_lru_copy_in(&v, &c, data->buf, data->size);
+
+  e->next = v.buckets[(hash / v.header->nstripes) % v.header->nbuckets];
+  v.buckets[(hash / v.header->nstripes) % v.header->nbuckets] = idx;
+  _shm_lru_unlock(&v);
+}
+
+static void _shm_lru_invalidate(mapcache_cache_shm_lru *cache, const char *key)
+{
+  _shm_lru_view v;
+  apr_size_t key_len = strlen(key);
+  apr_uint32_t hash = _shm_lru_hash(key, key_len);
+  apr_int32_t idx;
+  _shm_lru_view_get(cache->header, hash, &v);
+  if(_shm_lru_lock(&v) != MAPCACHE_SUCCESS) {
+    return;
+  }
+  idx = _shm_lru_find(&v, hash, key, key_len);
+  if(idx != -1) {
+    _shm_lru_remove(&v, idx);
+  }
+  _shm_lru_unlock(&v);
+}
+
+static char* _shm_lru_tile_key(mapcache_context *ctx, mapcache_tile *tile)
+{
+  return mapcache_util_get_tile_key(ctx, tile, NULL, NULL, NULL);
+}
+
+/*
+ * looks up a tile in the shared segment, filling its mtime and (if fetch is set) its encoded data if found.
+ * entries older than the tileset's auto_expire are dropped and reported as misses
+ */
+static int _shm_lru_lookup(mapcache_context *ctx, mapcache_cache_shm_lru *cache, mapcache_tile *tile, int fetch)
+{
+  _shm_lru_view v;
+  _shm_lru_entry *e;
+  _shm_lru_cursor c;
+  char *key = _shm_lru_tile_key(ctx, tile);
+  apr_size_t key_len = strlen(key);
+  apr_uint32_t hash = _shm_lru_hash(key, key_len);
+  apr_int32_t idx;
+  apr_size_t skip;
+
+  _shm_lru_view_get(cache->header, hash, &v);
+  if(_shm_lru_lock(&v) != MAPCACHE_SUCCESS) {
+    return MAPCACHE_CACHE_MISS;
+  }
+  idx = _shm_lru_find(&v, hash, key, key_len);
+  if(idx == -1) {
+    _shm_lru_unlock(&v);
+    return MAPCACHE_CACHE_MISS;
+  }
+  e = &v.entries[idx];
+  if(tile->tileset->auto_expire && e->mtime && e->mtime + apr_time_from_sec(tile->tileset->auto_expire) < apr_time_now()) {
+    _shm_lru_remove(&v, idx);
+    _shm_lru_unlock(&v);
+    return MAPCACHE_CACHE_MISS;
+  }
+  e->referenced = 1;
+  if(fetch) {
+    tile->encoded_data = mapcache_buffer_create(e->data_len, ctx->pool);
+    c.chunk = e->first_chunk;
+    c.pos = 0;
+    /* skip the key */
+    skip = e->key_len;
+    while(skip >= v.header->chunk_size) {
+      c.chunk = v.chain[c.chunk];
+      skip -= v.header->chunk_size;
+    }
+    c.pos = skip;
+    _shm_lru_copy_out(&v, &c, tile->encoded_data->buf, e->data_len);
+    tile->encoded_data->size = e->data_len;
+  }
+  tile->mtime = e->mtime;
+  tile->encoded_size = e->data_len;
+  _shm_lru_unlock(&v);
+  return MAPCACHE_SUCCESS;
+}
+
+static void _shm_lru_store_tile(mapcache_context *ctx, mapcache_cache_shm_lru *cache, mapcache_tile *tile)
+{
+  if(tile->nodata || !tile->encoded_data || !tile->encoded_data->size) {
+    return;
+  }
+  /* no mtime is kept for tiles whose child cache has none, rather than a made up one */
+  _shm_lru_store(cache, _shm_lru_tile_key(ctx, tile), tile->encoded_data, tile->mtime);
+}
+
+static int _mapcache_cache_shm_lru_tile_exists(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm_lru *cache = (mapcache_cache_shm_lru*)pcache;
+  if(_shm_lru_lookup(ctx, cache, tile, 0) == MAPCACHE_SUCCESS) {
+    return MAPCACHE_TRUE;
+  }
+  return mapcache_cache_tile_exists(ctx, cache->child, tile);
+}
+
+static int _mapcache_cache_shm_lru_tile_stat(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm_lru *cache = (mapcache_cache_shm_lru*)pcache;
+  if(_shm_lru_lookup(ctx, cache, tile, 0) == MAPCACHE_SUCCESS) {
+    return MAPCACHE_SUCCESS;
+  }
+  return mapcache_cache_tile_stat(ctx, cache->child, tile);
+}
+
+static void _mapcache_cache_shm_lru_tile_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm_lru *cache = (mapcache_cache_shm_lru*)pcache;
+  _shm_lru_invalidate(cache, _shm_lru_tile_key(ctx, tile));
+  mapcache_cache_tile_delete(ctx, cache->child, tile);
+}
+
+/**
+ * \brief get content of given tile
+ *
+ * serves the tile from the shared memory segment if present, else from the
+ * child cache, in which case the tile is added to the shared segment
+ * \private \memberof mapcache_cache_shm_lru
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_shm_lru_tile_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm_lru *cache = (mapcache_cache_shm_lru*)pcache;
+  int ret;
+  if(_shm_lru_lookup(ctx, cache, tile, 1) == MAPCACHE_SUCCESS) {
+    apr_atomic_inc32(&cache->header->hits);
+    return MAPCACHE_SUCCESS;
+  }
+  apr_atomic_inc32(&cache->header->misses);
+  ret = mapcache_cache_tile_get(ctx, cache->child, tile);
+  if(ret == MAPCACHE_SUCCESS) {
+    _shm_lru_store_tile(ctx, cache, tile);
+  }
+  return ret;
+}
+
+/**
+ * \brief get the content of several tiles
+ *
+ * the tiles that are not in the shared memory segment are fetched from the
+ * child cache with a single multi-get
+ * \private \memberof mapcache_cache_shm_lru
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_shm_lru_tile_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  mapcache_cache_shm_lru *cache = (mapcache_cache_shm_lru*)pcache;
+  mapcache_tile **missed = apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+  int *missed_idx = apr_palloc(ctx->pool, ntiles*sizeof(int));
+  int *missed_rets;
+  int i,nmissed = 0;
+  for(i=0; i<ntiles; i++) {
+    if(_shm_lru_lookup(ctx, cache, tiles[i], 1) == MAPCACHE_SUCCESS) {
+      apr_atomic_inc32(&cache->header->hits);
+      rets[i] = MAPCACHE_SUCCESS;
+    } else {
+      apr_atomic_inc32(&cache->header->misses);
+      missed[nmissed] = tiles[i];
+      missed_idx[nmissed] = i;
+      nmissed++;
+    }
+  }
+  if(!nmissed) {
+    return;
+  }
+  missed_rets = apr_palloc(ctx->pool, nmissed*sizeof(int));
+  mapcache_cache_tile_multi_get(ctx, cache->child, missed, nmissed, missed_rets);
+  GC_CHECK_ERROR(ctx);
+  for(i=0; i<nmissed; i++) {
+    rets[missed_idx[i]] = missed_rets[i];
+    if(missed_rets[i] == MAPCACHE_SUCCESS) {
+      _shm_lru_store_tile(ctx, cache, missed[i]);
+    }
+  }
+}
+
+static void _mapcache_cache_shm_lru_tile_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm_lru *cache = (mapcache_cache_shm_lru*)pcache;
+  mapcache_cache_tile_set(ctx, cache->child, tile);
+  GC_CHECK_ERROR(ctx);
+  _shm_lru_store_tile(ctx, cache, tile);
+}
+
+static void _mapcache_cache_shm_lru_tile_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  mapcache_cache_shm_lru *cache = (mapcache_cache_shm_lru*)pcache;
+  int i;
+  mapcache_cache_tile_multi_set(ctx, cache->child, tiles, ntiles);
+  GC_CHECK_ERROR(ctx);
+  for(i=0; i<ntiles; i++) {
+    _shm_lru_store_tile(ctx, cache, &tiles[i]);
+  }
+}
+
+void mapcache_cache_shm_lru_get_stats(mapcache_cache *pcache, apr_uint32_t *hits, apr_uint32_t *misses, apr_uint32_t *evictions)
+{
+  mapcache_cache_shm_lru *cache = (mapcache_cache_shm_lru*)pcache;
+  if(!cache->header) {
+    *hits = *misses = *evictions = 0;
+    return;
+  }
+  *hits = apr_atomic_read32(&cache->header->hits);
+  *misses = apr_atomic_read32(&cache->header->misses);
+  *evictions = apr_atomic_read32(&cache->header->evictions);
+}
+
+/**
+ * \private \memberof mapcache_cache_shm_lru
+ */
+static void _mapcache_cache_shm_lru_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *pcache, mapcache_cfg *config)
+{
+  ezxml_t cur_node;
+  mapcache_cache_shm_lru *cache = (mapcache_cache_shm_lru*)pcache;
+  char *endptr;
+  if((cur_node = ezxml_child(node,"cache")) != NULL) {
+    cache->child = mapcache_configuration_get_cache(config, cur_node->txt);
+    if(!cache->child) {
+      ctx->set_error(ctx, 400, "shm_lru cache \"%s\" references cache \"%s\","
+                     " but it is not configured (hint:referenced caches must be declared before this shm_lru cache in the xml file)", pcache->name, cur_node->txt);
+      return;
+    }
+  } else {
+    ctx->set_error(ctx, 400, "shm_lru cache \"%s\" does not reference a child <cache>", pcache->name);
+    return;
+  }
+  if((cur_node = ezxml_child(node,"size")) != NULL) {
+    long size = strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || size <= 0) {
+      ctx->set_error(ctx, 400, "failed to parse shm_lru cache \"%s\" <size> \"%s\" (expecting a positive number of megabytes)", pcache->name, cur_node->txt);
+      return;
+    }
+    cache->size = (apr_size_t)size * 1024 * 1024;
+  }
+  if((cur_node = ezxml_child(node,"stripes")) != NULL) {
+    cache->nstripes = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || cache->nstripes <= 0) {
+      ctx->set_error(ctx, 400, "failed to parse shm_lru cache \"%s\" <stripes> \"%s\" (expecting a positive integer)", pcache->name, cur_node->txt);
+      return;
+    }
+  }
+  if((cur_node = ezxml_child(node,"chunk_size")) != NULL) {
+    cache->chunk_size = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || cache->chunk_size < 256) {
+      ctx->set_error(ctx, 400, "failed to parse shm_lru cache \"%s\" <chunk_size> \"%s\" (expecting an integer of at least 256 bytes)", pcache->name, cur_node->txt);
+      return;
+    }
+  }
+  if((cur_node = ezxml_child(node,"shm_file")) != NULL) {
+    cache->shm_file = apr_pstrdup(ctx->pool, cur_node->txt);
+  }
+}
+
+static int _shm_lru_init_segment(mapcache_cache_shm_lru *cache, _shm_lru_header *header, apr_size_t size)
+{
+  apr_size_t stripe_size, per_chunk, avail;
+  pthread_mutexattr_t attr;
+  apr_uint32_t s;
+  int rv;
+  memset(header, 0, sizeof(_shm_lru_header));
+  header->nstripes = cache->nstripes;
+  header->chunk_size = cache->chunk_size;
+  stripe_size = (size - APR_ALIGN_DEFAULT(sizeof(_shm_lru_header))) / header->nstripes;
+  stripe_size &= ~((apr_size_t)7);
+  header->stripe_size = stripe_size;
+
+  /* a chunk costs its data, its chain link, one entry and one bucket */
+  per_chunk = header->chunk_size + sizeof(apr_int32_t) + sizeof(_shm_lru_entry) + sizeof(apr_int32_t);
+  avail = stripe_size - APR_ALIGN_DEFAULT(sizeof(_shm_lru_stripe)) - 4 * 8; /* room for alignment */
+  header->nchunks = header->nentries = header->nbuckets = avail / per_chunk;
+
+  header->buckets_offset = APR_ALIGN_DEFAULT(sizeof(_shm_lru_stripe));
+  header->entries_offset = APR_ALIGN_DEFAULT(header->buckets_offset + header->nbuckets * sizeof(apr_int32_t));
+  header->chain_offset = APR_ALIGN_DEFAULT(header->entries_offset + header->nentries * sizeof(_shm_lru_entry));
+  header->chunks_offset = APR_ALIGN_DEFAULT(header->chain_offset + header->nchunks * sizeof(apr_int32_t));
+
+  if((rv = pthread_mutexattr_init(&attr)) != 0) {
+    return rv;
+  }
+  if((rv = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)) != 0 ||
+      (rv = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) != 0) {
+    pthread_mutexattr_destroy(&attr);
+    return rv;
+  }
+  for(s=0; s<header->nstripes; s++) {
+    _shm_lru_view v;
+    _shm_lru_view_get(header, s, &v);
+    if((rv = pthread_mutex_init(&v.stripe->lock, &attr)) != 0) {
+      pthread_mutexattr_destroy(&attr);
+      return rv;
+    }
+    _shm_lru_stripe_clear(&v);
+  }
+  pthread_mutexattr_destroy(&attr);
+  apr_atomic_set32(&header->magic, SHM_LRU_MAGIC);
+  return 0;
+}
+
+/*
+ * create the segment named by <shm_file>, or attach to it if it already exists.
+ * apr removes a segment along with the pool it was created from, but a named segment
+ * is used by processes that outlive its creator, so it is created from a pool that
+ * is never destroyed
+ */
+static apr_status_t _shm_lru_create_named(mapcache_context *ctx, mapcache_cache_shm_lru *cache, int *attached)
+{
+  apr_pool_t *shm_pool;
+  apr_status_t rv;
+  *attached = 0;
+  rv = apr_pool_create_unmanaged_ex(&shm_pool, NULL, NULL);
+  if(rv == APR_SUCCESS) {
+    rv = apr_shm_create(&cache->shm, cache->size, cache->shm_file, shm_pool);
+    if(rv != APR_SUCCESS) {
+      apr_pool_destroy(shm_pool);
+    }
+  }
+  if(APR_STATUS_IS_EEXIST(rv)) {
+    rv = apr_shm_attach(&cache->shm, cache->shm_file, ctx->pool);
+    *attached = 1;
+  }
+  return rv;
+}
+
+/*
+ * is the attached segment initialized, with the geometry of the configuration ?
+ */
+static int _shm_lru_segment_matches(mapcache_cache_shm_lru *cache)
+{
+  _shm_lru_header *header = apr_shm_baseaddr_get(cache->shm);
+  int tries = 100;
+  while(apr_atomic_read32(&header->magic) != SHM_LRU_MAGIC && tries--) {
+    apr_sleep(10000); /* the creating process is still initializing the segment */
+  }
+  return apr_atomic_read32(&header->magic) == SHM_LRU_MAGIC &&
+         apr_shm_size_get(cache->shm) == cache->size && header->nstripes == (apr_uint32_t)cache->nstripes &&
+         header->chunk_size == (apr_uint32_t)cache->chunk_size;
+}
+
+/**
+ * \private \memberof mapcache_cache_shm_lru
+ *
+ * the segment is created here so that with the apache and nginx modules it is
+ * allocated in the parent process and shared by all the children. Independent
+ * processes (e.g. fastcgi) share a segment by configuring a <shm_file>, which
+ * outlives them, and is replaced if it was created with another geometry.
+ */
+static void _mapcache_cache_shm_lru_configuration_post_config(mapcache_context *ctx, mapcache_cache *pcache,
+    mapcache_cfg *cfg)
+{
+  mapcache_cache_shm_lru *cache = (mapcache_cache_shm_lru*)pcache;
+  apr_status_t rv;
+  char errmsg[120];
+  int attached = 0;
+
+  if(cache->shm_file) {
+    rv = _shm_lru_create_named(ctx, cache, &attached);
+    if(rv == APR_SUCCESS && attached && !_shm_lru_segment_matches(cache)) {
+      /*
+       * left over by an earlier configuration, or by a process that died while creating it.
+       * Processes still attached to it keep their mapping until they exit
+       */
+      ctx->log(ctx, MAPCACHE_NOTICE, "shm_lru cache \"%s\": replacing shared memory segment %s, created with another geometry",
+               pcache->name, cache->shm_file);
+      apr_shm_detach(cache->shm);
+      rv = apr_shm_remove(cache->shm_file, ctx->pool);
+      if(rv == APR_SUCCESS || APR_STATUS_IS_ENOENT(rv)) {
+        rv = _shm_lru_create_named(ctx, cache, &attached);
+      }
+      if(rv == APR_SUCCESS && attached && !_shm_lru_segment_matches(cache)) {
+        ctx->set_error(ctx, 500, "shm_lru cache \"%s\": shared memory segment %s is used by another configuration",
+                       pcache->name, cache->shm_file);
+        return;
+      }
+    }
+  } else {
+    rv = apr_shm_create(&cache->shm, cache->size, NULL, ctx->pool);
+  }
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "shm_lru cache \"%s\": failed to create shared memory segment: %s",
+                   pcache->name, apr_strerror(rv,errmsg,120));
+    return;
+  }
+  cache->header = apr_shm_baseaddr_get(cache->shm);
+  if(!attached) {
+    rv = _shm_lru_init_segment(cache, cache->header, apr_shm_size_get(cache->shm));
+    if(rv) {
+      ctx->set_error(ctx, 500, "shm_lru cache \"%s\": failed to create the stripe mutexes: %s",
+                     pcache->name, apr_strerror(rv,errmsg,120));
+      return;
+    }
+  }
+  if(!cache->header->nchunks) {
+    ctx->set_error(ctx, 400, "shm_lru cache \"%s\": <size> is too small", pcache->name);
+    return;
+  }
+  ctx->log(ctx, MAPCACHE_DEBUG, "shm_lru cache \"%s\": %s %d stripes of %d chunks of %d bytes",
+           pcache->name, attached?"attached to":"created", (int)cache->header->nstripes,
+           (int)cache->header->nchunks, (int)cache->header->chunk_size);
+}
+
+/**
+ * \brief creates and initializes a mapcache_cache_shm_lru
+ */
+mapcache_cache* mapcache_cache_shm_lru_create(mapcache_context *ctx)
+{
+  mapcache_cache_shm_lru *cache = apr_pcalloc(ctx->pool,sizeof(mapcache_cache_shm_lru));
+  if(!cache) {
+    ctx->set_error(ctx, 500, "failed to allocate shm_lru cache");
+    return NULL;
+  }
+  cache->size = 64 * 1024 * 1024;
+  cache->nstripes = 16;
+  cache->chunk_size = 4096;
+  cache->cache.metadata = apr_table_make(ctx->pool,3);
+  cache->cache.type = MAPCACHE_CACHE_COMPOSITE;
+  cache->cache._tile_delete = _mapcache_cache_shm_lru_tile_delete;
+  cache->cache._tile_get = _mapcache_cache_shm_lru_tile_get;
+  cache->cache._tile_multi_get = _mapcache_cache_shm_lru_tile_multi_get;
+  cache->cache._tile_exists = _mapcache_cache_shm_lru_tile_exists;
+  cache->cache._tile_stat = _mapcache_cache_shm_lru_tile_stat;
+  cache->cache._tile_set = _mapcache_cache_shm_lru_tile_set;
+  cache->cache._tile_multi_set = _mapcache_cache_shm_lru_tile_multi_set;
+  cache->cache.configuration_post_config = _mapcache_cache_shm_lru_configuration_post_config;
+  cache->cache.configuration_parse_xml = _mapcache_cache_shm_lru_configuration_parse_xml;
+  return (mapcache_cache*)cache;
+}
+
+#else
+
+mapcache_cache* mapcache_cache_shm_lru_create(mapcache_context *ctx)
+{
+  ctx->set_error(ctx, 400, "shm_lru cache: requires apr shared memory and robust process-shared pthread mutexes, not available on this platform");
+  return NULL;
+}
+
+void mapcache_cache_shm_lru_get_stats(mapcache_cache *pcache, apr_uint32_t *hits, apr_uint32_t *misses, apr_uint32_t *evictions)
+{
+  *hits = *misses = *evictions = 0;
+}
+
+#endif
+
+/* vim: ts=2 sts=2 et sw=2
+*/
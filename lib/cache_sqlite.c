@@ -62,12 +62,17 @@ struct sqlite_conn;
 struct mapcache_cache_sqlite {
   mapcache_cache cache;
   char *dbfile;
+  mapcache_key_template *dbfile_template; /* NULL if dbfile doesn't depend on the tile */
   mapcache_cache_sqlite_stmt create_stmt;
   mapcache_cache_sqlite_stmt exists_stmt;
   mapcache_cache_sqlite_stmt get_stmt;
+  mapcache_cache_sqlite_stmt stat_stmt; /* may be NULL if the mtime of a tile cannot be queried */
+  mapcache_cache_sqlite_stmt multi_get_stmt; /* may be NULL if tiles can only be fetched one by one */
   mapcache_cache_sqlite_stmt set_stmt;
   mapcache_cache_sqlite_stmt delete_stmt;
   apr_table_t *pragmas;
+  apr_int64_t read_mmap_size; /* PRAGMA mmap_size for read-only connections, 0 to keep the default */
+  int wal_autocheckpoint; /* pages, for read-write connections. -1 to keep the default */
   void (*bind_stmt)(mapcache_context *ctx, void *stmt, mapcache_cache_sqlite *cache, mapcache_tile *tile);
   int n_prepared_statements;
   int detect_blank;
@@ -94,6 +99,8 @@ struct sqlite_conn {
 #define GET_TILE_STMT_IDX 1
 #define SQLITE_SET_TILE_STMT_IDX 2
 #define SQLITE_DEL_TILE_STMT_IDX 3
+#define SQLITE_STAT_TILE_STMT_IDX 4
+#define SQLITE_MULTI_GET_TILE_STMT_IDX 5
 #define MBTILES_SET_EMPTY_TILE_STMT1_IDX 2
 #define MBTILES_SET_EMPTY_TILE_STMT2_IDX 3
 #define MBTILES_SET_TILE_STMT1_IDX 4
@@ -131,6 +138,22 @@ static void _sqlite_set_pragmas(mapcache_context *ctx, mapcache_cache_sqlite* ca
 
 
 
+/*
+ * returns the statement stored at idx for this connection, preparing it on first use.
+ * statements live as long as the connection, so we let sqlite know they are long-lived
+ */
+static sqlite3_stmt* _sqlite_prepared_statement(struct sqlite_conn *conn, int idx, const char *sql)
+{
+  if(!conn->prepared_statements[idx]) {
+#if SQLITE_VERSION_NUMBER >= 3020000
+    sqlite3_prepare_v3(conn->handle, sql, -1, SQLITE_PREPARE_PERSISTENT, &conn->prepared_statements[idx], NULL);
+#else
+    sqlite3_prepare_v2(conn->handle, sql, -1, &conn->prepared_statements[idx], NULL);
+#endif
+  }
+  return conn->prepared_statements[idx];
+}
+
 static void mapcache_sqlite_release_conn(mapcache_context *ctx, mapcache_pooled_connection *conn) {
   mapcache_connection_pool_release_connection(ctx,conn);
 }
@@ -171,6 +194,22 @@ void mapcache_sqlite_connection_constructor(mapcache_context *ctx, void **conn_,
     sqlite3_close(conn->handle);
     return;
   }
+  if(sq_params->readonly && sq_params->cache->read_mmap_size > 0) {
+    /* serve reads straight from the page cache instead of copying pages into sqlite's own cache */
+    char *pragma_stmt = apr_psprintf(ctx->pool,"PRAGMA mmap_size=%"APR_INT64_T_FMT,sq_params->cache->read_mmap_size);
+    if(sqlite3_exec(conn->handle, pragma_stmt, 0, 0, NULL) != SQLITE_OK) {
+      ctx->log(ctx, MAPCACHE_WARN, "sqlite cache %s: failed to set mmap_size on %s: %s",
+               sq_params->cache->cache.name, sq_params->dbfile, sqlite3_errmsg(conn->handle));
+    }
+  }
+  if(!sq_params->readonly && sq_params->cache->wal_autocheckpoint >= 0) {
+    /*
+     * in WAL mode, the commit that crosses the threshold runs the checkpoint while the other
+     * seeding threads wait on the write lock. a larger value batches that work, 0 leaves
+     * checkpointing to an external process
+     */
+    sqlite3_wal_autocheckpoint(conn->handle, sq_params->cache->wal_autocheckpoint);
+  }
   conn->prepared_statements = calloc(sq_params->cache->n_prepared_statements,sizeof(sqlite3_stmt*));
   conn->nstatements = sq_params->cache->n_prepared_statements;
 }
@@ -215,68 +254,13 @@ static mapcache_pooled_connection* mapcache_sqlite_get_conn(mapcache_context *ct
  */
 static void _mapcache_cache_sqlite_filename_for_tile(mapcache_context *ctx, mapcache_cache_sqlite *dcache, mapcache_tile *tile, char **path)
 {
-  *path = dcache->dbfile;
-
-  if(strstr(*path,"{")) {
-    /*
-     * generic template substitutions
-     */
-    if(strstr(*path,"{tileset}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{tileset}",
-              tile->tileset->name);
-    if(strstr(*path,"{grid}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{grid}",
-              tile->grid_link->grid->name);
-    if(tile->dimensions && strstr(*path,"{dim")) {
-      char *dimstring="";
-      int i = tile->dimensions->nelts;
-      while(i--) {
-        mapcache_requested_dimension *entry = APR_ARRAY_IDX(tile->dimensions,i,mapcache_requested_dimension*);
-        const char *dimval = mapcache_util_str_sanitize(ctx->pool,entry->cached_value,"/.",'#');
-        char *single_dim = apr_pstrcat(ctx->pool,"{dim:",entry->dimension->name,"}",NULL);
-        dimstring = apr_pstrcat(ctx->pool,dimstring,"#",dimval,NULL);
-        if(strstr(*path,single_dim)) {
-          *path = mapcache_util_str_replace(ctx->pool,*path, single_dim, dimval);
-        }
-      }
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{dim}", dimstring);
-    }
-    
-    
-    while(strstr(*path,"{z}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{z}",
-              apr_psprintf(ctx->pool,dcache->z_fmt,tile->z));
-    
-    if(dcache->count_x > 0) {
-      while(strstr(*path,"{div_x}"))
-        *path = mapcache_util_str_replace(ctx->pool,*path, "{div_x}",
-                apr_psprintf(ctx->pool,dcache->div_x_fmt,tile->x/dcache->count_x));
-      while(strstr(*path,"{inv_div_x}"))
-        *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_div_x}",
-                apr_psprintf(ctx->pool,dcache->inv_div_x_fmt,(tile->grid_link->grid->levels[tile->z]->maxx - tile->x - 1)/dcache->count_x));
-      while(strstr(*path,"{x}"))
-        *path = mapcache_util_str_replace(ctx->pool,*path, "{x}",
-                apr_psprintf(ctx->pool,dcache->x_fmt,tile->x/dcache->count_x*dcache->count_x));
-      while(strstr(*path,"{inv_x}"))
-        *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_x}",
-                apr_psprintf(ctx->pool,dcache->inv_x_fmt,(tile->grid_link->grid->levels[tile->z]->maxx - tile->x - 1)/dcache->count_x*dcache->count_x));
-    }
-    
-    if(dcache->count_y > 0) {
-      while(strstr(*path,"{div_y}"))
-        *path = mapcache_util_str_replace(ctx->pool,*path, "{div_y}",
-                apr_psprintf(ctx->pool,dcache->div_y_fmt,tile->y/dcache->count_y));
-      while(strstr(*path,"{inv_div_y}"))
-        *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_div_y}",
-                apr_psprintf(ctx->pool,dcache->inv_div_y_fmt,(tile->grid_link->grid->levels[tile->z]->maxy - tile->y - 1)/dcache->count_y));
-      while(strstr(*path,"{y}"))
-        *path = mapcache_util_str_replace(ctx->pool,*path, "{y}",
-                apr_psprintf(ctx->pool,dcache->y_fmt,tile->y/dcache->count_y*dcache->count_y));
-      while(strstr(*path,"{inv_y}"))
-        *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_y}",
-                apr_psprintf(ctx->pool,dcache->inv_y_fmt,(tile->grid_link->grid->levels[tile->z]->maxy - tile->y - 1)/dcache->count_y*dcache->count_y));
-      
+  if(dcache->dbfile_template) {
+    *path = mapcache_key_template_get(ctx, dcache->dbfile_template, tile);
+    if(GC_HAS_ERROR(ctx)) {
+      return;
     }
+  } else {
+    *path = dcache->dbfile;
   }
 
   if(!*path) {
@@ -286,6 +270,45 @@ static void _mapcache_cache_sqlite_filename_for_tile(mapcache_context *ctx, mapc
 
 
 
+/**
+ * \brief parse the dbfile template once, for the substitutions done by _mapcache_cache_sqlite_filename_for_tile()
+ * \private \memberof mapcache_cache_sqlite
+ */
+static void _mapcache_cache_sqlite_compile_dbfile(mapcache_context *ctx, mapcache_cache_sqlite *dcache)
+{
+  unsigned int tokens = MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_TILESET) | MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_GRID) |
+                        MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_Z) |
+                        MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_DIM) | MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_DIM_NAMED);
+  mapcache_key_template *tmpl;
+  if(!dcache->dbfile || !strstr(dcache->dbfile,"{")) {
+    return;
+  }
+  /* x and y variables are only substituted when the files hold blocks of tiles */
+  if(dcache->count_x > 0) {
+    tokens |= MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_X) | MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_INV_X) |
+              MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_DIV_X) | MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_INV_DIV_X);
+  }
+  if(dcache->count_y > 0) {
+    tokens |= MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_Y) | MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_INV_Y) |
+              MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_DIV_Y) | MAPCACHE_KEY_TOKEN(MAPCACHE_KEY_INV_DIV_Y);
+  }
+  tmpl = mapcache_key_template_compile(ctx->pool, dcache->dbfile, tokens);
+  if(dcache->count_x > 0) tmpl->count_x = dcache->count_x;
+  if(dcache->count_y > 0) tmpl->count_y = dcache->count_y;
+  tmpl->sanitized_chars = "/.";
+  tmpl->sanitize_to = '#';
+  mapcache_key_template_set_format(tmpl, MAPCACHE_KEY_Z, dcache->z_fmt);
+  mapcache_key_template_set_format(tmpl, MAPCACHE_KEY_X, dcache->x_fmt);
+  mapcache_key_template_set_format(tmpl, MAPCACHE_KEY_INV_X, dcache->inv_x_fmt);
+  mapcache_key_template_set_format(tmpl, MAPCACHE_KEY_DIV_X, dcache->div_x_fmt);
+  mapcache_key_template_set_format(tmpl, MAPCACHE_KEY_INV_DIV_X, dcache->inv_div_x_fmt);
+  mapcache_key_template_set_format(tmpl, MAPCACHE_KEY_Y, dcache->y_fmt);
+  mapcache_key_template_set_format(tmpl, MAPCACHE_KEY_INV_Y, dcache->inv_y_fmt);
+  mapcache_key_template_set_format(tmpl, MAPCACHE_KEY_DIV_Y, dcache->div_y_fmt);
+  mapcache_key_template_set_format(tmpl, MAPCACHE_KEY_INV_DIV_Y, dcache->inv_div_y_fmt);
+  dcache->dbfile_template = tmpl;
+}
+
 /**
  * \brief apply appropriate tile properties to the sqlite statement */
 static void _bind_sqlite_params(mapcache_context *ctx, void *vstmt, mapcache_cache_sqlite *cache, mapcache_tile *tile)
@@ -429,11 +452,7 @@ static int _mapcache_cache_sqlite_has_tile(mapcache_context *ctx, mapcache_cache
     return MAPCACHE_FALSE;
   }
   conn = SQLITE_CONN(pc);
-  stmt = conn->prepared_statements[HAS_TILE_STMT_IDX];
-  if(!stmt) {
-    sqlite3_prepare(conn->handle, cache->exists_stmt.sql, -1, &conn->prepared_statements[HAS_TILE_STMT_IDX], NULL);
-    stmt = conn->prepared_statements[HAS_TILE_STMT_IDX];
-  }
+  stmt = _sqlite_prepared_statement(conn, HAS_TILE_STMT_IDX, cache->exists_stmt.sql);
   cache->bind_stmt(ctx, stmt, cache, tile);
   ret = sqlite3_step(stmt);
   if (ret != SQLITE_DONE && ret != SQLITE_ROW) {
@@ -449,6 +468,52 @@ static int _mapcache_cache_sqlite_has_tile(mapcache_context *ctx, mapcache_cache
   return ret;
 }
 
+static int _mapcache_cache_sqlite_stat(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
+  mapcache_pooled_connection *pc;
+  struct sqlite_conn *conn;
+  sqlite3_stmt *stmt;
+  int ret;
+  if(!cache->stat_stmt.sql) {
+    return MAPCACHE_FAILURE;
+  }
+  pc = mapcache_sqlite_get_conn(ctx,cache,tile,1);
+  if (GC_HAS_ERROR(ctx)) {
+    if(pc) mapcache_sqlite_release_conn(ctx, pc);
+    if(!tile->tileset->read_only && tile->tileset->source) {
+      /* not an error in this case, as the db file may not have been created yet */
+      ctx->clear_errors(ctx);
+      return MAPCACHE_CACHE_MISS;
+    }
+    return MAPCACHE_FAILURE;
+  }
+  conn = SQLITE_CONN(pc);
+  stmt = _sqlite_prepared_statement(conn, SQLITE_STAT_TILE_STMT_IDX, cache->stat_stmt.sql);
+  cache->bind_stmt(ctx, stmt, cache, tile);
+  do {
+    ret = sqlite3_step(stmt);
+    if (ret != SQLITE_DONE && ret != SQLITE_ROW && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
+      ctx->set_error(ctx, 500, "sqlite backend failed on stat: %s", sqlite3_errmsg(conn->handle));
+      sqlite3_reset(stmt);
+      mapcache_sqlite_release_conn(ctx, pc);
+      return MAPCACHE_FAILURE;
+    }
+  } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
+  if (ret == SQLITE_DONE) {
+    ret = MAPCACHE_CACHE_MISS;
+  } else {
+    time_t mtime = sqlite3_column_int64(stmt, 0);
+    apr_time_ansi_put(&(tile->mtime), mtime);
+    /* custom stat queries may only return the modification time */
+    tile->encoded_size = (sqlite3_column_count(stmt) > 1) ? (apr_size_t)sqlite3_column_int64(stmt, 1) : 0;
+    ret = MAPCACHE_SUCCESS;
+  }
+  sqlite3_reset(stmt);
+  mapcache_sqlite_release_conn(ctx, pc);
+  return ret;
+}
+
 static void _mapcache_cache_sqlite_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
@@ -462,11 +527,7 @@ static void _mapcache_cache_sqlite_delete(mapcache_context *ctx, mapcache_cache
     return;
   }
   conn = SQLITE_CONN(pc);
-  stmt = conn->prepared_statements[SQLITE_DEL_TILE_STMT_IDX];
-  if(!stmt) {
-    sqlite3_prepare(conn->handle, cache->delete_stmt.sql, -1, &conn->prepared_statements[SQLITE_DEL_TILE_STMT_IDX], NULL);
-    stmt = conn->prepared_statements[SQLITE_DEL_TILE_STMT_IDX];
-  }
+  stmt = _sqlite_prepared_statement(conn, SQLITE_DEL_TILE_STMT_IDX, cache->delete_stmt.sql);
   cache->bind_stmt(ctx, stmt, cache, tile);
   ret = sqlite3_step(stmt);
   if (ret != SQLITE_DONE && ret != SQLITE_ROW) {
@@ -492,17 +553,9 @@ static void _mapcache_cache_mbtiles_delete(mapcache_context *ctx, mapcache_cache
     return;
   }
   conn = SQLITE_CONN(pc);
-  stmt1 = conn->prepared_statements[MBTILES_DEL_TILE_SELECT_STMT_IDX];
-  stmt2 = conn->prepared_statements[MBTILES_DEL_TILE_STMT1_IDX];
-  stmt3 = conn->prepared_statements[MBTILES_DEL_TILE_STMT2_IDX];
-  if(!stmt1) {
-    sqlite3_prepare(conn->handle, "select tile_id from map where tile_col=:x and tile_row=:y and zoom_level=:z",-1,&conn->prepared_statements[MBTILES_DEL_TILE_SELECT_STMT_IDX], NULL);
-    sqlite3_prepare(conn->handle, "delete from map where tile_col=:x and tile_row=:y and zoom_level=:z", -1, &conn->prepared_statements[MBTILES_DEL_TILE_STMT1_IDX], NULL);
-    sqlite3_prepare(conn->handle, "delete from images where tile_id=:foobar", -1, &conn->prepared_statements[MBTILES_DEL_TILE_STMT2_IDX], NULL);
-    stmt1 = conn->prepared_statements[MBTILES_DEL_TILE_SELECT_STMT_IDX];
-    stmt2 = conn->prepared_statements[MBTILES_DEL_TILE_STMT1_IDX];
-    stmt3 = conn->prepared_statements[MBTILES_DEL_TILE_STMT2_IDX];
-  }
+  stmt1 = _sqlite_prepared_statement(conn, MBTILES_DEL_TILE_SELECT_STMT_IDX, "select tile_id from map where tile_col=:x and tile_row=:y and zoom_level=:z");
+  stmt2 = _sqlite_prepared_statement(conn, MBTILES_DEL_TILE_STMT1_IDX, "delete from map where tile_col=:x and tile_row=:y and zoom_level=:z");
+  stmt3 = _sqlite_prepared_statement(conn, MBTILES_DEL_TILE_STMT2_IDX, "delete from images where tile_id=:foobar");
 
   /* first extract tile_id from the tile we will delete. We need this because we do not know
    * if the tile is empty or not.
@@ -572,33 +625,17 @@ static void _single_mbtile_set(mapcache_context *ctx, mapcache_cache_sqlite *cac
     GC_CHECK_ERROR(ctx);
   }
   if(mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE) {
-    stmt1 = conn->prepared_statements[MBTILES_SET_EMPTY_TILE_STMT1_IDX];
-    stmt2 = conn->prepared_statements[MBTILES_SET_EMPTY_TILE_STMT2_IDX];
-    if(!stmt1) {
-      sqlite3_prepare(conn->handle,
-                      "insert or ignore into images(tile_id,tile_data) values (:color,:data);",
-                      -1, &conn->prepared_statements[MBTILES_SET_EMPTY_TILE_STMT1_IDX], NULL);
-      sqlite3_prepare(conn->handle,
-                      "insert or replace into map(tile_column,tile_row,zoom_level,tile_id) values (:x,:y,:z,:color);",
-                      -1, &conn->prepared_statements[MBTILES_SET_EMPTY_TILE_STMT2_IDX], NULL);
-      stmt1 = conn->prepared_statements[MBTILES_SET_EMPTY_TILE_STMT1_IDX];
-      stmt2 = conn->prepared_statements[MBTILES_SET_EMPTY_TILE_STMT2_IDX];
-    }
+    stmt1 = _sqlite_prepared_statement(conn, MBTILES_SET_EMPTY_TILE_STMT1_IDX,
+                                       "insert or ignore into images(tile_id,tile_data) values (:color,:data);");
+    stmt2 = _sqlite_prepared_statement(conn, MBTILES_SET_EMPTY_TILE_STMT2_IDX,
+                                       "insert or replace into map(tile_column,tile_row,zoom_level,tile_id) values (:x,:y,:z,:color);");
     cache->bind_stmt(ctx, stmt1, cache, tile);
     cache->bind_stmt(ctx, stmt2, cache, tile);
   } else {
-    stmt1 = conn->prepared_statements[MBTILES_SET_TILE_STMT1_IDX];
-    stmt2 = conn->prepared_statements[MBTILES_SET_TILE_STMT2_IDX];
-    if(!stmt1) {
-      sqlite3_prepare(conn->handle,
-                      "insert or replace into images(tile_id,tile_data) values (:key,:data);",
-                      -1, &conn->prepared_statements[MBTILES_SET_TILE_STMT1_IDX], NULL);
-      sqlite3_prepare(conn->handle,
-                      "insert or replace into map(tile_column,tile_row,zoom_level,tile_id) values (:x,:y,:z,:key);",
-                      -1, &conn->prepared_statements[MBTILES_SET_TILE_STMT2_IDX], NULL);
-      stmt1 = conn->prepared_statements[MBTILES_SET_TILE_STMT1_IDX];
-      stmt2 = conn->prepared_statements[MBTILES_SET_TILE_STMT2_IDX];
-    }
+    stmt1 = _sqlite_prepared_statement(conn, MBTILES_SET_TILE_STMT1_IDX,
+                                       "insert or replace into images(tile_id,tile_data) values (:key,:data);");
+    stmt2 = _sqlite_prepared_statement(conn, MBTILES_SET_TILE_STMT2_IDX,
+                                       "insert or replace into map(tile_column,tile_row,zoom_level,tile_id) values (:x,:y,:z,:key);");
     cache->bind_stmt(ctx, stmt1, cache, tile);
     cache->bind_stmt(ctx, stmt2, cache, tile);
   }
@@ -628,6 +665,26 @@ static void _single_mbtile_set(mapcache_context *ctx, mapcache_cache_sqlite *cac
   sqlite3_reset(stmt2);
 }
 
+/**
+ * \brief load the tile data (and modification time if queried) found at column col of the current row
+ */
+static void _sqlite_tile_from_row(mapcache_context *ctx, mapcache_tile *tile, sqlite3_stmt *stmt, int col)
+{
+  const void *blob = sqlite3_column_blob(stmt, col);
+  int size = sqlite3_column_bytes(stmt, col);
+  if(size>0 && ((char*)blob)[0] == '#') {
+    tile->encoded_data = mapcache_empty_png_decode(ctx,tile->grid_link->grid->tile_sx, tile->grid_link->grid->tile_sy ,blob,&tile->nodata);
+  } else {
+    tile->encoded_data = mapcache_buffer_create(size, ctx->pool);
+    memcpy(tile->encoded_data->buf, blob, size);
+    tile->encoded_data->size = size;
+  }
+  if (sqlite3_column_count(stmt) > col + 1) {
+    time_t mtime = sqlite3_column_int64(stmt, col + 1);
+    apr_time_ansi_put(&(tile->mtime), mtime);
+  }
+}
+
 static int _mapcache_cache_sqlite_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
@@ -647,11 +704,7 @@ static int _mapcache_cache_sqlite_get(mapcache_context *ctx, mapcache_cache *pca
     }
   }
   conn = SQLITE_CONN(pc);
-  stmt = conn->prepared_statements[GET_TILE_STMT_IDX];
-  if(!stmt) {
-    sqlite3_prepare(conn->handle, cache->get_stmt.sql, -1, &conn->prepared_statements[GET_TILE_STMT_IDX], NULL);
-    stmt = conn->prepared_statements[GET_TILE_STMT_IDX];
-  }
+  stmt = _sqlite_prepared_statement(conn, GET_TILE_STMT_IDX, cache->get_stmt.sql);
   cache->bind_stmt(ctx, stmt, cache, tile);
   do {
     ret = sqlite3_step(stmt);
@@ -667,34 +720,130 @@ static int _mapcache_cache_sqlite_get(mapcache_context *ctx, mapcache_cache *pca
     mapcache_sqlite_release_conn(ctx, pc);
     return MAPCACHE_CACHE_MISS;
   } else {
-    const void *blob = sqlite3_column_blob(stmt, 0);
-    int size = sqlite3_column_bytes(stmt, 0);
-    if(size>0 && ((char*)blob)[0] == '#') {
-      tile->encoded_data = mapcache_empty_png_decode(ctx,tile->grid_link->grid->tile_sx, tile->grid_link->grid->tile_sy ,blob,&tile->nodata);
-    } else {
-      tile->encoded_data = mapcache_buffer_create(size, ctx->pool);
-      memcpy(tile->encoded_data->buf, blob, size);
-      tile->encoded_data->size = size;
+    _sqlite_tile_from_row(ctx, tile, stmt, 0);
+    sqlite3_reset(stmt);
+    mapcache_sqlite_release_conn(ctx, pc);
+    return MAPCACHE_SUCCESS;
+  }
+}
+
+/*
+ * can tiles a and b be fetched with a single range query ?
+ */
+static int _sqlite_same_range_query(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *a, char *a_dbfile, mapcache_tile *b, char *b_dbfile)
+{
+  if(a->tileset != b->tileset || a->grid_link->grid != b->grid_link->grid || a->z != b->z ||
+      strcmp(a_dbfile, b_dbfile)) {
+    return MAPCACHE_FALSE;
+  }
+  if(a->dimensions || b->dimensions) {
+    if(!a->dimensions || !b->dimensions) return MAPCACHE_FALSE;
+    if(strcmp(mapcache_util_get_tile_dimkey(ctx, a, NULL, NULL), mapcache_util_get_tile_dimkey(ctx, b, NULL, NULL))) {
+      return MAPCACHE_FALSE;
     }
-    if (sqlite3_column_count(stmt) > 1) {
-      time_t mtime = sqlite3_column_int64(stmt, 1);
-      apr_time_ansi_put(&(tile->mtime), mtime);
+  }
+  return MAPCACHE_TRUE;
+}
+
+/**
+ * \brief fetch a set of tiles with one range query per tileset/grid/level/dimension and database file
+ *
+ * the tiles of a GetMap request cover a rectangle of a single level, so this usually
+ * boils down to a single query.
+ * \private \memberof mapcache_cache_sqlite
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_sqlite_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
+  char **dbfiles = apr_palloc(ctx->pool, ntiles*sizeof(char*));
+  int *handled = apr_pcalloc(ctx->pool, ntiles*sizeof(int));
+  int *group = apr_palloc(ctx->pool, ntiles*sizeof(int));
+  int i,j;
+
+  for(i=0; i<ntiles; i++) {
+    rets[i] = MAPCACHE_CACHE_MISS;
+    _mapcache_cache_sqlite_filename_for_tile(ctx, cache, tiles[i], &dbfiles[i]);
+    GC_CHECK_ERROR(ctx);
+  }
+
+  for(i=0; i<ntiles; i++) {
+    int ngroup = 0, ret, paramidx;
+    int minx,maxx,miny,maxy;
+    mapcache_pooled_connection *pc;
+    struct sqlite_conn *conn;
+    sqlite3_stmt *stmt;
+    if(handled[i]) continue;
+
+    minx = maxx = tiles[i]->x;
+    miny = maxy = tiles[i]->y;
+    for(j=i; j<ntiles; j++) {
+      if(handled[j] || !_sqlite_same_range_query(ctx, cache, tiles[i], dbfiles[i], tiles[j], dbfiles[j])) continue;
+      handled[j] = 1;
+      group[ngroup++] = j;
+      if(tiles[j]->x < minx) minx = tiles[j]->x;
+      if(tiles[j]->x > maxx) maxx = tiles[j]->x;
+      if(tiles[j]->y < miny) miny = tiles[j]->y;
+      if(tiles[j]->y > maxy) maxy = tiles[j]->y;
+    }
+
+    pc = mapcache_sqlite_get_conn(ctx,cache,tiles[i],1);
+    if (GC_HAS_ERROR(ctx)) {
+      if(tiles[i]->tileset->read_only || !tiles[i]->tileset->source) {
+        mapcache_sqlite_release_conn(ctx, pc);
+        return;
+      }
+      /* not an error in this case, as the db file may not have been created yet */
+      ctx->clear_errors(ctx);
+      mapcache_sqlite_release_conn(ctx, pc);
+      continue;
+    }
+    conn = SQLITE_CONN(pc);
+    stmt = _sqlite_prepared_statement(conn, SQLITE_MULTI_GET_TILE_STMT_IDX, cache->multi_get_stmt.sql);
+    cache->bind_stmt(ctx, stmt, cache, tiles[i]);
+    paramidx = sqlite3_bind_parameter_index(stmt, ":minx");
+    if (paramidx) sqlite3_bind_int(stmt, paramidx, minx);
+    paramidx = sqlite3_bind_parameter_index(stmt, ":maxx");
+    if (paramidx) sqlite3_bind_int(stmt, paramidx, maxx);
+    paramidx = sqlite3_bind_parameter_index(stmt, ":miny");
+    if (paramidx) sqlite3_bind_int(stmt, paramidx, miny);
+    paramidx = sqlite3_bind_parameter_index(stmt, ":maxy");
+    if (paramidx) sqlite3_bind_int(stmt, paramidx, maxy);
+
+    while(1) {
+      int x,y,k;
+      ret = sqlite3_step(stmt);
+      if (ret == SQLITE_BUSY || ret == SQLITE_LOCKED) {
+        continue;
+      }
+      if (ret != SQLITE_ROW) {
+        break;
+      }
+      /* the range may contain tiles that were not requested */
+      x = sqlite3_column_int(stmt, 0);
+      y = sqlite3_column_int(stmt, 1);
+      for(k=0; k<ngroup; k++) {
+        if(tiles[group[k]]->x == x && tiles[group[k]]->y == y) {
+          _sqlite_tile_from_row(ctx, tiles[group[k]], stmt, 2);
+          rets[group[k]] = MAPCACHE_SUCCESS;
+          break;
+        }
+      }
+    }
+    if (ret != SQLITE_DONE) {
+      ctx->set_error(ctx, 500, "sqlite backend failed on multi get: %s", sqlite3_errmsg(conn->handle));
     }
     sqlite3_reset(stmt);
     mapcache_sqlite_release_conn(ctx, pc);
-    return MAPCACHE_SUCCESS;
+    GC_CHECK_ERROR(ctx);
   }
 }
 
 static void _single_sqlitetile_set(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile, struct sqlite_conn *conn)
 {
-  sqlite3_stmt *stmt = conn->prepared_statements[SQLITE_SET_TILE_STMT_IDX];
+  sqlite3_stmt *stmt = _sqlite_prepared_statement(conn, SQLITE_SET_TILE_STMT_IDX, cache->set_stmt.sql);
   int ret;
 
-  if(!stmt) {
-    sqlite3_prepare(conn->handle, cache->set_stmt.sql, -1, &conn->prepared_statements[SQLITE_SET_TILE_STMT_IDX], NULL);
-    stmt = conn->prepared_statements[SQLITE_SET_TILE_STMT_IDX];
-  }
   cache->bind_stmt(ctx, stmt, cache, tile);
   do {
     ret = sqlite3_step(stmt);
@@ -729,12 +878,14 @@ static void _mapcache_cache_sqlite_set(mapcache_context *ctx, mapcache_cache *pc
   mapcache_sqlite_release_conn(ctx, pc);
 }
 
-static void _mapcache_cache_sqlite_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+typedef void (*_sqlite_single_set_func)(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile, struct sqlite_conn *conn);
+
+static void _mapcache_cache_sqlite_multi_set_file(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile **tiles, int ntiles,
+    _sqlite_single_set_func single_set)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
   int i;
   struct sqlite_conn *conn;
-  mapcache_pooled_connection *pc = mapcache_sqlite_get_conn(ctx,cache,&tiles[0],0);
+  mapcache_pooled_connection *pc = mapcache_sqlite_get_conn(ctx,cache,tiles[0],0);
   if (GC_HAS_ERROR(ctx)) {
     mapcache_sqlite_release_conn(ctx, pc);
     return;
@@ -742,8 +893,7 @@ static void _mapcache_cache_sqlite_multi_set(mapcache_context *ctx, mapcache_cac
   conn = SQLITE_CONN(pc);
   sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
   for (i = 0; i < ntiles; i++) {
-    mapcache_tile *tile = &tiles[i];
-    _single_sqlitetile_set(ctx,cache, tile,conn);
+    single_set(ctx,cache,tiles[i],conn);
     if(GC_HAS_ERROR(ctx)) break;
   }
   if (GC_HAS_ERROR(ctx)) {
@@ -754,6 +904,50 @@ static void _mapcache_cache_sqlite_multi_set(mapcache_context *ctx, mapcache_cac
   mapcache_sqlite_release_conn(ctx, pc);
 }
 
+/*
+ * write the tiles with one transaction per database file. The tiles of a metatile
+ * usually share theirs, but those coalesced by a write-behind queue may be spread
+ * over the blocks of a dbfile template with x and y variables
+ */
+static void _mapcache_cache_sqlite_multi_set_files(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tiles, int ntiles,
+    _sqlite_single_set_func single_set)
+{
+  mapcache_tile **group = apr_palloc(ctx->pool, ntiles * sizeof(mapcache_tile*));
+  char **files;
+  int *done;
+  int i,j,n;
+  if(!cache->dbfile_template) {
+    for(i=0; i<ntiles; i++) {
+      group[i] = &tiles[i];
+    }
+    _mapcache_cache_sqlite_multi_set_file(ctx,cache,group,ntiles,single_set);
+    return;
+  }
+  files = apr_palloc(ctx->pool, ntiles * sizeof(char*));
+  done = apr_pcalloc(ctx->pool, ntiles * sizeof(int));
+  for(i=0; i<ntiles; i++) {
+    _mapcache_cache_sqlite_filename_for_tile(ctx,cache,&tiles[i],&files[i]);
+    GC_CHECK_ERROR(ctx);
+  }
+  for(i=0; i<ntiles; i++) {
+    if(done[i]) continue;
+    n = 0;
+    for(j=i; j<ntiles; j++) {
+      if(!done[j] && !strcmp(files[i],files[j])) {
+        done[j] = 1;
+        group[n++] = &tiles[j];
+      }
+    }
+    _mapcache_cache_sqlite_multi_set_file(ctx,cache,group,n,single_set);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+static void _mapcache_cache_sqlite_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  _mapcache_cache_sqlite_multi_set_files(ctx, (mapcache_cache_sqlite*)pcache, tiles, ntiles, _single_sqlitetile_set);
+}
+
 static void _mapcache_cache_mbtiles_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
@@ -785,8 +979,6 @@ static void _mapcache_cache_mbtiles_multi_set(mapcache_context *ctx, mapcache_ca
 {
   int i;
   mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
-  mapcache_pooled_connection *pc;
-  struct sqlite_conn *conn;
 
   /* decode/encode image data before going into the sqlite write lock */
   for (i = 0; i < ntiles; i++) {
@@ -801,25 +993,7 @@ static void _mapcache_cache_mbtiles_multi_set(mapcache_context *ctx, mapcache_ca
       GC_CHECK_ERROR(ctx);
     }
   }
-  pc = mapcache_sqlite_get_conn(ctx,cache,&tiles[0],0);
-  if (GC_HAS_ERROR(ctx)) {
-    mapcache_sqlite_release_conn(ctx, pc);
-    return;
-  }
-  conn = SQLITE_CONN(pc);
-
-  sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
-  for (i = 0; i < ntiles; i++) {
-    mapcache_tile *tile = &tiles[i];
-    _single_mbtile_set(ctx,cache,tile,conn);
-    if(GC_HAS_ERROR(ctx)) break;
-  }
-  if (GC_HAS_ERROR(ctx)) {
-    sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
-  } else {
-    sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
-  }
-  mapcache_sqlite_release_conn(ctx, pc);
+  _mapcache_cache_sqlite_multi_set_files(ctx, cache, tiles, ntiles, _single_mbtile_set);
 }
 
 static void _mapcache_cache_sqlite_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *pcache, mapcache_cfg *config)
@@ -902,6 +1076,24 @@ static void _mapcache_cache_sqlite_configuration_parse_xml(mapcache_context *ctx
       cur_node = cur_node->next;
     }
   }
+  if ((cur_node = ezxml_child(node, "read_mmap_size")) != NULL) {
+    char *endptr;
+    cache->read_mmap_size = apr_strtoi64(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || cache->read_mmap_size < 0) {
+      ctx->set_error(ctx,400,"failed to parse read_mmap_size value %s for sqlite cache %s (expecting a positive number of bytes)",
+                     cur_node->txt,cache->cache.name);
+      return;
+    }
+  }
+  if ((cur_node = ezxml_child(node, "wal_autocheckpoint")) != NULL) {
+    char *endptr;
+    cache->wal_autocheckpoint = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || cache->wal_autocheckpoint < 0) {
+      ctx->set_error(ctx,400,"failed to parse wal_autocheckpoint value %s for sqlite cache %s (expecting a positive number of pages)",
+                     cur_node->txt,cache->cache.name);
+      return;
+    }
+  }
   if ((cur_node = ezxml_child(node, "queries")) != NULL) {
     ezxml_t query_node;
     if ((query_node = ezxml_child(cur_node, "exists")) != NULL) {
@@ -909,6 +1101,19 @@ static void _mapcache_cache_sqlite_configuration_parse_xml(mapcache_context *ctx
     }
     if ((query_node = ezxml_child(cur_node, "get")) != NULL) {
       cache->get_stmt.sql = apr_pstrdup(ctx->pool,query_node->txt);
+      /* the default stat and multi_get queries would not match a custom schema */
+      cache->stat_stmt.sql = NULL;
+      cache->multi_get_stmt.sql = NULL;
+    }
+    if ((query_node = ezxml_child(cur_node, "stat")) != NULL) {
+      cache->stat_stmt.sql = apr_pstrdup(ctx->pool,query_node->txt);
+    }
+    if ((query_node = ezxml_child(cur_node, "multi_get")) != NULL) {
+      cache->multi_get_stmt.sql = apr_pstrdup(ctx->pool,query_node->txt);
+    }
+    if (!cache->multi_get_stmt.sql) {
+      /* fall back to fetching tiles one by one */
+      cache->cache._tile_multi_get = NULL;
     }
     if ((query_node = ezxml_child(cur_node, "set")) != NULL) {
       cache->set_stmt.sql = apr_pstrdup(ctx->pool,query_node->txt);
@@ -952,6 +1157,7 @@ static void _mapcache_cache_sqlite_configuration_post_config(mapcache_context *c
     ctx->set_error(ctx, 500, "sqlite cache \"%s\" is missing <dbfile> entry", pcache->name);
     return;
   }
+  _mapcache_cache_sqlite_compile_dbfile(ctx, cache);
 }
 
 /**
@@ -960,6 +1166,7 @@ static void _mapcache_cache_sqlite_configuration_post_config(mapcache_context *c
 static void _mapcache_cache_mbtiles_configuration_post_config(mapcache_context *ctx,
     mapcache_cache *pcache, mapcache_cfg *cfg)
 {
+  _mapcache_cache_sqlite_compile_dbfile(ctx, (mapcache_cache_sqlite*)pcache);
   /* check that only one tileset/grid references this cache, as mbtiles does
    not support multiple tilesets/grids per cache */
 #ifdef FIXME
@@ -997,7 +1204,9 @@ mapcache_cache* mapcache_cache_sqlite_create(mapcache_context *ctx)
   cache->cache.type = MAPCACHE_CACHE_SQLITE;
   cache->cache._tile_delete = _mapcache_cache_sqlite_delete;
   cache->cache._tile_get = _mapcache_cache_sqlite_get;
+  cache->cache._tile_multi_get = _mapcache_cache_sqlite_multi_get;
   cache->cache._tile_exists = _mapcache_cache_sqlite_has_tile;
+  cache->cache._tile_stat = _mapcache_cache_sqlite_stat;
   cache->cache._tile_set = _mapcache_cache_sqlite_set;
   cache->cache._tile_multi_set = _mapcache_cache_sqlite_multi_set;
   cache->cache.configuration_post_config = _mapcache_cache_sqlite_configuration_post_config;
@@ -1008,11 +1217,15 @@ mapcache_cache* mapcache_cache_sqlite_create(mapcache_context *ctx)
                                        "select 1 from tiles where x=:x and y=:y and z=:z and dim=:dim and tileset=:tileset and grid=:grid");
   cache->get_stmt.sql = apr_pstrdup(ctx->pool,
                                     "select data,strftime(\"%s\",ctime) from tiles where tileset=:tileset and grid=:grid and x=:x and y=:y and z=:z and dim=:dim");
+  cache->stat_stmt.sql = apr_pstrdup(ctx->pool,
+                                    "select strftime(\"%s\",ctime),length(data) from tiles where tileset=:tileset and grid=:grid and x=:x and y=:y and z=:z and dim=:dim");
+  cache->multi_get_stmt.sql = apr_pstrdup(ctx->pool,
+                                    "select x,y,data,strftime(\"%s\",ctime) from tiles where tileset=:tileset and grid=:grid and z=:z and dim=:dim and x between :minx and :maxx and y between :miny and :maxy");
   cache->set_stmt.sql = apr_pstrdup(ctx->pool,
                                     "insert or replace into tiles(tileset,grid,x,y,z,data,dim,ctime) values (:tileset,:grid,:x,:y,:z,:data,:dim,datetime('now'))");
   cache->delete_stmt.sql = apr_pstrdup(ctx->pool,
                                        "delete from tiles where x=:x and y=:y and z=:z and dim=:dim and tileset=:tileset and grid=:grid");
-  cache->n_prepared_statements = 4;
+  cache->n_prepared_statements = 6;
   cache->bind_stmt = _bind_sqlite_params;
   cache->detect_blank = 1;
   cache->x_fmt = cache->y_fmt = cache->z_fmt
@@ -1020,6 +1233,7 @@ mapcache_cache* mapcache_cache_sqlite_create(mapcache_context *ctx)
           = cache->div_x_fmt = cache->div_y_fmt
           = cache->inv_div_x_fmt = cache->inv_div_y_fmt = apr_pstrdup(ctx->pool,"%d");
   cache->count_x = cache->count_y = -1;
+  cache->wal_autocheckpoint = -1;
   return (mapcache_cache*)cache;
 }
 
@@ -1047,6 +1261,11 @@ mapcache_cache* mapcache_cache_mbtiles_create(mapcache_context *ctx)
                                        "select 1 from tiles where tile_column=:x and tile_row=:y and zoom_level=:z");
   cache->get_stmt.sql = apr_pstrdup(ctx->pool,
                                     "select tile_data from tiles where tile_column=:x and tile_row=:y and zoom_level=:z");
+  /* no modification time in the mbtiles schema */
+  cache->stat_stmt.sql = NULL;
+  /* tiles are fetched one by one */
+  cache->multi_get_stmt.sql = NULL;
+  cache->cache._tile_multi_get = NULL;
   cache->delete_stmt.sql = apr_pstrdup(ctx->pool,
                                        "delete from tiles where tile_column=:x and tile_row=:y and zoom_level=:z");
   cache->n_prepared_statements = 9;
@@ -40,6 +40,14 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <tiffio.h>
+#ifdef HAVE_PREAD
+#include <unistd.h>
+#include <fcntl.h>
+#include <apr_hash.h>
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+#endif
 
 #ifdef USE_GDAL
 #include "cpl_vsi.h"
@@ -70,6 +78,7 @@ typedef enum
 
 
 typedef struct mapcache_cache_tiff mapcache_cache_tiff;
+typedef struct mapcache_cache_tiff_handles mapcache_cache_tiff_handles;
 
 struct mapcache_cache_tiff {
   mapcache_cache cache;
@@ -79,6 +88,7 @@ struct mapcache_cache_tiff {
   int count_y;
   mapcache_image_format_jpeg *format;
   mapcache_locker *locker;
+  mapcache_cache_tiff_handles *handles; /**< files kept open by this process, NULL if disabled */
   struct {
     mapcache_cache_tiff_storage_type type;
     int connection_timeout;
@@ -507,6 +517,320 @@ static void check_tiff_format(mapcache_context *ctx, mapcache_cache_tiff *cache,
 }
 #endif
 
+#ifdef HAVE_PREAD
+
+/*
+ * per-process cache of open tiff files. for each file we keep a descriptor and the
+ * tile offsets, sizes and jpeg tables of its full resolution directory, so that
+ * reading a tile from a file that has already been accessed doesn't require going
+ * through libtiff again. entries are invalidated when the size or modification time
+ * of the file changes.
+ */
+
+typedef struct _tiff_handle _tiff_handle;
+
+struct _tiff_handle {
+  char *filename;
+  apr_time_t mtime;
+  apr_off_t size;
+  int fd;
+  uint32 ntiles;
+  toff_t *offsets;
+  toff_t *sizes;
+  unsigned char *jpegtable; /* NULL if the file has no jpeg tables */
+  uint32 jpegtable_size;
+  int refcount; /* number of requests currently reading from the file */
+  int stale; /* the handle has been replaced, close it once it isn't used anymore */
+  _tiff_handle *prev; /* more recently used */
+  _tiff_handle *next; /* less recently used */
+};
+
+struct mapcache_cache_tiff_handles {
+  apr_pool_t *pool;
+#if APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+  apr_hash_t *handles;
+  _tiff_handle *head; /* most recently used */
+  _tiff_handle *tail; /* least recently used, closed first */
+  int count;
+  int max_count;
+};
+
+static void _tiff_handle_close(_tiff_handle *h)
+{
+  if(h->fd >= 0) close(h->fd);
+  free(h->offsets);
+  free(h->sizes);
+  free(h->jpegtable);
+  free(h->filename);
+  free(h);
+}
+
+static void _tiff_handles_lock(mapcache_cache_tiff_handles *t)
+{
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(t->mutex);
+#endif
+}
+
+static void _tiff_handles_unlock(mapcache_cache_tiff_handles *t)
+{
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(t->mutex);
+#endif
+}
+
+/* removes a handle from the table, closing it if it isn't in use. must be called with the mutex held */
+static void _tiff_handles_remove(mapcache_cache_tiff_handles *t, _tiff_handle *h)
+{
+  if(h->prev) h->prev->next = h->next;
+  else t->head = h->next;
+  if(h->next) h->next->prev = h->prev;
+  else t->tail = h->prev;
+  h->prev = h->next = NULL;
+  apr_hash_set(t->handles, h->filename, APR_HASH_KEY_STRING, NULL);
+  t->count--;
+  if(h->refcount) {
+    h->stale = 1;
+  } else {
+    _tiff_handle_close(h);
+  }
+}
+
+static apr_status_t _tiff_handles_cleanup(void *data)
+{
+  mapcache_cache_tiff_handles *t = (mapcache_cache_tiff_handles*)data;
+  while(t->tail) {
+    _tiff_handles_remove(t, t->tail);
+  }
+  return APR_SUCCESS;
+}
+
+static mapcache_cache_tiff_handles* _tiff_handles_create(mapcache_context *ctx, int max_count)
+{
+  mapcache_cache_tiff_handles *t = apr_pcalloc(ctx->pool, sizeof(mapcache_cache_tiff_handles));
+  /* the hash gets its own pool as it is only ever accessed with the mutex held */
+  apr_pool_create(&t->pool, ctx->pool);
+#if APR_HAS_THREADS
+  if(apr_thread_mutex_create(&t->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to create tiff handle cache mutex");
+    return NULL;
+  }
+#endif
+  t->handles = apr_hash_make(t->pool);
+  t->max_count = max_count;
+  apr_pool_cleanup_register(ctx->pool, t, _tiff_handles_cleanup, apr_pool_cleanup_null);
+  return t;
+}
+
+/*
+ * reads the tile index of the full resolution directory of a tiff file. returns NULL
+ * without setting an error if the file cannot be opened or only contains overviews,
+ * in which case the uncached code path will be taken
+ */
+static _tiff_handle* _tiff_handle_open(mapcache_context *ctx, mapcache_cache_tiff *cache, const char *filename,
+                                       apr_finfo_t *finfo)
+{
+  TIFF *hTIFF;
+  _tiff_handle *h = NULL;
+
+  hTIFF = mapcache_cache_tiff_open(ctx,cache,filename,"r");
+  if(!hTIFF) {
+    return NULL;
+  }
+  do {
+    uint32 nSubType = 0;
+    toff_t *offsets = NULL, *sizes = NULL;
+    uint32 jpegtable_size = 0;
+    unsigned char *jpegtable_ptr = NULL;
+
+    if( !TIFFGetField(hTIFF, TIFFTAG_SUBFILETYPE, &nSubType) )
+      nSubType = 0;
+    if( nSubType & FILETYPE_REDUCEDIMAGE )
+      continue;
+
+    if(TIFFGetField(hTIFF, TIFFTAG_TILEOFFSETS, &offsets) != 1 ||
+        TIFFGetField(hTIFF, TIFFTAG_TILEBYTECOUNTS, &sizes) != 1) {
+      break;
+    }
+    h = calloc(1, sizeof(_tiff_handle));
+    if(!h) break;
+    h->fd = -1;
+    h->ntiles = TIFFNumberOfTiles(hTIFF);
+    h->filename = strdup(filename);
+    h->offsets = malloc(h->ntiles * sizeof(toff_t));
+    h->sizes = malloc(h->ntiles * sizeof(toff_t));
+    if(TIFFGetField(hTIFF, TIFFTAG_JPEGTABLES, &jpegtable_size, &jpegtable_ptr) == 1 &&
+        jpegtable_ptr && jpegtable_size >= 2) {
+      h->jpegtable = malloc(jpegtable_size);
+      if(h->jpegtable) {
+        memcpy(h->jpegtable, jpegtable_ptr, jpegtable_size);
+        h->jpegtable_size = jpegtable_size;
+      }
+    }
+    if(!h->filename || !h->offsets || !h->sizes || (jpegtable_size >= 2 && jpegtable_ptr && !h->jpegtable)) {
+      _tiff_handle_close(h);
+      h = NULL;
+      break;
+    }
+    memcpy(h->offsets, offsets, h->ntiles * sizeof(toff_t));
+    memcpy(h->sizes, sizes, h->ntiles * sizeof(toff_t));
+    break;
+  } while( TIFFReadDirectory( hTIFF ) );
+  MyTIFFClose(hTIFF);
+
+  if(h) {
+    h->fd = open(filename, O_RDONLY);
+    if(h->fd < 0) {
+      _tiff_handle_close(h);
+      return NULL;
+    }
+    h->mtime = finfo->mtime;
+    h->size = finfo->size;
+  }
+  return h;
+}
+
+/*
+ * returns the cached handle for the given file, opening it if needed. sets *missing if
+ * the file does not exist. the returned handle must be given back with _tiff_handle_release()
+ */
+static _tiff_handle* _tiff_handle_acquire(mapcache_context *ctx, mapcache_cache_tiff *cache, const char *filename,
+                                          int *missing)
+{
+  mapcache_cache_tiff_handles *t = cache->handles;
+  _tiff_handle *h, *other;
+  apr_finfo_t finfo;
+
+  *missing = 0;
+  if(apr_stat(&finfo, filename, APR_FINFO_MTIME|APR_FINFO_SIZE, ctx->pool) != APR_SUCCESS) {
+    *missing = 1;
+    return NULL;
+  }
+
+  _tiff_handles_lock(t);
+  h = apr_hash_get(t->handles, filename, APR_HASH_KEY_STRING);
+  if(h) {
+    if(h->mtime == finfo.mtime && h->size == finfo.size) {
+      /* move to the front of the lru list */
+      if(h->prev) {
+        h->prev->next = h->next;
+        if(h->next) h->next->prev = h->prev;
+        else t->tail = h->prev;
+        h->prev = NULL;
+        h->next = t->head;
+        t->head->prev = h;
+        t->head = h;
+      }
+      h->refcount++;
+      _tiff_handles_unlock(t);
+      return h;
+    }
+    /* the file has been modified since we read its index */
+    _tiff_handles_remove(t, h);
+  }
+  _tiff_handles_unlock(t);
+
+  /* parsing the file is done without holding the mutex */
+  h = _tiff_handle_open(ctx, cache, filename, &finfo);
+  if(!h) {
+    return NULL;
+  }
+
+  _tiff_handles_lock(t);
+  other = apr_hash_get(t->handles, filename, APR_HASH_KEY_STRING);
+  if(other) {
+    /* opened concurrently by another thread */
+    _tiff_handles_remove(t, other);
+  }
+  while(t->tail && t->count >= t->max_count) {
+    _tiff_handles_remove(t, t->tail);
+  }
+  h->next = t->head;
+  if(t->head) t->head->prev = h;
+  t->head = h;
+  if(!t->tail) t->tail = h;
+  apr_hash_set(t->handles, h->filename, APR_HASH_KEY_STRING, h);
+  t->count++;
+  h->refcount = 1;
+  _tiff_handles_unlock(t);
+  return h;
+}
+
+static void _tiff_handle_release(mapcache_cache_tiff *cache, _tiff_handle *h)
+{
+  mapcache_cache_tiff_handles *t = cache->handles;
+  _tiff_handles_lock(t);
+  h->refcount--;
+  if(h->stale && !h->refcount) {
+    _tiff_handle_close(h);
+  }
+  _tiff_handles_unlock(t);
+}
+
+/* index of the tile in the list of tiles of its tiff file */
+static int _mapcache_cache_tiff_tile_index(mapcache_cache_tiff *cache, mapcache_tile *tile)
+{
+  mapcache_grid_level *level = tile->grid_link->grid->levels[tile->z];
+  int ntilesx = MAPCACHE_MIN(cache->count_x, level->maxx);
+  int ntilesy = MAPCACHE_MIN(cache->count_y, level->maxy);
+  return (ntilesy - (tile->y % ntilesy) - 1) * ntilesx + tile->x % ntilesx;
+}
+
+/*
+ * reads a tile through the handle cache. returns -1 if the file couldn't be handled
+ * here and the regular libtiff code path should be used instead
+ */
+static int _mapcache_cache_tiff_cached_get(mapcache_context *ctx, mapcache_cache_tiff *cache, mapcache_tile *tile,
+                                           const char *filename)
+{
+  _tiff_handle *h;
+  int missing, tiff_off;
+  toff_t offset, size;
+  char *bufptr;
+  ssize_t bytes;
+
+  if(!strncmp(filename, "/vsi", 4)) {
+    return -1;
+  }
+  h = _tiff_handle_acquire(ctx, cache, filename, &missing);
+  if(!h) {
+    return missing ? MAPCACHE_CACHE_MISS : -1;
+  }
+  tiff_off = _mapcache_cache_tiff_tile_index(cache, tile);
+  if((uint32)tiff_off >= h->ntiles || h->offsets[tiff_off] == 0 || h->sizes[tiff_off] < 2) {
+    /* sparse tiff file without the requested tile */
+    _tiff_handle_release(cache, h);
+    return MAPCACHE_CACHE_MISS;
+  }
+  if(!h->jpegtable) {
+    ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" jpeg table", filename);
+    _tiff_handle_release(cache, h);
+    return MAPCACHE_FAILURE;
+  }
+  offset = h->offsets[tiff_off];
+  size = h->sizes[tiff_off];
+
+  /* the jpeg header without its last 2 bytes, followed by the tile data without its first 2 bytes */
+  tile->encoded_data = mapcache_buffer_create((h->jpegtable_size+size-4),ctx->pool);
+  memcpy(tile->encoded_data->buf,h->jpegtable,(h->jpegtable_size-2));
+  bufptr = ((char *)tile->encoded_data->buf) + (h->jpegtable_size-2);
+  bytes = pread(h->fd, bufptr, size-2, offset+2);
+  if(bytes < 0 || (toff_t)bytes != size-2) {
+    ctx->set_error(ctx,500,"failed to read jpeg body in \"%s\". (read %d of %d bytes)",
+                   filename,(int)bytes,(int)size-2);
+    _tiff_handle_release(cache, h);
+    return MAPCACHE_FAILURE;
+  }
+  tile->encoded_data->size = (h->jpegtable_size+size-4);
+  tile->mtime = h->mtime;
+  _tiff_handle_release(cache, h);
+  return MAPCACHE_SUCCESS;
+}
+
+#endif /* HAVE_PREAD */
+
 static int _mapcache_cache_tiff_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *filename;
@@ -517,6 +841,30 @@ static int _mapcache_cache_tiff_has_tile(mapcache_context *ctx, mapcache_cache *
     return MAPCACHE_FALSE;
   }
 
+#ifdef HAVE_PREAD
+  if(cache->handles && strncmp(filename, "/vsi", 4)) {
+    _tiff_handle *h;
+    int missing;
+#ifdef USE_GDAL
+    CPLPushErrorHandlerEx(mapcache_cache_tiff_gdal_error_handler, ctx);
+#endif
+    h = _tiff_handle_acquire(ctx, cache, filename, &missing);
+#ifdef USE_GDAL
+    CPLPopErrorHandler();
+#endif
+    if(h) {
+      int tiff_off = _mapcache_cache_tiff_tile_index(cache, tile);
+      int ret = ((uint32)tiff_off < h->ntiles && h->offsets[tiff_off] > 0 && h->sizes[tiff_off] > 0) ?
+                MAPCACHE_TRUE : MAPCACHE_FALSE;
+      _tiff_handle_release(cache, h);
+      return ret;
+    }
+    if(missing) {
+      return MAPCACHE_FALSE;
+    }
+  }
+#endif
+
 #ifdef USE_GDAL
   CPLPushErrorHandlerEx(mapcache_cache_tiff_gdal_error_handler, ctx);
 #endif
@@ -634,6 +982,18 @@ static int _mapcache_cache_tiff_get(mapcache_context *ctx, mapcache_cache *pcach
   CPLPushErrorHandlerEx(mapcache_cache_tiff_gdal_error_handler, ctx);
 #endif
 
+#ifdef HAVE_PREAD
+  if(cache->handles) {
+    rv = _mapcache_cache_tiff_cached_get(ctx, cache, tile, filename);
+    if(rv != -1) {
+#ifdef USE_GDAL
+      CPLPopErrorHandler();
+#endif
+      return rv;
+    }
+  }
+#endif
+
   hTIFF = mapcache_cache_tiff_open(ctx,cache,filename,"r");
 
   /*
@@ -1332,6 +1692,31 @@ static void _mapcache_cache_tiff_configuration_parse_xml(mapcache_context *ctx,
 
   }
 
+  cur_node = ezxml_child(node,"max_open_files");
+  if(cur_node && cur_node->txt && *cur_node->txt) {
+    char *endptr;
+    int max_open_files = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || max_open_files < 0) {
+      ctx->set_error(ctx,400,"failed to parse max_open_files value %s for tiff cache %s (positive integer expected)",
+                     cur_node->txt,pcache->name);
+      return;
+    }
+    if(max_open_files > 0) {
+#ifdef HAVE_PREAD
+      if(cache->storage.type != MAPCACHE_TIFF_STORAGE_FILE) {
+        ctx->set_error(ctx,400,"tiff cache %s: max_open_files is only supported for files on local storage",
+                       pcache->name);
+        return;
+      }
+      cache->handles = _tiff_handles_create(ctx, max_open_files);
+      GC_CHECK_ERROR(ctx);
+#else
+      ctx->set_error(ctx,400,"tiff cache %s: max_open_files is not supported on this platform",pcache->name);
+      return;
+#endif
+    }
+  }
+
 }
 
 /**
@@ -222,6 +222,8 @@ mapcache_cfg* mapcache_configuration_create(apr_pool_t *pool)
 
   cfg->loglevel = MAPCACHE_WARN;
   cfg->autoreload = 0;
+  cfg->fetching_threads = 8;
+  cfg->inflight = mapcache_inflight_table_create(pool);
 
   return cfg;
 }
@@ -427,6 +427,8 @@ void parseFormat(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config)
   if(!strcmp(type,"PNG")) {
     int colors = -1;
     mapcache_compression_type compression = MAPCACHE_COMPRESSION_DEFAULT;
+    mapcache_png_encoder encoder = MAPCACHE_PNG_ENCODER_LIBPNG;
+    int shared_palette = 0;
     if ((cur_node = ezxml_child(node,"compression")) != NULL) {
       if(!strcmp(cur_node->txt, "fast")) {
         compression = MAPCACHE_COMPRESSION_FAST;
@@ -439,6 +441,16 @@ void parseFormat(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config)
         return;
       }
     }
+    if ((cur_node = ezxml_child(node,"encoder")) != NULL) {
+      if(!strcmp(cur_node->txt, "libpng")) {
+        encoder = MAPCACHE_PNG_ENCODER_LIBPNG;
+      } else if(!strcmp(cur_node->txt, "libdeflate")) {
+        encoder = MAPCACHE_PNG_ENCODER_LIBDEFLATE;
+      } else {
+        ctx->set_error(ctx, 400, "unknown png encoder %s for format \"%s\" (expecting libpng or libdeflate)", cur_node->txt, name);
+        return;
+      }
+    }
     if ((cur_node = ezxml_child(node,"colors")) != NULL) {
       char *endptr;
       colors = (int)strtol(cur_node->txt,&endptr,10);
@@ -451,13 +463,30 @@ void parseFormat(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config)
       }
     }
 
+    if ((cur_node = ezxml_child(node,"shared_palette")) != NULL) {
+      if(cur_node->txt && !strcasecmp(cur_node->txt,"true"))
+        shared_palette = 1;
+      else if(!cur_node->txt || strcasecmp(cur_node->txt,"false")) {
+        ctx->set_error(ctx,400,"failed to parse png format %s shared_palette %s. expecting true or false",
+                       name,cur_node->txt);
+        return;
+      }
+      if(shared_palette && colors == -1) {
+        ctx->set_error(ctx,400,"png format %s: <shared_palette> requires <colors> to be set",name);
+        return;
+      }
+    }
+
     if(colors == -1) {
       format = mapcache_imageio_create_png_format(ctx->pool,
                name,compression);
     } else {
       format = mapcache_imageio_create_png_q_format(ctx->pool,
                name,compression, colors);
+      ((mapcache_image_format_png_q*)format)->shared_palette = shared_palette;
     }
+    mapcache_imageio_png_set_encoder(ctx, format, encoder);
+    GC_CHECK_ERROR(ctx);
   } else if(!strcmp(type,"JPEG")) {
     int quality = 95;
     int optimize = TRUE;
@@ -499,6 +528,48 @@ void parseFormat(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config)
     }
     format = mapcache_imageio_create_jpeg_format(ctx->pool,
              name,quality,photometric,optimize);
+  } else if(!strcasecmp(type,"WEBP")) {
+#ifdef USE_WEBP
+    int quality = 75;
+    int lossless = 0;
+    int method = 4;
+    if ((cur_node = ezxml_child(node,"quality")) != NULL) {
+      char *endptr;
+      quality = (int)strtol(cur_node->txt,&endptr,10);
+      if(*endptr != 0 || quality < 0 || quality > 100) {
+        ctx->set_error(ctx, 400, "failed to parse quality \"%s\" for format \"%s\""
+                       "(expecting an  integer between 0 and 100 "
+                       "eg <quality>75</quality>",
+                       cur_node->txt,name);
+        return;
+      }
+    }
+    if ((cur_node = ezxml_child(node,"lossless")) != NULL) {
+      if(cur_node->txt && !strcasecmp(cur_node->txt,"true"))
+        lossless = 1;
+      else if(!cur_node->txt || strcasecmp(cur_node->txt,"false")) {
+        ctx->set_error(ctx,400,"failed to parse webp format %s lossless %s. expecting true or false",
+                       name,cur_node->txt);
+        return;
+      }
+    }
+    if ((cur_node = ezxml_child(node,"method")) != NULL) {
+      char *endptr;
+      method = (int)strtol(cur_node->txt,&endptr,10);
+      if(*endptr != 0 || method < 0 || method > 6) {
+        ctx->set_error(ctx, 400, "failed to parse method \"%s\" for format \"%s\""
+                       "(expecting an  integer between 0 (fastest) and 6 (smallest) "
+                       "eg <method>4</method>",
+                       cur_node->txt,name);
+        return;
+      }
+    }
+    format = mapcache_imageio_create_webp_format(ctx->pool,
+             name,quality,lossless,method);
+#else
+    ctx->set_error(ctx, 400, "format \"%s\" cannot be created: webp support is not compiled in", name);
+    return;
+#endif
   } else if(!strcasecmp(type,"MIXED")) {
     mapcache_image_format *transparent=NULL, *opaque=NULL;
     unsigned int alpha_cutoff=255;
@@ -573,6 +644,8 @@ void parseCache(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config)
     cache = mapcache_cache_multitier_create(ctx);
   } else if(!strcmp(type,"composite")) {
     cache = mapcache_cache_composite_create(ctx);
+  } else if(!strcmp(type,"shm_lru")) {
+    cache = mapcache_cache_shm_lru_create(ctx);
   } else if(!strcmp(type,"rest")) {
     cache = mapcache_cache_rest_create(ctx);
   } else if(!strcmp(type,"s3")) {
@@ -622,6 +695,41 @@ void parseCache(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config)
       return;
     }
   }
+  if ((cur_node = ezxml_child(node,"write_behind")) != NULL) {
+    ezxml_t wb_node;
+    char *endptr;
+    double flush_interval = 1.0;
+    long batch_size = 256;
+    long megabytes = 32;
+    if ((wb_node = ezxml_child(cur_node,"flush_interval")) != NULL) {
+      flush_interval = strtod(wb_node->txt,&endptr);
+      if(*endptr != 0 || flush_interval <= 0) {
+        ctx->set_error(ctx,400,"cache (%s): failed to parse <write_behind> flush_interval \"%s\". Expecting a positive number of seconds",cache->name,wb_node->txt);
+        return;
+      }
+    }
+    if ((wb_node = ezxml_child(cur_node,"batch_size")) != NULL) {
+      batch_size = strtol(wb_node->txt,&endptr,10);
+      if(*endptr != 0 || batch_size < 1) {
+        ctx->set_error(ctx,400,"cache (%s): failed to parse <write_behind> batch_size \"%s\". Expecting a positive number of tiles",cache->name,wb_node->txt);
+        return;
+      }
+    }
+    if ((wb_node = ezxml_child(cur_node,"max_size")) != NULL) {
+      megabytes = strtol(wb_node->txt,&endptr,10);
+      if(*endptr != 0 || megabytes < 1) {
+        ctx->set_error(ctx,400,"cache (%s): failed to parse <write_behind> max_size \"%s\". Expecting a size in megabytes",cache->name,wb_node->txt);
+        return;
+      }
+    }
+    cache->write_behind = mapcache_write_behind_create(ctx->pool, cache, (apr_interval_time_t)(flush_interval * 1000000),
+                          (int)batch_size, (apr_size_t)megabytes * 1024 * 1024);
+    if(!cache->write_behind) {
+      ctx->set_error(ctx,400,"cache (%s): failed to create write-behind queue (<write_behind> requires thread support)",cache->name);
+      return;
+    }
+    config->write_behind++;
+  }
 
 
   cache->configuration_parse_xml(ctx,node,cache,config);
@@ -873,6 +981,16 @@ void parseTileset(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config)
     tileset->_cache = cache;
   }
 
+  if ((cur_node = ezxml_child(node,"transcode_cache")) != NULL) {
+    mapcache_cache *cache = mapcache_configuration_get_cache(config, cur_node->txt);
+    if(!cache) {
+      ctx->set_error(ctx, 400, "tileset \"%s\" references transcode cache \"%s\","
+                     " but it is not configured", name, cur_node->txt);
+      return;
+    }
+    tileset->transcode_cache = cache;
+  }
+
   if ((cur_node = ezxml_child(node,"source")) != NULL) {
     mapcache_source *source = mapcache_configuration_get_source(config, cur_node->txt);
     if(!source) {
@@ -972,6 +1090,19 @@ void parseTileset(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config)
       return;
     }
   }
+  if ((cur_node = ezxml_child(node,"stale_while_revalidate")) != NULL) {
+    if(!strcasecmp(cur_node->txt,"true")) {
+      if(!tileset->auto_expire) {
+        ctx->set_error(ctx, 400, "tileset \"%s\": <stale_while_revalidate> requires <auto_expire> to be set", name);
+        return;
+      }
+      tileset->stale_while_revalidate = 1;
+      config->background_refresh++;
+    } else if(strcasecmp(cur_node->txt,"false")) {
+      ctx->set_error(ctx, 400, "failed to parse stale_while_revalidate \"%s\". Expecting true or false",cur_node->txt);
+      return;
+    }
+  }
 
   if ((cur_node = ezxml_child(node,"metabuffer")) != NULL) {
     char *endptr;
@@ -1233,12 +1364,46 @@ void mapcache_configuration_parse_xml(mapcache_context *ctx, const char *filenam
   }
 
   if((node = ezxml_child(doc,"threaded_fetching")) != NULL) {
+    char *threads;
     if(!strcasecmp(node->txt,"true")) {
       config->threaded_fetching = 1;
     } else if(strcasecmp(node->txt,"false")) {
       ctx->set_error(ctx, 400, "failed to parse threaded_fetching \"%s\". Expecting true or false",node->txt);
       return;
     }
+    if((threads = (char*)ezxml_attr(node,"threads")) != NULL) {
+      char *endptr;
+      config->fetching_threads = (int)strtol(threads,&endptr,10);
+      if(*endptr != 0 || config->fetching_threads < 1) {
+        ctx->set_error(ctx, 400, "failed to parse threaded_fetching threads \"%s\". Expecting a positive integer",threads);
+        return;
+      }
+    }
+  }
+
+  if((node = ezxml_child(doc,"decoded_image_cache")) != NULL) {
+    char *endptr;
+    long megabytes = strtol(node->txt,&endptr,10);
+    if(*endptr != 0 || megabytes < 0) {
+      ctx->set_error(ctx, 400, "failed to parse decoded_image_cache \"%s\". Expecting a size in megabytes",node->txt);
+      return;
+    }
+    if(megabytes > 0) {
+      config->image_cache = mapcache_image_cache_create(ctx->pool, (apr_size_t)megabytes * 1024 * 1024);
+      if(!config->image_cache) {
+        ctx->set_error(ctx, 500, "failed to create decoded image cache");
+        return;
+      }
+    }
+  }
+
+  if((node = ezxml_child(doc,"http_engine")) != NULL) {
+    if(!strcasecmp(node->txt,"true")) {
+      config->http_engine = 1;
+    } else if(strcasecmp(node->txt,"false")) {
+      ctx->set_error(ctx, 400, "failed to parse http_engine \"%s\". Expecting true or false",node->txt);
+      return;
+    }
   }
 
   if((node = ezxml_child(doc,"log_level")) != NULL) {
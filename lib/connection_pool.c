@@ -32,6 +32,7 @@
 struct mapcache_connection_pool {
     apr_pool_t *server_pool;
     apr_reslist_t *connexions;
+    void *http_share;
 };
 
 
@@ -78,6 +79,11 @@ apr_status_t mapcache_connection_pool_create(mapcache_connection_pool **cp, apr_
   apr_status_t rv;
   *cp = apr_pcalloc(server_pool, sizeof(mapcache_connection_pool));
   (*cp)->server_pool = server_pool;
+  /* created first, so that it outlives the pooled curl handles using it. Not fatal, the
+   * handles then each keep their own dns cache and tls sessions */
+  if(mapcache_http_share_create(&(*cp)->http_share, server_pool) != APR_SUCCESS) {
+    (*cp)->http_share = NULL;
+  }
   rv = apr_reslist_create(&((*cp)->connexions), 1, 5, 1024, 60*1000000,
       mapcache_connection_container_creator,
       mapcache_connection_container_destructor,
@@ -191,3 +197,6 @@ void mapcache_connection_pool_release_connection(mapcache_context *ctx, mapcache
   }
 }
 
+void* mapcache_connection_pool_get_http_share(mapcache_connection_pool *cp) {
+  return cp->http_share;
+}
@@ -29,22 +29,10 @@
  *****************************************************************************/
 
 #include <apr_strings.h>
+#include <apr_date.h>
 #include "mapcache.h"
 #if APR_HAS_THREADS
-#include "apu_version.h"
-
-#if (APU_MAJOR_VERSION <= 1 && APU_MINOR_VERSION <= 3)
-#define USE_THREADPOOL 0
-#else
-#define USE_THREADPOOL 1
-#endif
-
-/* use a thread pool if using 1.3.12 or higher apu */
-#if !USE_THREADPOOL
 #include <apr_thread_proc.h>
-#else
-#include <apr_thread_pool.h>
-#endif
 
 typedef struct {
   mapcache_tile *tile;
@@ -56,12 +44,16 @@ static void* APR_THREAD_FUNC _thread_get_tile(apr_thread_t *thread, void *data)
 {
   _thread_tile* t = (_thread_tile*)data;
   mapcache_tileset_tile_get(t->ctx, t->tile);
-#if !USE_THREADPOOL
   apr_thread_exit(thread, APR_SUCCESS);
-#endif
   return NULL;
 }
 
+static void _worker_get_tile(void *data)
+{
+  _thread_tile* t = (_thread_tile*)data;
+  mapcache_tileset_tile_get(t->ctx, t->tile);
+}
+
 #endif
 
 
@@ -75,11 +67,28 @@ mapcache_http_response *mapcache_http_response_create(apr_pool_t *pool)
   return response;
 }
 
-void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int ntiles)
+/*
+ * look all the tiles up in their caches with batched requests, and
+ * return the ones that still need to go through mapcache_tileset_tile_get()
+ */
+static mapcache_tile** _mapcache_prefetch_cached_tiles(mapcache_context *ctx, mapcache_tile **tiles, int *ntiles)
+{
+  int i,n = 0;
+  int *done = apr_pcalloc(ctx->pool, *ntiles*sizeof(int));
+  mapcache_tile **pending;
+  mapcache_tileset_tile_multi_get_cached(ctx, tiles, *ntiles, done);
+  pending = apr_palloc(ctx->pool, *ntiles*sizeof(mapcache_tile*));
+  for(i=0; i<*ntiles; i++) {
+    if(!done[i]) {
+      pending[n++] = tiles[i];
+    }
+  }
+  *ntiles = n;
+  return pending;
+}
+
+static void _mapcache_fetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int ntiles)
 {
-  apr_thread_t **threads;
-  apr_threadattr_t *thread_attrs;
-  int nthreads;
 #if !APR_HAS_THREADS
   int i;
   for(i=0; i<ntiles; i++) {
@@ -100,11 +109,7 @@ void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int n
 
   /* allocate a thread struct for each tile. Not all will be used */
   thread_tiles = (_thread_tile*)apr_pcalloc(ctx->pool,ntiles*sizeof(_thread_tile));
-#if 1 || !USE_THREADPOOL
   /* use multiple threads, to fetch from multiple metatiles and/or multiple tilesets */
-  apr_threadattr_create(&thread_attrs, ctx->pool);
-  threads = (apr_thread_t**)apr_pcalloc(ctx->pool, ntiles*sizeof(apr_thread_t*));
-  nthreads = 0;
   for(i=0; i<ntiles; i++) {
     int j;
     thread_tiles[i].tile = tiles[i];
@@ -131,70 +136,144 @@ void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int n
     if(thread_tiles[i].launch)
       thread_tiles[i].ctx = ctx->clone(ctx);
   }
-  for(i=0; i<ntiles; i++) {
-    if(!thread_tiles[i].launch) continue; /* skip tiles that have been marked */
-    rv = apr_thread_create(&threads[i], thread_attrs, _thread_get_tile, (void*)&(thread_tiles[i]), thread_tiles[i].ctx->pool);
-    if(rv != APR_SUCCESS) {
-      ctx->set_error(ctx,500, "failed to create thread %d of %d\n",i,ntiles);
-      break;
+
+  if(ctx->worker_pool) {
+    /* hand the jobs over to the process wide worker pool */
+    mapcache_worker_batch *batch = mapcache_worker_batch_create(ctx->worker_pool, ctx->pool);
+    if(!batch) {
+      ctx->set_error(ctx,500, "failed to create worker batch");
+      return;
+    }
+    for(i=0; i<ntiles; i++) {
+      if(!thread_tiles[i].launch) continue;
+      rv = mapcache_worker_pool_push(batch, _worker_get_tile, (void*)&(thread_tiles[i]));
+      if(rv != APR_SUCCESS) {
+        /* the pool is shutting down, fetch the tile ourselves */
+        _worker_get_tile((void*)&(thread_tiles[i]));
+      }
+    }
+    ctx->log(ctx,MAPCACHE_DEBUG,"prefetching %d tiles: worker pool has %d queued jobs and %d of %d busy threads",
+             ntiles, mapcache_worker_pool_queue_depth(ctx->worker_pool),
+             mapcache_worker_pool_busy_count(ctx->worker_pool),
+             mapcache_worker_pool_thread_count(ctx->worker_pool));
+    mapcache_worker_batch_wait(batch);
+  } else {
+    /* no worker pool was set up for this process, spawn a thread per metatile */
+    apr_thread_t **threads;
+    apr_threadattr_t *thread_attrs;
+    apr_threadattr_create(&thread_attrs, ctx->pool);
+    threads = (apr_thread_t**)apr_pcalloc(ctx->pool, ntiles*sizeof(apr_thread_t*));
+    for(i=0; i<ntiles; i++) {
+      if(!thread_tiles[i].launch) continue; /* skip tiles that have been marked */
+      rv = apr_thread_create(&threads[i], thread_attrs, _thread_get_tile, (void*)&(thread_tiles[i]), thread_tiles[i].ctx->pool);
+      if(rv != APR_SUCCESS) {
+        ctx->set_error(ctx,500, "failed to create thread %d of %d\n",i,ntiles);
+        break;
+      }
+    }
+
+    /* wait for launched threads to finish */
+    for(i=0; i<ntiles; i++) {
+      if(!thread_tiles[i].launch || !threads[i]) continue;
+      apr_thread_join(&rv, threads[i]);
+      if(rv != APR_SUCCESS) {
+        ctx->set_error(ctx,500, "thread %d of %d failed on exit\n",i,ntiles);
+      }
     }
-    nthreads++;
   }
 
-  /* wait for launched threads to finish */
   for(i=0; i<ntiles; i++) {
-    if(!thread_tiles[i].launch) continue;
-    apr_thread_join(&rv, threads[i]);
-    if(rv != APR_SUCCESS) {
-      ctx->set_error(ctx,500, "thread %d of %d failed on exit\n",i,ntiles);
-    }
-    if(GC_HAS_ERROR(thread_tiles[i].ctx)) {
+    if(thread_tiles[i].launch && GC_HAS_ERROR(thread_tiles[i].ctx)) {
       /* transfer error message from child thread to main context */
       ctx->set_error(ctx,thread_tiles[i].ctx->get_error(thread_tiles[i].ctx),
                      thread_tiles[i].ctx->get_error_message(thread_tiles[i].ctx));
     }
   }
+  GC_CHECK_ERROR(ctx);
   for(i=0; i<ntiles; i++) {
     /* fetch the tiles that did not get a thread launched for them */
     if(thread_tiles[i].launch) continue;
     mapcache_tileset_tile_get(ctx, tiles[i]);
     GC_CHECK_ERROR(ctx);
   }
-#else
-  /* experimental version using a threadpool, disabled for stability reasons */
-  apr_thread_pool_t *thread_pool;
-  apr_thread_pool_create(&thread_pool,2,ctx->config->download_threads,ctx->pool);
-  for(i=0; i<ntiles; i++) {
-    ctx->log(ctx,MAPCACHE_DEBUG,"starting thread for tile %s",tiles[i]->tileset->name);
-    thread_tiles[i].tile = tiles[i];
-    thread_tiles[i].ctx = ctx->clone(ctx);
-    rv = apr_thread_pool_push(thread_pool,_thread_get_tile,(void*)&(thread_tiles[i]), 0,NULL);
-    if(rv != APR_SUCCESS) {
-      ctx->set_error(ctx,500, "failed to push thread %d of %d in thread pool\n",i,ntiles);
-      break;
-    }
+#endif
+
+}
+
+void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int ntiles)
+{
+  if(ntiles > 1) {
+    /* serve what we can with batched cache requests before fetching the rest one by one */
+    tiles = _mapcache_prefetch_cached_tiles(ctx, tiles, &ntiles);
+    GC_CHECK_ERROR(ctx);
+    if(!ntiles) return;
   }
-  GC_CHECK_ERROR(ctx);
-  while(apr_thread_pool_tasks_run_count(thread_pool) != ntiles || apr_thread_pool_busy_count(thread_pool)>0)
-    apr_sleep(10000);
-  apr_thread_pool_destroy(thread_pool);
-  for(i=0; i<ntiles; i++) {
-    if(GC_HAS_ERROR(thread_tiles[i].ctx)) {
-      ctx->set_error(ctx,thread_tiles[i].ctx->get_error(thread_tiles[i].ctx),
-                     thread_tiles[i].ctx->get_error_message(thread_tiles[i].ctx));
+  _mapcache_fetch_tiles(ctx, tiles, ntiles);
+}
+
+/*
+ * identify the version of a tile served at a given url by the size of its encoded
+ * data and its modification time, which is only meaningful if the cache keeps one
+ */
+static char* _mapcache_core_etag(mapcache_context *ctx, apr_size_t size, apr_time_t mtime)
+{
+  return apr_psprintf(ctx->pool, "\"%" APR_UINT64_T_HEX_FMT "-%" APR_UINT64_T_HEX_FMT "\"",
+                      (apr_uint64_t)size, (apr_uint64_t)mtime);
+}
+
+/*
+ * does the client already have the version of the resource identified by etag and mtime ?
+ */
+static int _mapcache_core_not_modified(mapcache_context *ctx, const char *etag, apr_time_t mtime)
+{
+  const char *header;
+  if(!ctx->headers_in) {
+    return MAPCACHE_FALSE;
+  }
+  if((header = apr_table_get(ctx->headers_in, "If-None-Match")) != NULL) {
+    /* If-Modified-Since is to be ignored when If-None-Match is present */
+    return (!strcmp(header, "*") || strstr(header, etag))?MAPCACHE_TRUE:MAPCACHE_FALSE;
+  }
+  if((header = apr_table_get(ctx->headers_in, "If-Modified-Since")) != NULL) {
+    apr_time_t ims = apr_date_parse_http(header);
+    if(ims != APR_DATE_BAD && apr_time_sec(mtime) <= apr_time_sec(ims)) {
+      return MAPCACHE_TRUE;
     }
   }
-#endif
+  return MAPCACHE_FALSE;
+}
 
-#endif
+static void _mapcache_core_set_expires(mapcache_context *ctx, mapcache_http_response *response, int expires)
+{
+  char *timestr;
+  apr_time_t now = apr_time_now();
+  apr_time_t additional = apr_time_from_sec(expires);
+  apr_time_t texpires = now + additional;
+  apr_table_set(response->headers, "Cache-Control",apr_psprintf(ctx->pool, "max-age=%d", expires));
+  timestr = apr_palloc(ctx->pool, APR_RFC822_DATE_LEN);
+  apr_rfc822_date(timestr, texpires);
+  apr_table_setn(response->headers, "Expires", timestr);
+}
 
+/*
+ * should the tile be served in the given format through its tileset's transcode cache
+ */
+static int _mapcache_core_transcodes(mapcache_tile *tile, mapcache_image_format *format)
+{
+  mapcache_tileset *tileset = tile->tileset;
+  if(!tileset->transcode_cache || !tileset->format || format == tileset->format) {
+    return MAPCACHE_FALSE;
+  }
+  if(format->type == GC_RAW || mapcache_imageio_is_raw_tileset(tileset)) {
+    return MAPCACHE_FALSE;
+  }
+  return MAPCACHE_TRUE;
 }
 
 mapcache_http_response *mapcache_core_get_tile(mapcache_context *ctx, mapcache_request_get_tile *req_tile)
 {
   int expires = 0;
   mapcache_http_response *response;
-  char *timestr;
   mapcache_image *base;
   mapcache_image_format *format;
   mapcache_image_format_type t;
@@ -214,6 +293,32 @@ mapcache_http_response *mapcache_core_get_tile(mapcache_context *ctx, mapcache_r
     req_tile->tiles[0]->allow_redirect = 1;
   }
 
+  if(ctx->supports_sendfile && req_tile->ntiles == 1 &&
+      !(req_tile->image_request.format && _mapcache_core_transcodes(req_tile->tiles[0], req_tile->image_request.format))) {
+    /* the encoded tile will be the response body */
+    req_tile->tiles[0]->allow_file = 1;
+  }
+
+  if(req_tile->ntiles == 1 && ctx->headers_in &&
+      (apr_table_get(ctx->headers_in, "If-None-Match") || apr_table_get(ctx->headers_in, "If-Modified-Since"))) {
+    /* conditional request: check if the client is up to date without loading the tile data if the cache allows it */
+    mapcache_tile *tile = req_tile->tiles[0];
+    if(mapcache_tileset_tile_stat(ctx, tile) == MAPCACHE_SUCCESS) {
+      char *etag = _mapcache_core_etag(ctx, tile->encoded_size, tile->mtime);
+      if(_mapcache_core_not_modified(ctx, etag, tile->mtime)) {
+        response->code = 304;
+        response->mtime = tile->mtime;
+        apr_table_set(response->headers, "ETag", etag);
+        if(tile->expires) {
+          _mapcache_core_set_expires(ctx, response, tile->expires);
+        }
+        return response;
+      }
+    }
+    /* fall back to the full lookup */
+    ctx->clear_errors(ctx);
+  }
+
   mapcache_prefetch_tiles(ctx,req_tile->tiles,req_tile->ntiles);
   if(GC_HAS_ERROR(ctx))
     return NULL;
@@ -302,7 +407,11 @@ mapcache_http_response *mapcache_core_get_tile(mapcache_context *ctx, mapcache_r
           format = ctx->config->default_image_format; /* this one is always defined */
         }
       }
-      response->data = format->write(ctx, base, format);
+      if(req_tile->ntiles == 1 && _mapcache_core_transcodes(req_tile->tiles[0], format)) {
+        response->data = mapcache_tileset_tile_transcode(ctx, req_tile->tiles[0], format);
+      } else {
+        response->data = format->write(ctx, base, format);
+      }
       if(GC_HAS_ERROR(ctx)) {
         return NULL;
       }
@@ -327,6 +436,13 @@ mapcache_http_response *mapcache_core_get_tile(mapcache_context *ctx, mapcache_r
         format = ctx->config->default_image_format; /* this one is always defined */
       }
     }
+    if(req_tile->ntiles == 1 && !req_tile->tiles[0]->nodata && _mapcache_core_transcodes(req_tile->tiles[0], format)) {
+      /* the client asked for another format than the one the tile is stored in */
+      response->data = mapcache_tileset_tile_transcode(ctx, req_tile->tiles[0], format);
+      if(GC_HAS_ERROR(ctx)) {
+        return NULL;
+      }
+    }
   }
 
   /* compute the content-type */
@@ -338,17 +454,26 @@ mapcache_http_response *mapcache_core_get_tile(mapcache_context *ctx, mapcache_r
       apr_table_set(response->headers,"Content-Type","image/png");
     else if(t == GC_JPEG)
       apr_table_set(response->headers,"Content-Type","image/jpeg");
+    else if(t == GC_WEBP)
+      apr_table_set(response->headers,"Content-Type","image/webp");
   }
 
   /* compute expiry headers */
   if(expires) {
-    apr_time_t now = apr_time_now();
-    apr_time_t additional = apr_time_from_sec(expires);
-    apr_time_t texpires = now + additional;
-    apr_table_set(response->headers, "Cache-Control",apr_psprintf(ctx->pool, "max-age=%d", expires));
-    timestr = apr_palloc(ctx->pool, APR_RFC822_DATE_LEN);
-    apr_rfc822_date(timestr, texpires);
-    apr_table_setn(response->headers, "Expires", timestr);
+    _mapcache_core_set_expires(ctx, response, expires);
+  }
+
+  if(req_tile->ntiles == 1 && response->mtime && response->data) {
+    /* the size of the tile as stored, to match the etag computed from mapcache_tileset_tile_stat() */
+    mapcache_tile *tile = req_tile->tiles[0];
+    char *etag = _mapcache_core_etag(ctx, tile->encoded_data ? tile->encoded_data->size : response->data->size,
+                                     response->mtime);
+    apr_table_set(response->headers, "ETag", etag);
+    if(_mapcache_core_not_modified(ctx, etag, response->mtime)) {
+      /* the tile was not up to date or the cache could not tell us without loading it */
+      response->code = 304;
+      response->data = NULL;
+    }
   }
 
   return response;
@@ -520,6 +645,8 @@ mapcache_http_response *mapcache_core_get_map(mapcache_context *ctx, mapcache_re
       apr_table_set(response->headers,"Content-Type","image/png");
     else if(t == GC_JPEG)
       apr_table_set(response->headers,"Content-Type","image/jpeg");
+    else if(t == GC_WEBP)
+      apr_table_set(response->headers,"Content-Type","image/webp");
   }
 
   /* compute expiry headers */
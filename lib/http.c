@@ -33,13 +33,61 @@
 #include <apr_strings.h>
 #include <ctype.h>
 
+#if APR_HAS_THREADS
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#endif
+
 #define MAX_STRING_LEN 10000
 
+#if APR_HAS_THREADS && LIBCURL_VERSION_NUM >= 0x074400
+/* curl_multi_poll() and curl_multi_wakeup() appeared in libcurl 7.68 */
+#define MAPCACHE_HTTP_ENGINE 1
+#endif
+
 struct _header_struct {
   apr_table_t *headers;
-  mapcache_context *ctx;
+  apr_pool_t *pool;
 };
 
+struct mapcache_http_transfer {
+  CURL *curl;
+  /*
+   * the response is collected in a root pool of its own, as it is written to
+   * from the engine thread while the requesting thread keeps on using its pool
+   */
+  apr_pool_t *pool;
+  mapcache_buffer *body;
+  struct _header_struct h;
+  mapcache_buffer *data; /* where the body is handed over to, may be NULL */
+  apr_table_t *headers; /* where the headers are handed over to, may be NULL */
+  CURLcode result;
+  int done; /* the transfer has completed */
+  int finished; /* the response has been handed over */
+  mapcache_http_engine *engine; /* set if the transfer was handed to the engine */
+  mapcache_http_transfer *next;
+
+  /* for transfers of a mapcache_http, see mapcache_http_submit() */
+  struct curl_slist *curl_headers;
+  char error_msg[CURL_ERROR_SIZE];
+  char *url;
+  long *http_code;
+  mapcache_pooled_connection *pc; /* the pooled connection curl belongs to, if any */
+};
+
+#ifdef MAPCACHE_HTTP_ENGINE
+struct mapcache_http_engine {
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *done;
+  apr_thread_t *thread;
+  CURLM *multi;
+  mapcache_http_transfer *queue; /* submitted, not yet handed over to curl */
+  mapcache_http_transfer *active; /* handed over to curl */
+  int shutdown;
+};
+#endif
+
 size_t _mapcache_curl_memory_callback(void *ptr, size_t size, size_t nmemb, void *data)
 {
   mapcache_buffer *buffer = (mapcache_buffer*)data;
@@ -51,15 +99,12 @@ size_t _mapcache_curl_header_callback( void *ptr, size_t size, size_t nmemb,  vo
 {
   char *colonptr;
   struct _header_struct *h = (struct _header_struct*)userdata;
-  char *header = apr_pstrndup(h->ctx->pool,ptr,size*nmemb);
+  char *header = apr_pstrndup(h->pool,ptr,size*nmemb);
   char *endptr = strstr(header,"\r\n");
   if(!endptr) {
     endptr = strstr(header,"\n");
     if(!endptr) {
       /* skip invalid header */
-#ifdef DEBUG
-      h->ctx->log(h->ctx,MAPCACHE_DEBUG,"received header %s with no trailing \\r\\n",header);
-#endif
       return size*nmemb;
     }
   }
@@ -99,14 +144,429 @@ static void _header_replace_str(mapcache_context *ctx, apr_table_t *headers, cha
   *val = value;
 }
 
-void mapcache_http_do_request(mapcache_context *ctx, mapcache_http *req, mapcache_buffer *data, apr_table_t *headers, long *http_code)
+#if APR_HAS_THREADS
+struct mapcache_http_share {
+  CURLSH *share;
+  apr_thread_mutex_t *locks[CURL_LOCK_DATA_LAST];
+};
+
+static void _mapcache_http_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
 {
-  CURL *curl_handle;
-  char error_msg[CURL_ERROR_SIZE];
-  int ret;
-  struct curl_slist *curl_headers=NULL;
-  struct _header_struct h;
-  curl_handle = curl_easy_init();
+  struct mapcache_http_share *s = (struct mapcache_http_share*)userptr;
+  apr_thread_mutex_lock(s->locks[data]);
+}
+
+static void _mapcache_http_share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+  struct mapcache_http_share *s = (struct mapcache_http_share*)userptr;
+  apr_thread_mutex_unlock(s->locks[data]);
+}
+#else
+struct mapcache_http_share {
+  CURLSH *share;
+};
+#endif
+
+static apr_status_t _mapcache_http_share_cleanup(void *data)
+{
+  struct mapcache_http_share *s = (struct mapcache_http_share*)data;
+  curl_share_cleanup(s->share);
+  return APR_SUCCESS;
+}
+
+apr_status_t mapcache_http_share_create(void **share, apr_pool_t *pool)
+{
+  struct mapcache_http_share *s = apr_pcalloc(pool, sizeof(struct mapcache_http_share));
+#if APR_HAS_THREADS
+  int i;
+  for(i=0; i<CURL_LOCK_DATA_LAST; i++) {
+    apr_status_t rv = apr_thread_mutex_create(&s->locks[i], APR_THREAD_MUTEX_DEFAULT, pool);
+    if(rv != APR_SUCCESS) {
+      return rv;
+    }
+  }
+#endif
+  *share = NULL;
+  curl_global_init(CURL_GLOBAL_ALL);
+  s->share = curl_share_init();
+  if(!s->share) {
+    return APR_EGENERAL;
+  }
+#if APR_HAS_THREADS
+  curl_share_setopt(s->share, CURLSHOPT_LOCKFUNC, _mapcache_http_share_lock);
+  curl_share_setopt(s->share, CURLSHOPT_UNLOCKFUNC, _mapcache_http_share_unlock);
+  curl_share_setopt(s->share, CURLSHOPT_USERDATA, s);
+#endif
+  curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+  /*
+   * an easy handle added to a multi handle uses the connection cache of the multi, which
+   * mapcache_http_transfer_await_all() throws away after each batch. A shared connection
+   * cache outlives it
+   */
+  curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+  apr_pool_cleanup_register(pool, s, _mapcache_http_share_cleanup, apr_pool_cleanup_null);
+  *share = s;
+  return APR_SUCCESS;
+}
+
+void mapcache_http_share_attach(void *share, void *curl)
+{
+  curl_easy_setopt((CURL*)curl, CURLOPT_SHARE, ((struct mapcache_http_share*)share)->share);
+}
+
+static void _mapcache_http_connection_constructor(mapcache_context *ctx, void **conn_, void *params)
+{
+  CURL *curl_handle = curl_easy_init();
+  if(!curl_handle) {
+    ctx->set_error(ctx,500,"failed to create curl handle");
+    *conn_ = NULL;
+    return;
+  }
+  *conn_ = curl_handle;
+}
+
+static void _mapcache_http_connection_destructor(void *conn_)
+{
+  curl_easy_cleanup((CURL*)conn_);
+}
+
+/*
+ * the pooled curl handles keep their connections open, they are keyed by
+ * scheme, host and port so that all the requests to a server share them
+ */
+static char* _mapcache_http_connection_key(mapcache_context *ctx, const char *url)
+{
+  const char *sep = strstr(url,"://"), *host, *end, *at;
+  char *scheme, *hostport, *c, *colon, *bracket;
+  if(!sep) {
+    return apr_pstrcat(ctx->pool,"http:",url,NULL);
+  }
+  scheme = apr_pstrndup(ctx->pool,url,sep-url);
+  host = sep+3;
+  end = host + strcspn(host,"/?#");
+  /* don't key on credentials */
+  at = memchr(host,'@',end-host);
+  if(at) host = at+1;
+  hostport = apr_pstrndup(ctx->pool,host,end-host);
+  for(c=scheme; *c; c++) *c = tolower(*c);
+  for(c=hostport; *c; c++) *c = tolower(*c);
+  colon = strrchr(hostport,':');
+  bracket = strrchr(hostport,']'); /* ipv6 address */
+  if(!colon || (bracket && colon < bracket)) {
+    hostport = apr_pstrcat(ctx->pool,hostport,strcmp(scheme,"https")?":80":":443",NULL);
+  }
+  return apr_pstrcat(ctx->pool,"http:",scheme,"://",hostport,NULL);
+}
+
+static mapcache_pooled_connection* _mapcache_http_get_connection(mapcache_context *ctx, mapcache_http *req)
+{
+  mapcache_pooled_connection *pc;
+  pc = mapcache_connection_pool_get_connection(ctx,_mapcache_http_connection_key(ctx,req->url),
+          _mapcache_http_connection_constructor, _mapcache_http_connection_destructor, NULL);
+  if(!GC_HAS_ERROR(ctx) && pc && pc->connection) {
+    CURL *curl_handle = (CURL*)pc->connection;
+    void *share = mapcache_connection_pool_get_http_share(ctx->connection_pool);
+    /* forgets the options of the previous request, but keeps the open connections */
+    curl_easy_reset(curl_handle);
+    if(share) {
+      mapcache_http_share_attach(share, curl_handle);
+    }
+    curl_easy_setopt(curl_handle, CURLOPT_MAXCONNECTS, (long)req->max_idle_connections);
+#if LIBCURL_VERSION_NUM >= 0x074100
+    if(req->idle_timeout > 0) {
+      curl_easy_setopt(curl_handle, CURLOPT_MAXAGE_CONN, (long)req->idle_timeout);
+    }
+#endif
+  }
+  return pc;
+}
+
+#ifdef MAPCACHE_HTTP_ENGINE
+
+/* must be called with the engine mutex held */
+static void _mapcache_http_engine_transfer_done(mapcache_http_engine *engine, mapcache_http_transfer *t, CURLcode result)
+{
+  mapcache_http_transfer **pt = &engine->active;
+  while(*pt && *pt != t) pt = &(*pt)->next;
+  if(*pt) *pt = t->next;
+  t->result = result;
+  t->done = 1;
+  apr_thread_cond_broadcast(engine->done);
+}
+
+static void* APR_THREAD_FUNC _mapcache_http_engine_thread(apr_thread_t *thread, void *data)
+{
+  mapcache_http_engine *engine = (mapcache_http_engine*)data;
+  apr_thread_mutex_lock(engine->mutex);
+  while(!engine->shutdown) {
+    CURLMsg *msg;
+    int running, msgs_left;
+    /* hand the newly submitted transfers over to curl */
+    while(engine->queue) {
+      mapcache_http_transfer *t = engine->queue;
+      engine->queue = t->next;
+      t->next = engine->active;
+      engine->active = t;
+      curl_easy_setopt(t->curl, CURLOPT_PRIVATE, (void*)t);
+      if(curl_multi_add_handle(engine->multi, t->curl) != CURLM_OK) {
+        _mapcache_http_engine_transfer_done(engine, t, CURLE_FAILED_INIT);
+      }
+    }
+    apr_thread_mutex_unlock(engine->mutex);
+
+    curl_multi_perform(engine->multi, &running);
+    while((msg = curl_multi_info_read(engine->multi, &msgs_left)) != NULL) {
+      mapcache_http_transfer *t;
+      CURLcode result;
+      if(msg->msg != CURLMSG_DONE) continue;
+      result = msg->data.result;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&t);
+      curl_multi_remove_handle(engine->multi, msg->easy_handle);
+      apr_thread_mutex_lock(engine->mutex);
+      _mapcache_http_engine_transfer_done(engine, t, result);
+      apr_thread_mutex_unlock(engine->mutex);
+    }
+    /* sleep until there is network activity or curl_multi_wakeup() is called by mapcache_http_transfer_submit() */
+    curl_multi_poll(engine->multi, NULL, 0, 1000, NULL);
+    apr_thread_mutex_lock(engine->mutex);
+  }
+
+  /* fail whatever is still pending */
+  while(engine->active) {
+    mapcache_http_transfer *t = engine->active;
+    curl_multi_remove_handle(engine->multi, t->curl);
+    _mapcache_http_engine_transfer_done(engine, t, CURLE_ABORTED_BY_CALLBACK);
+  }
+  while(engine->queue) {
+    mapcache_http_transfer *t = engine->queue;
+    engine->queue = t->next;
+    t->result = CURLE_ABORTED_BY_CALLBACK;
+    t->done = 1;
+  }
+  apr_thread_cond_broadcast(engine->done);
+  apr_thread_mutex_unlock(engine->mutex);
+  apr_thread_exit(thread, APR_SUCCESS);
+  return NULL;
+}
+
+static apr_status_t _mapcache_http_engine_cleanup(void *data)
+{
+  mapcache_http_engine *engine = (mapcache_http_engine*)data;
+  apr_status_t rv;
+  apr_thread_mutex_lock(engine->mutex);
+  engine->shutdown = 1;
+  apr_thread_mutex_unlock(engine->mutex);
+  curl_multi_wakeup(engine->multi);
+  apr_thread_join(&rv, engine->thread);
+  curl_multi_cleanup(engine->multi);
+  return APR_SUCCESS;
+}
+
+apr_status_t mapcache_http_engine_create(mapcache_http_engine **engine, apr_pool_t *server_pool)
+{
+  apr_status_t rv;
+  apr_threadattr_t *thread_attrs;
+  mapcache_http_engine *e = apr_pcalloc(server_pool, sizeof(mapcache_http_engine));
+  *engine = NULL;
+  if((rv = apr_thread_mutex_create(&e->mutex, APR_THREAD_MUTEX_DEFAULT, server_pool)) != APR_SUCCESS) {
+    return rv;
+  }
+  if((rv = apr_thread_cond_create(&e->done, server_pool)) != APR_SUCCESS) {
+    return rv;
+  }
+  e->multi = curl_multi_init();
+  if(!e->multi) {
+    return APR_EGENERAL;
+  }
+  /* let transfers to the same host share a single HTTP/2 connection */
+  curl_multi_setopt(e->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  apr_threadattr_create(&thread_attrs, server_pool);
+  rv = apr_thread_create(&e->thread, thread_attrs, _mapcache_http_engine_thread, e, server_pool);
+  if(rv != APR_SUCCESS) {
+    curl_multi_cleanup(e->multi);
+    return rv;
+  }
+  apr_pool_pre_cleanup_register(server_pool, e, _mapcache_http_engine_cleanup);
+  *engine = e;
+  return APR_SUCCESS;
+}
+
+#else
+
+apr_status_t mapcache_http_engine_create(mapcache_http_engine **engine, apr_pool_t *server_pool)
+{
+  *engine = NULL;
+  return APR_ENOTIMPL;
+}
+
+#endif
+
+/* wait for the transfer if it was handed to the engine */
+static void _mapcache_http_transfer_wait(mapcache_http_transfer *t)
+{
+#ifdef MAPCACHE_HTTP_ENGINE
+  if(t->engine) {
+    apr_thread_mutex_lock(t->engine->mutex);
+    while(!t->done) {
+      apr_thread_cond_wait(t->engine->done, t->engine->mutex);
+    }
+    apr_thread_mutex_unlock(t->engine->mutex);
+  }
+#endif
+}
+
+static apr_status_t _mapcache_http_transfer_cleanup(void *data)
+{
+  mapcache_http_transfer *t = (mapcache_http_transfer*)data;
+  /* the engine may still be writing to our pool if the transfer was not awaited */
+  _mapcache_http_transfer_wait(t);
+  apr_pool_destroy(t->pool);
+  return APR_SUCCESS;
+}
+
+mapcache_http_transfer* mapcache_http_transfer_create(mapcache_context *ctx, void *curl, mapcache_buffer *data, apr_table_t *headers)
+{
+  mapcache_http_transfer *t = apr_pcalloc(ctx->pool, sizeof(mapcache_http_transfer));
+  t->curl = curl;
+  t->data = data;
+  t->headers = headers;
+  apr_pool_create(&t->pool, NULL);
+  apr_pool_cleanup_register(ctx->pool, t, _mapcache_http_transfer_cleanup, apr_pool_cleanup_null);
+  t->body = mapcache_buffer_create(data?data->avail:0, t->pool);
+  curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, _mapcache_curl_memory_callback);
+  curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, (void *)t->body);
+  if(headers) {
+    t->h.headers = apr_table_make(t->pool, 5);
+    t->h.pool = t->pool;
+    curl_easy_setopt(t->curl, CURLOPT_HEADERFUNCTION, _mapcache_curl_header_callback);
+    curl_easy_setopt(t->curl, CURLOPT_WRITEHEADER, (void*)(&t->h));
+  }
+  return t;
+}
+
+void mapcache_http_transfer_submit(mapcache_context *ctx, mapcache_http_transfer *t)
+{
+#ifdef MAPCACHE_HTTP_ENGINE
+  mapcache_http_engine *engine = ctx->http_engine;
+  if(!engine || t->done) {
+    return;
+  }
+  /* prefer waiting for a multiplexed connection over opening a new one */
+  curl_easy_setopt(t->curl, CURLOPT_PIPEWAIT, 1L);
+  apr_thread_mutex_lock(engine->mutex);
+  if(engine->shutdown) {
+    /* will be run synchronously when awaited */
+    apr_thread_mutex_unlock(engine->mutex);
+    return;
+  }
+  t->engine = engine;
+  t->next = engine->queue;
+  engine->queue = t;
+  apr_thread_mutex_unlock(engine->mutex);
+  curl_multi_wakeup(engine->multi);
+#endif
+}
+
+void mapcache_http_transfer_await_all(mapcache_context *ctx, mapcache_http_transfer **transfers, int ntransfers)
+{
+  CURLM *multi;
+  CURLMsg *msg;
+  int i, running, msgs_left, nlocal = 0;
+  for(i=0; i<ntransfers; i++) {
+    if(!transfers[i]->engine && !transfers[i]->done) nlocal++;
+  }
+  if(nlocal < 2) {
+    /* handed to the engine, or nothing to run concurrently */
+    return;
+  }
+  multi = curl_multi_init();
+  if(!multi) {
+    /* mapcache_http_transfer_await() will run them one by one */
+    return;
+  }
+  for(i=0; i<ntransfers; i++) {
+    if(transfers[i]->engine || transfers[i]->done) continue;
+    curl_easy_setopt(transfers[i]->curl, CURLOPT_PRIVATE, (void*)transfers[i]);
+    curl_multi_add_handle(multi, transfers[i]->curl);
+  }
+  do {
+    CURLMcode mc = curl_multi_perform(multi, &running);
+    if(mc == CURLM_OK && running) {
+      mc = curl_multi_wait(multi, NULL, 0, 1000, NULL);
+    }
+    if(mc != CURLM_OK) {
+      ctx->log(ctx, MAPCACHE_WARN, "curl multi request failed: %s", curl_multi_strerror(mc));
+      break;
+    }
+  } while(running);
+  while((msg = curl_multi_info_read(multi, &msgs_left)) != NULL) {
+    mapcache_http_transfer *t;
+    if(msg->msg != CURLMSG_DONE) continue;
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&t);
+    t->result = msg->data.result;
+    t->done = 1;
+  }
+  for(i=0; i<ntransfers; i++) {
+    if(transfers[i]->engine) continue;
+    curl_multi_remove_handle(multi, transfers[i]->curl);
+    if(!transfers[i]->done) {
+      transfers[i]->result = CURLE_ABORTED_BY_CALLBACK;
+      transfers[i]->done = 1;
+    }
+  }
+  curl_multi_cleanup(multi);
+}
+
+int mapcache_http_transfer_await(mapcache_context *ctx, mapcache_http_transfer *t)
+{
+  if(t->finished) {
+    return t->result;
+  }
+  if(t->engine) {
+    _mapcache_http_transfer_wait(t);
+  } else if(!t->done) {
+    t->result = curl_easy_perform(t->curl);
+    t->done = 1;
+  }
+  /* hand the response over to the caller's pool */
+  if(t->data && t->body->size) {
+    mapcache_buffer_append(t->data, t->body->size, t->body->buf);
+  }
+  if(t->headers) {
+    const apr_array_header_t *array = apr_table_elts(t->h.headers);
+    apr_table_entry_t *elts = (apr_table_entry_t *) array->elts;
+    int i;
+    for (i = 0; i < array->nelts; i++) {
+      apr_table_set(t->headers, elts[i].key, elts[i].val);
+    }
+  }
+  t->finished = 1;
+  apr_pool_cleanup_run(ctx->pool, t, _mapcache_http_transfer_cleanup);
+  return t->result;
+}
+
+mapcache_http_transfer* mapcache_http_submit(mapcache_context *ctx, mapcache_http *req, mapcache_buffer *data, apr_table_t *headers, long *http_code)
+{
+  CURL *curl_handle = NULL;
+  mapcache_pooled_connection *pc = NULL;
+  mapcache_http_transfer *t;
+  if(ctx->connection_pool && req->max_idle_connections > 0) {
+    pc = _mapcache_http_get_connection(ctx, req);
+    if(GC_HAS_ERROR(ctx)) {
+      /* not fatal, run the request on a connection of its own */
+      ctx->log(ctx, MAPCACHE_WARN, "failed to get a pooled http connection: %s", ctx->get_error_message(ctx));
+      ctx->clear_errors(ctx);
+      pc = NULL;
+    } else {
+      curl_handle = pc->connection;
+    }
+  }
+  if(!curl_handle) {
+    curl_handle = curl_easy_init();
+  }
 
 
   /* specify URL to get */
@@ -114,21 +574,13 @@ void mapcache_http_do_request(mapcache_context *ctx, mapcache_http *req, mapcach
 #ifdef DEBUG
   ctx->log(ctx, MAPCACHE_DEBUG, "curl requesting url %s",req->url);
 #endif
-  /* send all data to this function  */
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, _mapcache_curl_memory_callback);
+  /* the body and headers are collected by the transfer */
+  t = mapcache_http_transfer_create(ctx, curl_handle, data, headers);
+  t->url = req->url;
+  t->http_code = http_code;
+  t->pc = pc;
 
-  /* we pass our mapcache_buffer struct to the callback function */
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)data);
-
-  if(headers != NULL) {
-    /* intercept headers */
-    h.headers = headers;
-    h.ctx=ctx;
-    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, _mapcache_curl_header_callback);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEHEADER, (void*)(&h));
-  }
-
-  curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, error_msg);
+  curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, t->error_msg);
   curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1);
   curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT, req->connection_timeout);
   curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, req->timeout);
@@ -145,13 +597,13 @@ void mapcache_http_do_request(mapcache_context *ctx, mapcache_http *req, mapcach
       if(val && strchr(val,'{') && ctx->headers_in) {
         _header_replace_str(ctx,ctx->headers_in,&val);
       }
-      curl_headers = curl_slist_append(curl_headers, apr_pstrcat(ctx->pool,elts[i].key,": ",val,NULL));
+      t->curl_headers = curl_slist_append(t->curl_headers, apr_pstrcat(ctx->pool,elts[i].key,": ",val,NULL));
     }
   }
   if(!req->headers || !apr_table_get(req->headers,"User-Agent")) {
-    curl_headers = curl_slist_append(curl_headers, "User-Agent: "MAPCACHE_USERAGENT);
+    t->curl_headers = curl_slist_append(t->curl_headers, "User-Agent: "MAPCACHE_USERAGENT);
   }
-  curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, curl_headers);
+  curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, t->curl_headers);
 
   if(req->post_body && req->post_len>0) {
     curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, req->post_body);
@@ -160,18 +612,36 @@ void mapcache_http_do_request(mapcache_context *ctx, mapcache_http *req, mapcach
   if(!http_code)
     curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1);
 
+  mapcache_http_transfer_submit(ctx, t);
+  return t;
+}
+
+void mapcache_http_await(mapcache_context *ctx, mapcache_http_transfer *t)
+{
   /* get it! */
-  ret = curl_easy_perform(curl_handle);
-  if(http_code)
-    curl_easy_getinfo (curl_handle, CURLINFO_RESPONSE_CODE, http_code);
+  int ret = mapcache_http_transfer_await(ctx, t);
+  if(t->http_code)
+    curl_easy_getinfo (t->curl, CURLINFO_RESPONSE_CODE, t->http_code);
 
   if(ret != CURLE_OK) {
-    ctx->set_error(ctx, 502, "curl failed to request url %s ", error_msg);
+    ctx->set_error(ctx, 502, "curl failed to request url %s ", t->error_msg);
  
   }
   /* cleanup curl stuff */
-  curl_slist_free_all(curl_headers);
-  curl_easy_cleanup(curl_handle);
+  curl_slist_free_all(t->curl_headers);
+  if(!t->pc) {
+    curl_easy_cleanup(t->curl);
+  } else if(ret != CURLE_OK) {
+    /* don't keep a connection around that may be in a bad state */
+    mapcache_connection_pool_invalidate_connection(ctx, t->pc);
+  } else {
+    mapcache_connection_pool_release_connection(ctx, t->pc);
+  }
+}
+
+void mapcache_http_do_request(mapcache_context *ctx, mapcache_http *req, mapcache_buffer *data, apr_table_t *headers, long *http_code)
+{
+  mapcache_http_await(ctx, mapcache_http_submit(ctx, req, data, headers, http_code));
 }
 
 void mapcache_http_do_request_with_params(mapcache_context *ctx, mapcache_http *req, apr_table_t *params,
@@ -403,6 +873,28 @@ mapcache_http* mapcache_http_configuration_parse_xml(mapcache_context *ctx, ezxm
     req->timeout = 600;
   }
 
+  if ((http_node = ezxml_child(node,"max_idle_connections")) != NULL) {
+    char *endptr;
+    req->max_idle_connections = (int)strtol(http_node->txt,&endptr,10);
+    if(*endptr != 0 || req->max_idle_connections<0) {
+      ctx->set_error(ctx,400,"invalid <http> <max_idle_connections> \"%s\" (positive integer or 0 expected)",
+                     http_node->txt);
+      return NULL;
+    }
+  } else {
+    req->max_idle_connections = 5;
+  }
+
+  if ((http_node = ezxml_child(node,"idle_timeout")) != NULL) {
+    char *endptr;
+    req->idle_timeout = (int)strtol(http_node->txt,&endptr,10);
+    if(*endptr != 0 || req->idle_timeout<1) {
+      ctx->set_error(ctx,400,"invalid <http> <idle_timeout> \"%s\" (positive integer expected)",
+                     http_node->txt);
+      return NULL;
+    }
+  }
+
   req->headers = apr_table_make(ctx->pool,1);
   if((http_node = ezxml_child(node,"headers")) != NULL) {
     ezxml_t header_node;
@@ -422,6 +914,8 @@ mapcache_http* mapcache_http_clone(mapcache_context *ctx, mapcache_http *orig)
   ret->url = apr_pstrdup(ctx->pool, orig->url);
   ret->connection_timeout = orig->connection_timeout;
   ret->timeout = orig->timeout;
+  ret->max_idle_connections = orig->max_idle_connections;
+  ret->idle_timeout = orig->idle_timeout;
   return ret;
 }
 
@@ -56,19 +56,28 @@ mapcache_image* mapcache_image_create_with_data(mapcache_context *ctx, int width
   return img;
 }
 
+/*
+ * record what a uniform alpha tells about mapcache_image_has_alpha(), whatever the
+ * cutoff it is called with. Only an opaque image qualifies: a transparent one has no
+ * pixel below a cutoff of 0
+ */
+static void _mapcache_image_uniform_alpha(mapcache_image *img, unsigned char alpha)
+{
+  if(alpha == 255) {
+    img->has_alpha = MC_ALPHA_NO;
+  }
+}
+
 int mapcache_image_has_alpha(mapcache_image *img, unsigned int cutoff)
 {
-  size_t i,j;
+  size_t i;
   if(img->has_alpha == MC_ALPHA_UNKNOWN) {
-    unsigned char *ptr, *rptr = img->data;
+    const mapcache_image_kernels *k = mapcache_image_kernels_get();
+    unsigned char *rptr = img->data;
     for(i=0; i<img->h; i++) {
-      ptr = rptr;
-      for(j=0; j<img->w; j++) {
-        if(ptr[3]<(unsigned char)cutoff) {
-          img->has_alpha = MC_ALPHA_YES;
-          return 1;
-        }
-        ptr += 4;
+      if(k->alpha_below(rptr, img->w, (unsigned char)cutoff)) {
+        img->has_alpha = MC_ALPHA_YES;
+        return 1;
       }
       rptr += img->stride;
     }
@@ -90,14 +99,19 @@ void mapcache_image_merge(mapcache_context *ctx, mapcache_image *base, mapcache_
   pixman_image_t *bi;
   pixman_transform_t transform;
 #else
-  int i,j;
-  unsigned char *browptr, *orowptr, *bptr, *optr;
+  int i;
+  unsigned char *browptr, *orowptr;
+  const mapcache_image_kernels *k;
 #endif
 
   if(base->w < overlay->w || base->h < overlay->h) {
     ctx->set_error(ctx, 500, "attempting to merge an larger image onto another");
     return;
   }
+  /* whatever was known about the base image does not hold anymore */
+  base->is_blank = MC_EMPTY_UNKNOWN;
+  base->has_alpha = MC_ALPHA_UNKNOWN;
+  base->palette = NULL;
   
   starti = (base->h - overlay->h)/2;
   startj = (base->w - overlay->w)/2;
@@ -120,87 +134,17 @@ void mapcache_image_merge(mapcache_context *ctx, mapcache_image *base, mapcache_
 #else
 
 
+  k = mapcache_image_kernels_get();
   browptr = base->data + starti * base->stride + startj*4;
   orowptr = overlay->data;
   for(i=0; i<overlay->h; i++) {
-    bptr = browptr;
-    optr = orowptr;
-    for(j=0; j<overlay->w; j++) {
-      if(optr[3]) { /* if overlay is not completely transparent */
-        if(optr[3] == 255) {
-          bptr[0]=optr[0];
-          bptr[1]=optr[1];
-          bptr[2]=optr[2];
-          bptr[3]=optr[3];
-        } else if(optr[3] != 0) {
-          unsigned int br = bptr[0];
-          unsigned int bg = bptr[1];
-          unsigned int bb = bptr[2];
-          unsigned int ba = bptr[3];
-          unsigned int or = optr[0];
-          unsigned int og = optr[1];
-          unsigned int ob = optr[2];
-          unsigned int oa = optr[3];
-          bptr[0] = (unsigned char)(or + (((255-oa)*br)>>8));
-          bptr[1] = (unsigned char)(og + (((255-oa)*bg)>>8));
-          bptr[2] = (unsigned char)(ob + (((255-oa)*bb)>>8));
-
-          bptr[3] = oa+((ba*(255-oa))>>8);
-        }
-      }
-      bptr+=4;
-      optr+=4;
-    }
+    k->over(browptr, orowptr, overlay->w);
     browptr += base->stride;
     orowptr += overlay->stride;
   }
 #endif
 }
 
-#ifndef USE_PIXMAN
-#ifndef _WIN32
-static inline void bilinear_pixel(mapcache_image *img, double x, double y, unsigned char *dst)
-{
-#else
-static __inline void bilinear_pixel(mapcache_image *img, double x, double y, unsigned char *dst)
-{
-#endif
-
-  int px,py;
-  int px1, py1;
-  unsigned char *p1, *p2, *p3, *p4;
-  float fx, fy, fx1, fy1;
-  int w1, w2, w3, w4;
-  px = (int)x;
-  py = (int)y;
-
-  px1 = (px==(img->w-1))?(px):(px+1);
-  py1 = (py==(img->h-1))?(py):(py+1);
-
-  p1 = &img->data[py*img->stride+px*4];
-  p2 = &img->data[py*img->stride+px1*4];
-  p3 = &img->data[py1*img->stride+px*4];
-  p4 = &img->data[py1*img->stride+px1*4];
-
-  // Calculate the weights for each pixel
-  fx = x - px;
-  fy = y - py;
-  fx1 = 1.0f - fx;
-  fy1 = 1.0f - fy;
-
-  w1 = fx1 * fy1 * 256.0f;
-  w2 = fx  * fy1 * 256.0f;
-  w3 = fx1 * fy  * 256.0f;
-  w4 = fx  * fy  * 256.0f;
-
-  // Calculate the weighted sum of pixels (for each color channel)
-  dst[0] = (p1[0] * w1 + p2[0] * w2 + p3[0] * w3 + p4[0] * w4) >> 8;
-  dst[1] = (p1[1] * w1 + p2[1] * w2 + p3[1] * w3 + p4[1] * w4) >> 8;
-  dst[2] = (p1[2] * w1 + p2[2] * w2 + p3[2] * w3 + p4[2] * w4) >> 8;
-  dst[3] = (p1[3] * w1 + p2[3] * w2 + p3[3] * w3 + p4[3] * w4) >> 8;
-}
-#endif
-
 void mapcache_image_copy_resampled_nearest(mapcache_context *ctx, mapcache_image *src, mapcache_image *dst,
     double off_x, double off_y, double scale_x, double scale_y)
 {
@@ -221,14 +165,20 @@ void mapcache_image_copy_resampled_nearest(mapcache_context *ctx, mapcache_image
 #else
   int dstx,dsty;
   unsigned char *dstrowptr = dst->data;
+  /* the source column of each destination column, -1 if outside of the source */
+  int *srcxs = apr_palloc(ctx->pool, dst->w*sizeof(int));
+  for(dstx=0; dstx<dst->w; dstx++) {
+    int srcx = (int)(((dstx-off_x)/scale_x)+0.5);
+    srcxs[dstx] = (srcx >= 0 && srcx < src->w)?srcx:-1;
+  }
   for(dsty=0; dsty<dst->h; dsty++) {
     int *dstptr = (int*)dstrowptr;
     int srcy = (int)(((dsty-off_y)/scale_y)+0.5);
     if(srcy >= 0 && srcy < src->h) {
+      int *srcrowptr = (int*)&(src->data[srcy*src->stride]);
       for(dstx=0; dstx<dst->w; dstx++) {
-        int srcx = (int)(((dstx-off_x)/scale_x)+0.5);
-        if(srcx >= 0 && srcx < src->w) {
-          *dstptr = *((int*)&(src->data[srcy*src->stride+srcx*4]));
+        if(srcxs[dstx] >= 0) {
+          *dstptr = srcrowptr[srcxs[dstx]];
         }
         dstptr ++;
       }
@@ -261,16 +211,43 @@ void mapcache_image_copy_resampled_bilinear(mapcache_context *ctx, mapcache_imag
 #else
   int dstx,dsty;
   unsigned char *dstrowptr = dst->data;
+  const mapcache_image_kernels *k = mapcache_image_kernels_get();
+  /*
+   * the source pixels and fixed point weights only depend on the destination
+   * column, compute them once for all the rows
+   */
+  int *x0 = apr_palloc(ctx->pool, dst->w*sizeof(int));
+  int *x1 = apr_palloc(ctx->pool, dst->w*sizeof(int));
+  unsigned short *fx = apr_palloc(ctx->pool, dst->w*sizeof(unsigned short));
+  char *valid = apr_palloc(ctx->pool, dst->w);
+  for(dstx=0; dstx<dst->w; dstx++) {
+    double srcx = (dstx-off_x)/scale_x;
+    valid[dstx] = (srcx >= 0 && srcx < src->w);
+    if(valid[dstx]) {
+      int px = (int)srcx;
+      x0[dstx] = px*4;
+      x1[dstx] = (px==(src->w-1))?(px*4):(px*4+4);
+      fx[dstx] = (unsigned short)((srcx-px)*256.0);
+    }
+  }
   for(dsty=0; dsty<dst->h; dsty++) {
-    unsigned char *dstptr = dstrowptr;
     double srcy = (dsty-off_y)/scale_y;
     if(srcy >= 0 && srcy < src->h) {
-      for(dstx=0; dstx<dst->w; dstx++) {
-        double srcx = (dstx-off_x)/scale_x;
-        if(srcx >= 0 && srcx < src->w) {
-          bilinear_pixel(src,srcx,srcy,dstptr);
+      int py = (int)srcy;
+      int py1 = (py==(src->h-1))?(py):(py+1);
+      unsigned int fy = (unsigned int)((srcy-py)*256.0);
+      unsigned char *r0 = src->data + py*src->stride;
+      unsigned char *r1 = src->data + py1*src->stride;
+      dstx = 0;
+      while(dstx<dst->w) {
+        /* interpolate each run of destination pixels that fall inside the source */
+        int start;
+        while(dstx<dst->w && !valid[dstx]) dstx++;
+        start = dstx;
+        while(dstx<dst->w && valid[dstx]) dstx++;
+        if(dstx > start) {
+          k->bilinear(dstrowptr+start*4, r0, r1, x0+start, x1+start, fx+start, fy, dstx-start);
         }
-        dstptr += 4;
       }
     }
     dstrowptr += dst->stride;
@@ -285,6 +262,7 @@ void mapcache_image_metatile_split(mapcache_context *ctx, mapcache_metatile *mt)
     /* the tileset has a format defined, we will use it to encode the data */
     mapcache_image *tileimg;
     mapcache_image *metatile;
+    mapcache_palette *palette = NULL;
     int i,j;
     int sx,sy;
 
@@ -310,6 +288,11 @@ void mapcache_image_metatile_split(mapcache_context *ctx, mapcache_metatile *mt)
       ctx->set_error(ctx, 500, "image size does not correspond to metatile size");
       return;
     }
+    if(!mt->map.tileset->watermark) {
+      /* quantize the whole metatile once instead of each of its tiles */
+      palette = mapcache_imageio_png_q_shared_palette(ctx, mt->map.tileset->format, metatile);
+      GC_CHECK_ERROR(ctx);
+    }
 
     for(i=0; i<mt->metasize_x; i++) {
       for(j=0; j<mt->metasize_y; j++) {
@@ -339,6 +322,14 @@ void mapcache_image_metatile_split(mapcache_context *ctx, mapcache_metatile *mt)
             return;
         }
         tileimg->data = &(metatile->data[sy*metatile->stride + 4 * sx]);
+        tileimg->palette = palette;
+        /* a blank or opaque metatile only has blank or opaque tiles */
+        if(metatile->is_blank == MC_EMPTY_YES) {
+          tileimg->is_blank = MC_EMPTY_YES;
+        }
+        if(metatile->has_alpha == MC_ALPHA_NO) {
+          tileimg->has_alpha = MC_ALPHA_NO;
+        }
         if(mt->map.tileset->watermark) {
           mapcache_image_merge(ctx,tileimg,mt->map.tileset->watermark);
           GC_CHECK_ERROR(ctx);
@@ -364,18 +355,17 @@ void mapcache_image_metatile_split(mapcache_context *ctx, mapcache_metatile *mt)
 int mapcache_image_blank_color(mapcache_image* image)
 {
   if(image->is_blank == MC_EMPTY_UNKNOWN) {
-    int* pixptr;
-    int r,c;
+    const mapcache_image_kernels *k = mapcache_image_kernels_get();
+    unsigned int color = *((unsigned int*)image->data);
+    int r;
     for(r=0; r<image->h; r++) {
-      pixptr = (int*)(image->data + r * image->stride);
-      for(c=0; c<image->w; c++) {
-        if(*(pixptr++) != *((int*)image->data)) {
-          image->is_blank = MC_EMPTY_NO;
-          return MAPCACHE_FALSE;
-        }
+      if(!k->uniform(image->data + r * image->stride, image->w, color)) {
+        image->is_blank = MC_EMPTY_NO;
+        return MAPCACHE_FALSE;
       }
     }
     image->is_blank = MC_EMPTY_YES;
+    _mapcache_image_uniform_alpha(image, image->data[3]);
   }
   assert(image->is_blank != MC_EMPTY_UNKNOWN);
   if(image->is_blank == MC_EMPTY_YES)
@@ -402,6 +392,10 @@ void mapcache_image_fill(mapcache_context *ctx, mapcache_image *image, const uns
     }
   }
 #endif
+  image->is_blank = MC_EMPTY_YES;
+  image->has_alpha = MC_ALPHA_UNKNOWN;
+  image->palette = NULL;
+  _mapcache_image_uniform_alpha(image, fill_color[3]);
 }
 /* vim: ts=2 sts=2 et sw=2
 */
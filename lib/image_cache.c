@@ -0,0 +1,198 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache per-process cache of decoded tile images
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_hash.h>
+#include <string.h>
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+
+typedef struct _image_cache_entry _image_cache_entry;
+
+struct _image_cache_entry {
+  char *key;
+  apr_time_t mtime;
+  int w, h;
+  unsigned char *data; /* w*h*4 bytes, rows are not padded */
+  _image_cache_entry *prev; /* more recently used */
+  _image_cache_entry *next; /* less recently used */
+};
+
+struct mapcache_image_cache {
+  apr_pool_t *pool;
+#if APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+  apr_hash_t *entries;
+  _image_cache_entry *head; /* most recently used */
+  _image_cache_entry *tail; /* least recently used, evicted first */
+  apr_size_t size; /* bytes of pixel data currently held */
+  apr_size_t max_size;
+};
+
+static void _image_cache_lock(mapcache_image_cache *cache)
+{
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(cache->mutex);
+#endif
+}
+
+static void _image_cache_unlock(mapcache_image_cache *cache)
+{
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(cache->mutex);
+#endif
+}
+
+static void _image_cache_unlink(mapcache_image_cache *cache, _image_cache_entry *e)
+{
+  if(e->prev) e->prev->next = e->next;
+  else cache->head = e->next;
+  if(e->next) e->next->prev = e->prev;
+  else cache->tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void _image_cache_push_front(mapcache_image_cache *cache, _image_cache_entry *e)
+{
+  e->prev = NULL;
+  e->next = cache->head;
+  if(cache->head) cache->head->prev = e;
+  cache->head = e;
+  if(!cache->tail) cache->tail = e;
+}
+
+/* must be called with the mutex held */
+static void _image_cache_remove(mapcache_image_cache *cache, _image_cache_entry *e)
+{
+  _image_cache_unlink(cache, e);
+  apr_hash_set(cache->entries, e->key, APR_HASH_KEY_STRING, NULL);
+  cache->size -= (apr_size_t)e->w * e->h * 4;
+  free(e->data);
+  free(e->key);
+  free(e);
+}
+
+static apr_status_t _image_cache_cleanup(void *data)
+{
+  mapcache_image_cache *cache = (mapcache_image_cache*)data;
+  while(cache->tail) {
+    _image_cache_remove(cache, cache->tail);
+  }
+  return APR_SUCCESS;
+}
+
+mapcache_image_cache* mapcache_image_cache_create(apr_pool_t *pool, apr_size_t max_size)
+{
+  mapcache_image_cache *cache = apr_pcalloc(pool, sizeof(mapcache_image_cache));
+  /* the hash gets its own pool as it is only ever accessed with the mutex held */
+  apr_pool_create(&cache->pool, pool);
+#if APR_HAS_THREADS
+  if(apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS) {
+    return NULL;
+  }
+#endif
+  cache->entries = apr_hash_make(cache->pool);
+  cache->max_size = max_size;
+  apr_pool_cleanup_register(pool, cache, _image_cache_cleanup, apr_pool_cleanup_null);
+  return cache;
+}
+
+int mapcache_image_cache_get(mapcache_image_cache *cache, const char *key, apr_time_t mtime, mapcache_image *dst)
+{
+  _image_cache_entry *e;
+  int row;
+  _image_cache_lock(cache);
+  e = apr_hash_get(cache->entries, key, APR_HASH_KEY_STRING);
+  if(!e) {
+    _image_cache_unlock(cache);
+    return MAPCACHE_CACHE_MISS;
+  }
+  if(e->mtime != mtime) {
+    /* the tile has been modified since it was decoded */
+    _image_cache_remove(cache, e);
+    _image_cache_unlock(cache);
+    return MAPCACHE_CACHE_MISS;
+  }
+  _image_cache_unlink(cache, e);
+  _image_cache_push_front(cache, e);
+  /* copy while the mutex is held, as the entry may be evicted as soon as it is released */
+  dst->w = e->w;
+  dst->h = e->h;
+  for(row=0; row<e->h; row++) {
+    memcpy(dst->data + row*dst->stride, e->data + row*e->w*4, e->w*4);
+  }
+  _image_cache_unlock(cache);
+  return MAPCACHE_SUCCESS;
+}
+
+void mapcache_image_cache_set(mapcache_image_cache *cache, const char *key, apr_time_t mtime, mapcache_image *src)
+{
+  _image_cache_entry *e;
+  apr_size_t size = (apr_size_t)src->w * src->h * 4;
+  int row;
+  if(size > cache->max_size) {
+    return;
+  }
+  e = calloc(1, sizeof(_image_cache_entry));
+  if(!e) return;
+  e->key = strdup(key);
+  e->data = malloc(size);
+  if(!e->key || !e->data) {
+    free(e->key);
+    free(e->data);
+    free(e);
+    return;
+  }
+  e->mtime = mtime;
+  e->w = src->w;
+  e->h = src->h;
+  /* copy outside of the mutex, most of the work is here */
+  for(row=0; row<src->h; row++) {
+    memcpy(e->data + row*src->w*4, src->data + row*src->stride, src->w*4);
+  }
+
+  _image_cache_lock(cache);
+  {
+    _image_cache_entry *old = apr_hash_get(cache->entries, key, APR_HASH_KEY_STRING);
+    if(old) {
+      _image_cache_remove(cache, old);
+    }
+  }
+  while(cache->tail && cache->size + size > cache->max_size) {
+    _image_cache_remove(cache, cache->tail);
+  }
+  _image_cache_push_front(cache, e);
+  apr_hash_set(cache->entries, e->key, APR_HASH_KEY_STRING, e);
+  cache->size += size;
+  _image_cache_unlock(cache);
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
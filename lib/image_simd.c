@@ -0,0 +1,449 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: vectorized pixel kernels
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#if defined(__SSE2__) || defined(HAVE_AVX2_DISPATCH)
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_AVX2_DISPATCH
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MAPCACHE_NEON 1
+#endif
+
+/*
+ * the vector versions process as many pixels as they can at a time, and leave
+ * the remainder of the row to the scalar ones
+ */
+
+static void _over_scalar(unsigned char *dst, const unsigned char *src, int n)
+{
+  int j;
+  for(j=0; j<n; j++) {
+    if(src[3]) { /* if overlay is not completely transparent */
+      if(src[3] == 255) {
+        dst[0]=src[0];
+        dst[1]=src[1];
+        dst[2]=src[2];
+        dst[3]=src[3];
+      } else {
+        unsigned int ia = 255-src[3];
+        dst[0] = (unsigned char)(src[0] + ((ia*dst[0])>>8));
+        dst[1] = (unsigned char)(src[1] + ((ia*dst[1])>>8));
+        dst[2] = (unsigned char)(src[2] + ((ia*dst[2])>>8));
+        dst[3] = (unsigned char)(src[3] + ((ia*dst[3])>>8));
+      }
+    }
+    dst+=4;
+    src+=4;
+  }
+}
+
+static int _alpha_below_scalar(const unsigned char *px, int n, unsigned char cutoff)
+{
+  int j;
+  for(j=0; j<n; j++) {
+    if(px[3]<cutoff) {
+      return MAPCACHE_TRUE;
+    }
+    px += 4;
+  }
+  return MAPCACHE_FALSE;
+}
+
+static int _uniform_scalar(const unsigned char *px, int n, unsigned int value)
+{
+  const unsigned int *pixptr = (const unsigned int*)px;
+  int j;
+  for(j=0; j<n; j++) {
+    if(pixptr[j] != value) {
+      return MAPCACHE_FALSE;
+    }
+  }
+  return MAPCACHE_TRUE;
+}
+
+static void _bilinear_scalar(unsigned char *dst, const unsigned char *r0, const unsigned char *r1,
+                             const int *x0, const int *x1, const unsigned short *fx, unsigned int fy, int n)
+{
+  int j,c;
+  unsigned int fy1 = 256 - fy;
+  for(j=0; j<n; j++) {
+    const unsigned char *p1 = r0 + x0[j], *p2 = r0 + x1[j];
+    const unsigned char *p3 = r1 + x0[j], *p4 = r1 + x1[j];
+    unsigned int wx = fx[j], wx1 = 256 - fx[j];
+    for(c=0; c<4; c++) {
+      unsigned int top = (p1[c]*wx1 + p2[c]*wx)>>8;
+      unsigned int bottom = (p3[c]*wx1 + p4[c]*wx)>>8;
+      dst[c] = (unsigned char)((top*fy1 + bottom*fy)>>8);
+    }
+    dst += 4;
+  }
+}
+
+static const mapcache_image_kernels _kernels_scalar = {
+  "scalar", _over_scalar, _alpha_below_scalar, _uniform_scalar, _bilinear_scalar
+};
+
+#if defined(__SSE2__) || defined(HAVE_AVX2_DISPATCH)
+
+#ifdef HAVE_AVX2_DISPATCH
+#define SSE2_TARGET __attribute__((target("sse2")))
+#else
+#define SSE2_TARGET
+#endif
+
+static SSE2_TARGET void _over_sse2(unsigned char *dst, const unsigned char *src, int n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i amask = _mm_set1_epi32((int)0xff000000);
+  const __m128i c255 = _mm_set1_epi16(255);
+  int j = 0;
+  for(; j+4<=n; j+=4) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(src+j*4));
+    __m128i sa = _mm_and_si128(s, amask);
+    __m128i transparent = _mm_cmpeq_epi32(sa, zero);
+    __m128i d, slo, shi, dlo, dhi, alo, ahi;
+    if(_mm_movemask_epi8(transparent) == 0xffff) {
+      continue;
+    }
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(sa, amask)) == 0xffff) {
+      _mm_storeu_si128((__m128i*)(dst+j*4), s);
+      continue;
+    }
+    d = _mm_loadu_si128((const __m128i*)(dst+j*4));
+    slo = _mm_unpacklo_epi8(s, zero);
+    shi = _mm_unpackhi_epi8(s, zero);
+    dlo = _mm_unpacklo_epi8(d, zero);
+    dhi = _mm_unpackhi_epi8(d, zero);
+    alo = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3)));
+    ahi = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3)));
+    dlo = _mm_add_epi16(slo, _mm_srli_epi16(_mm_mullo_epi16(dlo, alo), 8));
+    dhi = _mm_add_epi16(shi, _mm_srli_epi16(_mm_mullo_epi16(dhi, ahi), 8));
+    s = _mm_packus_epi16(dlo, dhi);
+    /* fully transparent overlay pixels leave the base untouched */
+    s = _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, s));
+    _mm_storeu_si128((__m128i*)(dst+j*4), s);
+  }
+  _over_scalar(dst+j*4, src+j*4, n-j);
+}
+
+/*
+ * the scans test 32 pixels per iteration and only branch once on the outcome,
+ * they are mostly run on images that turn out to be opaque or uniform and have
+ * to be read entirely
+ */
+static SSE2_TARGET int _alpha_below_sse2(const unsigned char *px, int n, unsigned char cutoff)
+{
+  /* cutoff in the alpha bytes only, the other bytes always compare as >= 0 */
+  const __m128i cut = _mm_set1_epi32((int)((unsigned int)cutoff<<24));
+  int j = 0, k;
+  for(; j+32<=n; j+=32) {
+    const __m128i *p = (const __m128i*)(px+j*4);
+    __m128i v = _mm_loadu_si128(p);
+    __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, cut), v);
+    for(k=1; k<8; k++) {
+      v = _mm_loadu_si128(p+k);
+      ge = _mm_and_si128(ge, _mm_cmpeq_epi8(_mm_max_epu8(v, cut), v));
+    }
+    if(_mm_movemask_epi8(ge) != 0xffff) {
+      return MAPCACHE_TRUE;
+    }
+  }
+  for(; j+4<=n; j+=4) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(px+j*4));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, cut), v)) != 0xffff) {
+      return MAPCACHE_TRUE;
+    }
+  }
+  return _alpha_below_scalar(px+j*4, n-j, cutoff);
+}
+
+static SSE2_TARGET int _uniform_sse2(const unsigned char *px, int n, unsigned int value)
+{
+  const __m128i ref = _mm_set1_epi32((int)value);
+  int j = 0, k;
+  for(; j+32<=n; j+=32) {
+    const __m128i *p = (const __m128i*)(px+j*4);
+    __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128(p), ref);
+    for(k=1; k<8; k++) {
+      eq = _mm_and_si128(eq, _mm_cmpeq_epi32(_mm_loadu_si128(p+k), ref));
+    }
+    if(_mm_movemask_epi8(eq) != 0xffff) {
+      return MAPCACHE_FALSE;
+    }
+  }
+  for(; j+4<=n; j+=4) {
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(px+j*4)), ref)) != 0xffff) {
+      return MAPCACHE_FALSE;
+    }
+  }
+  return _uniform_scalar(px+j*4, n-j, value);
+}
+
+static SSE2_TARGET void _bilinear_sse2(unsigned char *dst, const unsigned char *r0, const unsigned char *r1,
+                                       const int *x0, const int *x1, const unsigned short *fx, unsigned int fy, int n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i c256 = _mm_set1_epi16(256);
+  const __m128i wy = _mm_set1_epi16((short)fy);
+  const __m128i wy1 = _mm_set1_epi16((short)(256-fy));
+  int j = 0;
+  /* two pixels at a time, as 8 16 bit channels */
+#define LOAD2(row,x) _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(*((int*)((row)+(x)[j]))), \
+                                                          _mm_cvtsi32_si128(*((int*)((row)+(x)[j+1])))), zero)
+  for(; j+2<=n; j+=2) {
+    __m128i p1 = LOAD2(r0,x0), p2 = LOAD2(r0,x1);
+    __m128i p3 = LOAD2(r1,x0), p4 = LOAD2(r1,x1);
+    __m128i wx = _mm_set_epi16(fx[j+1],fx[j+1],fx[j+1],fx[j+1],fx[j],fx[j],fx[j],fx[j]);
+    __m128i wx1 = _mm_sub_epi16(c256, wx);
+    __m128i top = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(p1, wx1), _mm_mullo_epi16(p2, wx)), 8);
+    __m128i bottom = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(p3, wx1), _mm_mullo_epi16(p4, wx)), 8);
+    __m128i res = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(top, wy1), _mm_mullo_epi16(bottom, wy)), 8);
+    _mm_storel_epi64((__m128i*)(dst+j*4), _mm_packus_epi16(res, zero));
+  }
+#undef LOAD2
+  _bilinear_scalar(dst+j*4, r0, r1, x0+j, x1+j, fx+j, fy, n-j);
+}
+
+static const mapcache_image_kernels _kernels_sse2 = {
+  "sse2", _over_sse2, _alpha_below_sse2, _uniform_sse2, _bilinear_sse2
+};
+
+#endif /* __SSE2__ */
+
+#ifdef HAVE_AVX2_DISPATCH
+
+static __attribute__((target("avx2"))) void _over_avx2(unsigned char *dst, const unsigned char *src, int n)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i amask = _mm256_set1_epi32((int)0xff000000);
+  const __m256i c255 = _mm256_set1_epi16(255);
+  int j = 0;
+  for(; j+8<=n; j+=8) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)(src+j*4));
+    __m256i sa = _mm256_and_si256(s, amask);
+    __m256i transparent = _mm256_cmpeq_epi32(sa, zero);
+    __m256i d, slo, shi, dlo, dhi, alo, ahi;
+    if(_mm256_movemask_epi8(transparent) == -1) {
+      continue;
+    }
+    if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa, amask)) == -1) {
+      _mm256_storeu_si256((__m256i*)(dst+j*4), s);
+      continue;
+    }
+    d = _mm256_loadu_si256((const __m256i*)(dst+j*4));
+    /* unpack and pack work within 128 bit lanes, so the pixel order is preserved */
+    slo = _mm256_unpacklo_epi8(s, zero);
+    shi = _mm256_unpackhi_epi8(s, zero);
+    dlo = _mm256_unpacklo_epi8(d, zero);
+    dhi = _mm256_unpackhi_epi8(d, zero);
+    alo = _mm256_sub_epi16(c255, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(slo, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3)));
+    ahi = _mm256_sub_epi16(c255, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(shi, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3)));
+    dlo = _mm256_add_epi16(slo, _mm256_srli_epi16(_mm256_mullo_epi16(dlo, alo), 8));
+    dhi = _mm256_add_epi16(shi, _mm256_srli_epi16(_mm256_mullo_epi16(dhi, ahi), 8));
+    s = _mm256_packus_epi16(dlo, dhi);
+    s = _mm256_blendv_epi8(s, d, transparent);
+    _mm256_storeu_si256((__m256i*)(dst+j*4), s);
+  }
+  _over_sse2(dst+j*4, src+j*4, n-j);
+}
+
+static __attribute__((target("avx2"))) int _alpha_below_avx2(const unsigned char *px, int n, unsigned char cutoff)
+{
+  const __m256i cut = _mm256_set1_epi32((int)((unsigned int)cutoff<<24));
+  int j = 0, k;
+  for(; j+32<=n; j+=32) {
+    const __m256i *p = (const __m256i*)(px+j*4);
+    __m256i v = _mm256_loadu_si256(p);
+    __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(v, cut), v);
+    for(k=1; k<4; k++) {
+      v = _mm256_loadu_si256(p+k);
+      ge = _mm256_and_si256(ge, _mm256_cmpeq_epi8(_mm256_max_epu8(v, cut), v));
+    }
+    if(_mm256_movemask_epi8(ge) != -1) {
+      return MAPCACHE_TRUE;
+    }
+  }
+  return _alpha_below_sse2(px+j*4, n-j, cutoff);
+}
+
+static __attribute__((target("avx2"))) int _uniform_avx2(const unsigned char *px, int n, unsigned int value)
+{
+  const __m256i ref = _mm256_set1_epi32((int)value);
+  int j = 0, k;
+  for(; j+32<=n; j+=32) {
+    const __m256i *p = (const __m256i*)(px+j*4);
+    __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256(p), ref);
+    for(k=1; k<4; k++) {
+      eq = _mm256_and_si256(eq, _mm256_cmpeq_epi32(_mm256_loadu_si256(p+k), ref));
+    }
+    if(_mm256_movemask_epi8(eq) != -1) {
+      return MAPCACHE_FALSE;
+    }
+  }
+  return _uniform_sse2(px+j*4, n-j, value);
+}
+
+static const mapcache_image_kernels _kernels_avx2 = {
+  "avx2", _over_avx2, _alpha_below_avx2, _uniform_avx2, _bilinear_sse2
+};
+
+#endif /* HAVE_AVX2_DISPATCH */
+
+#ifdef MAPCACHE_NEON
+
+static void _over_neon(unsigned char *dst, const unsigned char *src, int n)
+{
+  static const unsigned char alpha_idx[8] = {3,3,3,3,7,7,7,7};
+  const uint8x8_t idx = vld1_u8(alpha_idx);
+  const uint8x8_t c255 = vdup_n_u8(255);
+  const uint8x8_t zero = vdup_n_u8(0);
+  int j = 0;
+  for(; j+2<=n; j+=2) {
+    uint8x8_t s = vld1_u8(src+j*4);
+    uint8x8_t d = vld1_u8(dst+j*4);
+    uint8x8_t a = vtbl1_u8(s, idx);
+    uint16x8_t r = vaddq_u16(vmovl_u8(s), vshrq_n_u16(vmull_u8(d, vsub_u8(c255, a)), 8));
+    /* fully transparent overlay pixels leave the base untouched */
+    vst1_u8(dst+j*4, vbsl_u8(vceq_u8(a, zero), d, vqmovn_u16(r)));
+  }
+  _over_scalar(dst+j*4, src+j*4, n-j);
+}
+
+static int _any_neon(uint8x16_t v)
+{
+  uint8x8_t any = vorr_u8(vget_low_u8(v), vget_high_u8(v));
+  return vget_lane_u64(vreinterpret_u64_u8(any), 0) != 0;
+}
+
+static int _alpha_below_neon(const unsigned char *px, int n, unsigned char cutoff)
+{
+  const uint8x16_t cut = vreinterpretq_u8_u32(vdupq_n_u32((unsigned int)cutoff<<24));
+  int j = 0, k;
+  for(; j+32<=n; j+=32) {
+    uint8x16_t lt = vcltq_u8(vld1q_u8(px+j*4), cut);
+    for(k=1; k<8; k++) {
+      lt = vorrq_u8(lt, vcltq_u8(vld1q_u8(px+j*4+k*16), cut));
+    }
+    if(_any_neon(lt)) {
+      return MAPCACHE_TRUE;
+    }
+  }
+  for(; j+4<=n; j+=4) {
+    if(_any_neon(vcltq_u8(vld1q_u8(px+j*4), cut))) {
+      return MAPCACHE_TRUE;
+    }
+  }
+  return _alpha_below_scalar(px+j*4, n-j, cutoff);
+}
+
+static int _uniform_neon(const unsigned char *px, int n, unsigned int value)
+{
+  const uint32x4_t ref = vdupq_n_u32(value);
+  int j = 0, k;
+  for(; j+32<=n; j+=32) {
+    const unsigned int *p = (const unsigned int*)(px+j*4);
+    uint32x4_t ne = vmvnq_u32(vceqq_u32(vld1q_u32(p), ref));
+    for(k=1; k<8; k++) {
+      ne = vorrq_u32(ne, vmvnq_u32(vceqq_u32(vld1q_u32(p+k*4), ref)));
+    }
+    if(_any_neon(vreinterpretq_u8_u32(ne))) {
+      return MAPCACHE_FALSE;
+    }
+  }
+  for(; j+4<=n; j+=4) {
+    if(_any_neon(vreinterpretq_u8_u32(vmvnq_u32(vceqq_u32(vld1q_u32((const unsigned int*)(px+j*4)), ref))))) {
+      return MAPCACHE_FALSE;
+    }
+  }
+  return _uniform_scalar(px+j*4, n-j, value);
+}
+
+static void _bilinear_neon(unsigned char *dst, const unsigned char *r0, const unsigned char *r1,
+                           const int *x0, const int *x1, const unsigned short *fx, unsigned int fy, int n)
+{
+  const uint16x8_t wy = vdupq_n_u16((unsigned short)fy);
+  const uint16x8_t wy1 = vdupq_n_u16((unsigned short)(256-fy));
+  int j = 0;
+#define LOAD2(row,x) vmovl_u8(vreinterpret_u8_u32(vset_lane_u32(*((unsigned int*)((row)+(x)[j+1])), \
+                              vdup_n_u32(*((unsigned int*)((row)+(x)[j]))), 1)))
+  for(; j+2<=n; j+=2) {
+    uint16x8_t p1 = LOAD2(r0,x0), p2 = LOAD2(r0,x1);
+    uint16x8_t p3 = LOAD2(r1,x0), p4 = LOAD2(r1,x1);
+    uint16x8_t wx = vcombine_u16(vdup_n_u16(fx[j]), vdup_n_u16(fx[j+1]));
+    uint16x8_t wx1 = vsubq_u16(vdupq_n_u16(256), wx);
+    uint16x8_t top = vshrq_n_u16(vmlaq_u16(vmulq_u16(p1, wx1), p2, wx), 8);
+    uint16x8_t bottom = vshrq_n_u16(vmlaq_u16(vmulq_u16(p3, wx1), p4, wx), 8);
+    uint16x8_t res = vshrq_n_u16(vmlaq_u16(vmulq_u16(top, wy1), bottom, wy), 8);
+    vst1_u8(dst+j*4, vmovn_u16(res));
+  }
+#undef LOAD2
+  _bilinear_scalar(dst+j*4, r0, r1, x0+j, x1+j, fx+j, fy, n-j);
+}
+
+static const mapcache_image_kernels _kernels_neon = {
+  "neon", _over_neon, _alpha_below_neon, _uniform_neon, _bilinear_neon
+};
+
+#endif /* MAPCACHE_NEON */
+
+const mapcache_image_kernels* mapcache_image_kernels_scalar(void)
+{
+  return &_kernels_scalar;
+}
+
+const mapcache_image_kernels* mapcache_image_kernels_get(void)
+{
+  /* all threads would pick the same kernels, so concurrent first calls are harmless */
+  static const mapcache_image_kernels *kernels = NULL;
+  if(!kernels) {
+    const mapcache_image_kernels *k = &_kernels_scalar;
+#ifdef HAVE_AVX2_DISPATCH
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")) {
+      k = &_kernels_sse2;
+    }
+    if(__builtin_cpu_supports("avx2")) {
+      k = &_kernels_avx2;
+    }
+#elif defined(__SSE2__)
+    k = &_kernels_sse2;
+#elif defined(MAPCACHE_NEON)
+    k = &_kernels_neon;
+#endif
+    kernels = k;
+  }
+  return kernels;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -30,6 +30,7 @@
 #include "mapcache.h"
 #include <png.h>
 #include <jpeglib.h>
+#include <string.h>
 
 /**\addtogroup imageio*/
 /** @{ */
@@ -37,7 +38,7 @@
 int mapcache_imageio_is_valid_format(mapcache_context *ctx, mapcache_buffer *buffer)
 {
   mapcache_image_format_type t = mapcache_imageio_header_sniff(ctx,buffer);
-  if(t==GC_PNG || t==GC_JPEG) {
+  if(t==GC_PNG || t==GC_JPEG || t==GC_WEBP) {
     return MAPCACHE_TRUE;
   } else {
     return MAPCACHE_FALSE;
@@ -53,6 +54,8 @@ mapcache_image_format_type mapcache_imageio_header_sniff(mapcache_context *ctx,
     return GC_PNG;
   } else if(buffer->size >= 2 && ((unsigned char*)buffer->buf)[0] == 0xFF && ((unsigned char*)buffer->buf)[1] == 0xD8) {
     return GC_JPEG;
+  } else if(buffer->size >= 12 && !memcmp(buffer->buf,"RIFF",4) && !memcmp((char*)buffer->buf+8,"WEBP",4)) {
+    return GC_WEBP;
   } else {
     return GC_UNKNOWN;
   }
@@ -65,6 +68,13 @@ mapcache_image* mapcache_imageio_decode(mapcache_context *ctx, mapcache_buffer *
     return _mapcache_imageio_png_decode(ctx,buffer);
   } else if(type == GC_JPEG) {
     return _mapcache_imageio_jpeg_decode(ctx,buffer);
+  } else if(type == GC_WEBP) {
+#ifdef USE_WEBP
+    return _mapcache_imageio_webp_decode(ctx,buffer);
+#else
+    ctx->set_error(ctx, 500, "mapcache_imageio_decode: webp support is not compiled in");
+    return NULL;
+#endif
   } else {
     ctx->set_error(ctx, 500, "mapcache_imageio_decode: unrecognized image format");
     return NULL;
@@ -75,8 +85,9 @@ void mapcache_image_create_empty(mapcache_context *ctx, mapcache_cfg *cfg)
 {
   unsigned int color=0;
 
-  /* create a transparent image for PNG, and a white one for jpeg */
-  if(cfg->default_image_format->mime_type && !strstr(cfg->default_image_format->mime_type,"png")) {
+  /* create a transparent image for PNG and WebP, and a white one for jpeg */
+  if(cfg->default_image_format->mime_type && !strstr(cfg->default_image_format->mime_type,"png") &&
+     !strstr(cfg->default_image_format->mime_type,"webp")) {
     color = 0xffffffff;
   }
   cfg->empty_image = cfg->default_image_format->create_empty_image(ctx, cfg->default_image_format,
@@ -91,13 +102,31 @@ void mapcache_imageio_decode_to_image(mapcache_context *ctx, mapcache_buffer *bu
   if(type == GC_PNG) {
     _mapcache_imageio_png_decode_to_image(ctx,buffer,image);
   } else if(type == GC_JPEG) {
-    _mapcache_imageio_jpeg_decode_to_image(ctx,buffer,image);
+    _mapcache_imageio_jpeg_decode_to_image(ctx,buffer,image,1);
+  } else if(type == GC_WEBP) {
+#ifdef USE_WEBP
+    _mapcache_imageio_webp_decode_to_image(ctx,buffer,image);
+#else
+    ctx->set_error(ctx, 500, "mapcache_imageio_decode: webp support is not compiled in");
+#endif
   } else {
     ctx->set_error(ctx, 500, "mapcache_imageio_decode: unrecognized image format");
   }
   return;
 }
 
+void mapcache_imageio_decode_to_image_scaled(mapcache_context *ctx, mapcache_buffer *buffer,
+    mapcache_image *image, int scale_denom)
+{
+  if(scale_denom == 1) {
+    mapcache_imageio_decode_to_image(ctx,buffer,image);
+  } else if(mapcache_imageio_header_sniff(ctx,buffer) == GC_JPEG) {
+    _mapcache_imageio_jpeg_decode_to_image(ctx,buffer,image,scale_denom);
+  } else {
+    ctx->set_error(ctx, 500, "mapcache_imageio_decode_to_image_scaled: only jpeg images can be decoded at a reduced size");
+  }
+}
+
 /** @} */
 
 /* vim: ts=2 sts=2 et sw=2
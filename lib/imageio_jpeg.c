@@ -30,6 +30,12 @@
 #include "mapcache.h"
 #include <apr_strings.h>
 #include <jpeglib.h>
+#ifdef USE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+#if APR_HAS_THREADS
+#include <apr_thread_proc.h>
+#endif
 
 /**\addtogroup imageio_jpg */
 /** @{ */
@@ -153,56 +159,134 @@ int _mapcache_imageio_jpeg_buffer_empty_output_buffer (j_compress_ptr cinfo)
   return TRUE;
 }
 
-mapcache_buffer* _mapcache_imageio_jpeg_encode(mapcache_context *ctx, mapcache_image *img, mapcache_image_format *format)
-{
+/*
+ * the compressors are kept in each thread and reused for all the images it encodes,
+ * instead of being set up and torn down for each of them
+ */
+typedef struct {
   struct jpeg_compress_struct cinfo;
   struct jpeg_error_mgr jerr;
-  mapcache_jpeg_destination_mgr *dest;
   JSAMPLE *rowdata;
-  unsigned int row;
-  mapcache_buffer *buffer = mapcache_buffer_create(5000, ctx->pool);
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_compress(&cinfo);
+  size_t rowdata_size;
+} _mapcache_jpeg_compressor;
 
-  cinfo.dest = (struct jpeg_destination_mgr *)(*cinfo.mem->alloc_small) (
-                 (j_common_ptr) &cinfo, JPOOL_PERMANENT,
-                 sizeof (mapcache_jpeg_destination_mgr));
-  ((mapcache_jpeg_destination_mgr*)cinfo.dest)->pub.empty_output_buffer = _mapcache_imageio_jpeg_buffer_empty_output_buffer;
-  ((mapcache_jpeg_destination_mgr*)cinfo.dest)->pub.term_destination = _mapcache_imageio_jpeg_buffer_term_destination;
-  ((mapcache_jpeg_destination_mgr*)cinfo.dest)->buffer = buffer;
+static void _mapcache_jpeg_compressor_destroy(void *data)
+{
+  _mapcache_jpeg_compressor *c = (_mapcache_jpeg_compressor*)data;
+  if(!c) return;
+  jpeg_destroy_compress(&c->cinfo);
+  free(c->rowdata);
+  free(c);
+}
 
-  dest = (mapcache_jpeg_destination_mgr*) cinfo.dest;
+#if !APR_HAS_THREADS
+static apr_status_t _mapcache_jpeg_compressor_cleanup(void *data)
+{
+  mapcache_image_format_jpeg *f = (mapcache_image_format_jpeg*)data;
+  _mapcache_jpeg_compressor_destroy(f->compressors);
+  f->compressors = NULL;
+  return APR_SUCCESS;
+}
+#endif
+
+static _mapcache_jpeg_compressor* _mapcache_jpeg_compressor_create(void)
+{
+  _mapcache_jpeg_compressor *c = calloc(1, sizeof(_mapcache_jpeg_compressor));
+  mapcache_jpeg_destination_mgr *dest;
+  if(!c) {
+    return NULL;
+  }
+  c->cinfo.err = jpeg_std_error(&c->jerr);
+  jpeg_create_compress(&c->cinfo);
+
+  c->cinfo.dest = (struct jpeg_destination_mgr *)(*c->cinfo.mem->alloc_small) (
+                    (j_common_ptr) &c->cinfo, JPOOL_PERMANENT,
+                    sizeof (mapcache_jpeg_destination_mgr));
+  dest = (mapcache_jpeg_destination_mgr*) c->cinfo.dest;
+  dest->pub.empty_output_buffer = _mapcache_imageio_jpeg_buffer_empty_output_buffer;
+  dest->pub.term_destination = _mapcache_imageio_jpeg_buffer_term_destination;
   dest->pub.init_destination = _mapcache_imageio_jpeg_init_destination;
+  return c;
+}
 
-  cinfo.image_width = img->w;
-  cinfo.image_height = img->h;
-  cinfo.input_components = 3;
-  cinfo.in_color_space = JCS_RGB;
-  jpeg_set_defaults(&cinfo);
-  jpeg_set_quality(&cinfo, ((mapcache_image_format_jpeg*)format)->quality, TRUE);
-  switch(((mapcache_image_format_jpeg*)format)->photometric) {
+/* \returns the compressor of the calling thread, or NULL if it cannot be kept around */
+static _mapcache_jpeg_compressor* _mapcache_jpeg_compressor_get(mapcache_image_format_jpeg *f)
+{
+  _mapcache_jpeg_compressor *c = NULL;
+#if APR_HAS_THREADS
+  if(!f->compressors || apr_threadkey_private_get((void**)&c, (apr_threadkey_t*)f->compressors) != APR_SUCCESS) {
+    return NULL;
+  }
+  if(!c) {
+    c = _mapcache_jpeg_compressor_create();
+    if(c && apr_threadkey_private_set(c, (apr_threadkey_t*)f->compressors) != APR_SUCCESS) {
+      _mapcache_jpeg_compressor_destroy(c);
+      return NULL;
+    }
+  }
+#else
+  if(!f->compressors) {
+    f->compressors = _mapcache_jpeg_compressor_create();
+  }
+  c = f->compressors;
+#endif
+  return c;
+}
+
+mapcache_buffer* _mapcache_imageio_jpeg_encode(mapcache_context *ctx, mapcache_image *img, mapcache_image_format *format)
+{
+  mapcache_image_format_jpeg *f = (mapcache_image_format_jpeg*)format;
+  _mapcache_jpeg_compressor *c = _mapcache_jpeg_compressor_get(f);
+  int transient = 0;
+  struct jpeg_compress_struct *cinfo;
+  JSAMPLE *rowdata;
+  unsigned int row;
+  mapcache_buffer *buffer = mapcache_buffer_create(5000, ctx->pool);
+  if(!c) {
+    c = _mapcache_jpeg_compressor_create();
+    transient = 1;
+    if(!c) {
+      ctx->set_error(ctx, 500, "failed to allocate jpeg compressor");
+      return NULL;
+    }
+  }
+  cinfo = &c->cinfo;
+  ((mapcache_jpeg_destination_mgr*)cinfo->dest)->buffer = buffer;
+
+  cinfo->image_width = img->w;
+  cinfo->image_height = img->h;
+  cinfo->input_components = 3;
+  cinfo->in_color_space = JCS_RGB;
+  jpeg_set_defaults(cinfo);
+  jpeg_set_quality(cinfo, f->quality, TRUE);
+  switch(f->photometric) {
     case MAPCACHE_PHOTOMETRIC_RGB:
-      jpeg_set_colorspace(&cinfo, JCS_RGB);
+      jpeg_set_colorspace(cinfo, JCS_RGB);
       break;
     case MAPCACHE_PHOTOMETRIC_YCBCR:
     default:
-      jpeg_set_colorspace(&cinfo, JCS_YCbCr);
+      jpeg_set_colorspace(cinfo, JCS_YCbCr);
   }
-  switch(((mapcache_image_format_jpeg*)format)->optimize) {
+  switch(f->optimize) {
     case MAPCACHE_OPTIMIZE_NO:
-      cinfo.optimize_coding = FALSE;
+      cinfo->optimize_coding = FALSE;
       break;
     case MAPCACHE_OPTIMIZE_ARITHMETIC:
-      cinfo.optimize_coding = FALSE;
-      cinfo.arith_code = TRUE;
+      cinfo->optimize_coding = FALSE;
+      cinfo->arith_code = TRUE;
       break;
     case MAPCACHE_OPTIMIZE_YES:
     default:
-      cinfo.optimize_coding = TRUE;
+      cinfo->optimize_coding = TRUE;
   }
-  jpeg_start_compress(&cinfo, TRUE);
+  jpeg_start_compress(cinfo, TRUE);
 
-  rowdata = (JSAMPLE*)malloc(img->w*cinfo.input_components*sizeof(JSAMPLE));
+  if(c->rowdata_size < img->w*cinfo->input_components*sizeof(JSAMPLE)) {
+    free(c->rowdata);
+    c->rowdata_size = img->w*cinfo->input_components*sizeof(JSAMPLE);
+    c->rowdata = (JSAMPLE*)malloc(c->rowdata_size);
+  }
+  rowdata = c->rowdata;
   for(row=0; row<img->h; row++) {
     JSAMPLE *pixptr = rowdata;
     int col;
@@ -218,19 +302,57 @@ mapcache_buffer* _mapcache_imageio_jpeg_encode(mapcache_context *ctx, mapcache_i
       g+=4;
       b+=4;
     }
-    (void) jpeg_write_scanlines(&cinfo, &rowdata, 1);
+    (void) jpeg_write_scanlines(cinfo, &rowdata, 1);
   }
 
   /* Step 6: Finish compression */
 
-  jpeg_finish_compress(&cinfo);
-  jpeg_destroy_compress(&cinfo);
-  free(rowdata);
+  jpeg_finish_compress(cinfo);
+  if(transient) {
+    _mapcache_jpeg_compressor_destroy(c);
+  }
   return buffer;
 }
 
-void _mapcache_imageio_jpeg_decode_to_image(mapcache_context *r, mapcache_buffer *buffer,
-    mapcache_image *img)
+#ifdef USE_TURBOJPEG
+/*
+ * the TurboJPEG api decompresses straight into the bgra image rows, scaling in the
+ * DCT domain like libjpeg does
+ */
+static void _mapcache_imageio_turbojpeg_decode_to_image(mapcache_context *r, mapcache_buffer *buffer,
+    mapcache_image *img, int scale_denom)
+{
+  int width, height, subsamp, colorspace;
+  tjscalingfactor scale;
+  tjhandle tj = tjInitDecompress();
+  if(!tj) {
+    r->set_error(r, 500, "failed to allocate turbojpeg decompressor");
+    return;
+  }
+  if(tjDecompressHeader3(tj, buffer->buf, buffer->size, &width, &height, &subsamp, &colorspace) != 0) {
+    r->set_error(r, 500, "failed to read jpeg header: %s", tjGetErrorStr2(tj));
+    tjDestroy(tj);
+    return;
+  }
+  scale.num = 1;
+  scale.denom = scale_denom;
+  img->w = TJSCALED(width, scale);
+  img->h = TJSCALED(height, scale);
+  if(!img->data) {
+    img->data = calloc(1,img->w*img->h*4*sizeof(unsigned char));
+    apr_pool_cleanup_register(r->pool, img->data, (void*)free, apr_pool_cleanup_null) ;
+    img->stride = img->w * 4;
+  }
+  if(tjDecompress2(tj, buffer->buf, buffer->size, img->data, img->w, img->stride, img->h, TJPF_BGRA, 0) != 0 &&
+     tjGetErrorCode(tj) != TJERR_WARNING) {
+    r->set_error(r, 500, "failed to decode jpeg image: %s", tjGetErrorStr2(tj));
+  }
+  tjDestroy(tj);
+}
+
+#else
+static void _mapcache_imageio_libjpeg_decode_to_image(mapcache_context *r, mapcache_buffer *buffer,
+    mapcache_image *img, int scale_denom)
 {
   int s;
   struct jpeg_decompress_struct cinfo = {NULL};
@@ -244,6 +366,8 @@ void _mapcache_imageio_jpeg_decode_to_image(mapcache_context *r, mapcache_buffer
   }
 
   jpeg_read_header(&cinfo, TRUE);
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = scale_denom;
   jpeg_start_decompress(&cinfo);
   img->w = cinfo.output_width;
   img->h = cinfo.output_height;
@@ -287,11 +411,22 @@ void _mapcache_imageio_jpeg_decode_to_image(mapcache_context *r, mapcache_buffer
   jpeg_finish_decompress(&cinfo);
   jpeg_destroy_decompress(&cinfo);
 }
+#endif
+
+void _mapcache_imageio_jpeg_decode_to_image(mapcache_context *r, mapcache_buffer *buffer,
+    mapcache_image *img, int scale_denom)
+{
+#ifdef USE_TURBOJPEG
+  _mapcache_imageio_turbojpeg_decode_to_image(r, buffer, img, scale_denom);
+#else
+  _mapcache_imageio_libjpeg_decode_to_image(r, buffer, img, scale_denom);
+#endif
+}
 
 mapcache_image* _mapcache_imageio_jpeg_decode(mapcache_context *r, mapcache_buffer *buffer)
 {
   mapcache_image *img = mapcache_image_create(r);
-  _mapcache_imageio_jpeg_decode_to_image(r, buffer,img);
+  _mapcache_imageio_jpeg_decode_to_image(r, buffer,img,1);
   if(GC_HAS_ERROR(r)) {
     return NULL;
   }
@@ -342,6 +477,13 @@ mapcache_image_format* mapcache_imageio_create_jpeg_format(apr_pool_t *pool, cha
   format->optimize = optimize;
   format->photometric = photometric;
   format->format.type = GC_JPEG;
+#if APR_HAS_THREADS
+  if(apr_threadkey_private_create((apr_threadkey_t**)&format->compressors, _mapcache_jpeg_compressor_destroy, pool) != APR_SUCCESS) {
+    format->compressors = NULL; /* compressors will be created for each image */
+  }
+#else
+  apr_pool_cleanup_register(pool, format, _mapcache_jpeg_compressor_cleanup, apr_pool_cleanup_null);
+#endif
   return (mapcache_image_format*)format;
 }
 
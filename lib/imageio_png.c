@@ -31,6 +31,13 @@
 #include "mapcache.h"
 #include <png.h>
 #include <apr_strings.h>
+#ifdef USE_LIBDEFLATE
+#include <stdlib.h>
+#include <libdeflate.h>
+#if APR_HAS_THREADS
+#include <apr_thread_proc.h>
+#endif
+#endif
 
 #ifdef _WIN32
 typedef unsigned char     uint8_t;
@@ -491,6 +498,351 @@ xrgb_to_rgbx (png_structp png, png_row_infop row_info, png_bytep data)
 
 
 
+#ifdef USE_LIBDEFLATE
+
+/*
+ * alternative png writer: the scanlines are filtered by us and compressed in one
+ * call by libdeflate, whose compressors are kept around in each thread along with
+ * the scratch buffers
+ */
+
+typedef struct {
+  struct libdeflate_compressor *compressor;
+  unsigned char *filtered; /* filtered scanlines, each prefixed by its filter type */
+  size_t filtered_size;
+  unsigned char *rows[2]; /* current and previous unfiltered scanlines */
+  size_t row_size;
+  unsigned char *out; /* the zlib stream */
+  size_t out_size;
+} _png_deflate_state;
+
+static void _png_deflate_state_destroy(void *data)
+{
+  _png_deflate_state *state = (_png_deflate_state*)data;
+  if(!state) return;
+  if(state->compressor) libdeflate_free_compressor(state->compressor);
+  free(state->filtered);
+  free(state->rows[0]);
+  free(state->rows[1]);
+  free(state->out);
+  free(state);
+}
+
+#if !APR_HAS_THREADS
+static apr_status_t _png_deflate_format_cleanup(void *data)
+{
+  mapcache_image_format_png *f = (mapcache_image_format_png*)data;
+  _png_deflate_state_destroy(f->encoder_state);
+  f->encoder_state = NULL;
+  return APR_SUCCESS;
+}
+#endif
+
+static int _png_deflate_level(mapcache_compression_type compression)
+{
+  switch(compression) {
+    case MAPCACHE_COMPRESSION_BEST:
+      return 12;
+    case MAPCACHE_COMPRESSION_FAST:
+      return 1;
+    case MAPCACHE_COMPRESSION_DISABLE:
+      return 0;
+    default:
+      return 6;
+  }
+}
+
+static _png_deflate_state* _png_deflate_get_state(mapcache_image_format_png *f)
+{
+  _png_deflate_state *state;
+#if APR_HAS_THREADS
+  apr_threadkey_t *key = (apr_threadkey_t*)f->encoder_state;
+  if(apr_threadkey_private_get((void**)&state, key) != APR_SUCCESS) {
+    return NULL;
+  }
+#else
+  state = (_png_deflate_state*)f->encoder_state;
+#endif
+  if(!state) {
+    state = calloc(1, sizeof(_png_deflate_state));
+    if(!state) {
+      return NULL;
+    }
+    state->compressor = libdeflate_alloc_compressor(_png_deflate_level(f->compression_level));
+    if(!state->compressor) {
+      free(state);
+      return NULL;
+    }
+#if APR_HAS_THREADS
+    apr_threadkey_private_set(state, key);
+#else
+    f->encoder_state = state;
+#endif
+  }
+  return state;
+}
+
+static int _png_deflate_reserve(unsigned char **buf, size_t *size, size_t needed)
+{
+  if(*size < needed) {
+    unsigned char *nbuf = realloc(*buf, needed);
+    if(!nbuf) {
+      return MAPCACHE_FAILURE;
+    }
+    *buf = nbuf;
+    *size = needed;
+  }
+  return MAPCACHE_SUCCESS;
+}
+
+static unsigned char _png_paeth(unsigned char a, unsigned char b, unsigned char c)
+{
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if(pa <= pb && pa <= pc) return a;
+  if(pb <= pc) return b;
+  return c;
+}
+
+/* filtered value of byte i of row for the given png filter type */
+#define PNG_FILTERED(type,row,prev,i,bpp) (unsigned char)((row)[i] - ( \
+    (type)==1 ? ((i)>=(bpp)?(row)[(i)-(bpp)]:0) : \
+    (type)==2 ? (prev)[i] : \
+    (type)==3 ? ((((i)>=(bpp)?(row)[(i)-(bpp)]:0) + (prev)[i])>>1) : \
+    (type)==4 ? _png_paeth((i)>=(bpp)?(row)[(i)-(bpp)]:0, (prev)[i], (i)>=(bpp)?(prev)[(i)-(bpp)]:0) : 0))
+
+/*
+ * filter a scanline into out, prefixed by the filter type. With adaptive filtering
+ * the filter is chosen with the minimum sum of absolute differences heuristic
+ * recommended by the png specification
+ */
+static void _png_filter_row(unsigned char *out, const unsigned char *row, const unsigned char *prev,
+                            size_t len, int bpp, int adaptive)
+{
+  int type = 0, t;
+  size_t i;
+  if(adaptive) {
+    unsigned long best = 0;
+    for(i=0; i<len; i++) {
+      best += row[i] < 128 ? row[i] : 256 - row[i];
+    }
+    for(t=1; t<=4; t++) {
+      unsigned long sum = 0;
+      for(i=0; i<len && sum<best; i++) {
+        unsigned char v = PNG_FILTERED(t,row,prev,i,bpp);
+        sum += v < 128 ? v : 256 - v;
+      }
+      if(sum < best) {
+        best = sum;
+        type = t;
+      }
+    }
+  }
+  out[0] = (unsigned char)type;
+  out++;
+  switch(type) {
+    case 0:
+      memcpy(out, row, len);
+      break;
+    case 1:
+      for(i=0; i<len; i++) out[i] = PNG_FILTERED(1,row,prev,i,bpp);
+      break;
+    case 2:
+      for(i=0; i<len; i++) out[i] = PNG_FILTERED(2,row,prev,i,bpp);
+      break;
+    case 3:
+      for(i=0; i<len; i++) out[i] = PNG_FILTERED(3,row,prev,i,bpp);
+      break;
+    default:
+      for(i=0; i<len; i++) out[i] = PNG_FILTERED(4,row,prev,i,bpp);
+      break;
+  }
+}
+
+static void _png_write_chunk(mapcache_buffer *buffer, const char *type, const unsigned char *data, size_t len)
+{
+  unsigned char hdr[8], tail[4];
+  uint32_t c;
+  hdr[0] = (len>>24)&0xff;
+  hdr[1] = (len>>16)&0xff;
+  hdr[2] = (len>>8)&0xff;
+  hdr[3] = len&0xff;
+  memcpy(hdr+4, type, 4);
+  mapcache_buffer_append(buffer, 8, hdr);
+  c = libdeflate_crc32(0, hdr+4, 4);
+  if(len) {
+    mapcache_buffer_append(buffer, len, (void*)data);
+    c = libdeflate_crc32(c, data, len);
+  }
+  tail[0] = (c>>24)&0xff;
+  tail[1] = (c>>16)&0xff;
+  tail[2] = (c>>8)&0xff;
+  tail[3] = c&0xff;
+  mapcache_buffer_append(buffer, 4, tail);
+}
+
+/* prepares the state for an image of height rows of rowbytes */
+static int _png_deflate_begin(_png_deflate_state *state, size_t rowbytes, int height)
+{
+  if(_png_deflate_reserve(&state->filtered, &state->filtered_size, (rowbytes+1)*height) != MAPCACHE_SUCCESS ||
+     _png_deflate_reserve(&state->rows[0], &state->row_size, rowbytes) != MAPCACHE_SUCCESS) {
+    return MAPCACHE_FAILURE;
+  }
+  /* rows[1] is always allocated with the size of rows[0] */
+  free(state->rows[1]);
+  state->rows[1] = calloc(1, state->row_size);
+  if(!state->rows[1]) {
+    return MAPCACHE_FAILURE;
+  }
+  return MAPCACHE_SUCCESS;
+}
+
+/* compresses the filtered scanlines and assembles the png */
+static mapcache_buffer* _png_deflate_end(mapcache_context *ctx, _png_deflate_state *state, int width, int height,
+                                         int depth, int color_type, size_t rowbytes,
+                                         const unsigned char *plte, int nplte, const unsigned char *trns, int ntrns)
+{
+  static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  unsigned char ihdr[13];
+  size_t in_size = (rowbytes+1)*height;
+  size_t out_len;
+  mapcache_buffer *buffer;
+
+  if(_png_deflate_reserve(&state->out, &state->out_size,
+                          libdeflate_zlib_compress_bound(state->compressor, in_size)) != MAPCACHE_SUCCESS) {
+    ctx->set_error(ctx, 500, "png encode: failed to allocate compression buffer");
+    return NULL;
+  }
+  out_len = libdeflate_zlib_compress(state->compressor, state->filtered, in_size, state->out, state->out_size);
+  if(!out_len) {
+    ctx->set_error(ctx, 500, "png encode: libdeflate compression failed");
+    return NULL;
+  }
+
+  ihdr[0] = (width>>24)&0xff;
+  ihdr[1] = (width>>16)&0xff;
+  ihdr[2] = (width>>8)&0xff;
+  ihdr[3] = width&0xff;
+  ihdr[4] = (height>>24)&0xff;
+  ihdr[5] = (height>>16)&0xff;
+  ihdr[6] = (height>>8)&0xff;
+  ihdr[7] = height&0xff;
+  ihdr[8] = depth;
+  ihdr[9] = color_type;
+  ihdr[10] = 0; /* deflate */
+  ihdr[11] = 0; /* adaptive filtering */
+  ihdr[12] = 0; /* no interlacing */
+
+  buffer = mapcache_buffer_create(out_len + 3*nplte + ntrns + 100, ctx->pool);
+  mapcache_buffer_append(buffer, 8, (void*)signature);
+  _png_write_chunk(buffer, "IHDR", ihdr, 13);
+  if(nplte) {
+    _png_write_chunk(buffer, "PLTE", plte, 3*nplte);
+  }
+  if(ntrns) {
+    _png_write_chunk(buffer, "tRNS", trns, ntrns);
+  }
+  _png_write_chunk(buffer, "IDAT", state->out, out_len);
+  _png_write_chunk(buffer, "IEND", NULL, 0);
+  return buffer;
+}
+
+/**
+ * \brief encode an image to RGB(A) PNG format with libdeflate
+ * \private \memberof mapcache_image_format_png
+ */
+static mapcache_buffer* _mapcache_imageio_png_deflate_encode(mapcache_context *ctx, mapcache_image *img, mapcache_image_format_png *f)
+{
+  _png_deflate_state *state = _png_deflate_get_state(f);
+  int has_alpha = mapcache_image_has_alpha(img,255);
+  int bpp = has_alpha ? 4 : 3;
+  size_t rowbytes = (size_t)img->w * bpp;
+  int adaptive = f->compression_level != MAPCACHE_COMPRESSION_FAST && f->compression_level != MAPCACHE_COMPRESSION_DISABLE;
+  int row, col;
+
+  if(!state || _png_deflate_begin(state, rowbytes, img->h) != MAPCACHE_SUCCESS) {
+    ctx->set_error(ctx, 500, "png encode: failed to allocate libdeflate encoder");
+    return NULL;
+  }
+  for(row=0; row<img->h; row++) {
+    unsigned char *cur = state->rows[row&1], *prev = state->rows[(row+1)&1];
+    unsigned char *src = img->data + row*img->stride, *b = cur;
+    /* same conversions as argb_to_rgba() and xrgb_to_rgbx() for libpng */
+    for(col=0; col<img->w; col++) {
+      uint32_t pixel;
+      memcpy(&pixel, src, sizeof(uint32_t));
+      if(has_alpha) {
+        uint8_t alpha = (pixel & 0xff000000) >> 24;
+        if (alpha == 0) {
+          b[0] = b[1] = b[2] = b[3] = 0;
+        } else if (alpha == 255) {
+          b[0] = (pixel & 0xff0000) >> 16;
+          b[1] = (pixel & 0x00ff00) >>  8;
+          b[2] = (pixel & 0x0000ff) >>  0;
+          b[3] = 255;
+        } else {
+          b[0] = (((pixel & 0xff0000) >> 16) * 255 + alpha / 2) / alpha;
+          b[1] = (((pixel & 0x00ff00) >>  8) * 255 + alpha / 2) / alpha;
+          b[2] = (((pixel & 0x0000ff) >>  0) * 255 + alpha / 2) / alpha;
+          b[3] = alpha;
+        }
+        b += 4;
+      } else {
+        b[0] = (pixel & 0xff0000) >> 16;
+        b[1] = (pixel & 0x00ff00) >>  8;
+        b[2] = (pixel & 0x0000ff) >>  0;
+        b += 3;
+      }
+      src += 4;
+    }
+    if(row == 0) {
+      memset(prev, 0, rowbytes);
+    }
+    _png_filter_row(state->filtered + row*(rowbytes+1), cur, prev, rowbytes, bpp, adaptive);
+  }
+  return _png_deflate_end(ctx, state, img->w, img->h, 8,
+                          has_alpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
+                          rowbytes, NULL, 0, NULL, 0);
+}
+
+/**
+ * \brief write 8 bit palette indexes as a PNG with libdeflate. Palette images are
+ * not filtered, as recommended by the png specification
+ * \private \memberof mapcache_image_format_png_q
+ */
+static mapcache_buffer* _mapcache_imageio_png_deflate_encode_palette(mapcache_context *ctx, mapcache_image_format_png *f,
+    const unsigned char *pixels, int width, int height, int sample_depth,
+    const unsigned char *plte, int nplte, const unsigned char *trns, int ntrns)
+{
+  _png_deflate_state *state = _png_deflate_get_state(f);
+  size_t rowbytes = ((size_t)width * sample_depth + 7) / 8;
+  int row, col;
+
+  if(!state || _png_deflate_begin(state, rowbytes, height) != MAPCACHE_SUCCESS) {
+    ctx->set_error(ctx, 500, "png encode: failed to allocate libdeflate encoder");
+    return NULL;
+  }
+  for(row=0; row<height; row++) {
+    const unsigned char *src = pixels + (size_t)row*width;
+    unsigned char *out = state->filtered + row*(rowbytes+1);
+    *(out++) = 0;
+    if(sample_depth == 8) {
+      memcpy(out, src, width);
+    } else {
+      /* pack the indexes, leftmost pixel in the high order bits */
+      int per_byte = 8 / sample_depth;
+      memset(out, 0, rowbytes);
+      for(col=0; col<width; col++) {
+        out[col/per_byte] |= src[col] << (8 - sample_depth*(1 + col%per_byte));
+      }
+    }
+  }
+  return _png_deflate_end(ctx, state, width, height, sample_depth, PNG_COLOR_TYPE_PALETTE,
+                          rowbytes, plte, nplte, trns, ntrns);
+}
+
+#endif /* USE_LIBDEFLATE */
+
 /**
  * \brief encode an image to RGB(A) PNG format
  * \private \memberof mapcache_image_format_png
@@ -504,7 +856,13 @@ mapcache_buffer* _mapcache_imageio_png_encode(mapcache_context *ctx, mapcache_im
   size_t row;
   mapcache_buffer *buffer = NULL;
   int compression = ((mapcache_image_format_png*)format)->compression_level;
-  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,NULL,NULL);
+  png_structp png_ptr;
+#ifdef USE_LIBDEFLATE
+  if(((mapcache_image_format_png*)format)->encoder == MAPCACHE_PNG_ENCODER_LIBDEFLATE) {
+    return _mapcache_imageio_png_deflate_encode(ctx, img, (mapcache_image_format_png*)format);
+  }
+#endif
+  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,NULL,NULL);
   if (!png_ptr) {
     ctx->set_error(ctx, 500, "failed to allocate png_struct structure");
     return NULL;
@@ -590,726 +948,6 @@ typedef struct {
   unsigned char r,g,b;
 } rgbPixel;
 
-#define PAM_GETR(p) ((p).r)
-#define PAM_GETG(p) ((p).g)
-#define PAM_GETB(p) ((p).b)
-#define PAM_GETA(p) ((p).a)
-#define PAM_ASSIGN(p,red,grn,blu,alf) \
-      do { (p).r = (red); (p).g = (grn); (p).b = (blu); (p).a = (alf); } while (0)
-#define PAM_EQUAL(p,q) \
-      ((p).r == (q).r && (p).g == (q).g && (p).b == (q).b && (p).a == (q).a)
-#define PAM_DEPTH(newp,p,oldmaxval,newmaxval) \
-      PAM_ASSIGN( (newp), \
-            ( (int) PAM_GETR(p) * (newmaxval) + (oldmaxval) / 2 ) / (oldmaxval), \
-            ( (int) PAM_GETG(p) * (newmaxval) + (oldmaxval) / 2 ) / (oldmaxval), \
-            ( (int) PAM_GETB(p) * (newmaxval) + (oldmaxval) / 2 ) / (oldmaxval), \
-            ( (int) PAM_GETA(p) * (newmaxval) + (oldmaxval) / 2 ) / (oldmaxval) )
-
-
-/* from pamcmap.h */
-
-typedef struct acolorhist_item *acolorhist_vector;
-struct acolorhist_item {
-  rgbaPixel acolor;
-  int value;
-};
-
-typedef struct acolorhist_list_item *acolorhist_list;
-struct acolorhist_list_item {
-  struct acolorhist_item ch;
-  acolorhist_list next;
-};
-
-typedef acolorhist_list *acolorhash_table;
-
-#define MAXCOLORS  32767
-
-#define LARGE_NORM
-#define REP_AVERAGE_PIXELS
-
-typedef struct box *box_vector;
-struct box {
-  int ind;
-  int colors;
-  int sum;
-};
-
-static acolorhist_vector mediancut(acolorhist_vector achv, int colors, int sum, unsigned char maxval, int newcolors);
-static int redcompare (const void *ch1, const void *ch2);
-static int greencompare (const void *ch1, const void *ch2);
-static int bluecompare (const void *ch1, const void *ch2);
-static int alphacompare (const void *ch1, const void *ch2);
-static int sumcompare (const void *b1, const void *b2);
-
-static acolorhist_vector pam_acolorhashtoacolorhist
-(acolorhash_table acht, int maxacolors);
-static acolorhist_vector pam_computeacolorhist
-(rgbaPixel **apixels, int cols, int rows, int maxacolors, int* acolorsP);
-static acolorhash_table pam_computeacolorhash
-(rgbaPixel** apixels, int cols, int rows, int maxacolors, int* acolorsP);
-static acolorhash_table pam_allocacolorhash (void);
-static int pam_addtoacolorhash
-(acolorhash_table acht, rgbaPixel *acolorP, int value);
-static int pam_lookupacolor (acolorhash_table acht, rgbaPixel* acolorP);
-static void pam_freeacolorhist (acolorhist_vector achv);
-static void pam_freeacolorhash (acolorhash_table acht);
-
-
-/**
- * Compute a palette for the given RGBA rasterBuffer using a median cut quantization.
- * - rb: the rasterBuffer to quantize
- * - reqcolors: the desired number of colors the palette should contain. will be set
- *   with the actual number of entries in the computed palette
- * - palette: preallocated array of palette entries that will be populated by the
- *   function
- * - maxval: max value of pixel intensity. In some cases, the input data has to
- *   be rescaled to compute the quantization. if the returned value of maxscale is
- *   less than 255, this means that the input pixels have been rescaled, and that
- *   the returned palette must be upscaled before being written to the png file
- * - forced_palette: entries that should appear in the computed palette
- * - num_forced_palette_entries: number of entries contained in "force_palette". if 0,
- *   "force_palette" can be NULL
- */
-int _mapcache_imageio_quantize_image(mapcache_image *rb,
-                                     unsigned int *reqcolors, rgbaPixel *palette,
-                                     unsigned int *maxval,
-                                     rgbaPixel *forced_palette, int num_forced_palette_entries)
-{
-
-  rgbaPixel **apixels=NULL; /* pointer to the start rows of truecolor pixels */
-  register rgbaPixel *pP;
-  register int col;
-
-  unsigned char newmaxval;
-  acolorhist_vector achv, acolormap=NULL;
-
-  int row;
-  int colors;
-  int newcolors = 0;
-
-  int x;
-  /*  int channels;  */
-
-
-  *maxval = 255;
-
-  apixels=(rgbaPixel**)malloc(rb->h*sizeof(rgbaPixel**));
-  if(!apixels) return MAPCACHE_FAILURE;
-
-  for(row=0; row<rb->h; row++) {
-    apixels[row]=(rgbaPixel*)(&(rb->data[row * rb->stride]));
-  }
-
-  /*
-   ** Step 2: attempt to make a histogram of the colors, unclustered.
-   ** If at first we don't succeed, lower maxval to increase color
-   ** coherence and try again.  This will eventually terminate, with
-   ** maxval at worst 15, since 32^3 is approximately MAXCOLORS.
-                 [GRR POSSIBLE BUG:  what about 32^4 ?]
-   */
-  for ( ; ; ) {
-    achv = pam_computeacolorhist(
-             apixels, rb->w, rb->h, MAXCOLORS, &colors );
-    if ( achv != (acolorhist_vector) 0 )
-      break;
-    newmaxval = *maxval / 2;
-    for ( row = 0; row < rb->h; ++row )
-      for ( col = 0, pP = apixels[row]; col < rb->w; ++col, ++pP )
-        PAM_DEPTH( *pP, *pP, *maxval, newmaxval );
-    *maxval = newmaxval;
-  }
-  newcolors = MAPCACHE_MIN(colors, *reqcolors);
-  acolormap = mediancut(achv, colors, rb->w*rb->h, *maxval, newcolors);
-  pam_freeacolorhist(achv);
-
-
-  *reqcolors = newcolors;
-
-
-  for (x = 0; x < newcolors; ++x) {
-    palette[x].r = acolormap[x].acolor.r;
-    palette[x].g = acolormap[x].acolor.g;
-    palette[x].b = acolormap[x].acolor.b;
-    palette[x].a = acolormap[x].acolor.a;
-  }
-
-  free(acolormap);
-  free(apixels);
-  return MAPCACHE_SUCCESS;
-}
-
-
-int _mapcache_imageio_classify(mapcache_image *rb, unsigned char *pixels,
-                               rgbaPixel *palette, int numPaletteEntries)
-{
-  register int ind;
-  unsigned char *outrow,*pQ;
-  register rgbaPixel *pP;
-  acolorhash_table acht;
-  int usehash, row, col;
-  /*
-   ** Step 4: map the colors in the image to their closest match in the
-   ** new colormap, and write 'em out.
-   */
-  acht = pam_allocacolorhash( );
-  usehash = 1;
-
-  for ( row = 0; row < rb->h; ++row ) {
-    outrow = &(pixels[row*rb->w]);
-    col = 0;
-    pP = (rgbaPixel*)(&(rb->data[row * rb->stride]));;
-    pQ = outrow;
-    do {
-      /* Check hash table to see if we have already matched this color. */
-      ind = pam_lookupacolor( acht, pP );
-      if ( ind == -1 ) {
-        /* No; search acolormap for closest match. */
-        register int i, r1, g1, b1, a1, r2, g2, b2, a2;
-        register long dist, newdist;
-
-        r1 = PAM_GETR( *pP );
-        g1 = PAM_GETG( *pP );
-        b1 = PAM_GETB( *pP );
-        a1 = PAM_GETA( *pP );
-        dist = 2000000000;
-        for ( i = 0; i < numPaletteEntries; ++i ) {
-          r2 = PAM_GETR( palette[i] );
-          g2 = PAM_GETG( palette[i] );
-          b2 = PAM_GETB( palette[i] );
-          a2 = PAM_GETA( palette[i] );
-          /* GRR POSSIBLE BUG */
-          newdist = ( r1 - r2 ) * ( r1 - r2 ) +  /* may overflow? */
-                    ( g1 - g2 ) * ( g1 - g2 ) +
-                    ( b1 - b2 ) * ( b1 - b2 ) +
-                    ( a1 - a2 ) * ( a1 - a2 );
-          if ( newdist < dist ) {
-            ind = i;
-            dist = newdist;
-          }
-        }
-        if ( usehash ) {
-          if ( pam_addtoacolorhash( acht, pP, ind ) < 0 ) {
-            usehash = 0;
-          }
-        }
-      }
-
-      /*          *pP = acolormap[ind].acolor;  */
-      *pQ = (unsigned char)ind;
-
-      ++col;
-      ++pP;
-      ++pQ;
-
-    } while ( col != rb->w );
-  }
-  pam_freeacolorhash(acht);
-
-  return MAPCACHE_SUCCESS;
-}
-
-
-
-/*
- ** Here is the fun part, the median-cut colormap generator.  This is based
- ** on Paul Heckbert's paper, "Color Image Quantization for Frame Buffer
- ** Display," SIGGRAPH 1982 Proceedings, page 297.
- */
-
-static acolorhist_vector
-mediancut(acolorhist_vector achv, int colors, int sum, unsigned char maxval, int newcolors )
-{
-  acolorhist_vector acolormap;
-  box_vector bv;
-  register int bi, i;
-  int boxes;
-
-  bv = (box_vector) malloc( sizeof(struct box) * newcolors );
-  acolormap =
-    (acolorhist_vector) malloc( sizeof(struct acolorhist_item) * newcolors);
-  if ( bv == (box_vector) 0 || acolormap == (acolorhist_vector) 0 ) {
-    fprintf( stderr, "  out of memory allocating box vector\n" );
-    fflush(stderr);
-    exit(6);
-  }
-  for ( i = 0; i < newcolors; ++i )
-    PAM_ASSIGN( acolormap[i].acolor, 0, 0, 0, 0 );
-
-  /*
-   ** Set up the initial box.
-   */
-  bv[0].ind = 0;
-  bv[0].colors = colors;
-  bv[0].sum = sum;
-  boxes = 1;
-
-  /*
-   ** Main loop: split boxes until we have enough.
-   */
-  while ( boxes < newcolors ) {
-    register int indx, clrs;
-    int sm;
-    register int minr, maxr, ming, mina, maxg, minb, maxb, maxa, v;
-    int halfsum, lowersum;
-
-    /*
-     ** Find the first splittable box.
-     */
-    for ( bi = 0; bi < boxes; ++bi )
-      if ( bv[bi].colors >= 2 )
-        break;
-    if ( bi == boxes )
-      break;        /* ran out of colors! */
-    indx = bv[bi].ind;
-    clrs = bv[bi].colors;
-    sm = bv[bi].sum;
-
-    /*
-     ** Go through the box finding the minimum and maximum of each
-     ** component - the boundaries of the box.
-     */
-    minr = maxr = PAM_GETR( achv[indx].acolor );
-    ming = maxg = PAM_GETG( achv[indx].acolor );
-    minb = maxb = PAM_GETB( achv[indx].acolor );
-    mina = maxa = PAM_GETA( achv[indx].acolor );
-    for ( i = 1; i < clrs; ++i ) {
-      v = PAM_GETR( achv[indx + i].acolor );
-      if ( v < minr ) minr = v;
-      if ( v > maxr ) maxr = v;
-      v = PAM_GETG( achv[indx + i].acolor );
-      if ( v < ming ) ming = v;
-      if ( v > maxg ) maxg = v;
-      v = PAM_GETB( achv[indx + i].acolor );
-      if ( v < minb ) minb = v;
-      if ( v > maxb ) maxb = v;
-      v = PAM_GETA( achv[indx + i].acolor );
-      if ( v < mina ) mina = v;
-      if ( v > maxa ) maxa = v;
-    }
-
-    /*
-     ** Find the largest dimension, and sort by that component.  I have
-     ** included two methods for determining the "largest" dimension;
-     ** first by simply comparing the range in RGB space, and second
-     ** by transforming into luminosities before the comparison.  You
-     ** can switch which method is used by switching the commenting on
-     ** the LARGE_ defines at the beginning of this source file.
-     */
-#ifdef LARGE_NORM
-    if ( maxa - mina >= maxr - minr && maxa - mina >= maxg - ming && maxa - mina >= maxb - minb )
-      qsort(
-        (char*) &(achv[indx]), clrs, sizeof(struct acolorhist_item),
-        alphacompare );
-    else if ( maxr - minr >= maxg - ming && maxr - minr >= maxb - minb )
-      qsort(
-        (char*) &(achv[indx]), clrs, sizeof(struct acolorhist_item),
-        redcompare );
-    else if ( maxg - ming >= maxb - minb )
-      qsort(
-        (char*) &(achv[indx]), clrs, sizeof(struct acolorhist_item),
-        greencompare );
-    else
-      qsort(
-        (char*) &(achv[indx]), clrs, sizeof(struct acolorhist_item),
-        bluecompare );
-#endif /*LARGE_NORM*/
-#ifdef LARGE_LUM
-    {
-      apixel p;
-      float rl, gl, bl, al;
-
-      PAM_ASSIGN(p, maxr - minr, 0, 0, 0);
-      rl = PPM_LUMIN(p);
-      PAM_ASSIGN(p, 0, maxg - ming, 0, 0);
-      gl = PPM_LUMIN(p);
-      PAM_ASSIGN(p, 0, 0, maxb - minb, 0);
-      bl = PPM_LUMIN(p);
-
-      /*
-      GRR: treat alpha as grayscale and assign (maxa - mina) to each of R, G, B?
-      assign (maxa - mina)/3 to each?
-      use alpha-fractional luminosity?  (normalized_alpha * lum(r,g,b))
-      al = dunno ...
-      [probably should read Heckbert's paper to decide]
-       */
-
-      if ( al >= rl && al >= gl && al >= bl )
-        qsort(
-          (char*) &(achv[indx]), clrs, sizeof(struct acolorhist_item),
-          alphacompare );
-      else if ( rl >= gl && rl >= bl )
-        qsort(
-          (char*) &(achv[indx]), clrs, sizeof(struct acolorhist_item),
-          redcompare );
-      else if ( gl >= bl )
-        qsort(
-          (char*) &(achv[indx]), clrs, sizeof(struct acolorhist_item),
-          greencompare );
-      else
-        qsort(
-          (char*) &(achv[indx]), clrs, sizeof(struct acolorhist_item),
-          bluecompare );
-    }
-#endif /*LARGE_LUM*/
-
-    /*
-     ** Now find the median based on the counts, so that about half the
-     ** pixels (not colors, pixels) are in each subdivision.
-     */
-    lowersum = achv[indx].value;
-    halfsum = sm / 2;
-    for ( i = 1; i < clrs - 1; ++i ) {
-      if ( lowersum >= halfsum )
-        break;
-      lowersum += achv[indx + i].value;
-    }
-
-    /*
-     ** Split the box, and sort to bring the biggest boxes to the top.
-     */
-    bv[bi].colors = i;
-    bv[bi].sum = lowersum;
-    bv[boxes].ind = indx + i;
-    bv[boxes].colors = clrs - i;
-    bv[boxes].sum = sm - lowersum;
-    ++boxes;
-    qsort( (char*) bv, boxes, sizeof(struct box), sumcompare );
-  }
-
-  /*
-   ** Ok, we've got enough boxes.  Now choose a representative color for
-   ** each box.  There are a number of possible ways to make this choice.
-   ** One would be to choose the center of the box; this ignores any structure
-   ** within the boxes.  Another method would be to average all the colors in
-   ** the box - this is the method specified in Heckbert's paper.  A third
-   ** method is to average all the pixels in the box.  You can switch which
-   ** method is used by switching the commenting on the REP_ defines at
-   ** the beginning of this source file.
-   */
-  for ( bi = 0; bi < boxes; ++bi ) {
-#ifdef REP_CENTER_BOX
-    register int indx = bv[bi].ind;
-    register int clrs = bv[bi].colors;
-    register int minr, maxr, ming, maxg, minb, maxb, mina, maxa, v;
-
-    minr = maxr = PAM_GETR( achv[indx].acolor );
-    ming = maxg = PAM_GETG( achv[indx].acolor );
-    minb = maxb = PAM_GETB( achv[indx].acolor );
-    mina = maxa = PAM_GETA( achv[indx].acolor );
-    for ( i = 1; i < clrs; ++i ) {
-      v = PAM_GETR( achv[indx + i].acolor );
-      minr = min( minr, v );
-      maxr = max( maxr, v );
-      v = PAM_GETG( achv[indx + i].acolor );
-      ming = min( ming, v );
-      maxg = max( maxg, v );
-      v = PAM_GETB( achv[indx + i].acolor );
-      minb = min( minb, v );
-      maxb = max( maxb, v );
-      v = PAM_GETA( achv[indx + i].acolor );
-      mina = min( mina, v );
-      maxa = max( maxa, v );
-    }
-    PAM_ASSIGN(
-      acolormap[bi].acolor, ( minr + maxr ) / 2, ( ming + maxg ) / 2,
-      ( minb + maxb ) / 2, ( mina + maxa ) / 2 );
-#endif /*REP_CENTER_BOX*/
-#ifdef REP_AVERAGE_COLORS
-    register int indx = bv[bi].ind;
-    register int clrs = bv[bi].colors;
-    register long r = 0, g = 0, b = 0, a = 0;
-
-    for ( i = 0; i < clrs; ++i ) {
-      r += PAM_GETR( achv[indx + i].acolor );
-      g += PAM_GETG( achv[indx + i].acolor );
-      b += PAM_GETB( achv[indx + i].acolor );
-      a += PAM_GETA( achv[indx + i].acolor );
-    }
-    r = r / clrs;
-    g = g / clrs;
-    b = b / clrs;
-    a = a / clrs;
-    PAM_ASSIGN( acolormap[bi].acolor, r, g, b, a );
-#endif /*REP_AVERAGE_COLORS*/
-#ifdef REP_AVERAGE_PIXELS
-    register int indx = bv[bi].ind;
-    register int clrs = bv[bi].colors;
-    register long r = 0, g = 0, b = 0, a = 0, sum = 0;
-
-    for ( i = 0; i < clrs; ++i ) {
-      r += PAM_GETR( achv[indx + i].acolor ) * achv[indx + i].value;
-      g += PAM_GETG( achv[indx + i].acolor ) * achv[indx + i].value;
-      b += PAM_GETB( achv[indx + i].acolor ) * achv[indx + i].value;
-      a += PAM_GETA( achv[indx + i].acolor ) * achv[indx + i].value;
-      sum += achv[indx + i].value;
-    }
-    r = r / sum;
-    if ( r > maxval ) r = maxval;        /* avoid math errors */
-    g = g / sum;
-    if ( g > maxval ) g = maxval;
-    b = b / sum;
-    if ( b > maxval ) b = maxval;
-    a = a / sum;
-    if ( a > maxval ) a = maxval;
-    /* GRR 20001228:  added casts to quiet warnings; 255 DEPENDENCY */
-    PAM_ASSIGN( acolormap[bi].acolor, (unsigned char)r, (unsigned char)g, (unsigned char)b, (unsigned char)a );
-#endif /*REP_AVERAGE_PIXELS*/
-  }
-
-  /*
-   ** All done.
-   */
-  free(bv);
-  return acolormap;
-}
-
-static int
-redcompare( const void *ch1, const void *ch2 )
-{
-  return (int) PAM_GETR( ((acolorhist_vector)ch1)->acolor ) -
-         (int) PAM_GETR( ((acolorhist_vector)ch2)->acolor );
-}
-
-static int
-greencompare( const void *ch1, const void *ch2 )
-{
-  return (int) PAM_GETG( ((acolorhist_vector)ch1)->acolor ) -
-         (int) PAM_GETG( ((acolorhist_vector)ch2)->acolor );
-}
-
-static int
-bluecompare( const void *ch1, const void *ch2 )
-{
-  return (int) PAM_GETB( ((acolorhist_vector)ch1)->acolor ) -
-         (int) PAM_GETB( ((acolorhist_vector)ch2)->acolor );
-}
-
-static int
-alphacompare( const void *ch1, const void *ch2 )
-{
-  return (int) PAM_GETA( ((acolorhist_vector)ch1)->acolor ) -
-         (int) PAM_GETA( ((acolorhist_vector)ch2)->acolor );
-}
-
-static int
-sumcompare( const void *b1, const void *b2 )
-{
-  return ((box_vector)b2)->sum -
-         ((box_vector)b1)->sum;
-}
-
-
-/*===========================================================================*/
-
-
-/* libpam3.c - pam (portable alpha map) utility library part 3
- **
- ** Colormap routines.
- **
- ** Copyright (C) 1989, 1991 by Jef Poskanzer.
- ** Copyright (C) 1997 by Greg Roelofs.
- **
- ** Permission to use, copy, modify, and distribute this software and its
- ** documentation for any purpose and without fee is hereby granted, provided
- ** that the above copyright notice appear in all copies and that both that
- ** copyright notice and this permission notice appear in supporting
- ** documentation.  This software is provided "as is" without express or
- ** implied warranty.
- */
-
-/*
-#include "pam.h"
-#include "pamcmap.h"
- */
-
-#define HASH_SIZE 20023
-
-#define pam_hashapixel(p) ( ( ( (long) PAM_GETR(p) * 33023 + \
-      (long) PAM_GETG(p) * 30013 + \
-      (long) PAM_GETB(p) * 27011 + \
-      (long) PAM_GETA(p) * 24007 ) \
-      & 0x7fffffff ) % HASH_SIZE )
-
-static acolorhist_vector
-pam_computeacolorhist( apixels, cols, rows, maxacolors, acolorsP )
-rgbaPixel** apixels;
-int cols, rows, maxacolors;
-int* acolorsP;
-{
-  acolorhash_table acht;
-  acolorhist_vector achv;
-
-  acht = pam_computeacolorhash( apixels, cols, rows, maxacolors, acolorsP );
-  if ( acht == (acolorhash_table) 0 )
-    return (acolorhist_vector) 0;
-  achv = pam_acolorhashtoacolorhist( acht, maxacolors );
-  pam_freeacolorhash( acht );
-  return achv;
-}
-
-
-
-static acolorhash_table
-pam_computeacolorhash( apixels, cols, rows, maxacolors, acolorsP )
-rgbaPixel** apixels;
-int cols, rows, maxacolors;
-int* acolorsP;
-{
-  acolorhash_table acht;
-  register rgbaPixel* pP;
-  acolorhist_list achl;
-  int col, row, hash;
-
-  acht = pam_allocacolorhash( );
-  *acolorsP = 0;
-
-  /* Go through the entire image, building a hash table of colors. */
-  for ( row = 0; row < rows; ++row )
-    for ( col = 0, pP = apixels[row]; col < cols; ++col, ++pP ) {
-      hash = pam_hashapixel( *pP );
-      for ( achl = acht[hash]; achl != (acolorhist_list) 0; achl = achl->next )
-        if ( PAM_EQUAL( achl->ch.acolor, *pP ) )
-          break;
-      if ( achl != (acolorhist_list) 0 )
-        ++(achl->ch.value);
-      else {
-        if ( ++(*acolorsP) > maxacolors ) {
-          pam_freeacolorhash( acht );
-          return (acolorhash_table) 0;
-        }
-        achl = (acolorhist_list) malloc( sizeof(struct acolorhist_list_item) );
-        if ( achl == 0 ) {
-          fprintf( stderr, "  out of memory computing hash table\n" );
-          exit(7);
-        }
-        achl->ch.acolor = *pP;
-        achl->ch.value = 1;
-        achl->next = acht[hash];
-        acht[hash] = achl;
-      }
-    }
-
-  return acht;
-}
-
-
-
-static acolorhash_table
-pam_allocacolorhash( )
-{
-  acolorhash_table acht;
-  int i;
-
-  acht = (acolorhash_table) malloc( HASH_SIZE * sizeof(acolorhist_list) );
-  if ( acht == 0 ) {
-    fprintf( stderr, "  out of memory allocating hash table\n" );
-    exit(8);
-  }
-
-  for ( i = 0; i < HASH_SIZE; ++i )
-    acht[i] = (acolorhist_list) 0;
-
-  return acht;
-}
-
-
-
-static int
-pam_addtoacolorhash( acht, acolorP, value )
-acolorhash_table acht;
-rgbaPixel* acolorP;
-int value;
-{
-  register int hash;
-  register acolorhist_list achl;
-
-  achl = (acolorhist_list) malloc( sizeof(struct acolorhist_list_item) );
-  if ( achl == 0 )
-    return -1;
-  hash = pam_hashapixel( *acolorP );
-  achl->ch.acolor = *acolorP;
-  achl->ch.value = value;
-  achl->next = acht[hash];
-  acht[hash] = achl;
-  return 0;
-}
-
-
-
-static acolorhist_vector
-pam_acolorhashtoacolorhist( acht, maxacolors )
-acolorhash_table acht;
-int maxacolors;
-{
-  acolorhist_vector achv;
-  acolorhist_list achl;
-  int i, j;
-
-  /* Now collate the hash table into a simple acolorhist array. */
-  achv = (acolorhist_vector) malloc( maxacolors * sizeof(struct acolorhist_item) );
-  /* (Leave room for expansion by caller.) */
-  if ( achv == (acolorhist_vector) 0 ) {
-    fprintf( stderr, "  out of memory generating histogram\n" );
-    exit(9);
-  }
-
-  /* Loop through the hash table. */
-  j = 0;
-  for ( i = 0; i < HASH_SIZE; ++i )
-    for ( achl = acht[i]; achl != (acolorhist_list) 0; achl = achl->next ) {
-      /* Add the new entry. */
-      achv[j] = achl->ch;
-      ++j;
-    }
-
-  /* All done. */
-  return achv;
-}
-
-
-
-static int
-pam_lookupacolor( acht, acolorP )
-acolorhash_table acht;
-rgbaPixel* acolorP;
-{
-  int hash;
-  acolorhist_list achl;
-
-  hash = pam_hashapixel( *acolorP );
-  for ( achl = acht[hash]; achl != (acolorhist_list) 0; achl = achl->next )
-    if ( PAM_EQUAL( achl->ch.acolor, *acolorP ) )
-      return achl->ch.value;
-
-  return -1;
-}
-
-
-
-static void
-pam_freeacolorhist( achv )
-acolorhist_vector achv;
-{
-  free( (char*) achv );
-}
-
-
-
-static void
-pam_freeacolorhash( acht )
-acolorhash_table acht;
-{
-  int i;
-  acolorhist_list achl, achlnext;
-
-  for ( i = 0; i < HASH_SIZE; ++i )
-    for ( achl = acht[i]; achl != (acolorhist_list) 0; achl = achlnext ) {
-      achlnext = achl->next;
-      free( (char*) achl );
-    }
-  free( (char*) acht );
-}
-
 /** \endcond DONOTDOCUMENT */
 
 int _mapcache_imageio_remap_palette(unsigned char *pixels, int npixels,
@@ -1390,10 +1028,12 @@ mapcache_buffer* _mapcache_imageio_png_q_encode( mapcache_context *ctx, mapcache
   mapcache_buffer *buffer = mapcache_buffer_create(3000,ctx->pool);
   mapcache_image_format_png_q *f = (mapcache_image_format_png_q*)format;
   int compression = f->format.compression_level;
-  unsigned int numPaletteEntries = f->ncolors;
+  unsigned int numPaletteEntries;
   unsigned char *pixels = (unsigned char*)apr_pcalloc(ctx->pool,image->w*image->h*sizeof(unsigned char));
   rgbaPixel palette[256];
-  unsigned int maxval;
+  unsigned int maxval = 255;
+  const mapcache_palette *quantizer = image->palette;
+  const unsigned char *colors;
   png_infop info_ptr;
   rgbPixel rgb[256];
   unsigned char a[256];
@@ -1401,15 +1041,36 @@ mapcache_buffer* _mapcache_imageio_png_q_encode( mapcache_context *ctx, mapcache
   int row,sample_depth;
   png_structp png_ptr;
 
-  if(MAPCACHE_SUCCESS != _mapcache_imageio_quantize_image(image,&numPaletteEntries,palette, &maxval, NULL, 0)) {
-    ctx->set_error(ctx,500,"failed to quantize image buffer");
-    return NULL;
+  if(!quantizer) {
+    quantizer = mapcache_palette_create(ctx, image, f->ncolors);
+    if(GC_HAS_ERROR(ctx)) {
+      return NULL;
+    }
   }
-  if(MAPCACHE_SUCCESS != _mapcache_imageio_classify(image,pixels,palette,numPaletteEntries)) {
-    ctx->set_error(ctx,500,"failed to quantize image buffer");
+  mapcache_palette_classify(ctx, quantizer, image, pixels);
+  if(GC_HAS_ERROR(ctx)) {
     return NULL;
   }
+  numPaletteEntries = mapcache_palette_colors(quantizer, &colors);
+  memcpy(palette, colors, numPaletteEntries * sizeof(rgbaPixel));
 
+  if (numPaletteEntries <= 2)
+    sample_depth = 1;
+  else if (numPaletteEntries <= 4)
+    sample_depth = 2;
+  else if (numPaletteEntries <= 16)
+    sample_depth = 4;
+  else
+    sample_depth = 8;
+
+#ifdef USE_LIBDEFLATE
+  if(f->format.encoder == MAPCACHE_PNG_ENCODER_LIBDEFLATE) {
+    _mapcache_imageio_remap_palette(pixels, image->w * image->h, palette, numPaletteEntries,
+                                    maxval,rgb,a,&num_a);
+    return _mapcache_imageio_png_deflate_encode_palette(ctx, &f->format, pixels, image->w, image->h, sample_depth,
+           (unsigned char*)rgb, numPaletteEntries, a, num_a);
+  }
+#endif
 
   png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,NULL,NULL);
 
@@ -1436,16 +1097,6 @@ mapcache_buffer* _mapcache_imageio_png_q_encode( mapcache_context *ctx, mapcache
 
   png_set_write_fn(png_ptr,buffer, _mapcache_imageio_png_write_func, _mapcache_imageio_png_flush_func);
 
-
-  if (numPaletteEntries <= 2)
-    sample_depth = 1;
-  else if (numPaletteEntries <= 4)
-    sample_depth = 2;
-  else if (numPaletteEntries <= 16)
-    sample_depth = 4;
-  else
-    sample_depth = 8;
-
   png_set_IHDR(png_ptr, info_ptr, image->w , image->h,
                sample_depth, PNG_COLOR_TYPE_PALETTE,
                0, PNG_COMPRESSION_TYPE_DEFAULT,
@@ -1531,6 +1182,40 @@ mapcache_image_format* mapcache_imageio_create_png_q_format(apr_pool_t *pool, ch
   return (mapcache_image_format*)format;
 }
 
+mapcache_palette* mapcache_imageio_png_q_shared_palette(mapcache_context *ctx, mapcache_image_format *format,
+    mapcache_image *metatile)
+{
+  mapcache_image_format_png_q *f = (mapcache_image_format_png_q*)format;
+  if(format->write != _mapcache_imageio_png_q_encode || !f->shared_palette) {
+    return NULL;
+  }
+  return mapcache_palette_create(ctx, metatile, f->ncolors);
+}
+
+void mapcache_imageio_png_set_encoder(mapcache_context *ctx, mapcache_image_format *format, mapcache_png_encoder encoder)
+{
+  mapcache_image_format_png *f = (mapcache_image_format_png*)format;
+  if(encoder == MAPCACHE_PNG_ENCODER_LIBDEFLATE) {
+#ifdef USE_LIBDEFLATE
+#if APR_HAS_THREADS
+    apr_threadkey_t *key;
+    if(apr_threadkey_private_create(&key, _png_deflate_state_destroy, ctx->pool) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to create thread key for png format %s", format->name);
+      return;
+    }
+    f->encoder_state = key;
+#else
+    f->encoder_state = NULL;
+    apr_pool_cleanup_register(ctx->pool, f, _png_deflate_format_cleanup, apr_pool_cleanup_null);
+#endif
+#else
+    ctx->set_error(ctx, 400, "png format %s: the libdeflate encoder requires mapcache to be built with libdeflate support", format->name);
+    return;
+#endif
+  }
+  f->encoder = encoder;
+}
+
 /** @} */
 
 /* vim: ts=2 sts=2 et sw=2
@@ -0,0 +1,224 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: WebP format
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+
+#ifdef USE_WEBP
+
+#include <apr_strings.h>
+#include <webp/encode.h>
+#include <webp/decode.h>
+
+/**\addtogroup imageio_webp */
+/** @{ */
+
+static int _mapcache_imageio_webp_write(const uint8_t *data, size_t data_size, const WebPPicture *picture)
+{
+  mapcache_buffer *buffer = (mapcache_buffer*)picture->custom_ptr;
+  mapcache_buffer_append(buffer, data_size, (void*)data);
+  return 1;
+}
+
+/*
+ * mapcache images are premultiplied, whereas webp expects straight alpha
+ */
+static unsigned char* _mapcache_imageio_webp_unpremultiply(mapcache_image *img)
+{
+  unsigned char *straight = malloc(img->w*img->h*4);
+  unsigned int row,col;
+  if(!straight) {
+    return NULL;
+  }
+  for(row=0; row<img->h; row++) {
+    unsigned char *src = &img->data[row*img->stride];
+    unsigned char *dst = &straight[row*img->w*4];
+    for(col=0; col<img->w; col++) {
+      unsigned int alpha = src[3];
+      if(alpha == 255) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+      } else if(alpha == 0) {
+        dst[0] = dst[1] = dst[2] = 0;
+      } else {
+        dst[0] = (src[0]*255 + alpha/2)/alpha;
+        dst[1] = (src[1]*255 + alpha/2)/alpha;
+        dst[2] = (src[2]*255 + alpha/2)/alpha;
+      }
+      dst[3] = alpha;
+      src += 4;
+      dst += 4;
+    }
+  }
+  return straight;
+}
+
+static mapcache_buffer* _mapcache_imageio_webp_encode(mapcache_context *ctx, mapcache_image *img, mapcache_image_format *format)
+{
+  mapcache_image_format_webp *f = (mapcache_image_format_webp*)format;
+  WebPConfig config;
+  WebPPicture picture;
+  mapcache_buffer *buffer;
+  unsigned char *straight = NULL;
+  int ok;
+
+  if(!WebPConfigPreset(&config, WEBP_PRESET_DEFAULT, f->quality) || !WebPPictureInit(&picture)) {
+    ctx->set_error(ctx, 500, "webp encoder: library version mismatch");
+    return NULL;
+  }
+  config.lossless = f->lossless;
+  config.method = f->method;
+  if(!WebPValidateConfig(&config)) {
+    ctx->set_error(ctx, 500, "webp encoder: invalid configuration for format %s", format->name);
+    return NULL;
+  }
+
+  picture.use_argb = f->lossless;
+  picture.width = img->w;
+  picture.height = img->h;
+  if(mapcache_image_has_alpha(img,255)) {
+    straight = _mapcache_imageio_webp_unpremultiply(img);
+    if(!straight) {
+      ctx->set_error(ctx, 500, "webp encoder: failed to allocate unpremultiplied image");
+      return NULL;
+    }
+    ok = WebPPictureImportBGRA(&picture, straight, img->w*4);
+    free(straight);
+  } else {
+    /* opaque images can be imported as is, without an alpha plane */
+    ok = WebPPictureImportBGRX(&picture, img->data, img->stride);
+  }
+  if(!ok) {
+    ctx->set_error(ctx, 500, "webp encoder: failed to import image");
+    WebPPictureFree(&picture);
+    return NULL;
+  }
+
+  buffer = mapcache_buffer_create(5000, ctx->pool);
+  picture.writer = _mapcache_imageio_webp_write;
+  picture.custom_ptr = buffer;
+  if(!WebPEncode(&config, &picture)) {
+    ctx->set_error(ctx, 500, "webp encoder: failed to encode image (error code %d)", picture.error_code);
+    WebPPictureFree(&picture);
+    return NULL;
+  }
+  WebPPictureFree(&picture);
+  return buffer;
+}
+
+void _mapcache_imageio_webp_decode_to_image(mapcache_context *ctx, mapcache_buffer *buffer,
+    mapcache_image *img)
+{
+  WebPDecoderConfig config;
+  if(!WebPInitDecoderConfig(&config)) {
+    ctx->set_error(ctx, 500, "webp decoder: library version mismatch");
+    return;
+  }
+  if(WebPGetFeatures(buffer->buf, buffer->size, &config.input) != VP8_STATUS_OK) {
+    ctx->set_error(ctx, 500, "webp decoder: failed to read image header");
+    return;
+  }
+  img->w = config.input.width;
+  img->h = config.input.height;
+  if(!img->data) {
+    img->data = calloc(1,img->w*img->h*4*sizeof(unsigned char));
+    apr_pool_cleanup_register(ctx->pool, img->data, (void*)free, apr_pool_cleanup_null) ;
+    img->stride = img->w * 4;
+  }
+  /* decode straight into the image rows, letting libwebp premultiply the colors */
+  config.output.colorspace = MODE_bgrA;
+  config.output.is_external_memory = 1;
+  config.output.u.RGBA.rgba = img->data;
+  config.output.u.RGBA.stride = img->stride;
+  config.output.u.RGBA.size = img->stride * img->h;
+  if(WebPDecode(buffer->buf, buffer->size, &config) != VP8_STATUS_OK) {
+    ctx->set_error(ctx, 500, "webp decoder: failed to decode image");
+    return;
+  }
+  if(!config.input.has_alpha) {
+    img->has_alpha = MC_ALPHA_NO;
+  }
+}
+
+mapcache_image* _mapcache_imageio_webp_decode(mapcache_context *ctx, mapcache_buffer *buffer)
+{
+  mapcache_image *img = mapcache_image_create(ctx);
+  _mapcache_imageio_webp_decode_to_image(ctx,buffer,img);
+  if(GC_HAS_ERROR(ctx)) {
+    return NULL;
+  }
+  return img;
+}
+
+static mapcache_buffer* _mapcache_imageio_webp_create_empty(mapcache_context *ctx, mapcache_image_format *format,
+    size_t width, size_t height, unsigned int color)
+{
+  mapcache_image *empty;
+  mapcache_buffer *buf;
+  int i;
+  empty = mapcache_image_create(ctx);
+  if(GC_HAS_ERROR(ctx)) {
+    return NULL;
+  }
+  empty->data = malloc(width*height*4*sizeof(unsigned char));
+  for(i=0; i<width*height; i++) {
+    ((unsigned int*)empty->data)[i] = color;
+  }
+  empty->w = width;
+  empty->h = height;
+  empty->stride = width * 4;
+
+  buf = format->write(ctx,empty,format);
+  free(empty->data);
+  return buf;
+}
+
+mapcache_image_format* mapcache_imageio_create_webp_format(apr_pool_t *pool, char *name, int quality,
+    int lossless, int method)
+{
+  mapcache_image_format_webp *format = apr_pcalloc(pool, sizeof(mapcache_image_format_webp));
+  format->format.name = name;
+  format->format.extension = apr_pstrdup(pool,"webp");
+  format->format.mime_type = apr_pstrdup(pool,"image/webp");
+  format->format.metadata = apr_table_make(pool,3);
+  format->format.create_empty_image = _mapcache_imageio_webp_create_empty;
+  format->format.write = _mapcache_imageio_webp_encode;
+  format->format.type = GC_WEBP;
+  format->quality = quality;
+  format->lossless = lossless;
+  format->method = method;
+  return (mapcache_image_format*)format;
+}
+
+/** @} */
+
+#endif /* USE_WEBP */
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -0,0 +1,271 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile key templates
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <string.h>
+#include <stdio.h>
+
+static const struct {
+  const char *name;
+  mapcache_key_token_type type;
+} _key_variables[] = {
+  {"tileset", MAPCACHE_KEY_TILESET},
+  {"grid", MAPCACHE_KEY_GRID},
+  {"ext", MAPCACHE_KEY_EXT},
+  {"x", MAPCACHE_KEY_X},
+  {"inv_x", MAPCACHE_KEY_INV_X},
+  {"y", MAPCACHE_KEY_Y},
+  {"inv_y", MAPCACHE_KEY_INV_Y},
+  {"z", MAPCACHE_KEY_Z},
+  {"inv_z", MAPCACHE_KEY_INV_Z},
+  {"div_x", MAPCACHE_KEY_DIV_X},
+  {"inv_div_x", MAPCACHE_KEY_INV_DIV_X},
+  {"div_y", MAPCACHE_KEY_DIV_Y},
+  {"inv_div_y", MAPCACHE_KEY_INV_DIV_Y},
+  {"dim", MAPCACHE_KEY_DIM},
+  {NULL, MAPCACHE_KEY_LITERAL}
+};
+
+static void _key_add_token(mapcache_key_template *tmpl, mapcache_key_token_type type, const char *text, int len)
+{
+  mapcache_key_token *token = &tmpl->tokens[tmpl->ntokens++];
+  token->type = type;
+  token->text = text;
+  token->len = len;
+  token->fmt = "%d";
+}
+
+mapcache_key_template* mapcache_key_template_compile(apr_pool_t *pool, const char *template, unsigned int tokens)
+{
+  mapcache_key_template *tmpl = apr_pcalloc(pool, sizeof(mapcache_key_template));
+  const char *p, *literal;
+  int maxtokens = 1;
+
+  template = apr_pstrdup(pool, template);
+  for(p = template; *p; p++) {
+    if(*p == '{') maxtokens += 2;
+  }
+  tmpl->tokens = apr_pcalloc(pool, maxtokens * sizeof(mapcache_key_token));
+  tmpl->count_x = tmpl->count_y = 1;
+
+  literal = p = template;
+  while((p = strchr(p, '{')) != NULL) {
+    const char *end = strchr(p, '}');
+    const char *name = p + 1;
+    int namelen, i;
+    mapcache_key_token_type type = MAPCACHE_KEY_LITERAL;
+    if(!end) {
+      break;
+    }
+    namelen = end - name;
+    if(namelen > 4 && !strncmp(name, "dim:", 4)) {
+      type = MAPCACHE_KEY_DIM_NAMED;
+    } else {
+      for(i = 0; _key_variables[i].name; i++) {
+        if((int)strlen(_key_variables[i].name) == namelen && !strncmp(_key_variables[i].name, name, namelen)) {
+          type = _key_variables[i].type;
+          break;
+        }
+      }
+    }
+    if(type == MAPCACHE_KEY_LITERAL || !(tokens & MAPCACHE_KEY_TOKEN(type))) {
+      /* not a variable we substitute, keep it in the current literal */
+      p++;
+      continue;
+    }
+    if(p > literal) {
+      _key_add_token(tmpl, MAPCACHE_KEY_LITERAL, literal, p - literal);
+    }
+    _key_add_token(tmpl, type, p, end + 1 - p);
+    if(type == MAPCACHE_KEY_DIM_NAMED) {
+      tmpl->tokens[tmpl->ntokens-1].name = apr_pstrndup(pool, name + 4, namelen - 4);
+    }
+    literal = p = end + 1;
+  }
+  if(*literal) {
+    _key_add_token(tmpl, MAPCACHE_KEY_LITERAL, literal, strlen(literal));
+  }
+  return tmpl;
+}
+
+void mapcache_key_template_set_format(mapcache_key_template *tmpl, mapcache_key_token_type type, const char *fmt)
+{
+  int i;
+  for(i = 0; i < tmpl->ntokens; i++) {
+    if(tmpl->tokens[i].type == type) {
+      tmpl->tokens[i].fmt = fmt;
+    }
+  }
+}
+
+/* appends n bytes to the key, keeping track of the full length even once the buffer is full */
+static int _key_append(char *buf, int size, int len, const char *str, int n)
+{
+  if(len < size) {
+    memcpy(buf + len, str, MAPCACHE_MIN(n, size - len));
+  }
+  return len + n;
+}
+
+static int _key_append_dimension(mapcache_key_template *tmpl, char *buf, int size, int len, const char *value)
+{
+  if(!tmpl->sanitized_chars) {
+    return _key_append(buf, size, len, value, strlen(value));
+  }
+  for(; *value; value++, len++) {
+    if(len < size) {
+      buf[len] = strchr(tmpl->sanitized_chars, *value) ? tmpl->sanitize_to : *value;
+    }
+  }
+  return len;
+}
+
+int mapcache_key_template_render(mapcache_context *ctx, mapcache_key_template *tmpl, mapcache_tile *tile,
+                                 char *buf, int size)
+{
+  int i, len = 0;
+  /* keep the last byte for the terminating null */
+  int avail = size - 1;
+  mapcache_grid_level *level = tile->grid_link->grid->levels[tile->z];
+
+  for(i = 0; i < tmpl->ntokens; i++) {
+    mapcache_key_token *token = &tmpl->tokens[i];
+    int value;
+    switch(token->type) {
+      case MAPCACHE_KEY_LITERAL:
+        len = _key_append(buf, avail, len, token->text, token->len);
+        continue;
+      case MAPCACHE_KEY_TILESET:
+        len = _key_append(buf, avail, len, tile->tileset->name, strlen(tile->tileset->name));
+        continue;
+      case MAPCACHE_KEY_GRID:
+        len = _key_append(buf, avail, len, tile->grid_link->grid->name, strlen(tile->grid_link->grid->name));
+        continue;
+      case MAPCACHE_KEY_EXT: {
+        const char *ext = tile->tileset->format ? tile->tileset->format->extension : "png";
+        len = _key_append(buf, avail, len, ext, strlen(ext));
+        continue;
+      }
+      case MAPCACHE_KEY_DIM:
+      case MAPCACHE_KEY_DIM_NAMED: {
+        int d, found = 0;
+        if(!tile->dimensions) {
+          /* tiles without dimensions keep the variable as is */
+          len = _key_append(buf, avail, len, token->text, token->len);
+          continue;
+        }
+        d = tile->dimensions->nelts;
+        while(d--) {
+          mapcache_requested_dimension *entry = APR_ARRAY_IDX(tile->dimensions,d,mapcache_requested_dimension*);
+          if(!entry->cached_value) {
+            ctx->set_error(ctx,500,"BUG: dimension (%s) not set",entry->dimension->name);
+            return -1;
+          }
+          if(token->type == MAPCACHE_KEY_DIM) {
+            len = _key_append(buf, avail, len, "#", 1);
+            if(tmpl->dim_names) {
+              len = _key_append(buf, avail, len, entry->dimension->name, strlen(entry->dimension->name));
+              len = _key_append(buf, avail, len, "#", 1);
+            }
+            len = _key_append_dimension(tmpl, buf, avail, len, entry->cached_value);
+          } else if(!found && !strcmp(entry->dimension->name, token->name)) {
+            len = _key_append_dimension(tmpl, buf, avail, len, entry->cached_value);
+            found = 1;
+          }
+        }
+        if(token->type == MAPCACHE_KEY_DIM_NAMED && !found) {
+          len = _key_append(buf, avail, len, token->text, token->len);
+        }
+        continue;
+      }
+      case MAPCACHE_KEY_X:
+        value = tile->x / tmpl->count_x * tmpl->count_x;
+        break;
+      case MAPCACHE_KEY_INV_X:
+        value = (level->maxx - tile->x - 1) / tmpl->count_x * tmpl->count_x;
+        break;
+      case MAPCACHE_KEY_Y:
+        value = tile->y / tmpl->count_y * tmpl->count_y;
+        break;
+      case MAPCACHE_KEY_INV_Y:
+        value = (level->maxy - tile->y - 1) / tmpl->count_y * tmpl->count_y;
+        break;
+      case MAPCACHE_KEY_Z:
+        value = tile->z;
+        break;
+      case MAPCACHE_KEY_INV_Z:
+        value = tile->grid_link->grid->nlevels - tile->z - 1;
+        break;
+      case MAPCACHE_KEY_DIV_X:
+        value = tile->x / tmpl->count_x;
+        break;
+      case MAPCACHE_KEY_INV_DIV_X:
+        value = (level->maxx - tile->x - 1) / tmpl->count_x;
+        break;
+      case MAPCACHE_KEY_DIV_Y:
+        value = tile->y / tmpl->count_y;
+        break;
+      case MAPCACHE_KEY_INV_DIV_Y:
+        value = (level->maxy - tile->y - 1) / tmpl->count_y;
+        break;
+      default:
+        continue;
+    }
+    {
+      char number[64];
+      int n = snprintf(number, sizeof(number), token->fmt, value);
+      if(n > 0) {
+        len = _key_append(buf, avail, len, number, MAPCACHE_MIN(n, (int)sizeof(number) - 1));
+      }
+    }
+  }
+  buf[MAPCACHE_MIN(len, avail)] = '\0';
+  return len;
+}
+
+char* mapcache_key_template_get(mapcache_context *ctx, mapcache_key_template *tmpl, mapcache_tile *tile)
+{
+  char buf[512];
+  char *key;
+  int len = mapcache_key_template_render(ctx, tmpl, tile, buf, sizeof(buf));
+  if(len < 0) {
+    return NULL;
+  }
+  if(len < (int)sizeof(buf)) {
+    return apr_pstrmemdup(ctx->pool, buf, len);
+  }
+  /* longer than the stack buffer, render again directly into a large enough one */
+  key = apr_palloc(ctx->pool, len + 1);
+  mapcache_key_template_render(ctx, tmpl, tile, key, len + 1);
+  return key;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -33,6 +33,10 @@
 #include <apr_time.h>
 #ifndef _WIN32
 #include <unistd.h>
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
 #endif
 
 typedef struct {
@@ -45,6 +49,12 @@ typedef struct {
    * need to be synchronized
    */
   const char *dir;
+
+  /**
+   * wake up waiters as soon as the lockfile is removed, instead of stat()ing it
+   * every retry_interval
+   */
+  int notify;
 } mapcache_locker_disk;
 
 typedef struct {
@@ -88,8 +98,13 @@ int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, mapcache_locker *l
         ctx->log(ctx,MAPCACHE_ERROR,"deleting a possibly stale lock after waiting on it for %g seconds",waited/1000.0);
         return MAPCACHE_FALSE;
       }
-      apr_sleep(locker->retry_interval * 1000000);
-      rv = locker->ping_lock(ctx,locker, *lock);
+      if(locker->wait_lock) {
+        /* 1ms past the timeout so the stale lock check above triggers on return */
+        rv = locker->wait_lock(ctx, locker, *lock, start_wait + (apr_time_t)(locker->timeout * 1000000) + 1000);
+      } else {
+        apr_sleep(locker->retry_interval * 1000000);
+        rv = locker->ping_lock(ctx,locker, *lock);
+      }
     }
     return MAPCACHE_FALSE;
   }
@@ -146,6 +161,50 @@ mapcache_lock_result mapcache_locker_disk_ping_lock(mapcache_context *ctx, mapca
   }
 }
 
+#ifdef HAVE_INOTIFY
+mapcache_lock_result mapcache_locker_disk_wait_lock(mapcache_context *ctx, mapcache_locker *self, void *lock, apr_time_t deadline) {
+  mapcache_locker_disk *ldisk = (mapcache_locker_disk*)self;
+  mapcache_lock_result rv;
+  union {
+    struct inotify_event event;
+    char buf[4096];
+  } events;
+  int fd;
+
+  fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if(fd == -1 || inotify_add_watch(fd, ldisk->dir, IN_DELETE|IN_MOVED_FROM) == -1) {
+    /* most probably out of inotify instances or watches, fall back to polling */
+    if(fd != -1) close(fd);
+    apr_sleep(self->retry_interval * 1000000);
+    return mapcache_locker_disk_ping_lock(ctx, self, lock);
+  }
+
+  /* the watch is in place, so checking the lockfile now can't miss its removal */
+  while((rv = mapcache_locker_disk_ping_lock(ctx, self, lock)) == MAPCACHE_LOCK_LOCKED) {
+    struct pollfd pfd;
+    apr_interval_time_t wait = deadline - apr_time_now();
+    if(wait <= 0) {
+      break;
+    }
+    /*
+     * inotify does not see lockfiles removed by other hosts on a network
+     * filesystem, so we still check back every retry_interval
+     */
+    if(wait > self->retry_interval * 1000000) {
+      wait = self->retry_interval * 1000000;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, (int)((wait + 999) / 1000)) > 0) {
+      /* we're woken up by any lockfile of the directory, just drain the events and check ours */
+      while(read(fd, events.buf, sizeof(events.buf)) > 0);
+    }
+  }
+  close(fd);
+  return rv;
+}
+#endif
+
 void mapcache_locker_disk_release_lock(mapcache_context *ctx, mapcache_locker *self, void *lock)
 {
   char *lockname = (char*)lock;
@@ -156,6 +215,18 @@ void mapcache_unlock_resource(mapcache_context *ctx, mapcache_locker *locker, vo
   locker->release_lock(ctx, locker, lock);
 }
 
+void* mapcache_lock_copy(mapcache_context *ctx, mapcache_locker *locker, void *lock, apr_pool_t *pool) {
+  if(!locker->copy_lock) {
+    return NULL;
+  }
+  return locker->copy_lock(ctx, locker, lock, pool);
+}
+
+void* mapcache_locker_disk_copy_lock(mapcache_context *ctx, mapcache_locker *self, void *lock, apr_pool_t *pool)
+{
+  return apr_pstrdup(pool, (char*)lock);
+}
+
 void mapcache_locker_disk_parse_xml(mapcache_context *ctx, mapcache_locker *self, ezxml_t doc) {
   mapcache_locker_disk *ldisk = (mapcache_locker_disk*)self;
   ezxml_t node;
@@ -164,6 +235,22 @@ void mapcache_locker_disk_parse_xml(mapcache_context *ctx, mapcache_locker *self
   } else {
     ldisk->dir = apr_pstrdup(ctx->pool,"/tmp");
   }
+  if((node = ezxml_child(doc,"notify")) != NULL) {
+    if(!strcasecmp(node->txt,"false")) {
+      ldisk->notify = 0;
+    } else if(!strcasecmp(node->txt,"true")) {
+      ldisk->notify = 1;
+#ifndef HAVE_INOTIFY
+      ctx->log(ctx,MAPCACHE_WARN,"disk locker: lockfile notifications are not available on this platform, falling back to polling");
+#endif
+    } else {
+      ctx->set_error(ctx,400,"failed to parse locker <notify> \"%s\". Expecting true or false",node->txt);
+      return;
+    }
+  }
+#ifdef HAVE_INOTIFY
+  self->wait_lock = ldisk->notify?mapcache_locker_disk_wait_lock:NULL;
+#endif
 }
 
 mapcache_locker* mapcache_locker_disk_create(mapcache_context *ctx) {
@@ -174,6 +261,11 @@ mapcache_locker* mapcache_locker_disk_create(mapcache_context *ctx) {
   l->parse_xml = mapcache_locker_disk_parse_xml;
   l->release_lock = mapcache_locker_disk_release_lock;
   l->ping_lock = mapcache_locker_disk_ping_lock;
+  l->copy_lock = mapcache_locker_disk_copy_lock;
+#ifdef HAVE_INOTIFY
+  l->wait_lock = mapcache_locker_disk_wait_lock;
+#endif
+  ld->notify = 1;
   return l;
 }
 
@@ -187,6 +279,19 @@ void mapcache_locker_fallback_release_lock(mapcache_context *ctx, mapcache_locke
   flock->locker->release_lock(ctx,flock->locker,flock->lock);
 }
 
+void* mapcache_locker_fallback_copy_lock(mapcache_context *ctx, mapcache_locker *self, void *lock, apr_pool_t *pool) {
+  struct mapcache_locker_fallback_lock *flock = lock;
+  struct mapcache_locker_fallback_lock *copy;
+  void *child_lock = mapcache_lock_copy(ctx, flock->locker, flock->lock, pool);
+  if(!child_lock) {
+    return NULL;
+  }
+  copy = apr_pcalloc(pool, sizeof(struct mapcache_locker_fallback_lock));
+  copy->locker = flock->locker;
+  copy->lock = child_lock;
+  return copy;
+}
+
 mapcache_lock_result mapcache_locker_fallback_ping_lock(mapcache_context *ctx, mapcache_locker *self, void *lock) {
   struct mapcache_locker_fallback_lock *flock = lock;
   return flock->locker->ping_lock(ctx,flock->locker,flock->lock);
@@ -365,10 +470,17 @@ void mapcache_locker_memcache_release_lock(mapcache_context *ctx, mapcache_locke
   apr_status_t rv;
   mapcache_lock_memcache *mlock = (mapcache_lock_memcache*)lock;
   char errmsg[120];
-  if(!mlock || !mlock->memcache || !mlock->lockname) {
+  if(!mlock || !mlock->lockname) {
     /*error*/
     return;
   }
+  if(!mlock->memcache) {
+    /* a copied lock, connect again from the releasing context */
+    mlock->memcache = create_memcache(ctx, (mapcache_locker_memcache*)self);
+    if(!mlock->memcache) {
+      return;
+    }
+  }
 
   rv = apr_memcache_delete(mlock->memcache,mlock->lockname,0);
   if(rv != APR_SUCCESS && rv!= APR_NOTFOUND) {
@@ -377,6 +489,14 @@ void mapcache_locker_memcache_release_lock(mapcache_context *ctx, mapcache_locke
 
 }
 
+void* mapcache_locker_memcache_copy_lock(mapcache_context *ctx, mapcache_locker *self, void *lock, apr_pool_t *pool) {
+  mapcache_lock_memcache *mlock = (mapcache_lock_memcache*)lock;
+  mapcache_lock_memcache *copy = apr_pcalloc(pool, sizeof(mapcache_lock_memcache));
+  /* the connection belongs to the request pool, the copy reconnects when released */
+  copy->lockname = apr_pstrdup(pool, mlock->lockname);
+  return copy;
+}
+
 mapcache_locker* mapcache_locker_memcache_create(mapcache_context *ctx) {
   mapcache_locker_memcache *lm = (mapcache_locker_memcache*)apr_pcalloc(ctx->pool, sizeof(mapcache_locker_memcache));
   mapcache_locker *l = (mapcache_locker*)lm;
@@ -385,6 +505,7 @@ mapcache_locker* mapcache_locker_memcache_create(mapcache_context *ctx) {
   l->ping_lock = mapcache_locker_memcache_ping_lock;
   l->parse_xml = mapcache_locker_memcache_parse_xml;
   l->release_lock = mapcache_locker_memcache_release_lock;
+  l->copy_lock = mapcache_locker_memcache_copy_lock;
   lm->nservers = 0;
   lm->servers = NULL;
   return l;
@@ -400,6 +521,7 @@ mapcache_locker* mapcache_locker_fallback_create(mapcache_context *ctx) {
   l->ping_lock = mapcache_locker_fallback_ping_lock;
   l->parse_xml = mapcache_locker_fallback_parse_xml;
   l->release_lock = mapcache_locker_fallback_release_lock;
+  l->copy_lock = mapcache_locker_fallback_copy_lock;
   return l;
 }
 
@@ -479,5 +601,176 @@ void mapcache_config_parse_locker(mapcache_context *ctx, ezxml_t node, mapcache_
     (*locker)->timeout = 120;
   }
 }
+
+/*
+ * in-process coalescing of metatile renders.
+ *
+ * threads of a same process asking for a same missing metatile join a single
+ * "flight": the first one (the leader) goes through the configured locker and
+ * renders the metatile, the others wait on a condition variable and are handed
+ * a copy of the encoded tiles once the leader is done, instead of polling the
+ * locker.
+ */
+
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+
+typedef struct {
+  int x,y;
+  unsigned char *data;
+  apr_size_t size;
+  apr_time_t mtime;
+} mapcache_inflight_tile;
+
+struct mapcache_inflight {
+  char *key;
+  int refcount;
+  int done;
+  int ntiles;
+  mapcache_inflight_tile *tiles;
+};
+
+struct mapcache_inflight_table {
+  apr_pool_t *pool;
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *cond;
+  apr_hash_t *flights;
+};
+
+mapcache_inflight_table* mapcache_inflight_table_create(apr_pool_t *pool)
+{
+  mapcache_inflight_table *table = apr_pcalloc(pool, sizeof(mapcache_inflight_table));
+  /* the hash gets its own pool as it is only ever accessed with the mutex held */
+  apr_pool_create(&table->pool, pool);
+  if(apr_thread_mutex_create(&table->mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS ||
+     apr_thread_cond_create(&table->cond, pool) != APR_SUCCESS) {
+    return NULL;
+  }
+  table->flights = apr_hash_make(table->pool);
+  return table;
+}
+
+mapcache_inflight* mapcache_inflight_join(mapcache_context *ctx, mapcache_inflight_table *table, const char *key, int *leader)
+{
+  mapcache_inflight *flight;
+  if(!table) {
+    *leader = MAPCACHE_TRUE;
+    return NULL;
+  }
+  apr_thread_mutex_lock(table->mutex);
+  flight = apr_hash_get(table->flights, key, APR_HASH_KEY_STRING);
+  if(flight) {
+    *leader = MAPCACHE_FALSE;
+  } else {
+    *leader = MAPCACHE_TRUE;
+    flight = calloc(1, sizeof(mapcache_inflight));
+    flight->key = strdup(key);
+    apr_hash_set(table->flights, flight->key, APR_HASH_KEY_STRING, flight);
+  }
+  flight->refcount++;
+  apr_thread_mutex_unlock(table->mutex);
+  return flight;
+}
+
+void mapcache_inflight_land(mapcache_context *ctx, mapcache_inflight_table *table, mapcache_inflight *flight, mapcache_metatile *mt)
+{
+  mapcache_inflight_tile *tiles = NULL;
+  int i, ntiles = 0;
+  if(!flight) return;
+  apr_thread_mutex_lock(table->mutex);
+  if(flight->refcount <= 1) {
+    /* nobody joined the flight, and nobody can anymore once it is out of the hash:
+     * don't bother copying the tiles */
+    mt = NULL;
+  }
+  /* new requests for this metatile must now go through the cache */
+  apr_hash_set(table->flights, flight->key, APR_HASH_KEY_STRING, NULL);
+  apr_thread_mutex_unlock(table->mutex);
+  if(mt) {
+    tiles = calloc(mt->ntiles, sizeof(mapcache_inflight_tile));
+    for(i=0; i<mt->ntiles; i++) {
+      mapcache_tile *tile = &mt->tiles[i];
+      /* only share tiles that we can hand out as is, the others will be read back from the cache */
+      if(tile->nodata || !tile->encoded_data || !tile->encoded_data->size) continue;
+      tiles[ntiles].data = malloc(tile->encoded_data->size);
+      if(!tiles[ntiles].data) continue;
+      memcpy(tiles[ntiles].data, tile->encoded_data->buf, tile->encoded_data->size);
+      tiles[ntiles].size = tile->encoded_data->size;
+      tiles[ntiles].mtime = tile->mtime;
+      tiles[ntiles].x = tile->x;
+      tiles[ntiles].y = tile->y;
+      ntiles++;
+    }
+  }
+  apr_thread_mutex_lock(table->mutex);
+  flight->tiles = tiles;
+  flight->ntiles = ntiles;
+  flight->done = 1;
+  apr_thread_cond_broadcast(table->cond);
+  apr_thread_mutex_unlock(table->mutex);
+}
+
+int mapcache_inflight_wait(mapcache_context *ctx, mapcache_inflight_table *table, mapcache_inflight *flight, mapcache_tile *tile)
+{
+  int i, ret = MAPCACHE_CACHE_MISS;
+  apr_thread_mutex_lock(table->mutex);
+  while(!flight->done) {
+    apr_thread_cond_wait(table->cond, table->mutex);
+  }
+  for(i=0; i<flight->ntiles; i++) {
+    if(flight->tiles[i].x == tile->x && flight->tiles[i].y == tile->y) {
+      tile->encoded_data = mapcache_buffer_create(flight->tiles[i].size, ctx->pool);
+      memcpy(tile->encoded_data->buf, flight->tiles[i].data, flight->tiles[i].size);
+      tile->encoded_data->size = flight->tiles[i].size;
+      tile->mtime = flight->tiles[i].mtime;
+      ret = MAPCACHE_SUCCESS;
+      break;
+    }
+  }
+  apr_thread_mutex_unlock(table->mutex);
+  return ret;
+}
+
+void mapcache_inflight_leave(mapcache_context *ctx, mapcache_inflight_table *table, mapcache_inflight *flight)
+{
+  int i, last;
+  if(!flight) return;
+  apr_thread_mutex_lock(table->mutex);
+  last = (--flight->refcount == 0);
+  apr_thread_mutex_unlock(table->mutex);
+  if(last) {
+    for(i=0; i<flight->ntiles; i++) {
+      free(flight->tiles[i].data);
+    }
+    free(flight->tiles);
+    free(flight->key);
+    free(flight);
+  }
+}
+
+#else
+
+mapcache_inflight_table* mapcache_inflight_table_create(apr_pool_t *pool)
+{
+  return NULL;
+}
+
+mapcache_inflight* mapcache_inflight_join(mapcache_context *ctx, mapcache_inflight_table *table, const char *key, int *leader)
+{
+  *leader = MAPCACHE_TRUE;
+  return NULL;
+}
+
+void mapcache_inflight_land(mapcache_context *ctx, mapcache_inflight_table *table, mapcache_inflight *flight, mapcache_metatile *mt) {}
+
+int mapcache_inflight_wait(mapcache_context *ctx, mapcache_inflight_table *table, mapcache_inflight *flight, mapcache_tile *tile)
+{
+  return MAPCACHE_CACHE_MISS;
+}
+
+void mapcache_inflight_leave(mapcache_context *ctx, mapcache_inflight_table *table, mapcache_inflight *flight) {}
+
+#endif
 /* vim: ts=2 sts=2 et sw=2
 */
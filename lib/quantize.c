@@ -0,0 +1,558 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: palette generation for quantized images
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * - the colors of the image are counted in an open addressing hash table. When there
+ *   are too many of them, low order bits of each channel are dropped from the hash
+ *   keys, the exact sums of the counted colors being kept to compute their averages.
+ * - if there are no more colors than requested they are used as is. Otherwise they
+ *   are inserted in an octree (with 16 children per node, alpha being the fourth
+ *   dimension) whose least populated deepest nodes are merged until there are few
+ *   enough leaves, and the leaf colors are refined by a k-means pass over the
+ *   histogram.
+ * - pixels are mapped to their closest palette entry with a k-d tree search, behind a
+ *   cache of the last looked up colors.
+ *
+ * the channels are processed in the byte order of the image pixels, which does not
+ * matter for any of the above.
+ */
+
+#define HIST_MAX_BITS 16 /* the histogram holds at most 32768 colors */
+#define OCTREE_DEPTH 5
+#define CLASSIFY_CACHE_BITS 12
+
+typedef struct {
+  unsigned char index; /* of the palette entry */
+  unsigned char axis;
+  short left, right; /* -1 if absent */
+} _kd_node;
+
+struct mapcache_palette {
+  int ncolors;
+  unsigned char colors[256][4];
+  _kd_node kd[256];
+  int kd_root;
+};
+
+typedef struct {
+  unsigned int key;
+  unsigned int count; /* 0 for free slots */
+  double sum[4];
+} _hist_entry;
+
+typedef struct {
+  _hist_entry *entries;
+  int bits;
+  int used;
+  int shift; /* number of low order bits dropped from each channel */
+  unsigned int mask;
+} _hist;
+
+typedef struct {
+  double sum[4];
+  double count;
+  int child[16]; /* 0 if absent, the root is nobody's child */
+  int level;
+  int leaf;
+} _octree_node;
+
+typedef struct {
+  _octree_node *nodes;
+  int nnodes;
+  int size;
+} _octree;
+
+static _hist_entry* _hist_slot(_hist *h, unsigned int key)
+{
+  unsigned int mask = (1u << h->bits) - 1;
+  unsigned int i = (key * 2654435761u) >> (32 - h->bits);
+  while(h->entries[i].count && h->entries[i].key != key) {
+    i = (i + 1) & mask;
+  }
+  return &h->entries[i];
+}
+
+/* drop one more bit from each channel and merge the colors that now share a key */
+static int _hist_coarsen(_hist *h)
+{
+  _hist_entry *old = h->entries;
+  int i, n = 1 << h->bits;
+  unsigned int m;
+  h->entries = calloc(n, sizeof(_hist_entry));
+  if(!h->entries) {
+    h->entries = old;
+    return MAPCACHE_FAILURE;
+  }
+  h->shift++;
+  m = (0xff << h->shift) & 0xff;
+  h->mask = m | m << 8 | m << 16 | m << 24;
+  h->used = 0;
+  for(i=0; i<n; i++) {
+    if(old[i].count) {
+      _hist_entry *e = _hist_slot(h, old[i].key & h->mask);
+      int c;
+      if(!e->count) {
+        e->key = old[i].key & h->mask;
+        h->used++;
+      }
+      e->count += old[i].count;
+      for(c=0; c<4; c++) e->sum[c] += old[i].sum[c];
+    }
+  }
+  free(old);
+  return MAPCACHE_SUCCESS;
+}
+
+static int _hist_add(_hist *h, unsigned int pixel, unsigned int count)
+{
+  const unsigned char *c = (const unsigned char*)&pixel;
+  _hist_entry *e = _hist_slot(h, pixel & h->mask);
+  if(!e->count) {
+    /* keep the load factor under one half */
+    while(h->used >= (1 << (h->bits - 1))) {
+      if(_hist_coarsen(h) != MAPCACHE_SUCCESS) {
+        return MAPCACHE_FAILURE;
+      }
+      e = _hist_slot(h, pixel & h->mask);
+      if(e->count) break;
+    }
+    if(!e->count) {
+      e->key = pixel & h->mask;
+      h->used++;
+    }
+  }
+  e->count += count;
+  e->sum[0] += (double)c[0] * count;
+  e->sum[1] += (double)c[1] * count;
+  e->sum[2] += (double)c[2] * count;
+  e->sum[3] += (double)c[3] * count;
+  return MAPCACHE_SUCCESS;
+}
+
+static int _hist_build(_hist *h, mapcache_image *image)
+{
+  size_t npixels = image->w * image->h;
+  size_t row, col;
+  memset(h, 0, sizeof(_hist));
+  h->bits = 4;
+  while(h->bits < HIST_MAX_BITS && ((size_t)1 << (h->bits - 1)) < npixels) {
+    h->bits++;
+  }
+  h->mask = 0xffffffff;
+  h->entries = calloc(1 << h->bits, sizeof(_hist_entry));
+  if(!h->entries) {
+    return MAPCACHE_FAILURE;
+  }
+  for(row=0; row<image->h; row++) {
+    unsigned int *px = (unsigned int*)(image->data + row * image->stride);
+    unsigned int run = 1;
+    /* tiles are full of runs of identical pixels, count them before hashing */
+    for(col=1; col<image->w; col++) {
+      if(px[col] == px[col-1]) {
+        run++;
+        continue;
+      }
+      if(_hist_add(h, px[col-1], run) != MAPCACHE_SUCCESS) {
+        return MAPCACHE_FAILURE;
+      }
+      run = 1;
+    }
+    if(image->w && _hist_add(h, px[image->w-1], run) != MAPCACHE_SUCCESS) {
+      return MAPCACHE_FAILURE;
+    }
+  }
+  return MAPCACHE_SUCCESS;
+}
+
+static void _hist_entry_color(const _hist_entry *e, unsigned char *color)
+{
+  int c;
+  for(c=0; c<4; c++) {
+    color[c] = (unsigned char)(e->sum[c] / e->count + 0.5);
+  }
+}
+
+static int _octree_new_node(_octree *o, int level)
+{
+  if(o->nnodes == o->size) {
+    int size = o->size ? o->size * 2 : 256;
+    _octree_node *nodes = realloc(o->nodes, size * sizeof(_octree_node));
+    if(!nodes) {
+      return -1;
+    }
+    o->nodes = nodes;
+    o->size = size;
+  }
+  memset(&o->nodes[o->nnodes], 0, sizeof(_octree_node));
+  o->nodes[o->nnodes].level = level;
+  o->nodes[o->nnodes].leaf = (level == OCTREE_DEPTH);
+  return o->nnodes++;
+}
+
+/* \returns the number of leaves created, or -1 on allocation failure */
+static int _octree_insert(_octree *o, const _hist_entry *e)
+{
+  unsigned char color[4];
+  int node = 0, level, c, created = 0;
+  _hist_entry_color(e, color);
+  for(level=0; ; level++) {
+    _octree_node *n = &o->nodes[node];
+    int idx;
+    n->count += e->count;
+    for(c=0; c<4; c++) n->sum[c] += e->sum[c];
+    if(level == OCTREE_DEPTH) {
+      break;
+    }
+    idx = ((color[0] >> (7 - level)) & 1) |
+          (((color[1] >> (7 - level)) & 1) << 1) |
+          (((color[2] >> (7 - level)) & 1) << 2) |
+          (((color[3] >> (7 - level)) & 1) << 3);
+    if(!n->child[idx]) {
+      int child = _octree_new_node(o, level + 1);
+      if(child < 0) {
+        return -1;
+      }
+      /* o->nodes may have moved */
+      o->nodes[node].child[idx] = child;
+      if(level + 1 == OCTREE_DEPTH) {
+        created++;
+      }
+    }
+    node = o->nodes[node].child[idx];
+  }
+  return created;
+}
+
+typedef struct {
+  double count;
+  int node;
+} _octree_candidate;
+
+static int _octree_candidate_cmp(const void *a, const void *b)
+{
+  double ca = ((const _octree_candidate*)a)->count, cb = ((const _octree_candidate*)b)->count;
+  return (ca > cb) - (ca < cb);
+}
+
+/*
+ * merge the nodes of the deepest level into their parents, least populated first,
+ * until there are no more than ncolors leaves. The children of the nodes of a level
+ * are all leaves once the levels below it have been processed.
+ */
+static int _octree_reduce(_octree *o, int leaves, int ncolors)
+{
+  _octree_candidate *candidates = malloc(o->nnodes * sizeof(_octree_candidate));
+  int level, i, k;
+  if(!candidates) {
+    return MAPCACHE_FAILURE;
+  }
+  for(level=OCTREE_DEPTH-1; level>=0 && leaves>ncolors; level--) {
+    int n = 0;
+    for(i=0; i<o->nnodes; i++) {
+      if(o->nodes[i].level == level) {
+        candidates[n].count = o->nodes[i].count;
+        candidates[n].node = i;
+        n++;
+      }
+    }
+    qsort(candidates, n, sizeof(_octree_candidate), _octree_candidate_cmp);
+    for(i=0; i<n && leaves>ncolors; i++) {
+      _octree_node *node = &o->nodes[candidates[i].node];
+      int nchildren = 0;
+      for(k=0; k<16; k++) {
+        if(node->child[k]) nchildren++;
+      }
+      node->leaf = 1;
+      leaves -= nchildren - 1;
+    }
+  }
+  free(candidates);
+  return MAPCACHE_SUCCESS;
+}
+
+static void _octree_palette(_octree *o, int node, mapcache_palette *p)
+{
+  _octree_node *n = &o->nodes[node];
+  int k;
+  if(n->leaf) {
+    for(k=0; k<4; k++) {
+      p->colors[p->ncolors][k] = (unsigned char)(n->sum[k] / n->count + 0.5);
+    }
+    p->ncolors++;
+    return;
+  }
+  for(k=0; k<16; k++) {
+    if(n->child[k]) {
+      _octree_palette(o, n->child[k], p);
+    }
+  }
+}
+
+/* partition idx so that the k-th entry is in its sorted position along axis */
+static void _kd_select(const mapcache_palette *p, unsigned char *idx, int n, int k, int axis)
+{
+  int lo = 0, hi = n - 1;
+  while(lo < hi) {
+    int pivot = p->colors[idx[(lo + hi) / 2]][axis];
+    int i = lo, j = hi;
+    while(i <= j) {
+      while(p->colors[idx[i]][axis] < pivot) i++;
+      while(p->colors[idx[j]][axis] > pivot) j--;
+      if(i <= j) {
+        unsigned char t = idx[i];
+        idx[i] = idx[j];
+        idx[j] = t;
+        i++;
+        j--;
+      }
+    }
+    if(k <= j) {
+      hi = j;
+    } else if(k >= i) {
+      lo = i;
+    } else {
+      break;
+    }
+  }
+}
+
+static int _kd_build(mapcache_palette *p, unsigned char *idx, int n, int *next)
+{
+  int lo[4] = {255, 255, 255, 255}, hi[4] = {0, 0, 0, 0};
+  int i, c, axis = 0, m, node;
+  if(n <= 0) {
+    return -1;
+  }
+  for(i=0; i<n; i++) {
+    for(c=0; c<4; c++) {
+      int v = p->colors[idx[i]][c];
+      if(v < lo[c]) lo[c] = v;
+      if(v > hi[c]) hi[c] = v;
+    }
+  }
+  for(c=1; c<4; c++) {
+    if(hi[c] - lo[c] > hi[axis] - lo[axis]) axis = c;
+  }
+  m = n / 2;
+  _kd_select(p, idx, n, m, axis);
+  node = (*next)++;
+  p->kd[node].index = idx[m];
+  p->kd[node].axis = axis;
+  p->kd[node].left = _kd_build(p, idx, m, next);
+  p->kd[node].right = _kd_build(p, idx + m + 1, n - m - 1, next);
+  return node;
+}
+
+static void _palette_index(mapcache_palette *p)
+{
+  unsigned char idx[256];
+  int i, next = 0;
+  for(i=0; i<p->ncolors; i++) {
+    idx[i] = i;
+  }
+  p->kd_root = _kd_build(p, idx, p->ncolors, &next);
+}
+
+static void _kd_nearest(const mapcache_palette *p, int node, const unsigned char *color, int *best, int *bestdist)
+{
+  while(node >= 0) {
+    const _kd_node *n = &p->kd[node];
+    const unsigned char *pc = p->colors[n->index];
+    int d0 = color[0] - pc[0], d1 = color[1] - pc[1], d2 = color[2] - pc[2], d3 = color[3] - pc[3];
+    int dist = d0*d0 + d1*d1 + d2*d2 + d3*d3;
+    int diff = color[n->axis] - pc[n->axis];
+    if(dist < *bestdist) {
+      *bestdist = dist;
+      *best = n->index;
+    }
+    if(diff < 0) {
+      _kd_nearest(p, n->left, color, best, bestdist);
+      node = n->right;
+    } else {
+      _kd_nearest(p, n->right, color, best, bestdist);
+      node = n->left;
+    }
+    /* the other side can only hold a closer color if the splitting plane is */
+    if(diff*diff >= *bestdist) {
+      break;
+    }
+  }
+}
+
+static int _palette_lookup(const mapcache_palette *p, const unsigned char *color)
+{
+  int best = 0, bestdist = 0x7fffffff;
+  _kd_nearest(p, p->kd_root, color, &best, &bestdist);
+  return best;
+}
+
+/* move each palette entry to the average of the histogram colors closest to it */
+static void _palette_refine(mapcache_palette *p, _hist *h)
+{
+  double (*sums)[5] = calloc(p->ncolors, sizeof(*sums));
+  int i, c, n = 1 << h->bits;
+  if(!sums) {
+    return; /* keep the unrefined palette */
+  }
+  for(i=0; i<n; i++) {
+    if(h->entries[i].count) {
+      unsigned char color[4];
+      int k;
+      _hist_entry_color(&h->entries[i], color);
+      k = _palette_lookup(p, color);
+      for(c=0; c<4; c++) sums[k][c] += h->entries[i].sum[c];
+      sums[k][4] += h->entries[i].count;
+    }
+  }
+  for(i=0; i<p->ncolors; i++) {
+    if(sums[i][4] > 0) {
+      for(c=0; c<4; c++) {
+        p->colors[i][c] = (unsigned char)(sums[i][c] / sums[i][4] + 0.5);
+      }
+    }
+  }
+  free(sums);
+  _palette_index(p);
+}
+
+mapcache_palette* mapcache_palette_create(mapcache_context *ctx, mapcache_image *image, int ncolors)
+{
+  mapcache_palette *p;
+  _hist h;
+  int i, n;
+
+  if(ncolors < 1 || ncolors > 256) {
+    ctx->set_error(ctx, 500, "BUG: invalid number of palette colors %d", ncolors);
+    return NULL;
+  }
+  if(_hist_build(&h, image) != MAPCACHE_SUCCESS) {
+    free(h.entries);
+    ctx->set_error(ctx, 500, "failed to allocate image histogram");
+    return NULL;
+  }
+  p = apr_pcalloc(ctx->pool, sizeof(mapcache_palette));
+  n = 1 << h.bits;
+
+  if(h.shift == 0 && h.used <= ncolors) {
+    /* few enough colors to be kept exactly */
+    for(i=0; i<n; i++) {
+      if(h.entries[i].count) {
+        memcpy(p->colors[p->ncolors++], &h.entries[i].key, 4);
+      }
+    }
+    _palette_index(p);
+  } else {
+    _octree o;
+    int leaves = 0;
+    memset(&o, 0, sizeof(_octree));
+    if(_octree_new_node(&o, 0) < 0) {
+      goto nomem;
+    }
+    for(i=0; i<n; i++) {
+      if(h.entries[i].count) {
+        int created = _octree_insert(&o, &h.entries[i]);
+        if(created < 0) {
+          free(o.nodes);
+          goto nomem;
+        }
+        leaves += created;
+      }
+    }
+    if(_octree_reduce(&o, leaves, ncolors) != MAPCACHE_SUCCESS) {
+      free(o.nodes);
+      goto nomem;
+    }
+    _octree_palette(&o, 0, p);
+    free(o.nodes);
+    _palette_index(p);
+    _palette_refine(p, &h);
+  }
+  free(h.entries);
+  return p;
+
+nomem:
+  free(h.entries);
+  ctx->set_error(ctx, 500, "failed to allocate palette octree");
+  return NULL;
+}
+
+void mapcache_palette_classify(mapcache_context *ctx, const mapcache_palette *palette, mapcache_image *image,
+                               unsigned char *pixels)
+{
+  struct {
+    unsigned int pixel;
+    int index;
+  } *cache;
+  size_t row, col;
+  int i;
+
+  cache = malloc(sizeof(*cache) << CLASSIFY_CACHE_BITS);
+  if(!cache) {
+    ctx->set_error(ctx, 500, "failed to allocate palette lookup cache");
+    return;
+  }
+  for(i=0; i<(1 << CLASSIFY_CACHE_BITS); i++) {
+    cache[i].index = -1;
+  }
+  for(row=0; row<image->h; row++) {
+    unsigned int *px = (unsigned int*)(image->data + row * image->stride);
+    unsigned char *out = pixels + row * image->w;
+    unsigned int last = 0;
+    int last_index = -1;
+    for(col=0; col<image->w; col++) {
+      unsigned int slot;
+      if(last_index >= 0 && px[col] == last) {
+        out[col] = last_index;
+        continue;
+      }
+      slot = (px[col] * 2654435761u) >> (32 - CLASSIFY_CACHE_BITS);
+      if(cache[slot].index < 0 || cache[slot].pixel != px[col]) {
+        cache[slot].pixel = px[col];
+        cache[slot].index = _palette_lookup(palette, (const unsigned char*)&px[col]);
+      }
+      last = px[col];
+      last_index = cache[slot].index;
+      out[col] = last_index;
+    }
+  }
+  free(cache);
+}
+
+int mapcache_palette_colors(const mapcache_palette *palette, const unsigned char **colors)
+{
+  *colors = &palette->colors[0][0];
+  return palette->ncolors;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
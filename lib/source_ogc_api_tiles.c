@@ -209,6 +209,7 @@ void _mapcache_source_ogc_api_tiles_proxy_map(mapcache_context *ctx, mapcache_so
   mapcache_source_ogc_api_vtmatrix *vtmatrix;
    
   int col, row, matrix, x, y, level, i, imax ;
+  mapcache_http_transfer **transfers;
   char *tilematrixset = grid_link->grid->name;
   char *extension = map->tileset->format->extension;
   char *tilesetname = map->tileset->name;
@@ -277,6 +278,7 @@ void _mapcache_source_ogc_api_tiles_proxy_map(mapcache_context *ctx, mapcache_so
 
 
   imax = vtmatrix->urls->nelts;
+  transfers = apr_pcalloc(ctx->pool, imax*sizeof(mapcache_http_transfer*));
 
   ctx->log(ctx,MAPCACHE_DEBUG,"ogc_api_tiles: fetching tiles...%d",imax);   
   for(i=0;i<imax;i++) {
@@ -288,8 +290,13 @@ void _mapcache_source_ogc_api_tiles_proxy_map(mapcache_context *ctx, mapcache_so
     http->url = _mapcache_source_ogc_api_tiles_get_tile_url(ctx, entry->url, tilematrixset, matrix, row, col, tilesetname, extension);
   
     ctx->log(ctx,MAPCACHE_DEBUG,"URL %s from Template %s",http->url, entry->url);   
-    mapcache_http_do_request(ctx,http,map->encoded_data,NULL,NULL);
-    GC_CHECK_ERROR(ctx);
+    transfers[i] = mapcache_http_submit(ctx,http,map->encoded_data,NULL,NULL);
+  }
+
+  /* the urls are fetched concurrently, their responses are appended in order */
+  mapcache_http_transfer_await_all(ctx,transfers,imax);
+  for(i=0;i<imax;i++) {
+    mapcache_http_await(ctx,transfers[i]);
   }
 
   GC_CHECK_ERROR(ctx);
@@ -253,6 +253,50 @@ void mapcache_tileset_get_map_tiles(mapcache_context *ctx, mapcache_tileset *til
   *ntiles = i;
 }
 
+/*
+ * decode the tiles of the given row of tiles (band) of the mosaic into dst, starting at the given row
+ */
+static void _mapcache_tileset_assemble_band(mapcache_context *ctx, mapcache_tile **tiles, int ntiles,
+    int *tile_ox, int *tile_band, int band, mapcache_image *dst, int row, int scale_denom)
+{
+  int i;
+  for(i=0; i<ntiles; i++) {
+    mapcache_image fakeimg;
+    mapcache_tile *tile = tiles[i];
+    if(tile->nodata || tile_band[i] != band) continue;
+
+    fakeimg.stride = dst->stride;
+    fakeimg.data = &(dst->data[row*dst->stride+tile_ox[i]*4]);
+    if(!tile->raw_image) {
+      mapcache_image_cache *image_cache = tile->tileset->config?tile->tileset->config->image_cache:NULL;
+      char *key = NULL;
+      if(image_cache && tile->mtime) {
+        /* without a modification time we couldn't tell if a previously decoded image is stale */
+        key = apr_psprintf(ctx->pool, "%s/%d", mapcache_util_get_tile_key(ctx, tile, NULL, NULL, NULL), scale_denom);
+        if(mapcache_image_cache_get(image_cache, key, tile->mtime, &fakeimg) == MAPCACHE_SUCCESS) {
+          continue;
+        }
+      }
+      mapcache_imageio_decode_to_image_scaled(ctx,tile->encoded_data,&fakeimg,scale_denom);
+      if(GC_HAS_ERROR(ctx)) {
+        return;
+      }
+      if(key) {
+        mapcache_image_cache_set(image_cache, key, tile->mtime, &fakeimg);
+      }
+    } else {
+      int r;
+      unsigned char *srcptr = tile->raw_image->data;
+      unsigned char *dstptr = fakeimg.data;
+      for(r=0; r<tile->raw_image->h; r++) {
+        memcpy(dstptr,srcptr,tile->raw_image->stride);
+        srcptr += tile->raw_image->stride;
+        dstptr += fakeimg.stride;
+      }
+    }
+  }
+}
+
 mapcache_image* mapcache_tileset_assemble_map_tiles(mapcache_context *ctx, mapcache_tileset *tileset,
     mapcache_grid_link *grid_link,
     mapcache_extent *bbox, int width, int height,
@@ -269,6 +313,10 @@ mapcache_image* mapcache_tileset_assemble_map_tiles(mapcache_context *ctx, mapca
   mapcache_image *image;
   mapcache_image *srcimage;
   double tileresolution, dstminx, dstminy, hf, vf;
+  int scale_denom = 8;
+  int tile_sx, tile_sy;
+  int *tile_ox, *tile_band;
+  int nbands, band, halo, nearest, y0, y1;
 #ifdef DEBUG
   /* we know at least one tile contains data */
   for(i=0; i<ntiles; i++) {
@@ -297,71 +345,73 @@ mapcache_image* mapcache_tileset_assemble_map_tiles(mapcache_context *ctx, mapca
     if(tile->x > Mx) Mx = tile->x;
     if(tile->y > My) My = tile->y;
   }
-  /* create image that will contain the unscaled tiles data */
-  srcimage = mapcache_image_create_with_data(ctx,
-          (Mx-mx+1)*tiles[0]->grid_link->grid->tile_sx,
-          (My-my+1)*tiles[0]->grid_link->grid->tile_sy);
 
-  /* copy the tiles data into the src image */
+  /*
+   * if the map has a lower resolution than the tiles, jpeg tiles can be reduced by
+   * 2, 4 or 8 while being decoded, which is much cheaper than decoding them fully
+   * before downsampling
+   */
+  tile_sx = tiles[0]->grid_link->grid->tile_sx;
+  tile_sy = tiles[0]->grid_link->grid->tile_sy;
+  tileresolution = tiles[0]->grid_link->grid->levels[tiles[0]->z]->resolution;
+  while(scale_denom > 1 && (tileresolution * scale_denom > hresolution * 1.0001 ||
+                            tileresolution * scale_denom > vresolution * 1.0001 ||
+                            tile_sx % scale_denom || tile_sy % scale_denom)) {
+    scale_denom /= 2;
+  }
+  for(i=0; i<ntiles && scale_denom > 1; i++) {
+    if(!tiles[i]->nodata && (tiles[i]->raw_image || mapcache_imageio_header_sniff(ctx,tiles[i]->encoded_data) != GC_JPEG)) {
+      scale_denom = 1;
+    }
+  }
+  tile_sx /= scale_denom;
+  tile_sy /= scale_denom;
+
+  /* compute where each tile lands in the mosaic of unresampled tiles */
+  nbands = My-my+1;
+  tile_ox = apr_palloc(ctx->pool, ntiles*sizeof(int));
+  tile_band = apr_palloc(ctx->pool, ntiles*sizeof(int));
   for(i=0; i<ntiles; i++) {
-    int ox,oy; /* the offset from the start of the src image to the start of the tile */
-    mapcache_image fakeimg;
+    int oy; /* the offset from the start of the mosaic to the start of the tile */
     mapcache_tile *tile = tiles[i];
     switch(grid_link->grid->origin) {
       case MAPCACHE_GRID_ORIGIN_BOTTOM_LEFT:
         if(tile->x == mx && tile->y == My) {
           toplefttile = tile;
         }
-        ox = (tile->x - mx) * tile->grid_link->grid->tile_sx;
-        oy = (My - tile->y) * tile->grid_link->grid->tile_sy;
+        tile_ox[i] = (tile->x - mx) * tile_sx;
+        oy = (My - tile->y) * tile_sy;
         break;
       case MAPCACHE_GRID_ORIGIN_TOP_LEFT:
         if(tile->x == mx && tile->y == my) {
           toplefttile = tile;
         }
-        ox = (tile->x - mx) * tile->grid_link->grid->tile_sx;
-        oy = (tile->y - my) * tile->grid_link->grid->tile_sy;
+        tile_ox[i] = (tile->x - mx) * tile_sx;
+        oy = (tile->y - my) * tile_sy;
         break;
       case MAPCACHE_GRID_ORIGIN_BOTTOM_RIGHT:
         if(tile->x == Mx && tile->y == My) {
           toplefttile = tile;
         }
-        ox = (Mx - tile->x) * tile->grid_link->grid->tile_sx;
-        oy = (My - tile->y) * tile->grid_link->grid->tile_sy;
+        tile_ox[i] = (Mx - tile->x) * tile_sx;
+        oy = (My - tile->y) * tile_sy;
         break;
       case MAPCACHE_GRID_ORIGIN_TOP_RIGHT:
         if(tile->x == Mx && tile->y == my) {
           toplefttile = tile;
         }
-        ox = (Mx - tile->x) * tile->grid_link->grid->tile_sx;
-        oy = (tile->y - my) * tile->grid_link->grid->tile_sy;
+        tile_ox[i] = (Mx - tile->x) * tile_sx;
+        oy = (tile->y - my) * tile_sy;
         break;
       default:
         ctx->set_error(ctx,500,"BUG: invalid grid origin");
         return NULL;
     }
-    if(tile->nodata) continue;
-
-
-    fakeimg.stride = srcimage->stride;
-    fakeimg.data = &(srcimage->data[oy*srcimage->stride+ox*4]);
-    if(!tile->raw_image) {
-      mapcache_imageio_decode_to_image(ctx,tile->encoded_data,&fakeimg);
-    } else {
-      int r;
-      unsigned char *srcptr = tile->raw_image->data;
-      unsigned char *dstptr = fakeimg.data;
-      for(r=0; r<tile->raw_image->h; r++) {
-        memcpy(dstptr,srcptr,tile->raw_image->stride);
-        srcptr += tile->raw_image->stride;
-        dstptr += fakeimg.stride;
-      }
-    }
+    tile_band[i] = oy / tile_sy;
   }
 
   assert(toplefttile);
 
-  /* copy/scale the srcimage onto the destination image */
   tileresolution = toplefttile->grid_link->grid->levels[toplefttile->z]->resolution;
   mapcache_grid_get_tile_extent(ctx,toplefttile->grid_link->grid,
                            toplefttile->x, toplefttile->y, toplefttile->z, &tilebbox);
@@ -369,21 +419,75 @@ mapcache_image* mapcache_tileset_assemble_map_tiles(mapcache_context *ctx, mapca
   /*compute the pixel position of top left corner*/
   dstminx = (tilebbox.minx-bbox->minx)/hresolution;
   dstminy = (bbox->maxy-tilebbox.maxy)/vresolution;
-  hf = tileresolution/hresolution;
-  vf = tileresolution/vresolution;
-  if(fabs(hf-1)<0.0001 && fabs(vf-1)<0.0001) {
-    //use nearest resampling if we are at the resolution of the tiles
-    mapcache_image_copy_resampled_nearest(ctx,srcimage,image,dstminx,dstminy,hf,vf);
-  } else {
-    switch(mode) {
-      case MAPCACHE_RESAMPLE_BILINEAR:
-        mapcache_image_copy_resampled_bilinear(ctx,srcimage,image,dstminx,dstminy,hf,vf,0);
-        break;
-      default:
-        mapcache_image_copy_resampled_nearest(ctx,srcimage,image,dstminx,dstminy,hf,vf);
-        break;
+  hf = tileresolution*scale_denom/hresolution;
+  vf = tileresolution*scale_denom/vresolution;
+  //use nearest resampling if we are at the resolution of the tiles
+  nearest = (fabs(hf-1)<0.0001 && fabs(vf-1)<0.0001) || mode != MAPCACHE_RESAMPLE_BILINEAR;
+
+  /*
+   * the mosaic is assembled and resampled one row of tiles (band) at a time, so that only
+   * the current band, the next one and the last row of the previous one are held in memory
+   * instead of the whole mosaic. The next band is needed when interpolating the last rows of
+   * the current one, and the previous row when a destination row rounds to just above it.
+   */
+  halo = (nbands > 1)?1:0;
+  srcimage = mapcache_image_create_with_data(ctx, (Mx-mx+1)*tile_sx, (nbands > 1)?(2*tile_sy+1):tile_sy);
+  _mapcache_tileset_assemble_band(ctx, tiles, ntiles, tile_ox, tile_band, 0, srcimage, halo, scale_denom);
+  if(nbands > 1 && !GC_HAS_ERROR(ctx)) {
+    _mapcache_tileset_assemble_band(ctx, tiles, ntiles, tile_ox, tile_band, 1, srcimage, halo+tile_sy, scale_denom);
+  }
+  if(GC_HAS_ERROR(ctx)) {
+    return NULL;
+  }
+
+  /* copy/scale the bands onto the destination image */
+  y0 = 0;
+  for(band=0; band<nbands; band++) {
+    mapcache_image window, dstband;
+    int first_row; /* the row of the mosaic at the start of the window */
+    if(band > 0) {
+      /* slide the bands up, keeping the last row of the previous band */
+      memcpy(srcimage->data, srcimage->data + tile_sy*srcimage->stride, srcimage->stride);
+      memcpy(srcimage->data + srcimage->stride, srcimage->data + (1+tile_sy)*srcimage->stride, tile_sy*srcimage->stride);
+      memset(srcimage->data + (1+tile_sy)*srcimage->stride, 0, tile_sy*srcimage->stride);
+      if(band+1 < nbands) {
+        _mapcache_tileset_assemble_band(ctx, tiles, ntiles, tile_ox, tile_band, band+1, srcimage, 1+tile_sy, scale_denom);
+        if(GC_HAS_ERROR(ctx)) {
+          return NULL;
+        }
+      }
+    }
+    window = *srcimage;
+    if(band > 0) {
+      first_row = band*tile_sy - 1;
+      window.h = 1 + tile_sy;
+    } else {
+      first_row = 0;
+      window.data = srcimage->data + halo*srcimage->stride;
+      window.h = tile_sy;
+    }
+    if(band+1 < nbands) {
+      window.h += tile_sy;
+      /* the destination rows whose (rounded) source row falls in the current band */
+      y1 = (int)ceil(dstminy + ((band+1)*tile_sy - (nearest?0.5:0))*vf);
+      if(y1 > image->h) y1 = image->h;
+      if(y1 < y0) y1 = y0;
+    } else {
+      y1 = image->h;
+    }
+    if(y1 > y0) {
+      dstband = *image;
+      dstband.data = image->data + y0*image->stride;
+      dstband.h = y1 - y0;
+      if(nearest) {
+        mapcache_image_copy_resampled_nearest(ctx,&window,&dstband,dstminx,dstminy+first_row*vf-y0,hf,vf);
+      } else {
+        mapcache_image_copy_resampled_bilinear(ctx,&window,&dstband,dstminx,dstminy+first_row*vf-y0,hf,vf,0);
+      }
     }
+    y0 = y1;
   }
+
   /* free the memory of the temporary source image */
   apr_pool_cleanup_run(ctx->pool, srcimage->data, (void*)free) ;
   return image;
@@ -506,6 +610,91 @@ mapcache_source *mapcache_select_source(mapcache_context *ctx, mapcache_metatile
   
   return source;
 }
+#if APR_HAS_THREADS
+typedef struct {
+  mapcache_context *ctx;
+  mapcache_tile **tiles;
+  int ntiles;
+} _encode_job;
+
+static void _mapcache_tileset_encode_tiles(mapcache_context *ctx, mapcache_tile **tiles, int ntiles)
+{
+  int i;
+  for(i=0; i<ntiles; i++) {
+    tiles[i]->encoded_data = tiles[i]->tileset->format->write(ctx, tiles[i]->raw_image, tiles[i]->tileset->format);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+static void _worker_encode_tiles(void *data)
+{
+  _encode_job *job = (_encode_job*)data;
+  _mapcache_tileset_encode_tiles(job->ctx, job->tiles, job->ntiles);
+}
+#endif
+
+/*
+ * encode the tiles of a freshly split metatile before they are handed to the cache,
+ * spreading them over the worker pool threads that are idle. Tiles that are not
+ * encoded here (blank ones, whose encoding caches may skip, or all of them if the
+ * worker pool is busy) are encoded by the cache as before.
+ */
+static void _mapcache_tileset_metatile_encode(mapcache_context *ctx, mapcache_metatile *mt)
+{
+#if APR_HAS_THREADS
+  mapcache_worker_batch *batch;
+  mapcache_tile **tiles;
+  _encode_job *jobs;
+  int i, n = 0, idle, njobs, start;
+
+  if(!ctx->worker_pool || mt->ntiles < 2 || !mt->map.tileset->format) {
+    return;
+  }
+  /* never queue more jobs than there are idle workers, so that other requests do not wait behind us */
+  idle = mapcache_worker_pool_thread_count(ctx->worker_pool) - mapcache_worker_pool_busy_count(ctx->worker_pool)
+         - mapcache_worker_pool_queue_depth(ctx->worker_pool);
+  if(idle <= 0) {
+    return;
+  }
+  tiles = apr_palloc(ctx->pool, mt->ntiles * sizeof(mapcache_tile*));
+  for(i=0; i<mt->ntiles; i++) {
+    mapcache_tile *tile = &mt->tiles[i];
+    if(tile->encoded_data || !tile->raw_image || mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE) {
+      continue;
+    }
+    tiles[n++] = tile;
+  }
+  if(n < 2) {
+    return;
+  }
+  /* the calling thread encodes its share of the tiles too */
+  njobs = MAPCACHE_MIN(idle + 1, n);
+  batch = mapcache_worker_batch_create(ctx->worker_pool, ctx->pool);
+  if(!batch) {
+    return;
+  }
+  jobs = apr_pcalloc(ctx->pool, njobs * sizeof(_encode_job));
+  for(i=0, start=0; i<njobs; i++) {
+    jobs[i].tiles = tiles + start;
+    jobs[i].ntiles = (n - start) / (njobs - i);
+    start += jobs[i].ntiles;
+  }
+  for(i=1; i<njobs; i++) {
+    jobs[i].ctx = ctx->clone(ctx);
+    if(mapcache_worker_pool_push(batch, _worker_encode_tiles, &jobs[i]) != APR_SUCCESS) {
+      _worker_encode_tiles(&jobs[i]);
+    }
+  }
+  _mapcache_tileset_encode_tiles(ctx, jobs[0].tiles, jobs[0].ntiles);
+  mapcache_worker_batch_wait(batch);
+  for(i=1; i<njobs; i++) {
+    if(GC_HAS_ERROR(jobs[i].ctx) && !GC_HAS_ERROR(ctx)) {
+      ctx->set_error(ctx, jobs[i].ctx->get_error(jobs[i].ctx), jobs[i].ctx->get_error_message(jobs[i].ctx));
+    }
+  }
+#endif
+}
+
 /*
  * do the actual rendering and saving of a metatile:
  *  - query the datasource for the image data
@@ -533,6 +722,8 @@ void mapcache_tileset_render_metatile(mapcache_context *ctx, mapcache_metatile *
   GC_CHECK_ERROR(ctx);
   mapcache_image_metatile_split(ctx, mt);
   GC_CHECK_ERROR(ctx);
+  _mapcache_tileset_metatile_encode(ctx, mt);
+  GC_CHECK_ERROR(ctx);
   mapcache_cache_tile_multi_set(ctx, tileset->_cache, mt->tiles, mt->ntiles);
 }
 
@@ -547,6 +738,7 @@ mapcache_tileset* mapcache_tileset_create(mapcache_context *ctx)
   tileset->metabuffer = 0;
   tileset->expires = 300; /*set a reasonable default to 5 mins */
   tileset->auto_expire = 0;
+  tileset->stale_while_revalidate = 0;
   tileset->read_only = 0;
   tileset->metadata = apr_table_make(ctx->pool,3);
   tileset->dimensions = NULL;
@@ -567,6 +759,7 @@ mapcache_tileset* mapcache_tileset_clone(mapcache_context *ctx, mapcache_tileset
   dst->metabuffer = src->metabuffer;
   dst->expires = src->expires;
   dst->auto_expire = src->auto_expire;
+  dst->stale_while_revalidate = src->stale_while_revalidate;
   dst->metadata = src->metadata;
   dst->dimensions = src->dimensions;
   dst->format = src->format;
@@ -574,6 +767,7 @@ mapcache_tileset* mapcache_tileset_clone(mapcache_context *ctx, mapcache_tileset
   dst->config = src->config;
   dst->name = src->name;
   dst->_cache = src->_cache;
+  dst->transcode_cache = src->transcode_cache;
   dst->source = src->source;
   dst->watermark = src->watermark;
   dst->wgs84bbox = src->wgs84bbox;
@@ -624,6 +818,7 @@ mapcache_tile* mapcache_tileset_tile_clone(apr_pool_t *pool, mapcache_tile *src)
   tile->z = src->z;
 
   tile->allow_redirect = src->allow_redirect;
+  tile->allow_file = src->allow_file;
   return tile;
 }
 
@@ -832,6 +1027,102 @@ int mapcache_tileset_tile_get_readonly(mapcache_context *ctx, mapcache_tile *til
   return ret;
 }
 
+int mapcache_tileset_tile_stat(mapcache_context *ctx, mapcache_tile *tile) {
+  int ret;
+  if(tile->grid_link->outofzoom_strategy != MAPCACHE_OUTOFZOOM_NOTCONFIGURED &&
+          tile->z > tile->grid_link->max_cached_zoom) {
+    return MAPCACHE_FAILURE;
+  }
+  if(tile->dimensions) {
+    /* the cached dimension values would need to be resolved first */
+    return MAPCACHE_FAILURE;
+  }
+  ret = mapcache_cache_tile_stat(ctx, tile->tileset->_cache, tile);
+  if(GC_HAS_ERROR(ctx) || ret != MAPCACHE_SUCCESS) {
+    return ret;
+  }
+  if(!tile->mtime || !tile->encoded_size) {
+    /* not enough to identify the version of the tile */
+    return MAPCACHE_FAILURE;
+  }
+  if(tile->tileset->auto_expire) {
+    apr_time_t now = apr_time_now();
+    apr_time_t expire_time = tile->mtime + apr_time_from_sec(tile->tileset->auto_expire);
+    if(expire_time < now && tile->tileset->source && !tile->tileset->read_only) {
+      /* stale, will be re-rendered */
+      return MAPCACHE_CACHE_RELOAD;
+    }
+    tile->expires = apr_time_sec(expire_time-now);
+  }
+  return MAPCACHE_SUCCESS;
+}
+
+static int _mapcache_tileset_tile_batchable(mapcache_tile *tile) {
+  if(tile->grid_link->outofzoom_strategy != MAPCACHE_OUTOFZOOM_NOTCONFIGURED &&
+          tile->z > tile->grid_link->max_cached_zoom) {
+    return MAPCACHE_FALSE;
+  }
+  /* tiles with dimensions need their cached values resolved first */
+  return tile->dimensions?MAPCACHE_FALSE:MAPCACHE_TRUE;
+}
+
+void mapcache_tileset_tile_multi_get_cached(mapcache_context *ctx, mapcache_tile **tiles, int ntiles, int *done)
+{
+  mapcache_tile **batch = apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+  int *batch_idx = apr_palloc(ctx->pool, ntiles*sizeof(int));
+  int *rets = apr_palloc(ctx->pool, ntiles*sizeof(int));
+  int *seen = apr_pcalloc(ctx->pool, ntiles*sizeof(int));
+  int i,j,n;
+
+  for(i=0; i<ntiles; i++) {
+    mapcache_cache *cache;
+    if(seen[i] || !_mapcache_tileset_tile_batchable(tiles[i])) continue;
+    /* gather all the remaining tiles that live in the same cache */
+    cache = tiles[i]->tileset->_cache;
+    n = 0;
+    for(j=i; j<ntiles; j++) {
+      if(seen[j] || tiles[j]->tileset->_cache != cache || !_mapcache_tileset_tile_batchable(tiles[j])) continue;
+      seen[j] = 1;
+      batch[n] = tiles[j];
+      batch_idx[n] = j;
+      n++;
+    }
+    if(n < 2) {
+      /* nothing to gain, leave it to the regular path */
+      continue;
+    }
+
+    mapcache_cache_tile_multi_get(ctx, cache, batch, n, rets);
+    if(GC_HAS_ERROR(ctx)) {
+      /* let the single tile path deal with (and report) the error */
+      ctx->log(ctx, MAPCACHE_DEBUG, "batched get of %d tiles on cache %s failed (%s), retrying tile by tile",
+               n, cache->name, ctx->get_error_message(ctx));
+      ctx->clear_errors(ctx);
+      continue;
+    }
+
+    for(j=0; j<n; j++) {
+      mapcache_tile *tile = batch[j];
+      int read_only = (tile->tileset->read_only || !tile->tileset->source)?1:0;
+      if(rets[j] == MAPCACHE_SUCCESS) {
+        if(tile->tileset->auto_expire && tile->mtime) {
+          apr_time_t now = apr_time_now();
+          apr_time_t expire_time = tile->mtime + apr_time_from_sec(tile->tileset->auto_expire);
+          if(expire_time < now && !read_only) {
+            /* stale, mapcache_tileset_tile_get() will take care of refreshing it */
+            continue;
+          }
+          tile->expires = apr_time_sec(expire_time-now);
+        }
+        done[batch_idx[j]] = 1;
+      } else if(rets[j] == MAPCACHE_CACHE_MISS && read_only) {
+        tile->nodata = 1;
+        done[batch_idx[j]] = 1;
+      }
+    }
+  }
+}
+
 typedef struct {
   mapcache_tile *tile;
   int cache_status;
@@ -1033,6 +1324,138 @@ void mapcache_tileset_tile_get_with_subdimensions(mapcache_context *ctx, mapcach
   
 }
 
+/*
+ * render the metatile, unless another process is already doing so in which case
+ * we wait for it to finish, and hand over the result to the threads of this
+ * process that joined the flight.
+ */
+static int mapcache_tileset_metatile_render_once(mapcache_context *ctx, mapcache_metatile *mt, char *key, mapcache_inflight *flight)
+{
+  void *lock;
+  int isLocked = mapcache_lock_or_wait_for_resource(ctx, ctx->config->locker, key, &lock);
+  if(isLocked == MAPCACHE_TRUE && !GC_HAS_ERROR(ctx)) {
+    mapcache_write_behind_hold *hold, *outer = ctx->write_behind_hold;
+    void *error = NULL;
+     /* no other thread is doing the rendering, do it ourselves */
+#ifdef DEBUG
+    ctx->log(ctx, MAPCACHE_DEBUG, "cache miss/reload: tileset %s - metatile %d %d %d",
+         mt->map.tileset->name,mt->x, mt->y,mt->z);
+#endif
+    /* this will query the source to create the tiles, and save them to the cache */
+    hold = ctx->write_behind_hold = mapcache_write_behind_hold_create(ctx);
+    mapcache_tileset_render_metatile(ctx, mt);
+    ctx->write_behind_hold = outer;
+
+    if(GC_HAS_ERROR(ctx)) {
+      /* temporarily clear error state so we don't mess up with error handling in the locker */
+      ctx->pop_errors(ctx,&error);
+    }
+    /*
+     * tiles queued for writing are only visible to this process: keep other processes
+     * waiting on the lock until the writer has put them in the cache
+     */
+    if(!hold || mapcache_write_behind_hold_lock(ctx, hold, ctx->config->locker, lock) != MAPCACHE_SUCCESS) {
+      mapcache_unlock_resource(ctx, ctx->config->locker, lock);
+    }
+    if(error) {
+      ctx->push_errors(ctx,error);
+    }
+  }
+  /* wake up the threads waiting on us, handing them the tiles if we rendered them */
+  mapcache_inflight_land(ctx, ctx->config->inflight, flight,
+      (isLocked == MAPCACHE_TRUE && !GC_HAS_ERROR(ctx))?mt:NULL);
+  return isLocked;
+}
+
+typedef struct {
+  mapcache_tile *tile;
+  char *key;
+  mapcache_inflight *flight;
+} mapcache_tileset_revalidate_job;
+
+static void mapcache_tileset_revalidate_job_run(mapcache_context *ctx, void *data)
+{
+  mapcache_tileset_revalidate_job *job = (mapcache_tileset_revalidate_job*)data;
+  mapcache_metatile *mt = mapcache_tileset_metatile_get(ctx, job->tile);
+  mapcache_tileset_metatile_render_once(ctx, mt, job->key, job->flight);
+  mapcache_inflight_leave(ctx, ctx->config->inflight, job->flight);
+  if(GC_HAS_ERROR(ctx)) {
+    ctx->log(ctx, MAPCACHE_WARN, "tileset %s: background refresh of stale tile %d %d %d failed: %s",
+        job->tile->tileset->name, job->tile->x, job->tile->y, job->tile->z, ctx->get_error_message(ctx));
+  }
+}
+
+/* the worker pool is shutting down: let the threads that joined the flight fall back to the cache */
+static void mapcache_tileset_revalidate_job_cancel(mapcache_context *ctx, void *data)
+{
+  mapcache_tileset_revalidate_job *job = (mapcache_tileset_revalidate_job*)data;
+  mapcache_inflight_land(ctx, ctx->config->inflight, job->flight, NULL);
+  mapcache_inflight_leave(ctx, ctx->config->inflight, job->flight);
+}
+
+/*
+ * queue the re-rendering of a stale tile to the worker pool, unless its metatile is
+ * already being rendered by this process. Returns MAPCACHE_FAILURE if the refresh
+ * could not be queued, in which case the caller should render the tile itself.
+ */
+static int mapcache_tileset_tile_revalidate(mapcache_context *ctx, mapcache_tile *tile)
+{
+  mapcache_context *dctx;
+  mapcache_metatile *mt;
+  mapcache_inflight *flight;
+  mapcache_tileset_revalidate_job *job;
+  char *key;
+  int i, isLeader;
+
+  if(!ctx->worker_pool) {
+    return MAPCACHE_FAILURE;
+  }
+  mt = mapcache_tileset_metatile_get(ctx, tile);
+  key = mapcache_tileset_metatile_resource_key(ctx,mt);
+  flight = mapcache_inflight_join(ctx, ctx->config->inflight, key, &isLeader);
+  if(!isLeader) {
+    /* already being refreshed */
+    mapcache_inflight_leave(ctx, ctx->config->inflight, flight);
+    return MAPCACHE_SUCCESS;
+  }
+
+  dctx = mapcache_worker_pool_detached_context(ctx);
+  if(!dctx) {
+    mapcache_inflight_land(ctx, ctx->config->inflight, flight, NULL);
+    mapcache_inflight_leave(ctx, ctx->config->inflight, flight);
+    return MAPCACHE_FAILURE;
+  }
+
+  /* the job outlives the request, so copy everything it needs that may have been allocated from the request pool */
+  job = apr_pcalloc(dctx->pool, sizeof(mapcache_tileset_revalidate_job));
+  job->tile = mapcache_tileset_tile_clone(dctx->pool, tile);
+  job->tile->tileset = mapcache_tileset_clone(dctx, tile->tileset);
+  job->tile->tileset->name = apr_pstrdup(dctx->pool, tile->tileset->name);
+  job->tile->tileset->read_only = tile->tileset->read_only;
+  if(job->tile->dimensions) {
+    for(i=0; i<job->tile->dimensions->nelts; i++) {
+      mapcache_requested_dimension *rdim = APR_ARRAY_IDX(job->tile->dimensions,i,mapcache_requested_dimension*);
+      rdim->requested_value = apr_pstrdup(dctx->pool, rdim->requested_value);
+      rdim->cached_value = apr_pstrdup(dctx->pool, rdim->cached_value);
+    }
+  }
+  job->key = apr_pstrdup(dctx->pool, key);
+  job->flight = flight;
+
+  if(mapcache_worker_pool_push_detached(dctx, mapcache_tileset_revalidate_job_run,
+        mapcache_tileset_revalidate_job_cancel, job) != APR_SUCCESS) {
+    apr_pool_destroy(dctx->pool);
+    mapcache_inflight_land(ctx, ctx->config->inflight, flight, NULL);
+    mapcache_inflight_leave(ctx, ctx->config->inflight, flight);
+    return MAPCACHE_FAILURE;
+  }
+#ifdef DEBUG
+  ctx->log(ctx, MAPCACHE_DEBUG, "stale tile: tileset %s - tile %d %d %d queued for background refresh",
+       tile->tileset->name,tile->x, tile->y,tile->z);
+#endif
+  return MAPCACHE_SUCCESS;
+}
+
 /**
  * \brief return the image data for a given tile
  * this call uses a global (interprocess+interthread) mutex if the tile was not found
@@ -1071,6 +1494,13 @@ static void mapcache_tileset_tile_get_without_subdimensions(mapcache_context *ct
     }
   }
 
+  if (ret == MAPCACHE_CACHE_RELOAD && tile->tileset->stale_while_revalidate && !read_only && !ctx->config->non_blocking) {
+    /* return the stale tile straight away, it will be updated in the background */
+    if(mapcache_tileset_tile_revalidate(ctx, tile) == MAPCACHE_SUCCESS) {
+      ret = MAPCACHE_SUCCESS;
+    }
+  }
+
   if (ret == MAPCACHE_CACHE_MISS) {
     /* bail out straight away if the tileset has no source or is read-only */
     if(read_only) {
@@ -1092,44 +1522,42 @@ static void mapcache_tileset_tile_get_without_subdimensions(mapcache_context *ct
 
   if (ret == MAPCACHE_CACHE_MISS || ret == MAPCACHE_CACHE_RELOAD) {
     int isLocked = MAPCACHE_FALSE;
-    void *lock;
+    int coalesced = MAPCACHE_FALSE;
 
     /* If the tile does not exist or stale, we must take action before re-asking for it */
     if( !read_only && !ctx->config->non_blocking) {
-      /*
-       * is the tile already being rendered by another thread ?
-       * the call is protected by the same mutex that sets the lock on the tile,
-       * so we can assure that:
-       * - if the lock does not exist, then this thread should do the rendering
-       * - if the lock exists, we should wait for the other thread to finish
-       */
-
-      /* aquire a lock on the metatile */
+      int isLeader;
+      mapcache_inflight *flight;
+      char *key;
       mt = mapcache_tileset_metatile_get(ctx, tile);
-      isLocked = mapcache_lock_or_wait_for_resource(ctx, ctx->config->locker, mapcache_tileset_metatile_resource_key(ctx,mt), &lock);
-      GC_CHECK_ERROR(ctx);
-      if(isLocked == MAPCACHE_TRUE) {
-         /* no other thread is doing the rendering, do it ourselves */
-#ifdef DEBUG
-        ctx->log(ctx, MAPCACHE_DEBUG, "cache miss/reload: tileset %s - tile %d %d %d",
-             tile->tileset->name,tile->x, tile->y,tile->z);
-#endif
-        /* this will query the source to create the tiles, and save them to the cache */
-        mapcache_tileset_render_metatile(ctx, mt);
+      key = mapcache_tileset_metatile_resource_key(ctx,mt);
 
-        if(GC_HAS_ERROR(ctx)) {
-          /* temporarily clear error state so we don't mess up with error handling in the locker */
-          void *error;
-          ctx->pop_errors(ctx,&error);
-          mapcache_unlock_resource(ctx, ctx->config->locker, lock);
-          ctx->push_errors(ctx,error);
-        } else {
-          mapcache_unlock_resource(ctx, ctx->config->locker, lock);
+      /*
+       * is the metatile already being rendered by another thread of this process ?
+       * if so there is no need to go through the (possibly disk or network based)
+       * locker, just wait for that thread to hand us the tile.
+       */
+      flight = mapcache_inflight_join(ctx, ctx->config->inflight, key, &isLeader);
+      if(isLeader) {
+        /*
+         * is the tile already being rendered by another process ?
+         * the call is protected by the same mutex that sets the lock on the tile,
+         * so we can assure that:
+         * - if the lock does not exist, then this thread should do the rendering
+         * - if the lock exists, we should wait for the other process to finish
+         */
+        isLocked = mapcache_tileset_metatile_render_once(ctx, mt, key, flight);
+      } else {
+        if(mapcache_inflight_wait(ctx, ctx->config->inflight, flight, tile) == MAPCACHE_SUCCESS) {
+          coalesced = MAPCACHE_TRUE;
         }
       }
+      mapcache_inflight_leave(ctx, ctx->config->inflight, flight);
     }
 
-    if (ret == MAPCACHE_CACHE_RELOAD && GC_HAS_ERROR(ctx))
+    if(coalesced) {
+      /* the tile was handed over by the thread that rendered it, no need to re-read it from the cache */
+    } else if (ret == MAPCACHE_CACHE_RELOAD && GC_HAS_ERROR(ctx))
       /* If we tried to reload a stale tile but failed, we know we have already
        * fetched it from the cache. We can then ignore errors and just use old tile.
        */
@@ -1195,7 +1623,61 @@ void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile) {
     }
   }
   return mapcache_tileset_tile_get_without_subdimensions(ctx,tile, (tile->tileset->read_only||!tile->tileset->source)?1:0);
-  
+
+}
+
+mapcache_buffer* mapcache_tileset_tile_transcode(mapcache_context *ctx, mapcache_tile *tile, mapcache_image_format *format)
+{
+  mapcache_tile *variant;
+  mapcache_buffer *encoded;
+  int ret;
+
+  /*
+   * variants are stored as tiles of a tileset named after the original one and the
+   * target format, so that they can't collide with the original tiles even if both
+   * end up in the same cache
+   */
+  variant = mapcache_tileset_tile_clone(ctx->pool, tile);
+  variant->tileset = mapcache_tileset_clone(ctx, tile->tileset);
+  variant->tileset->name = apr_pstrcat(ctx->pool, tile->tileset->name, "@", format->name, NULL);
+  variant->tileset->format = format;
+  variant->tileset->_cache = tile->tileset->transcode_cache;
+  variant->tileset->read_only = tile->tileset->read_only;
+
+  ret = mapcache_cache_tile_get(ctx, variant->tileset->_cache, variant);
+  if(GC_HAS_ERROR(ctx)) {
+    /* the variant cache is only an optimization, fall back to encoding the tile */
+    ctx->log(ctx, MAPCACHE_WARN, "tileset %s: failed to lookup %s variant of tile %d %d %d: %s",
+             tile->tileset->name, format->name, tile->x, tile->y, tile->z, ctx->get_error_message(ctx));
+    ctx->clear_errors(ctx);
+    ret = MAPCACHE_CACHE_MISS;
+  }
+  if(ret == MAPCACHE_SUCCESS && variant->encoded_data &&
+      !(variant->mtime && tile->mtime && variant->mtime < tile->mtime)) {
+    return variant->encoded_data;
+  }
+
+  if(!tile->raw_image) {
+    tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
+    if(GC_HAS_ERROR(ctx)) {
+      return NULL;
+    }
+  }
+  encoded = format->write(ctx, tile->raw_image, format);
+  if(GC_HAS_ERROR(ctx)) {
+    return NULL;
+  }
+
+  variant->encoded_data = encoded;
+  variant->raw_image = NULL;
+  variant->nodata = 0;
+  mapcache_cache_tile_set(ctx, variant->tileset->_cache, variant);
+  if(GC_HAS_ERROR(ctx)) {
+    ctx->log(ctx, MAPCACHE_WARN, "tileset %s: failed to store %s variant of tile %d %d %d: %s",
+             tile->tileset->name, format->name, tile->x, tile->y, tile->z, ctx->get_error_message(ctx));
+    ctx->clear_errors(ctx);
+  }
+  return encoded;
 }
 
 void mapcache_tileset_tile_delete(mapcache_context *ctx, mapcache_tile *tile, int whole_metatile)
@@ -389,6 +389,9 @@ void mapcache_context_init(mapcache_context *ctx)
   ctx->pop_errors = _mapcache_context_pop_errors;
   ctx->push_errors = _mapcache_context_push_errors;
   ctx->headers_in = NULL;
+  ctx->worker_pool = NULL;
+  ctx->http_engine = NULL;
+  ctx->write_behind_hold = NULL;
 }
 
 void mapcache_context_copy(mapcache_context *src, mapcache_context *dst)
@@ -409,10 +412,14 @@ void mapcache_context_copy(mapcache_context *src, mapcache_context *dst)
   dst->service = src->service;
   dst->exceptions = src->exceptions;
   dst->supports_redirects = src->supports_redirects;
+  dst->supports_sendfile = src->supports_sendfile;
   dst->pop_errors = src->pop_errors;
   dst->push_errors = src->push_errors;
   dst->connection_pool = src->connection_pool;
+  dst->worker_pool = src->worker_pool;
+  dst->http_engine = src->http_engine;
   dst->headers_in = src->headers_in;
+  dst->write_behind_hold = NULL;
 }
 
 char* mapcache_util_get_tile_dimkey(mapcache_context *ctx, mapcache_tile *tile, char* sanitized_chars, char *sanitize_to)
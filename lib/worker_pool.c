@@ -0,0 +1,336 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache per-process worker thread pool
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+
+#if APR_HAS_THREADS
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+
+typedef struct mapcache_worker_job mapcache_worker_job;
+
+struct mapcache_worker_job {
+  mapcache_worker_func func;
+  mapcache_worker_detached_func detached_func;
+  mapcache_worker_detached_func detached_cancel; /* run instead of detached_func when shutting down */
+  void *data;
+  mapcache_worker_batch *batch; /* NULL for detached jobs */
+  mapcache_context *ctx; /* detached jobs only */
+  mapcache_worker_job *next;
+};
+
+struct mapcache_worker_batch {
+  mapcache_worker_pool *wp;
+  apr_pool_t *pool;
+  int pending; /* number of pushed jobs that have not completed yet */
+  apr_thread_cond_t *done;
+};
+
+struct mapcache_worker_pool {
+  apr_pool_t *pool;
+  mapcache_context *ctx; /* cloned for each detached job */
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *work;
+  apr_thread_t **threads;
+  int nthreads;
+  mapcache_worker_job *head;
+  mapcache_worker_job *tail;
+  int queued;
+  int busy;
+  int shutdown;
+};
+
+/* must be called with the pool mutex held */
+static void _mapcache_worker_job_done(mapcache_worker_job *job)
+{
+  if(--job->batch->pending == 0) {
+    apr_thread_cond_signal(job->batch->done);
+  }
+}
+
+static void* APR_THREAD_FUNC _mapcache_worker_thread(apr_thread_t *thread, void *data)
+{
+  mapcache_worker_pool *wp = (mapcache_worker_pool*)data;
+  apr_thread_mutex_lock(wp->mutex);
+  while(1) {
+    mapcache_worker_job *job;
+    while(!wp->head && !wp->shutdown) {
+      apr_thread_cond_wait(wp->work, wp->mutex);
+    }
+    if(!wp->head) {
+      break; /* shutting down, and nothing left to run */
+    }
+    job = wp->head;
+    wp->head = job->next;
+    if(!wp->head) wp->tail = NULL;
+    wp->queued--;
+    wp->busy++;
+    if(!job->batch) {
+      /*
+       * detached job, that lives in the pool of its own context. Don't bother running it if
+       * shutting down, but give it a chance to release what it holds on to
+       */
+      mapcache_context *jctx = job->ctx;
+      int run = !wp->shutdown;
+      apr_thread_mutex_unlock(wp->mutex);
+      if(run) {
+        job->detached_func(jctx, job->data);
+      } else if(job->detached_cancel) {
+        job->detached_cancel(jctx, job->data);
+      }
+      apr_pool_destroy(jctx->pool);
+      apr_thread_mutex_lock(wp->mutex);
+      wp->busy--;
+      continue;
+    }
+    apr_thread_mutex_unlock(wp->mutex);
+
+    job->func(job->data);
+
+    apr_thread_mutex_lock(wp->mutex);
+    wp->busy--;
+    _mapcache_worker_job_done(job);
+  }
+  apr_thread_mutex_unlock(wp->mutex);
+  apr_thread_exit(thread, APR_SUCCESS);
+  return NULL;
+}
+
+/*
+ * registered as a pre-cleanup so that the worker threads are joined before
+ * apr destroys the subpools they are running with
+ */
+static apr_status_t _mapcache_worker_pool_cleanup(void *data)
+{
+  mapcache_worker_pool *wp = (mapcache_worker_pool*)data;
+  apr_status_t rv;
+  int i;
+  apr_thread_mutex_lock(wp->mutex);
+  wp->shutdown = 1;
+  apr_thread_cond_broadcast(wp->work);
+  apr_thread_mutex_unlock(wp->mutex);
+  for(i=0; i<wp->nthreads; i++) {
+    apr_thread_join(&rv, wp->threads[i]);
+  }
+  wp->nthreads = 0;
+  return APR_SUCCESS;
+}
+
+apr_status_t mapcache_worker_pool_create(mapcache_worker_pool **wp, int nthreads, mapcache_context *ctx, apr_pool_t *server_pool)
+{
+  apr_status_t rv;
+  apr_threadattr_t *thread_attrs;
+  int i;
+  *wp = apr_pcalloc(server_pool, sizeof(mapcache_worker_pool));
+  (*wp)->pool = server_pool;
+  (*wp)->ctx = ctx;
+  if(nthreads < 1) nthreads = 1;
+  (*wp)->threads = apr_pcalloc(server_pool, nthreads*sizeof(apr_thread_t*));
+  if((rv = apr_thread_mutex_create(&(*wp)->mutex, APR_THREAD_MUTEX_DEFAULT, server_pool)) != APR_SUCCESS) {
+    return rv;
+  }
+  if((rv = apr_thread_cond_create(&(*wp)->work, server_pool)) != APR_SUCCESS) {
+    return rv;
+  }
+  apr_pool_pre_cleanup_register(server_pool, *wp, _mapcache_worker_pool_cleanup);
+  apr_threadattr_create(&thread_attrs, server_pool);
+  for(i=0; i<nthreads; i++) {
+    rv = apr_thread_create(&(*wp)->threads[i], thread_attrs, _mapcache_worker_thread, *wp, server_pool);
+    if(rv != APR_SUCCESS) {
+      break;
+    }
+    (*wp)->nthreads++;
+  }
+  return rv;
+}
+
+mapcache_worker_batch* mapcache_worker_batch_create(mapcache_worker_pool *wp, apr_pool_t *pool)
+{
+  mapcache_worker_batch *batch = apr_pcalloc(pool, sizeof(mapcache_worker_batch));
+  batch->wp = wp;
+  batch->pool = pool;
+  if(apr_thread_cond_create(&batch->done, pool) != APR_SUCCESS) {
+    return NULL;
+  }
+  return batch;
+}
+
+apr_status_t mapcache_worker_pool_push(mapcache_worker_batch *batch, mapcache_worker_func func, void *data)
+{
+  mapcache_worker_pool *wp = batch->wp;
+  mapcache_worker_job *job = apr_palloc(batch->pool, sizeof(mapcache_worker_job));
+  job->func = func;
+  job->data = data;
+  job->batch = batch;
+  job->next = NULL;
+  apr_thread_mutex_lock(wp->mutex);
+  if(wp->shutdown || !wp->nthreads) {
+    apr_thread_mutex_unlock(wp->mutex);
+    return APR_EGENERAL;
+  }
+  if(wp->tail) {
+    wp->tail->next = job;
+  } else {
+    wp->head = job;
+  }
+  wp->tail = job;
+  wp->queued++;
+  batch->pending++;
+  apr_thread_cond_signal(wp->work);
+  apr_thread_mutex_unlock(wp->mutex);
+  return APR_SUCCESS;
+}
+
+mapcache_context* mapcache_worker_pool_detached_context(mapcache_context *ctx)
+{
+  mapcache_worker_pool *wp = ctx->worker_pool;
+  mapcache_context *dctx;
+  if(!wp || !wp->ctx || !wp->ctx->clone) {
+    return NULL;
+  }
+  dctx = wp->ctx->clone(wp->ctx);
+  if(!dctx) {
+    return NULL;
+  }
+  dctx->config = ctx->config;
+  dctx->connection_pool = ctx->connection_pool;
+  dctx->worker_pool = wp;
+  dctx->http_engine = ctx->http_engine;
+  dctx->headers_in = NULL;
+  return dctx;
+}
+
+apr_status_t mapcache_worker_pool_push_detached(mapcache_context *dctx, mapcache_worker_detached_func func,
+    mapcache_worker_detached_func cancel, void *data)
+{
+  mapcache_worker_pool *wp = dctx->worker_pool;
+  mapcache_worker_job *job = apr_pcalloc(dctx->pool, sizeof(mapcache_worker_job));
+  job->detached_func = func;
+  job->detached_cancel = cancel;
+  job->data = data;
+  job->ctx = dctx;
+  apr_thread_mutex_lock(wp->mutex);
+  if(wp->shutdown || !wp->nthreads) {
+    apr_thread_mutex_unlock(wp->mutex);
+    return APR_EGENERAL;
+  }
+  if(wp->tail) {
+    wp->tail->next = job;
+  } else {
+    wp->head = job;
+  }
+  wp->tail = job;
+  wp->queued++;
+  apr_thread_cond_signal(wp->work);
+  apr_thread_mutex_unlock(wp->mutex);
+  return APR_SUCCESS;
+}
+
+void mapcache_worker_batch_wait(mapcache_worker_batch *batch)
+{
+  mapcache_worker_pool *wp = batch->wp;
+  apr_thread_mutex_lock(wp->mutex);
+  while(batch->pending) {
+    /*
+     * instead of idling while our jobs sit in the queue behind those of other
+     * requests, take them back and run them in the calling thread. This also
+     * guarantees progress when every worker is busy.
+     */
+    mapcache_worker_job *job = wp->head, *prev = NULL;
+    while(job && job->batch != batch) {
+      prev = job;
+      job = job->next;
+    }
+    if(!job) {
+      apr_thread_cond_wait(batch->done, wp->mutex);
+      continue;
+    }
+    if(prev) {
+      prev->next = job->next;
+    } else {
+      wp->head = job->next;
+    }
+    if(wp->tail == job) wp->tail = prev;
+    wp->queued--;
+    apr_thread_mutex_unlock(wp->mutex);
+
+    job->func(job->data);
+
+    apr_thread_mutex_lock(wp->mutex);
+    batch->pending--;
+  }
+  apr_thread_mutex_unlock(wp->mutex);
+}
+
+int mapcache_worker_pool_queue_depth(mapcache_worker_pool *wp)
+{
+  int queued;
+  apr_thread_mutex_lock(wp->mutex);
+  queued = wp->queued;
+  apr_thread_mutex_unlock(wp->mutex);
+  return queued;
+}
+
+int mapcache_worker_pool_busy_count(mapcache_worker_pool *wp)
+{
+  int busy;
+  apr_thread_mutex_lock(wp->mutex);
+  busy = wp->busy;
+  apr_thread_mutex_unlock(wp->mutex);
+  return busy;
+}
+
+int mapcache_worker_pool_thread_count(mapcache_worker_pool *wp)
+{
+  return wp->nthreads;
+}
+
+#else
+
+apr_status_t mapcache_worker_pool_create(mapcache_worker_pool **wp, int nthreads, mapcache_context *ctx, apr_pool_t *server_pool)
+{
+  *wp = NULL;
+  return APR_ENOTIMPL;
+}
+
+mapcache_context* mapcache_worker_pool_detached_context(mapcache_context *ctx)
+{
+  return NULL;
+}
+
+apr_status_t mapcache_worker_pool_push_detached(mapcache_context *dctx, mapcache_worker_detached_func func,
+    mapcache_worker_detached_func cancel, void *data)
+{
+  return APR_ENOTIMPL;
+}
+
+#endif
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -0,0 +1,587 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache per-process queue of tiles waiting to be written to a cache
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+
+#if APR_HAS_THREADS
+#include <apr_atomic.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct _write_behind_batch _write_behind_batch;
+typedef struct _write_behind_entry _write_behind_entry;
+
+/*
+ * the lock of a metatile whose tiles were queued, released once they have all been
+ * written so that other processes waiting on it find them in the cache
+ */
+struct mapcache_write_behind_hold {
+  apr_pool_t *pool;
+  volatile apr_uint32_t refcount; /* batches holding the lock, plus the renderer until it hands it over */
+  mapcache_locker *locker;
+  void *lock; /* a copy of the lock, NULL if the locker can't copy it */
+  mapcache_write_behind_hold *next; /* in the list of locks to release */
+};
+
+/* the tiles queued by a single push, destroyed once they have all been written or replaced */
+struct _write_behind_batch {
+  apr_pool_t *pool;
+  int refcount;
+  mapcache_write_behind_hold *hold;
+};
+
+struct _write_behind_entry {
+  char *key;
+  char *dimkey;
+  mapcache_tile *tile; /* a copy of the tile and its encoded data, allocated from the batch pool */
+  apr_size_t size;
+  apr_time_t queued;
+  int writing; /* taken off the waiting list by the writer */
+  int deleted; /* deleted from the cache while it was being written */
+  _write_behind_batch *batch;
+  _write_behind_entry *prev;
+  _write_behind_entry *next;
+};
+
+struct mapcache_write_behind {
+  mapcache_cache *cache;
+  apr_pool_t *pool;
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *wakeup;
+  apr_thread_cond_t *written; /* broadcast each time the writer is done with a batch of tiles */
+  apr_uint64_t batches_written;
+  apr_hash_t *entries; /* most recent entry of each queued tile, waiting or being written */
+  _write_behind_entry *head; /* queued first, written first */
+  _write_behind_entry *tail;
+  int waiting; /* number of entries in the waiting list */
+  apr_size_t size; /* bytes of tile data held, including the tiles being written */
+  apr_interval_time_t flush_interval;
+  int batch_size;
+  apr_size_t max_size;
+  int flushing; /* a writer has been started and has not emptied the queue yet */
+  mapcache_write_behind_hold *unlocks; /* locks to release, done outside of the mutex */
+};
+
+/* must be called with the mutex held */
+static void _write_behind_unlink(mapcache_write_behind *wb, _write_behind_entry *e)
+{
+  if(e->prev) e->prev->next = e->next;
+  else wb->head = e->next;
+  if(e->next) e->next->prev = e->prev;
+  else wb->tail = e->prev;
+  e->prev = e->next = NULL;
+  wb->waiting--;
+}
+
+/* must be called with the mutex held, and the entry no longer referenced by the hash */
+static void _write_behind_release(mapcache_write_behind *wb, _write_behind_entry *e)
+{
+  wb->size -= e->size;
+  if(--e->batch->refcount == 0) {
+    mapcache_write_behind_hold *hold = e->batch->hold;
+    if(hold && apr_atomic_dec32(&hold->refcount) == 0) {
+      hold->next = wb->unlocks;
+      wb->unlocks = hold;
+    }
+    apr_pool_destroy(e->batch->pool);
+  }
+}
+
+static void _write_behind_hold_release(mapcache_context *ctx, mapcache_write_behind_hold *hold)
+{
+  if(hold->lock) {
+    /* the lock is not ours, don't fail the current request if it can't be released */
+    void *error;
+    apr_pool_t *ctx_pool = ctx->pool;
+    ctx->pop_errors(ctx, &error);
+    ctx->pool = hold->pool;
+    mapcache_unlock_resource(ctx, hold->locker, hold->lock);
+    if(GC_HAS_ERROR(ctx)) {
+      ctx->log(ctx, MAPCACHE_ERROR, "failed to release the lock of written tiles: %s", ctx->get_error_message(ctx));
+      ctx->clear_errors(ctx);
+    }
+    ctx->pool = ctx_pool;
+    ctx->push_errors(ctx, error);
+  }
+  apr_pool_destroy(hold->pool);
+}
+
+/* release the locks whose tiles have all been written */
+static void _write_behind_unlock(mapcache_context *ctx, mapcache_write_behind *wb)
+{
+  mapcache_write_behind_hold *hold;
+  apr_thread_mutex_lock(wb->mutex);
+  hold = wb->unlocks;
+  wb->unlocks = NULL;
+  apr_thread_mutex_unlock(wb->mutex);
+  while(hold) {
+    mapcache_write_behind_hold *next = hold->next;
+    _write_behind_hold_release(ctx, hold);
+    hold = next;
+  }
+}
+
+/* must be called with the mutex held. The writer releases the entries it has taken itself */
+static void _write_behind_remove(mapcache_write_behind *wb, _write_behind_entry *e)
+{
+  apr_hash_set(wb->entries, e->key, APR_HASH_KEY_STRING, NULL);
+  if(!e->writing) {
+    _write_behind_unlink(wb, e);
+    _write_behind_release(wb, e);
+  }
+}
+
+/* tiles that can be handed to the cache in a single multi_set call compare equal */
+static int _write_behind_entry_cmp_set(const _write_behind_entry *a, const _write_behind_entry *b)
+{
+  int rv;
+  if(a->tile->tileset != b->tile->tileset) {
+    rv = strcmp(a->tile->tileset->name, b->tile->tileset->name);
+    if(rv) return rv;
+  }
+  if(a->tile->grid_link != b->tile->grid_link) {
+    rv = strcmp(a->tile->grid_link->grid->name, b->tile->grid_link->grid->name);
+    if(rv) return rv;
+  }
+  rv = strcmp(a->dimkey, b->dimkey);
+  if(rv) return rv;
+  return a->tile->z - b->tile->z;
+}
+
+static int _write_behind_entry_cmp(const void *pa, const void *pb)
+{
+  const _write_behind_entry *a = *(const _write_behind_entry**)pa;
+  const _write_behind_entry *b = *(const _write_behind_entry**)pb;
+  int rv = _write_behind_entry_cmp_set(a, b);
+  if(rv) return rv;
+  if(a->tile->y != b->tile->y) return a->tile->y - b->tile->y;
+  return a->tile->x - b->tile->x;
+}
+
+static int _write_behind_start(mapcache_context *ctx, mapcache_write_behind *wb);
+
+/*
+ * write the queued tiles to the cache, in batches of at most batch_size tiles
+ * sorted so that each multi_set call gets tiles sharing their tileset, grid,
+ * dimensions and zoom level. When wait is set, a batch is only written once
+ * its oldest tile has been queued for flush_interval, or once the queue has
+ * grown large enough, and the function returns when the queue is empty.
+ * Otherwise the tiles currently waiting are written at once, and the tiles
+ * queued in the meantime are handed to a writer job, or written as well if
+ * none can be started.
+ */
+static void _write_behind_flush(mapcache_context *ctx, mapcache_write_behind *wb, int wait)
+{
+  apr_pool_t *ctx_pool = ctx->pool;
+  apr_thread_mutex_lock(wb->mutex);
+  while(1) {
+    _write_behind_entry **entries;
+    mapcache_tile *tiles;
+    apr_pool_t *pool;
+    int i, n, start;
+    if(wait) {
+      while(wb->head && wb->waiting < wb->batch_size && wb->size < wb->max_size / 2) {
+        apr_time_t now = apr_time_now();
+        apr_time_t due = wb->head->queued + wb->flush_interval;
+        if(now >= due) break;
+        apr_thread_cond_timedwait(wb->wakeup, wb->mutex, due - now);
+      }
+    }
+    if(!wb->head) break;
+    n = wait ? MAPCACHE_MIN(wb->waiting, wb->batch_size) : wb->waiting;
+    apr_pool_create(&pool, ctx_pool);
+    entries = apr_palloc(pool, n * sizeof(_write_behind_entry*));
+    for(i=0; i<n; i++) {
+      entries[i] = wb->head;
+      _write_behind_unlink(wb, wb->head);
+      entries[i]->writing = 1;
+    }
+    apr_thread_mutex_unlock(wb->mutex);
+
+    /* the tiles are still served from the queue while they are being written */
+    ctx->pool = pool;
+    qsort(entries, n, sizeof(_write_behind_entry*), _write_behind_entry_cmp);
+    tiles = apr_palloc(pool, n * sizeof(mapcache_tile));
+    for(i=0; i<n; i++) {
+      tiles[i] = *entries[i]->tile;
+    }
+    for(start=0; start<n; start=i) {
+      for(i=start+1; i<n && !_write_behind_entry_cmp_set(entries[start], entries[i]); i++);
+      mapcache_cache_tile_multi_set_direct(ctx, wb->cache, &tiles[start], i - start);
+      if(GC_HAS_ERROR(ctx)) {
+        ctx->log(ctx, MAPCACHE_ERROR, "cache (%s): failed to write %d queued tiles of tileset %s: %s",
+                 wb->cache->name, i - start, tiles[start].tileset->name, ctx->get_error_message(ctx));
+        ctx->clear_errors(ctx);
+      }
+    }
+
+    apr_thread_mutex_lock(wb->mutex);
+    for(i=0; i<n; i++) {
+      if(apr_hash_get(wb->entries, entries[i]->key, APR_HASH_KEY_STRING) == entries[i]) {
+        apr_hash_set(wb->entries, entries[i]->key, APR_HASH_KEY_STRING, NULL);
+      }
+    }
+    apr_thread_mutex_unlock(wb->mutex);
+    /*
+     * the entries are out of the hash, so their deleted flag can no longer change. A newer
+     * version of the tile may have been queued since, which must be left alone
+     */
+    for(i=0; i<n; i++) {
+      if(entries[i]->deleted) {
+        mapcache_cache_tile_delete_direct(ctx, wb->cache, &tiles[i]);
+        if(GC_HAS_ERROR(ctx)) {
+          ctx->log(ctx, MAPCACHE_ERROR, "cache (%s): failed to delete written tile: %s",
+                   wb->cache->name, ctx->get_error_message(ctx));
+          ctx->clear_errors(ctx);
+        }
+      }
+    }
+    ctx->pool = ctx_pool;
+
+    apr_thread_mutex_lock(wb->mutex);
+    for(i=0; i<n; i++) {
+      _write_behind_release(wb, entries[i]);
+    }
+    apr_pool_destroy(pool);
+    wb->batches_written++;
+    apr_thread_cond_broadcast(wb->written);
+    apr_thread_mutex_unlock(wb->mutex);
+    _write_behind_unlock(ctx, wb);
+    apr_thread_mutex_lock(wb->mutex);
+    if(!wait && wb->head) {
+      /* pushes don't schedule a writer while we are flushing, so the new tiles are ours */
+      apr_thread_mutex_unlock(wb->mutex);
+      if(_write_behind_start(ctx, wb) == MAPCACHE_SUCCESS) {
+        return; /* the job now owns the flushing flag */
+      }
+      apr_thread_mutex_lock(wb->mutex);
+    }
+  }
+  wb->flushing = 0;
+  apr_thread_mutex_unlock(wb->mutex);
+}
+
+static void _write_behind_job(mapcache_context *ctx, void *data)
+{
+  _write_behind_flush(ctx, (mapcache_write_behind*)data, 1);
+}
+
+/* the worker pool is shutting down: write what is queued now rather than dropping it */
+static void _write_behind_cancel(mapcache_context *ctx, void *data)
+{
+  _write_behind_flush(ctx, (mapcache_write_behind*)data, 0);
+}
+
+/* hand the queue to a thread of the worker pool, the caller having set the flushing flag */
+static int _write_behind_start(mapcache_context *ctx, mapcache_write_behind *wb)
+{
+  mapcache_context *dctx = mapcache_worker_pool_detached_context(ctx);
+  if(!dctx) {
+    return MAPCACHE_FAILURE;
+  }
+  if(mapcache_worker_pool_push_detached(dctx, _write_behind_job, _write_behind_cancel, wb) != APR_SUCCESS) {
+    apr_pool_destroy(dctx->pool);
+    return MAPCACHE_FAILURE;
+  }
+  return MAPCACHE_SUCCESS;
+}
+
+static apr_status_t _write_behind_cleanup(void *data)
+{
+  mapcache_write_behind *wb = (mapcache_write_behind*)data;
+  /* the worker pool threads have been joined by now, so nothing is being written */
+  while(wb->head) {
+    _write_behind_entry *e = wb->head;
+    _write_behind_unlink(wb, e);
+    _write_behind_release(wb, e);
+  }
+  /* with no context left to release them, the locks go stale and are removed by the lockers */
+  while(wb->unlocks) {
+    mapcache_write_behind_hold *hold = wb->unlocks;
+    wb->unlocks = hold->next;
+    apr_pool_destroy(hold->pool);
+  }
+  return APR_SUCCESS;
+}
+
+mapcache_write_behind* mapcache_write_behind_create(apr_pool_t *pool, mapcache_cache *cache,
+    apr_interval_time_t flush_interval, int batch_size, apr_size_t max_size)
+{
+  mapcache_write_behind *wb = apr_pcalloc(pool, sizeof(mapcache_write_behind));
+  /* the hash gets its own pool as it is only ever accessed with the mutex held */
+  apr_pool_create(&wb->pool, pool);
+  if(apr_thread_mutex_create(&wb->mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS) {
+    return NULL;
+  }
+  if(apr_thread_cond_create(&wb->wakeup, pool) != APR_SUCCESS) {
+    return NULL;
+  }
+  if(apr_thread_cond_create(&wb->written, pool) != APR_SUCCESS) {
+    return NULL;
+  }
+  wb->entries = apr_hash_make(wb->pool);
+  wb->cache = cache;
+  wb->flush_interval = flush_interval;
+  wb->batch_size = batch_size;
+  wb->max_size = max_size;
+  apr_pool_cleanup_register(pool, wb, _write_behind_cleanup, apr_pool_cleanup_null);
+  return wb;
+}
+
+int mapcache_write_behind_push(mapcache_context *ctx, mapcache_write_behind *wb, mapcache_tile *tiles, int ntiles)
+{
+  apr_pool_t *pool;
+  _write_behind_batch *batch;
+  _write_behind_entry **entries;
+  apr_size_t size = 0;
+  apr_time_t now;
+  int i,j,schedule = 0;
+
+  if(!ctx->worker_pool) {
+    /* e.g. the seeder, which has no threads to hand the writes to */
+    return MAPCACHE_FAILURE;
+  }
+  /* queued tiles are kept encoded, as most caches store them that way */
+  for(i=0; i<ntiles; i++) {
+    mapcache_tile *tile = &tiles[i];
+    if(!tile->encoded_data) {
+      if(!tile->raw_image || !tile->tileset->format) {
+        return MAPCACHE_FAILURE;
+      }
+      tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+      if(GC_HAS_ERROR(ctx)) {
+        return MAPCACHE_FAILURE;
+      }
+    }
+    size += tile->encoded_data->size;
+  }
+
+  /* the tiles outlive the request, copy them to a pool of their own */
+  if(apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+    return MAPCACHE_FAILURE;
+  }
+  batch = apr_pcalloc(pool, sizeof(_write_behind_batch));
+  batch->pool = pool;
+  entries = apr_palloc(pool, ntiles * sizeof(_write_behind_entry*));
+  now = apr_time_now();
+  for(i=0; i<ntiles; i++) {
+    mapcache_tile *tile = &tiles[i];
+    _write_behind_entry *e = apr_pcalloc(pool, sizeof(_write_behind_entry));
+    e->key = apr_pstrdup(pool, mapcache_util_get_tile_key(ctx, tile, NULL, NULL, NULL));
+    e->dimkey = apr_pstrdup(pool, mapcache_util_get_tile_dimkey(ctx, tile, NULL, NULL));
+    e->tile = mapcache_tileset_tile_clone(pool, tile);
+    if(e->tile->dimensions) {
+      for(j=0; j<e->tile->dimensions->nelts; j++) {
+        mapcache_requested_dimension *rdim = APR_ARRAY_IDX(e->tile->dimensions,j,mapcache_requested_dimension*);
+        rdim->requested_value = apr_pstrdup(pool, rdim->requested_value);
+        rdim->cached_value = apr_pstrdup(pool, rdim->cached_value);
+      }
+    }
+    e->tile->mtime = tile->mtime ? tile->mtime : now;
+    e->tile->encoded_data = mapcache_buffer_create(tile->encoded_data->size, pool);
+    mapcache_buffer_append(e->tile->encoded_data, tile->encoded_data->size, tile->encoded_data->buf);
+    e->size = tile->encoded_data->size;
+    e->queued = now;
+    e->batch = batch;
+    entries[i] = e;
+  }
+
+  apr_thread_mutex_lock(wb->mutex);
+  if(wb->size + size > wb->max_size) {
+    /*
+     * the queue is full and the caller is going to write these tiles itself: make sure
+     * older versions of them that are still waiting are not written afterwards, and wait
+     * for the ones the writer has already taken to be in the cache before overwriting them
+     */
+    int in_progress = 0;
+    for(i=0; i<ntiles; i++) {
+      _write_behind_entry *old = apr_hash_get(wb->entries, entries[i]->key, APR_HASH_KEY_STRING);
+      if(old) {
+        if(old->writing) in_progress = 1;
+        _write_behind_remove(wb, old);
+      }
+    }
+    apr_thread_cond_signal(wb->wakeup);
+    if(in_progress) {
+      /* a single flush writes all the entries it has taken, so one batch is enough */
+      apr_uint64_t gen = wb->batches_written;
+      while(wb->batches_written == gen) {
+        apr_thread_cond_wait(wb->written, wb->mutex);
+      }
+    }
+    apr_thread_mutex_unlock(wb->mutex);
+    apr_pool_destroy(pool);
+    _write_behind_unlock(ctx, wb);
+    return MAPCACHE_FAILURE;
+  }
+  batch->refcount = ntiles;
+  if(ctx->write_behind_hold) {
+    batch->hold = ctx->write_behind_hold;
+    apr_atomic_inc32(&batch->hold->refcount);
+  }
+  for(i=0; i<ntiles; i++) {
+    _write_behind_entry *e = entries[i];
+    _write_behind_entry *old = apr_hash_get(wb->entries, e->key, APR_HASH_KEY_STRING);
+    if(old) {
+      _write_behind_remove(wb, old);
+    }
+    e->prev = wb->tail;
+    if(wb->tail) wb->tail->next = e;
+    else wb->head = e;
+    wb->tail = e;
+    wb->waiting++;
+    wb->size += e->size;
+    apr_hash_set(wb->entries, e->key, APR_HASH_KEY_STRING, e);
+  }
+  if(!wb->flushing) {
+    wb->flushing = schedule = 1;
+  } else if(wb->waiting >= wb->batch_size || wb->size >= wb->max_size / 2) {
+    apr_thread_cond_signal(wb->wakeup);
+  }
+  apr_thread_mutex_unlock(wb->mutex);
+  _write_behind_unlock(ctx, wb);
+
+  if(schedule && _write_behind_start(ctx, wb) != MAPCACHE_SUCCESS) {
+    /* no thread to hand the queue to, write it from this request */
+    _write_behind_flush(ctx, wb, 0);
+  }
+  return MAPCACHE_SUCCESS;
+}
+
+int mapcache_write_behind_get(mapcache_context *ctx, mapcache_write_behind *wb, mapcache_tile *tile, int with_data)
+{
+  _write_behind_entry *e;
+  char *key = mapcache_util_get_tile_key(ctx, tile, NULL, NULL, NULL);
+  apr_thread_mutex_lock(wb->mutex);
+  e = apr_hash_get(wb->entries, key, APR_HASH_KEY_STRING);
+  if(!e) {
+    apr_thread_mutex_unlock(wb->mutex);
+    return MAPCACHE_CACHE_MISS;
+  }
+  tile->mtime = e->tile->mtime;
+  tile->encoded_size = e->size;
+  if(with_data) {
+    /* copy while the mutex is held, as the entry is released as soon as it has been written */
+    tile->encoded_data = mapcache_buffer_create(e->size, ctx->pool);
+    mapcache_buffer_append(tile->encoded_data, e->size, e->tile->encoded_data->buf);
+    tile->nodata = 0;
+  }
+  apr_thread_mutex_unlock(wb->mutex);
+  return MAPCACHE_SUCCESS;
+}
+
+void mapcache_write_behind_delete(mapcache_context *ctx, mapcache_write_behind *wb, mapcache_tile *tile)
+{
+  _write_behind_entry *e;
+  char *key = mapcache_util_get_tile_key(ctx, tile, NULL, NULL, NULL);
+  apr_thread_mutex_lock(wb->mutex);
+  e = apr_hash_get(wb->entries, key, APR_HASH_KEY_STRING);
+  if(e) {
+    if(e->writing) {
+      /* the writer deletes it again once it has been written */
+      e->deleted = 1;
+    }
+    _write_behind_remove(wb, e);
+  }
+  apr_thread_mutex_unlock(wb->mutex);
+  _write_behind_unlock(ctx, wb);
+}
+
+mapcache_write_behind_hold* mapcache_write_behind_hold_create(mapcache_context *ctx)
+{
+  apr_pool_t *pool;
+  mapcache_write_behind_hold *hold;
+  if(!ctx->config->write_behind || !ctx->worker_pool) {
+    return NULL;
+  }
+  /* the lock may be released after the request is gone */
+  if(apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+    return NULL;
+  }
+  hold = apr_pcalloc(pool, sizeof(mapcache_write_behind_hold));
+  hold->pool = pool;
+  hold->refcount = 1;
+  return hold;
+}
+
+int mapcache_write_behind_hold_lock(mapcache_context *ctx, mapcache_write_behind_hold *hold,
+    mapcache_locker *locker, void *lock)
+{
+  /* copy before giving up our reference, after which the writer may destroy the hold */
+  void *copy = mapcache_lock_copy(ctx, locker, lock, hold->pool);
+  hold->locker = locker;
+  hold->lock = copy;
+  if(apr_atomic_dec32(&hold->refcount) == 0) {
+    /* nothing was queued, or it has all been written already */
+    apr_pool_destroy(hold->pool);
+    return MAPCACHE_FAILURE;
+  }
+  return copy ? MAPCACHE_SUCCESS : MAPCACHE_FAILURE;
+}
+
+#else
+
+mapcache_write_behind* mapcache_write_behind_create(apr_pool_t *pool, mapcache_cache *cache,
+    apr_interval_time_t flush_interval, int batch_size, apr_size_t max_size)
+{
+  return NULL;
+}
+
+int mapcache_write_behind_push(mapcache_context *ctx, mapcache_write_behind *wb, mapcache_tile *tiles, int ntiles)
+{
+  return MAPCACHE_FAILURE;
+}
+
+int mapcache_write_behind_get(mapcache_context *ctx, mapcache_write_behind *wb, mapcache_tile *tile, int with_data)
+{
+  return MAPCACHE_CACHE_MISS;
+}
+
+void mapcache_write_behind_delete(mapcache_context *ctx, mapcache_write_behind *wb, mapcache_tile *tile)
+{
+}
+
+mapcache_write_behind_hold* mapcache_write_behind_hold_create(mapcache_context *ctx)
+{
+  return NULL;
+}
+
+int mapcache_write_behind_hold_lock(mapcache_context *ctx, mapcache_write_behind_hold *hold,
+    mapcache_locker *locker, void *lock)
+{
+  return MAPCACHE_FAILURE;
+}
+
+#endif
+
+/* vim: ts=2 sts=2 et sw=2
+*/
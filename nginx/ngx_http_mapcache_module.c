@@ -5,9 +5,13 @@
 #include <apr_date.h>
 #include <apr_strings.h>
 #include <apr_pools.h>
+#include <apr_portable.h>
 
 
 apr_pool_t *process_pool = NULL;
+/* worker threads cannot survive the fork, so the pool is created in each worker process */
+static mapcache_worker_pool *process_worker_pool = NULL;
+static int process_worker_threads = 0;
 static char *ngx_http_mapcache(ngx_conf_t *cf, ngx_command_t *cmd,
                                void *conf);
 
@@ -73,18 +77,57 @@ ngx_http_mapcache_create_conf(ngx_conf_t *cf)
 }
 
 
+/*
+ * point the buffer to the file backing the data. The descriptor is duplicated as the
+ * apr one is closed along with the mapcache context, possibly before the response
+ * has been sent out.
+ */
+static ngx_int_t ngx_http_mapcache_file_buf(ngx_http_request_t *r, ngx_buf_t *b, mapcache_buffer *data)
+{
+  apr_os_file_t fd;
+  ngx_pool_cleanup_t *cln;
+  ngx_pool_cleanup_file_t *clnf;
+
+  if(apr_os_file_get(&fd, data->file) != APR_SUCCESS) {
+    return NGX_ERROR;
+  }
+  b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+  cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+  if(b->file == NULL || cln == NULL) {
+    return NGX_ERROR;
+  }
+  fd = dup(fd);
+  if(fd == NGX_INVALID_FILE) {
+    return NGX_ERROR;
+  }
+  cln->handler = ngx_pool_cleanup_file;
+  clnf = cln->data;
+  clnf->fd = fd;
+  clnf->name = (u_char*)"mapcache tile";
+  clnf->log = r->connection->log;
+
+  b->file->fd = fd;
+  b->file->name.data = clnf->name;
+  b->file->name.len = ngx_strlen(clnf->name);
+  b->file->log = r->connection->log;
+  b->file_pos = data->file_offset;
+  b->file_last = data->file_offset + data->size;
+  return NGX_OK;
+}
+
 static void ngx_http_mapcache_write_response(mapcache_context *ctx, ngx_http_request_t *r,
     mapcache_http_response *response)
 {
   if(response->mtime) {
     time_t  if_modified_since;
-    if(r->headers_in.if_modified_since) {
+    /* If-Modified-Since is to be ignored when If-None-Match is present, the core has checked the latter */
+    if(r->headers_in.if_modified_since && !r->headers_in.if_none_match) {
       if_modified_since = ngx_http_parse_time(r->headers_in.if_modified_since->value.data,
                                               r->headers_in.if_modified_since->value.len);
       if (if_modified_since != NGX_ERROR) {
         apr_time_t apr_if_m_s;
         apr_time_ansi_put ( &apr_if_m_s, if_modified_since);
-        if(apr_if_m_s<response->mtime) {
+        if(apr_time_sec(response->mtime) <= apr_time_sec(apr_if_m_s)) {
           r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
           ngx_http_send_header(r);
           return;
@@ -118,6 +161,11 @@ static void ngx_http_mapcache_write_response(mapcache_context *ctx, ngx_http_req
       }
     }
   }
+  if(response->code == NGX_HTTP_NOT_MODIFIED) {
+    r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+    ngx_http_send_header(r);
+    return;
+  }
   if(response->data) {
     r->headers_out.content_length_n = response->data->size;
   }
@@ -138,10 +186,15 @@ static void ngx_http_mapcache_write_response(mapcache_context *ctx, ngx_http_req
       return;
     }
 
-    b->pos = ngx_pcalloc(r->pool,response->data->size);
-    memcpy(b->pos,response->data->buf,response->data->size);
-    b->last = b->pos + response->data->size;
-    b->memory = 1;
+    if(response->data->file && ngx_http_mapcache_file_buf(r, b, response->data) == NGX_OK) {
+      /* sent straight from the cache file, with sendfile if enabled */
+      b->in_file = 1;
+    } else {
+      b->pos = ngx_pcalloc(r->pool,response->data->size);
+      memcpy(b->pos,response->data->buf,response->data->size);
+      b->last = b->pos + response->data->size;
+      b->memory = 1;
+    }
     b->last_buf = 1;
     b->flush = 1;
     out.buf = b;
@@ -172,6 +225,13 @@ static ngx_int_t ngx_mapcache_init_process(ngx_cycle_t *cycle)
   atexit(apr_terminate);
   apr_pool_initialize();
   apr_pool_create(&process_pool,NULL);
+  if(process_worker_threads > 0) {
+    /* no context for detached jobs: mapcache runs in non-blocking mode under nginx, and never refreshes tiles */
+    if(mapcache_worker_pool_create(&process_worker_pool,process_worker_threads,NULL,process_pool) != APR_SUCCESS) {
+      ngx_log_error(NGX_LOG_WARN, cycle->log, 0, "failed to create mapcache worker pool");
+      process_worker_pool = NULL;
+    }
+  }
   return NGX_OK;
 }
 
@@ -210,6 +270,9 @@ ngx_http_mapcache_handler(ngx_http_request_t *r)
   mapcache_ngx_context *ngctx = ngx_http_get_module_loc_conf(r, ngx_http_mapcache_module);
   mapcache_context *ctx = (mapcache_context*)ngctx;
   apr_pool_create(&(ctx->pool),process_pool);
+  ctx->worker_pool = process_worker_pool;
+  /* single tiles read from a file are sent with ngx_http_mapcache_file_buf() */
+  ctx->supports_sendfile = 1;
   ngctx->r = r;
   mapcache_request *request = NULL;
   mapcache_http_response *http_response;
@@ -220,6 +283,17 @@ ngx_http_mapcache_handler(ngx_http_request_t *r)
   char *sparams = apr_pstrndup(ctx->pool, (char*)r->args.data, r->args.len);
   apr_table_t *params = mapcache_http_parse_param_string(ctx, sparams);
 
+  /* the conditional request headers, so that tile requests can be answered with a 304 */
+  ctx->headers_in = apr_table_make(ctx->pool, 2);
+  if(r->headers_in.if_none_match) {
+    apr_table_setn(ctx->headers_in, "If-None-Match",
+                   apr_pstrndup(ctx->pool, (char*)r->headers_in.if_none_match->value.data, r->headers_in.if_none_match->value.len));
+  }
+  if(r->headers_in.if_modified_since) {
+    apr_table_setn(ctx->headers_in, "If-Modified-Since",
+                   apr_pstrndup(ctx->pool, (char*)r->headers_in.if_modified_since->value.data, r->headers_in.if_modified_since->value.len));
+  }
+
   mapcache_service_dispatch_request(ctx,&request,pathInfo,params,ctx->config);
   if(GC_HAS_ERROR(ctx) || !request) {
     ngx_http_mapcache_write_response(ctx,r, mapcache_core_respond_to_error(ctx));
@@ -302,6 +376,9 @@ ngx_http_mapcache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
   }
   mapcache_connection_pool_create(&ctx->connection_pool,ctx->pool);
   ctx->config->non_blocking = 1;
+  if(ctx->config->threaded_fetching && ctx->config->fetching_threads > process_worker_threads) {
+    process_worker_threads = ctx->config->fetching_threads;
+  }
 
   ngx_http_core_loc_conf_t  *clcf;
 
@@ -47,3 +47,33 @@ gdalinfo -checksum /tmp/0.jpg | grep Checksum=20574 >/dev/null || (echo "Did not
 curl -s "http://localhost/mapcache/wmts/1.0.0/global/default/GoogleMapsCompatible/0/0/0.jpg" > /tmp/0_bis.jpg
 diff /tmp/0.jpg /tmp/0_bis.jpg
 
+
+# conditional requests: a matching If-None-Match gets a 304, whatever If-Modified-Since says
+TILE_URL="http://localhost/mapcache/wmts/1.0.0/global/default/GoogleMapsCompatible/0/0/0.jpg"
+ETAG=$(curl -s -D - -o /dev/null "$TILE_URL" | tr -d '\r' | grep -i '^etag:' | cut -d' ' -f2-)
+test -n "$ETAG" || (echo "Did not get an ETag"; /bin/false)
+STATUS=$(curl -s -o /dev/null -w "%{http_code}" -H "If-None-Match: $ETAG" "$TILE_URL")
+test "$STATUS" = "304" || (echo "Expected 304 for a matching If-None-Match, got $STATUS"; /bin/false)
+STATUS=$(curl -s -o /dev/null -w "%{http_code}" -H "If-None-Match: $ETAG" -H "If-Modified-Since: Thu, 01 Jan 1970 00:00:00 GMT" "$TILE_URL")
+test "$STATUS" = "304" || (echo "Expected 304 for a matching If-None-Match with an old If-Modified-Since, got $STATUS"; /bin/false)
+
+# a non-matching If-None-Match gets the tile, even if If-Modified-Since alone would give a 304
+STATUS=$(curl -s -o /tmp/0_inm.jpg -w "%{http_code}" -H 'If-None-Match: "0-0"' -H "If-Modified-Since: $(date -u -d '+1 day' '+%a, %d %b %Y %H:%M:%S GMT')" "$TILE_URL")
+test "$STATUS" = "200" || (echo "Expected 200 for a non-matching If-None-Match, got $STATUS"; /bin/false)
+diff /tmp/0.jpg /tmp/0_inm.jpg
+
+# webp tiles
+curl -s -D /tmp/0_webp.headers "http://localhost/mapcache-extra/wmts/1.0.0/global-webp/default/GoogleMapsCompatible/0/0/0.webp" > /tmp/0.webp
+grep -i '^content-type: image/webp' /tmp/0_webp.headers >/dev/null || (echo "Did not get a webp content type"; cat /tmp/0_webp.headers; /bin/false)
+test "$(head -c 4 /tmp/0.webp)$(dd if=/tmp/0.webp bs=1 skip=8 count=4 2>/dev/null)" = "RIFFWEBP" || (echo "Did not get a webp tile"; /bin/false)
+
+# bundle layout: tiles written by the seeder are served, also once the reseeded bundle has been compacted
+BUNDLE=/tmp/mc/bundles/global-bundle/GoogleMapsCompatible/00/R0000C0000.bundle
+mapcache_seed -c /tmp/mc/mapcache-extra.xml -t global-bundle --force -z 0,1
+mapcache_seed -c /tmp/mc/mapcache-extra.xml -t global-bundle --force -z 0,1
+SIZE_BEFORE=$(stat -c %s $BUNDLE)
+mapcache_compact /tmp/mc/bundles
+SIZE_AFTER=$(stat -c %s $BUNDLE)
+test "$SIZE_AFTER" -lt "$SIZE_BEFORE" || (echo "Compaction did not shrink $BUNDLE: $SIZE_BEFORE -> $SIZE_AFTER bytes"; /bin/false)
+curl -s "http://localhost/mapcache-extra/wmts/1.0.0/global-bundle/default/GoogleMapsCompatible/0/0/0.jpg" > /tmp/0_bundle.jpg
+gdalinfo -checksum /tmp/0_bundle.jpg | grep Checksum=20574 >/dev/null || (echo "Did not get expected checksum"; gdalinfo -checksum /tmp/0_bundle.jpg; /bin/false)
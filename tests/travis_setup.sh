@@ -52,6 +52,41 @@ echo '    <service type="wms" enabled="true"/>' >> $MAPCACHE_CONF
 echo '    <log_level>debug</log_level>' >> $MAPCACHE_CONF
 echo '</mapcache>' >> $MAPCACHE_CONF
 
+# features that are kept out of the capabilities compared by run_tests.sh
+MAPCACHE_EXTRA_CONF=/tmp/mc/mapcache-extra.xml
+echo '<?xml version="1.0" encoding="UTF-8"?>' >> $MAPCACHE_EXTRA_CONF
+echo '<mapcache>' >> $MAPCACHE_EXTRA_CONF
+echo '    <source name="global-tif" type="gdal">' >> $MAPCACHE_EXTRA_CONF
+echo '        <data>/tmp/mc/world.tif</data>' >> $MAPCACHE_EXTRA_CONF
+echo '    </source>' >> $MAPCACHE_EXTRA_CONF
+echo '    <cache name="disk" type="disk">' >> $MAPCACHE_EXTRA_CONF
+echo '        <base>/tmp/mc/extra</base>' >> $MAPCACHE_EXTRA_CONF
+echo '    </cache>' >> $MAPCACHE_EXTRA_CONF
+echo '    <format name="WEBP" type="WEBP">' >> $MAPCACHE_EXTRA_CONF
+echo '        <quality>75</quality>' >> $MAPCACHE_EXTRA_CONF
+echo '        <method>4</method>' >> $MAPCACHE_EXTRA_CONF
+echo '    </format>' >> $MAPCACHE_EXTRA_CONF
+echo '    <tileset name="global-webp">' >> $MAPCACHE_EXTRA_CONF
+echo '        <cache>disk</cache>' >> $MAPCACHE_EXTRA_CONF
+echo '        <source>global-tif</source>' >> $MAPCACHE_EXTRA_CONF
+echo '        <grid maxzoom="17">GoogleMapsCompatible</grid>' >> $MAPCACHE_EXTRA_CONF
+echo '        <format>WEBP</format>' >> $MAPCACHE_EXTRA_CONF
+echo '        <metatile>1 1</metatile>' >> $MAPCACHE_EXTRA_CONF
+echo '    </tileset>' >> $MAPCACHE_EXTRA_CONF
+echo '    <cache name="bundles" type="disk" layout="bundle">' >> $MAPCACHE_EXTRA_CONF
+echo '        <base>/tmp/mc/bundles</base>' >> $MAPCACHE_EXTRA_CONF
+echo '    </cache>' >> $MAPCACHE_EXTRA_CONF
+echo '    <tileset name="global-bundle">' >> $MAPCACHE_EXTRA_CONF
+echo '        <cache>bundles</cache>' >> $MAPCACHE_EXTRA_CONF
+echo '        <source>global-tif</source>' >> $MAPCACHE_EXTRA_CONF
+echo '        <grid maxzoom="17">GoogleMapsCompatible</grid>' >> $MAPCACHE_EXTRA_CONF
+echo '        <format>JPEG</format>' >> $MAPCACHE_EXTRA_CONF
+echo '        <metatile>1 1</metatile>' >> $MAPCACHE_EXTRA_CONF
+echo '    </tileset>' >> $MAPCACHE_EXTRA_CONF
+echo '    <service type="wmts" enabled="true"/>' >> $MAPCACHE_EXTRA_CONF
+echo '    <log_level>debug</log_level>' >> $MAPCACHE_EXTRA_CONF
+echo '</mapcache>' >> $MAPCACHE_EXTRA_CONF
+
 cp data/world.tif /tmp/mc
 
 sudo su -c "echo 'LoadModule mapcache_module /usr/lib/apache2/modules/mod_mapcache.so' >> /etc/apache2/apache2.conf"
@@ -60,6 +95,7 @@ sudo su -c "echo '   <Directory /tmp/mc>' >> /etc/apache2/apache2.conf"
 sudo su -c "echo '      Require all granted' >> /etc/apache2/apache2.conf"
 sudo su -c "echo '   </Directory>' >> /etc/apache2/apache2.conf"
 sudo su -c "echo '   MapCacheAlias /mapcache \"/tmp/mc/mapcache.xml\"' >> /etc/apache2/apache2.conf"
+sudo su -c "echo '   MapCacheAlias /mapcache-extra \"/tmp/mc/mapcache-extra.xml\"' >> /etc/apache2/apache2.conf"
 sudo su -c "echo '</IfModule>' >> /etc/apache2/apache2.conf"
 
 sudo service apache2 restart
@@ -0,0 +1,657 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache utility program measuring the cost of its inner loops
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_file_io.h>
+#include <apr_getopt.h>
+#include <apr_strings.h>
+#include <apr_time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef USE_GDAL
+#include <gdal.h>
+#endif
+
+#define BENCH_TILE_SIZE 256
+
+typedef struct {
+  const char *name;
+  const char *description;
+  void (*run)(mapcache_context *ctx, int iterations);
+} bench_suite;
+
+mapcache_context ctx;
+mapcache_image *bench_input = NULL; /* the image the encoders are measured on, cut into tiles */
+
+void bench_log(mapcache_context *ctx, mapcache_log_level level, char *msg, ...)
+{
+  va_list args;
+  va_start(args,msg);
+  vfprintf(stderr,msg,args);
+  va_end(args);
+  fprintf(stderr,"\n");
+}
+
+/* print the throughput of a measured loop, in units (e.g. pixels or bytes) per second */
+static void bench_report(const char *name, apr_time_t elapsed, double units, const char *unit, int ops)
+{
+  double secs = (double)(elapsed ? elapsed : 1) / APR_USEC_PER_SEC;
+  printf("  %-44s %12.1f M%s/s %10.2f us/op\n", name, units / secs / 1000000.0, unit,
+         (double)elapsed / ops);
+}
+
+/*
+ * a tile of random premultiplied pixels, with an alpha spread over the whole range
+ * so that the compositing kernels don't take their opaque or transparent shortcuts
+ */
+static mapcache_image* bench_random_image(mapcache_context *ctx, int w, int h, unsigned int seed)
+{
+  int i;
+  mapcache_image *img = mapcache_image_create_with_data(ctx, w, h);
+  srand(seed);
+  for(i=0; i<w*h; i++) {
+    unsigned char *px = img->data + i*4;
+    unsigned int a = rand() & 0xff;
+    px[0] = (unsigned char)((rand() & 0xff) * a / 255);
+    px[1] = (unsigned char)((rand() & 0xff) * a / 255);
+    px[2] = (unsigned char)((rand() & 0xff) * a / 255);
+    px[3] = (unsigned char)a;
+  }
+  img->has_alpha = MC_ALPHA_YES;
+  img->is_blank = MC_EMPTY_NO;
+  return img;
+}
+
+static void bench_kernel_set(mapcache_context *ctx, const mapcache_image_kernels *k, int iterations)
+{
+  mapcache_image *src = bench_random_image(ctx, BENCH_TILE_SIZE, BENCH_TILE_SIZE, 1);
+  mapcache_image *dst = bench_random_image(ctx, BENCH_TILE_SIZE, BENCH_TILE_SIZE, 2);
+  mapcache_image *opaque = mapcache_image_create_with_data(ctx, BENCH_TILE_SIZE, BENCH_TILE_SIZE);
+  int *x0 = apr_palloc(ctx->pool, BENCH_TILE_SIZE * sizeof(int));
+  int *x1 = apr_palloc(ctx->pool, BENCH_TILE_SIZE * sizeof(int));
+  unsigned short *fx = apr_palloc(ctx->pool, BENCH_TILE_SIZE * sizeof(unsigned short));
+  double pixels = (double)BENCH_TILE_SIZE * BENCH_TILE_SIZE * iterations;
+  volatile int sink = 0;
+  apr_time_t start;
+  int i, y;
+  char *label;
+
+  memset(opaque->data, 0xff, opaque->stride * opaque->h);
+  /* a 2x upsampling of the left half of the source rows */
+  for(i=0; i<BENCH_TILE_SIZE; i++) {
+    x0[i] = (i/2) * 4;
+    x1[i] = (i/2 + 1) * 4;
+    fx[i] = (i&1) ? 128 : 0;
+  }
+
+  label = apr_psprintf(ctx->pool, "%s over", k->name);
+  start = apr_time_now();
+  for(i=0; i<iterations; i++) {
+    for(y=0; y<BENCH_TILE_SIZE; y++) {
+      k->over(dst->data + y*dst->stride, src->data + y*src->stride, BENCH_TILE_SIZE);
+    }
+  }
+  bench_report(label, apr_time_now() - start, pixels, "pix", iterations);
+
+  /* an opaque image has to be scanned to its end */
+  label = apr_psprintf(ctx->pool, "%s alpha_below", k->name);
+  start = apr_time_now();
+  for(i=0; i<iterations; i++) {
+    for(y=0; y<BENCH_TILE_SIZE; y++) {
+      sink += k->alpha_below(opaque->data + y*opaque->stride, BENCH_TILE_SIZE, 255);
+    }
+  }
+  bench_report(label, apr_time_now() - start, pixels, "pix", iterations);
+
+  label = apr_psprintf(ctx->pool, "%s uniform", k->name);
+  start = apr_time_now();
+  for(i=0; i<iterations; i++) {
+    for(y=0; y<BENCH_TILE_SIZE; y++) {
+      sink += k->uniform(opaque->data + y*opaque->stride, BENCH_TILE_SIZE, 0xffffffff);
+    }
+  }
+  bench_report(label, apr_time_now() - start, pixels, "pix", iterations);
+
+  label = apr_psprintf(ctx->pool, "%s bilinear", k->name);
+  start = apr_time_now();
+  for(i=0; i<iterations; i++) {
+    for(y=0; y<BENCH_TILE_SIZE-1; y++) {
+      k->bilinear(dst->data + y*dst->stride, src->data + (y/2)*src->stride, src->data + (y/2+1)*src->stride,
+                  x0, x1, fx, (y&1) ? 128 : 0, BENCH_TILE_SIZE);
+    }
+  }
+  bench_report(label, apr_time_now() - start, (double)BENCH_TILE_SIZE * (BENCH_TILE_SIZE-1) * iterations, "pix", iterations);
+}
+
+/*
+ * the pixel kernels, scalar and as dispatched for this cpu, then the image functions
+ * built on them, which go through pixman instead when it is available
+ */
+static void bench_kernels(mapcache_context *ctx, int iterations)
+{
+  const mapcache_image_kernels *scalar = mapcache_image_kernels_scalar();
+  const mapcache_image_kernels *best = mapcache_image_kernels_get();
+  mapcache_image *base, *overlay, *resampled;
+  double pixels = (double)BENCH_TILE_SIZE * BENCH_TILE_SIZE * iterations;
+  apr_time_t start;
+  int i;
+#ifdef USE_PIXMAN
+  const char *backend = "pixman";
+#else
+  const char *backend = best->name;
+#endif
+
+  bench_kernel_set(ctx, scalar, iterations);
+  if(best != scalar) {
+    bench_kernel_set(ctx, best, iterations);
+  }
+
+  base = bench_random_image(ctx, BENCH_TILE_SIZE, BENCH_TILE_SIZE, 3);
+  overlay = bench_random_image(ctx, BENCH_TILE_SIZE, BENCH_TILE_SIZE, 4);
+  start = apr_time_now();
+  for(i=0; i<iterations; i++) {
+    mapcache_image_merge(ctx, base, overlay);
+  }
+  bench_report(apr_psprintf(ctx->pool, "mapcache_image_merge (%s)", backend),
+               apr_time_now() - start, pixels, "pix", iterations);
+
+  resampled = mapcache_image_create_with_data(ctx, BENCH_TILE_SIZE, BENCH_TILE_SIZE);
+  start = apr_time_now();
+  for(i=0; i<iterations; i++) {
+    mapcache_image_copy_resampled_nearest(ctx, overlay, resampled, -17.3, -9.1, 1.7, 1.7);
+  }
+  bench_report(apr_psprintf(ctx->pool, "copy_resampled_nearest (%s)", backend),
+               apr_time_now() - start, pixels, "pix", iterations);
+
+  start = apr_time_now();
+  for(i=0; i<iterations; i++) {
+    mapcache_image_copy_resampled_bilinear(ctx, overlay, resampled, -17.3, -9.1, 1.7, 1.7, 0);
+  }
+  bench_report(apr_psprintf(ctx->pool, "copy_resampled_bilinear (%s)", backend),
+               apr_time_now() - start, pixels, "pix", iterations);
+}
+
+/* a made up map-like image: flat areas, gradients and thin lines */
+static mapcache_image* bench_synthetic_image(mapcache_context *ctx, int w, int h)
+{
+  int x, y;
+  mapcache_image *img = mapcache_image_create_with_data(ctx, w, h);
+  for(y=0; y<h; y++) {
+    for(x=0; x<w; x++) {
+      unsigned char *px = GET_IMG_PIXEL(*img, x, y);
+      if(x % 97 == 0 || (x + 2*y) % 151 == 0) {
+        px[0] = 40; px[1] = 40; px[2] = 180;
+      } else if(((x/64) + (y/48)) % 3 == 0) {
+        px[0] = 200; px[1] = 230; px[2] = 200;
+      } else {
+        px[0] = (unsigned char)(x * 255 / w);
+        px[1] = (unsigned char)(y * 255 / h);
+        px[2] = 220;
+      }
+      px[3] = 255;
+    }
+  }
+  img->has_alpha = MC_ALPHA_NO;
+  img->is_blank = MC_EMPTY_NO;
+  return img;
+}
+
+#ifdef USE_GDAL
+/* read the first bands of a raster as an rgb(a) image */
+static mapcache_image* bench_gdal_image(mapcache_context *ctx, const char *filename)
+{
+  GDALDatasetH ds;
+  mapcache_image *img;
+  int bands_bgra[] = { 3, 2, 1, 4 };
+  int nbands, i;
+  CPLErr err;
+  GDALAllRegister();
+  ds = GDALOpen(filename, GA_ReadOnly);
+  if(!ds) {
+    ctx->set_error(ctx, 500, "failed to open %s with gdal", filename);
+    return NULL;
+  }
+  nbands = GDALGetRasterCount(ds);
+  if(nbands != 3 && nbands != 4) {
+    ctx->set_error(ctx, 500, "%s: expecting an rgb or rgba raster", filename);
+    GDALClose(ds);
+    return NULL;
+  }
+  img = mapcache_image_create_with_data(ctx, GDALGetRasterXSize(ds), GDALGetRasterYSize(ds));
+  memset(img->data, 255, img->stride * img->h);
+  err = GDALDatasetRasterIO(ds, GF_Read, 0, 0, img->w, img->h, img->data, img->w, img->h, GDT_Byte,
+                            nbands, bands_bgra, 4, img->stride, 1);
+  GDALClose(ds);
+  if(err != CE_None) {
+    ctx->set_error(ctx, 500, "failed to read %s with gdal", filename);
+    return NULL;
+  }
+  if(nbands == 4) {
+    for(i=0; i<img->w*img->h; i++) {
+      unsigned char *px = img->data + i*4;
+      px[0] = (unsigned char)(px[0] * px[3] / 255);
+      px[1] = (unsigned char)(px[1] * px[3] / 255);
+      px[2] = (unsigned char)(px[2] * px[3] / 255);
+    }
+  }
+  return img;
+}
+#endif
+
+/* an encoded png, jpeg or webp image, or any raster gdal can read */
+static mapcache_image* bench_load_image(mapcache_context *ctx, const char *filename)
+{
+  apr_file_t *f;
+  apr_finfo_t finfo;
+  apr_size_t size;
+  mapcache_buffer *buffer;
+  if(apr_file_open(&f, filename, APR_FOPEN_READ|APR_FOPEN_BINARY, APR_OS_DEFAULT, ctx->pool) != APR_SUCCESS ||
+      apr_file_info_get(&finfo, APR_FINFO_SIZE, f) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to open %s", filename);
+    return NULL;
+  }
+  size = (apr_size_t)finfo.size;
+  buffer = mapcache_buffer_create(size, ctx->pool);
+  if(apr_file_read_full(f, buffer->buf, size, &buffer->size) != APR_SUCCESS) {
+    apr_file_close(f);
+    ctx->set_error(ctx, 500, "failed to read %s", filename);
+    return NULL;
+  }
+  apr_file_close(f);
+  if(mapcache_imageio_header_sniff(ctx, buffer) != GC_UNKNOWN) {
+    return mapcache_imageio_decode(ctx, buffer);
+  }
+#ifdef USE_GDAL
+  return bench_gdal_image(ctx, filename);
+#else
+  ctx->set_error(ctx, 500, "%s is not a png, jpeg or webp image (built without gdal)", filename);
+  return NULL;
+#endif
+}
+
+/* the input image cut into tiles, sharing its pixels */
+static mapcache_image** bench_tiles(mapcache_context *ctx, int *ntiles)
+{
+  mapcache_image *src = bench_input ? bench_input : bench_synthetic_image(ctx, 4*BENCH_TILE_SIZE, 4*BENCH_TILE_SIZE);
+  int nx = src->w / BENCH_TILE_SIZE, ny = src->h / BENCH_TILE_SIZE, i, j;
+  mapcache_image **tiles = apr_palloc(ctx->pool, (nx*ny + 1) * sizeof(mapcache_image*));
+  if(!nx || !ny) {
+    /* too small to be cut, use it as a single tile */
+    tiles[0] = src;
+    *ntiles = 1;
+    return tiles;
+  }
+  for(j=0; j<ny; j++) {
+    for(i=0; i<nx; i++) {
+      mapcache_image *tile = mapcache_image_create(ctx);
+      tile->w = tile->h = BENCH_TILE_SIZE;
+      tile->stride = src->stride;
+      tile->data = GET_IMG_PIXEL(*src, i*BENCH_TILE_SIZE, j*BENCH_TILE_SIZE);
+      tiles[j*nx+i] = tile;
+    }
+  }
+  *ntiles = nx*ny;
+  return tiles;
+}
+
+/* encode each tile iterations times, reporting the throughput and the mean encoded size */
+static void bench_encode(mapcache_context *ctx, const char *name, mapcache_image_format *format,
+                         mapcache_image **tiles, int ntiles, int iterations)
+{
+  apr_pool_t *pool, *ctx_pool = ctx->pool;
+  apr_size_t bytes = 0;
+  apr_time_t start, elapsed;
+  double pixels = 0;
+  int i, t;
+  apr_pool_create(&pool, ctx_pool);
+  ctx->pool = pool;
+  start = apr_time_now();
+  for(i=0; i<iterations; i++) {
+    for(t=0; t<ntiles; t++) {
+      mapcache_buffer *encoded;
+      /* the encoders cache what they learn about the image, start afresh each time */
+      tiles[t]->has_alpha = MC_ALPHA_UNKNOWN;
+      tiles[t]->is_blank = MC_EMPTY_UNKNOWN;
+      tiles[t]->palette = NULL;
+      encoded = format->write(ctx, tiles[t], format);
+      if(GC_HAS_ERROR(ctx)) {
+        ctx->pool = ctx_pool;
+        apr_pool_destroy(pool);
+        return;
+      }
+      if(i == 0) bytes += encoded->size;
+      pixels += (double)tiles[t]->w * tiles[t]->h;
+    }
+    apr_pool_clear(pool);
+  }
+  elapsed = apr_time_now() - start;
+  ctx->pool = ctx_pool;
+  apr_pool_destroy(pool);
+  bench_report(name, elapsed, pixels, "pix", iterations * ntiles);
+  printf("  %-44s %12lu bytes/tile\n", "", (unsigned long)(bytes / ntiles));
+}
+
+/* the png encoders, at each compression level, on rgba and quantized images */
+static void bench_png(mapcache_context *ctx, int iterations)
+{
+  static const struct {
+    const char *name;
+    mapcache_compression_type compression;
+  } levels[] = {
+    { "fast", MAPCACHE_COMPRESSION_FAST },
+    { "default", MAPCACHE_COMPRESSION_DEFAULT },
+    { "best", MAPCACHE_COMPRESSION_BEST }
+  };
+  static const struct {
+    const char *name;
+    mapcache_png_encoder encoder;
+  } encoders[] = {
+    { "libpng", MAPCACHE_PNG_ENCODER_LIBPNG },
+#ifdef USE_LIBDEFLATE
+    { "libdeflate", MAPCACHE_PNG_ENCODER_LIBDEFLATE },
+#endif
+  };
+  int ntiles, e, l, q;
+  mapcache_image **tiles = bench_tiles(ctx, &ntiles);
+
+  for(q=0; q<2; q++) {
+    for(e=0; e<(int)(sizeof(encoders)/sizeof(encoders[0])); e++) {
+      for(l=0; l<(int)(sizeof(levels)/sizeof(levels[0])); l++) {
+        char *name = apr_psprintf(ctx->pool, "%s %s %s", q ? "png8" : "png", encoders[e].name, levels[l].name);
+        mapcache_image_format *format = q ?
+          mapcache_imageio_create_png_q_format(ctx->pool, name, levels[l].compression, 256) :
+          mapcache_imageio_create_png_format(ctx->pool, name, levels[l].compression);
+        mapcache_imageio_png_set_encoder(ctx, format, encoders[e].encoder);
+        GC_CHECK_ERROR(ctx);
+        bench_encode(ctx, name, format, tiles, ntiles, iterations);
+        GC_CHECK_ERROR(ctx);
+      }
+    }
+  }
+}
+
+/* encode then decode the tiles with a format, reporting both costs and the encoded size */
+static void bench_codec(mapcache_context *ctx, const char *name, mapcache_image_format *format,
+                        mapcache_image **tiles, int ntiles, int iterations)
+{
+  apr_pool_t *pool, *ctx_pool = ctx->pool;
+  mapcache_buffer **encoded = apr_palloc(ctx->pool, ntiles * sizeof(mapcache_buffer*));
+  apr_time_t start;
+  double pixels = 0;
+  int i, t;
+
+  bench_encode(ctx, apr_psprintf(ctx->pool, "%s encode", name), format, tiles, ntiles, iterations);
+  GC_CHECK_ERROR(ctx);
+  for(t=0; t<ntiles; t++) {
+    tiles[t]->has_alpha = MC_ALPHA_UNKNOWN;
+    tiles[t]->is_blank = MC_EMPTY_UNKNOWN;
+    tiles[t]->palette = NULL;
+    encoded[t] = format->write(ctx, tiles[t], format);
+    GC_CHECK_ERROR(ctx);
+  }
+
+  apr_pool_create(&pool, ctx_pool);
+  ctx->pool = pool;
+  start = apr_time_now();
+  for(i=0; i<iterations; i++) {
+    for(t=0; t<ntiles; t++) {
+      mapcache_imageio_decode(ctx, encoded[t]);
+      if(GC_HAS_ERROR(ctx)) {
+        ctx->pool = ctx_pool;
+        apr_pool_destroy(pool);
+        return;
+      }
+      pixels += (double)tiles[t]->w * tiles[t]->h;
+    }
+    apr_pool_clear(pool);
+  }
+  bench_report(apr_psprintf(ctx_pool, "%s decode", name), apr_time_now() - start, pixels, "pix", iterations * ntiles);
+  ctx->pool = ctx_pool;
+  apr_pool_destroy(pool);
+}
+
+/* the response formats compared on the same tiles: png, jpeg and webp at a few settings */
+static void bench_formats(mapcache_context *ctx, int iterations)
+{
+  int ntiles;
+  mapcache_image **tiles = bench_tiles(ctx, &ntiles);
+#ifdef USE_WEBP
+  int m;
+#endif
+
+  bench_codec(ctx, "png default", mapcache_imageio_create_png_format(ctx->pool, "png",
+              MAPCACHE_COMPRESSION_DEFAULT), tiles, ntiles, iterations);
+  GC_CHECK_ERROR(ctx);
+  bench_codec(ctx, "png8 default", mapcache_imageio_create_png_q_format(ctx->pool, "png8",
+              MAPCACHE_COMPRESSION_DEFAULT, 256), tiles, ntiles, iterations);
+  GC_CHECK_ERROR(ctx);
+  bench_codec(ctx, "jpeg q90", mapcache_imageio_create_jpeg_format(ctx->pool, "jpeg90", 90,
+              MAPCACHE_PHOTOMETRIC_YCBCR, MAPCACHE_OPTIMIZE_YES), tiles, ntiles, iterations);
+  GC_CHECK_ERROR(ctx);
+  bench_codec(ctx, "jpeg q75", mapcache_imageio_create_jpeg_format(ctx->pool, "jpeg75", 75,
+              MAPCACHE_PHOTOMETRIC_YCBCR, MAPCACHE_OPTIMIZE_YES), tiles, ntiles, iterations);
+  GC_CHECK_ERROR(ctx);
+#ifdef USE_WEBP
+  for(m=0; m<=6; m+=2) {
+    char *name = apr_psprintf(ctx->pool, "webp q75 method %d", m);
+    bench_codec(ctx, name, mapcache_imageio_create_webp_format(ctx->pool, name, 75, 0, m),
+                tiles, ntiles, iterations);
+    GC_CHECK_ERROR(ctx);
+  }
+  for(m=0; m<=6; m+=3) {
+    char *name = apr_psprintf(ctx->pool, "webp lossless method %d", m);
+    bench_codec(ctx, name, mapcache_imageio_create_webp_format(ctx->pool, name, 75, 1, m),
+                tiles, ntiles, iterations);
+    GC_CHECK_ERROR(ctx);
+  }
+#else
+  printf("  (built without webp support)\n");
+#endif
+}
+
+/*
+ * tile keys rendered from precompiled templates, against the search and replace
+ * expansion of mapcache_util_get_tile_key() the caches used to go through
+ */
+static void bench_keys(mapcache_context *ctx, int iterations)
+{
+  static const char *templates[] = {
+    "/var/cache/mapcache/{tileset}/{grid}/{z}/{x}/{y}.{ext}",
+    "/var/cache/mapcache/{tileset}-{grid}-{dim}-{z}.sqlite3",
+    "https://tiles.example.com/{tileset}/{grid}/{dim}/{z}/{inv_y}/{x}.{ext}",
+    NULL
+  };
+  mapcache_tileset *tileset = mapcache_tileset_create(ctx);
+  mapcache_grid_link *grid_link = apr_pcalloc(ctx->pool, sizeof(mapcache_grid_link));
+  mapcache_dimension *dimension = apr_pcalloc(ctx->pool, sizeof(mapcache_dimension));
+  mapcache_requested_dimension *rdim = apr_pcalloc(ctx->pool, sizeof(mapcache_requested_dimension));
+  mapcache_tile *tile;
+  apr_pool_t *pool, *ctx_pool = ctx->pool;
+  int i, t, n = iterations * 1000;
+  char buf[1024];
+
+  tileset->name = "osm";
+  tileset->format = mapcache_imageio_create_png_format(ctx->pool, "PNG", MAPCACHE_COMPRESSION_DEFAULT);
+  grid_link->grid = mapcache_configuration_get_grid(ctx->config, "GoogleMapsCompatible");
+  grid_link->maxz = grid_link->grid->nlevels;
+  dimension->name = "TIME";
+  rdim->dimension = dimension;
+  rdim->requested_value = rdim->cached_value = "2024-06-01T00:00:00Z";
+  tile = mapcache_tileset_tile_create(ctx->pool, tileset, grid_link);
+  tile->dimensions = apr_array_make(ctx->pool, 1, sizeof(mapcache_requested_dimension*));
+  APR_ARRAY_PUSH(tile->dimensions, mapcache_requested_dimension*) = rdim;
+  tile->z = 15;
+
+  apr_pool_create(&pool, ctx_pool);
+  for(t=0; templates[t]; t++) {
+    mapcache_key_template *tmpl = mapcache_key_template_compile(ctx->pool, templates[t], MAPCACHE_KEY_TILE_TOKENS);
+    volatile apr_size_t sink = 0;
+    apr_time_t start;
+    printf("  %s\n", templates[t]);
+
+    ctx->pool = pool;
+    start = apr_time_now();
+    for(i=0; i<n; i++) {
+      tile->x = 17000 + (i & 1023);
+      tile->y = 11000 + ((i >> 10) & 1023);
+      sink += strlen(mapcache_util_get_tile_key(ctx, tile, (char*)templates[t], "./", "#"));
+      /* the keys live as long as the request pool, clear it as a request would end */
+      if((i & 1023) == 1023) apr_pool_clear(pool);
+    }
+    bench_report("search and replace", apr_time_now() - start, n, "keys", n);
+    apr_pool_clear(pool);
+
+    start = apr_time_now();
+    for(i=0; i<n; i++) {
+      tile->x = 17000 + (i & 1023);
+      tile->y = 11000 + ((i >> 10) & 1023);
+      sink += strlen(mapcache_key_template_get(ctx, tmpl, tile));
+      if((i & 1023) == 1023) apr_pool_clear(pool);
+    }
+    bench_report("compiled template, pool copy", apr_time_now() - start, n, "keys", n);
+    apr_pool_clear(pool);
+
+    start = apr_time_now();
+    for(i=0; i<n; i++) {
+      tile->x = 17000 + (i & 1023);
+      tile->y = 11000 + ((i >> 10) & 1023);
+      sink += mapcache_key_template_render(ctx, tmpl, tile, buf, sizeof(buf));
+    }
+    bench_report("compiled template, stack buffer", apr_time_now() - start, n, "keys", n);
+    ctx->pool = ctx_pool;
+    GC_CHECK_ERROR(ctx);
+  }
+  apr_pool_destroy(pool);
+}
+
+static const bench_suite bench_suites[] = {
+  {"kernels", "image pixel kernels, compositing and resampling", bench_kernels},
+  {"png", "png encoders and compression levels, on the input image", bench_png},
+  {"formats", "encoding and decoding cost and size of png, jpeg and webp, on the input image", bench_formats},
+  {"keys", "disk, sqlite and rest tile key rendering", bench_keys},
+  {NULL, NULL, NULL}
+};
+
+static const apr_getopt_option_t bench_options[] = {
+  /* long-option, short-option, has-arg flag, description */
+  { "iterations", 'n', TRUE, "number of times each measured loop is run (default 200)" },
+  { "input", 'i', TRUE, "image the encoders are measured on, cut into 256x256 tiles: a png, jpeg or webp file, or any rgb(a) raster gdal can read (e.g. tests/data/world.tif). Defaults to a synthetic 1024x1024 image" },
+  { "help", 'h', FALSE, "show help" },
+  { NULL, 0, 0, NULL },
+};
+
+int usage(const char *progname, char *msg)
+{
+  int i;
+  if(msg) {
+    printf("%s\n%s\n", progname, msg);
+  }
+  printf("usage: %s [options] [suite ...]\noptions:\n", progname);
+  for(i=0; bench_options[i].name; i++) {
+    if(bench_options[i].has_arg) {
+      printf("-%c|--%s [value]: %s\n", bench_options[i].optch, bench_options[i].name, bench_options[i].description);
+    } else {
+      printf("-%c|--%s: %s\n", bench_options[i].optch, bench_options[i].name, bench_options[i].description);
+    }
+  }
+  printf("suites (all of them if none is given):\n");
+  for(i=0; bench_suites[i].name; i++) {
+    printf("  %s: %s\n", bench_suites[i].name, bench_suites[i].description);
+  }
+  apr_terminate();
+  return 1;
+}
+
+int main(int argc, const char **argv)
+{
+  apr_getopt_t *opt;
+  const char *optarg;
+  int optch, i, j, iterations = 200;
+  apr_status_t rv;
+
+  apr_initialize();
+  apr_pool_create(&ctx.pool, NULL);
+  mapcache_context_init(&ctx);
+  ctx.config = mapcache_configuration_create(ctx.pool);
+  ctx.log = bench_log;
+  apr_getopt_init(&opt, ctx.pool, argc, argv);
+
+  while((rv = apr_getopt_long(opt, bench_options, &optch, &optarg)) == APR_SUCCESS) {
+    switch(optch) {
+      case 'h':
+        return usage(argv[0], NULL);
+      case 'n':
+        iterations = (int)strtol(optarg, NULL, 10);
+        if(iterations <= 0) {
+          return usage(argv[0], "failed to parse iterations, expecting a positive integer");
+        }
+        break;
+      case 'i':
+        bench_input = bench_load_image(&ctx, optarg);
+        if(GC_HAS_ERROR(&ctx)) {
+          return usage(argv[0], ctx.get_error_message(&ctx));
+        }
+        break;
+    }
+  }
+  if(rv != APR_EOF) {
+    return usage(argv[0], "bad options");
+  }
+  for(j=opt->ind; j<argc; j++) {
+    for(i=0; bench_suites[i].name && strcmp(argv[j], bench_suites[i].name); i++);
+    if(!bench_suites[i].name) {
+      return usage(argv[0], apr_psprintf(ctx.pool, "unknown suite %s", argv[j]));
+    }
+  }
+
+  for(i=0; bench_suites[i].name; i++) {
+    int selected = (opt->ind == argc);
+    for(j=opt->ind; j<argc; j++) {
+      if(!strcmp(argv[j], bench_suites[i].name)) selected = 1;
+    }
+    if(selected) {
+      apr_pool_t *pool, *ctx_pool = ctx.pool;
+      apr_pool_create(&pool, ctx_pool);
+      ctx.pool = pool;
+      printf("%s (%d iterations)\n", bench_suites[i].name, iterations);
+      bench_suites[i].run(&ctx, iterations);
+      if(GC_HAS_ERROR(&ctx)) {
+        printf("  failed: %s\n", ctx.get_error_message(&ctx));
+        ctx.clear_errors(&ctx);
+      }
+      ctx.pool = ctx_pool;
+      apr_pool_destroy(pool);
+    }
+  }
+  apr_terminate();
+  return 0;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -0,0 +1,176 @@
+/******************************************************************************
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache utility program compacting bundle layout disk caches
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_file_io.h>
+#include <apr_file_info.h>
+#include <apr_getopt.h>
+#include <apr_strings.h>
+#include <stdio.h>
+#include <string.h>
+
+mapcache_context ctx;
+int verbose = 0;
+int failures = 0;
+apr_off_t total_before = 0, total_after = 0;
+
+void compact_log(mapcache_context *ctx, mapcache_log_level level, char *msg, ...)
+{
+  va_list args;
+  va_start(args,msg);
+  vfprintf(stderr,msg,args);
+  va_end(args);
+  fprintf(stderr,"\n");
+}
+
+static void compact_bundle(mapcache_context *ctx, const char *path)
+{
+  apr_off_t before, after;
+  if(mapcache_cache_disk_bundle_compact(ctx, path, &before, &after) != MAPCACHE_SUCCESS) {
+    fprintf(stderr, "%s\n", ctx->get_error_message(ctx));
+    ctx->clear_errors(ctx);
+    failures++;
+    return;
+  }
+  total_before += before;
+  total_after += after;
+  if(verbose) {
+    printf("%s: %" APR_OFF_T_FMT " -> %" APR_OFF_T_FMT " bytes\n", path, before, after);
+  }
+}
+
+/* compacts path if it is a bundle, or every bundle found below it if it is a directory */
+static void compact_path(mapcache_context *ctx, const char *path)
+{
+  apr_finfo_t finfo;
+  apr_dir_t *dir;
+  apr_status_t rv;
+  apr_pool_t *pool;
+  size_t len;
+
+  rv = apr_stat(&finfo, path, APR_FINFO_TYPE, ctx->pool);
+  if(rv != APR_SUCCESS) {
+    char errmsg[120];
+    fprintf(stderr, "failed to stat %s: %s\n", path, apr_strerror(rv, errmsg, 120));
+    failures++;
+    return;
+  }
+  if(finfo.filetype != APR_DIR) {
+    len = strlen(path);
+    if(len > 7 && !strcmp(path + len - 7, ".bundle")) {
+      compact_bundle(ctx, path);
+    }
+    return;
+  }
+  if(apr_dir_open(&dir, path, ctx->pool) != APR_SUCCESS) {
+    fprintf(stderr, "failed to open directory %s\n", path);
+    failures++;
+    return;
+  }
+  apr_pool_create(&pool, ctx->pool);
+  while(apr_dir_read(&finfo, APR_FINFO_NAME | APR_FINFO_TYPE, dir) == APR_SUCCESS) {
+    apr_pool_t *ctx_pool = ctx->pool;
+    if(!strcmp(finfo.name, ".") || !strcmp(finfo.name, "..") ||
+       (finfo.filetype != APR_DIR && finfo.filetype != APR_REG)) {
+      continue;
+    }
+    ctx->pool = pool;
+    compact_path(ctx, apr_pstrcat(pool, path, "/", finfo.name, NULL));
+    ctx->pool = ctx_pool;
+    apr_pool_clear(pool);
+  }
+  apr_pool_destroy(pool);
+  apr_dir_close(dir);
+}
+
+static const apr_getopt_option_t compact_options[] = {
+  /* long-option, short-option, has-arg flag, description */
+  { "verbose", 'v', FALSE, "print the size of each bundle before and after compaction" },
+  { "help", 'h', FALSE, "show help" },
+  { NULL, 0, 0, NULL },
+};
+
+int usage(const char *progname, char *msg)
+{
+  int i;
+  if(msg) {
+    printf("%s\n%s\n", progname, msg);
+  }
+  printf("usage: %s [options] path ...\n"
+         "rewrites the .bundle files of a disk cache with layout=\"bundle\", dropping the data of\n"
+         "overwritten and deleted tiles. paths are bundle files, or directories searched for them.\n"
+         "mapcache must not be serving nor seeding the cache while it is being compacted.\n"
+         "options:\n", progname);
+  for(i=0; compact_options[i].name; i++) {
+    printf("-%c|--%s: %s\n", compact_options[i].optch, compact_options[i].name, compact_options[i].description);
+  }
+  apr_terminate();
+  return 1;
+}
+
+int main(int argc, const char **argv)
+{
+  apr_getopt_t *opt;
+  const char *optarg;
+  int optch, i;
+  apr_status_t rv;
+
+  apr_initialize();
+  apr_pool_create(&ctx.pool, NULL);
+  mapcache_context_init(&ctx);
+  ctx.config = mapcache_configuration_create(ctx.pool);
+  ctx.log = compact_log;
+  apr_getopt_init(&opt, ctx.pool, argc, argv);
+
+  while((rv = apr_getopt_long(opt, compact_options, &optch, &optarg)) == APR_SUCCESS) {
+    switch(optch) {
+      case 'h':
+        return usage(argv[0], NULL);
+      case 'v':
+        verbose = 1;
+        break;
+    }
+  }
+  if(rv != APR_EOF) {
+    return usage(argv[0], "bad options");
+  }
+  if(opt->ind == argc) {
+    return usage(argv[0], "no bundle or directory given");
+  }
+
+  for(i=opt->ind; i<argc; i++) {
+    compact_path(&ctx, argv[i]);
+  }
+  printf("compacted %" APR_OFF_T_FMT " bytes of bundles down to %" APR_OFF_T_FMT " bytes\n", total_before, total_after);
+
+  apr_pool_destroy(ctx.pool);
+  apr_terminate();
+  return failures ? 1 : 0;
+}
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -1121,6 +1121,13 @@ int main(int argc, const char **argv)
     if(ctx.get_error(&ctx))
       return usage(argv[0],ctx.get_error_message(&ctx));
     mapcache_connection_pool_create(&ctx.connection_pool, ctx.pool);
+    /* the engine thread would not survive the fork() of the seeding processes */
+    if(cfg->http_engine && nprocesses <= 1) {
+      if(mapcache_http_engine_create(&ctx.http_engine, ctx.pool) != APR_SUCCESS) {
+        ctx.log(&ctx,MAPCACHE_WARN,"failed to create http engine, http requests will be run synchronously");
+        ctx.http_engine = NULL;
+      }
+    }
   }
 
 #ifdef USE_CLIPPERS